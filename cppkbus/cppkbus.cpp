@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "cppkbus.h"
 #include "linux/kbus_defns.h"
@@ -54,6 +55,13 @@ namespace
             return arg;
     }
 
+    // The current time, in milliseconds, for RequestCache TTLs
+    uint64_t nowMs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
 }
 
 namespace cppkbus
@@ -97,6 +105,29 @@ namespace cppkbus
         return 0;
     }
 
+    // Write the message data to a Ksock in auto send mode, where the
+    // write() that completes the message also sends it. SafeWrite won't do,
+    // because EAGAIN then means the message is still being sent, and we
+    // mustn't write it again.
+    int AutoSendWrite(int mFd, const uint8_t *data, unsigned dataLen)
+    {
+        int rv;
+        size_t countWritten = 0;
+
+        while (countWritten < dataLen)
+        {
+            rv = write(mFd, &data[countWritten], dataLen - countWritten);
+            if (rv < 0)
+            {
+                if (errno != EINTR)
+                    return -errno;
+            }
+            else
+                countWritten += rv;
+        }
+        return 0;
+    }
+
     // Similarly for reading message data
     int SafeRead(int mFd, uint8_t *data, unsigned dataLen)
     {
@@ -1059,6 +1090,7 @@ namespace cppkbus
 
     int Ksock::Close()
     {
+        mAutoSend = false;
         return mDevice.Close();
     }
 
@@ -1228,6 +1260,31 @@ namespace cppkbus
         }
     }
 
+    int Ksock::SetAutoSend(const bool shouldAutoSend)
+    {
+        uint32_t array[1] = { shouldAutoSend?1U:0U };
+        int rv = ioctl(mDevice.mFd, KBUS_IOC_AUTOSEND, &array[0]);
+        if (rv < 0)
+            return -errno;
+        mAutoSend = shouldAutoSend;
+        return 0;
+    }
+
+    int Ksock::WillAutoSend(bool& autoSend) const
+    {
+        uint32_t array[1] = { 0xFFFFFFFF };
+        int rv = ioctl(mDevice.mFd, KBUS_IOC_AUTOSEND, &array[0]);
+        if (rv < 0)
+        {
+            return -errno;
+        }
+        else
+        {
+            autoSend = array[0] ? true : false;
+            return 0;
+        }
+    }
+
     int Ksock::Send(Message& ioMessage, MessageId *msgId)
     {
         if (ioMessage.IsEmpty())
@@ -1238,13 +1295,27 @@ namespace cppkbus
         kbus_message_header *hdr = (kbus_message_header *)(&ioMessage.mData[0]);
         int msgLen = ioMessage.mData.size();    // we hope/trust this is the right length
 
-        int rv = SafeWrite(mDevice.mFd, (uint8_t *)hdr, msgLen);
-        if (rv < 0) return -errno;
-
         struct kbus_msg_id id;
+        int rv;
 
-        rv = ioctl(mDevice.mFd, KBUS_IOC_SEND, &id);
-        if (rv < 0) return -errno;
+        if (mAutoSend)
+        {
+            // Writing the message also sends it
+            rv = AutoSendWrite(mDevice.mFd, (uint8_t *)hdr, msgLen);
+            if (rv < 0) return rv;
+            if (!msgId) return 0;
+
+            rv = ioctl(mDevice.mFd, KBUS_IOC_LASTSENT, &id);
+            if (rv < 0) return -errno;
+        }
+        else
+        {
+            rv = SafeWrite(mDevice.mFd, (uint8_t *)hdr, msgLen);
+            if (rv < 0) return -errno;
+
+            rv = ioctl(mDevice.mFd, KBUS_IOC_SEND, &id);
+            if (rv < 0) return -errno;
+        }
 
         if (msgId) {
             msgId->mNetworkId = id.network_id;
@@ -1379,6 +1450,564 @@ namespace cppkbus
         stream << ">";
         return stream.str();
     }
+
+    // REQUEST CACHE ======================================================
+
+    RequestCache::RequestCache(const unsigned inDeviceNumber,
+            const uint32_t inDefaultTtlMs, const std::string& inInvalidateName,
+            const uint32_t inMaxEntries) :
+        mKsock(inDeviceNumber),
+        mMaxEntries(inMaxEntries ? inMaxEntries : DefaultMaxEntries),
+        mDefaultTtlMs(inDefaultTtlMs),
+        mInvalidateName(inInvalidateName),
+        mReading(false)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mChanged, NULL);
+    }
+
+    RequestCache::~RequestCache()
+    {
+        (void) Close();
+        pthread_cond_destroy(&mChanged);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    int RequestCache::Open()
+    {
+        int rv = mKsock.Open();
+        if (rv < 0) return rv;
+
+        if (!mInvalidateName.empty())
+        {
+            rv = mKsock.Bind(mInvalidateName);
+            if (rv < 0)
+            {
+                (void) mKsock.Close();
+                return rv;
+            }
+        }
+        return 0;
+    }
+
+    int RequestCache::Close()
+    {
+        // Anything still pending that is not in the table is only in mPending
+        for (PendingMap::iterator it = mPending.begin(); it != mPending.end(); ++it)
+        {
+            if (!it->second->mInTable)
+                delete it->second;
+        }
+        mPending.clear();
+
+        for (EntryMap::iterator it = mEntries.begin(); it != mEntries.end(); ++it)
+        {
+            delete it->second;
+        }
+        mEntries.clear();
+
+        if (!mKsock.IsOpen())
+            return 0;
+        return mKsock.Close();
+    }
+
+    int RequestCache::SetTtl(const std::string& inName, const uint32_t inTtlMs)
+    {
+        pthread_mutex_lock(&mLock);
+        mTtls[inName] = inTtlMs;
+        pthread_mutex_unlock(&mLock);
+        return 0;
+    }
+
+    // Take an entry out of the table. If no-one is waiting on it, it is
+    // also freed.
+    void RequestCache::Unlink(Entry *entry)
+    {
+        if (entry->mInTable)
+        {
+            mEntries.erase(entry->mKey);
+            entry->mInTable = false;
+        }
+        if (entry->mUsers == 0 && entry->mState != Entry::Pending)
+            delete entry;
+    }
+
+    void RequestCache::Release(Entry *entry)
+    {
+        entry->mUsers --;
+        if (entry->mUsers == 0 && !entry->mInTable &&
+                entry->mState != Entry::Pending)
+            delete entry;
+    }
+
+    // Throw away every stale entry
+    void RequestCache::Purge(const uint64_t now)
+    {
+        EntryMap::iterator it = mEntries.begin();
+        while (it != mEntries.end())
+        {
+            Entry *entry = it->second;
+            ++it;
+            if (entry->mState == Entry::Ready && entry->mExpiresMs <= now)
+                Unlink(entry);
+        }
+    }
+
+    // Forget the cached Replies for Requests with the given name, or for
+    // all Requests if inName is NULL. Requests still waiting for their
+    // Replies get them, but they are not cached.
+    void RequestCache::DoInvalidate(const std::string *inName)
+    {
+        EntryMap::iterator it = mEntries.begin();
+        while (it != mEntries.end())
+        {
+            Entry *entry = it->second;
+            ++it;
+            if (inName == NULL || entry->mKey.first == *inName)
+            {
+                if (entry->mState == Entry::Pending)
+                    entry->mTtlMs = 0;
+                Unlink(entry);
+            }
+        }
+        mStats.mInvalidations ++;
+    }
+
+    void RequestCache::Invalidate(const std::string& inName)
+    {
+        pthread_mutex_lock(&mLock);
+        DoInvalidate(&inName);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void RequestCache::InvalidateAll()
+    {
+        pthread_mutex_lock(&mLock);
+        DoInvalidate(NULL);
+        pthread_mutex_unlock(&mLock);
+    }
+
+    void RequestCache::GetStats(Stats& outStats)
+    {
+        pthread_mutex_lock(&mLock);
+        outStats = mStats;
+        outStats.mEntries = mEntries.size();
+        pthread_mutex_unlock(&mLock);
+    }
+
+    // Deal with a message read from our Ksock
+    void RequestCache::Dispatch(const Message& msg)
+    {
+        if (msg.IsReply())
+        {
+            MessageId inReplyTo;
+            (void) msg.GetInReplyTo(inReplyTo);
+
+            PendingMap::iterator it = mPending.find(inReplyTo);
+            if (it == mPending.end())
+                return;
+            Entry *entry = it->second;
+            mPending.erase(it);
+
+            entry->mReply = msg;
+            entry->mState = Entry::Ready;
+            entry->mExpiresMs = nowMs() + entry->mTtlMs;
+
+            // Synthetic Replies (the Replier went away, etc.) are not kept
+            if (entry->mTtlMs == 0 || (msg.GetFlags() & MessageFlags::Synthetic))
+                Unlink(entry);
+            else if (!entry->mInTable && entry->mUsers == 0)
+                delete entry;
+            return;
+        }
+
+        if (!mInvalidateName.empty() && msg.GetName() == mInvalidateName)
+        {
+            // The data may name the Requests to forget, otherwise forget
+            // them all
+            const char *data = (const char *)msg.GetData();
+            size_t len = data ? msg.GetDataLength() : 0;
+            while (len > 0 && data[len - 1] == '\0')
+                len --;
+            if (len)
+            {
+                std::string name(data, len);
+                DoInvalidate(&name);
+            }
+            else
+            {
+                DoInvalidate(NULL);
+            }
+        }
+    }
+
+    // Deal with any messages waiting on our Ksock, without waiting for more.
+    // Only to be called when no-one else is reading it.
+    int RequestCache::Drain()
+    {
+        for (;;)
+        {
+            Message msg;
+            int rv = mKsock.Receive(msg);
+            if (rv <= 0) return rv;
+            Dispatch(msg);
+        }
+    }
+
+    // Wait for an entry's Reply. Only one thread at a time reads our Ksock,
+    // passing on any Replies it reads, whoever they are for - the others
+    // wait for it to tell them something has happened.
+    //
+    // Must be called with mLock held, and returns with it held.
+    int RequestCache::Wait(Entry *entry)
+    {
+        while (entry->mState == Entry::Pending)
+        {
+            if (mReading)
+            {
+                pthread_cond_wait(&mChanged, &mLock);
+                continue;
+            }
+
+            mReading = true;
+            pthread_mutex_unlock(&mLock);
+
+            Message msg;
+            unsigned pollFlags;
+            int rv = mKsock.WaitForMessage(pollFlags, PollFlags::Receive, -1);
+            if (rv >= 0)
+                rv = mKsock.Receive(msg);
+
+            pthread_mutex_lock(&mLock);
+            mReading = false;
+            if (rv > 0)
+                Dispatch(msg);
+            pthread_cond_broadcast(&mChanged);
+            if (rv < 0)
+                return rv;
+        }
+        return 0;
+    }
+
+    int RequestCache::Request(const std::string& inName, const uint8_t *data,
+            const size_t nr_bytes, Message& outReply)
+    {
+        Key key(inName, std::string((const char *)data, data ? nr_bytes : 0));
+        uint64_t now = nowMs();
+        Entry *entry = NULL;
+        int rv = 0;
+
+        pthread_mutex_lock(&mLock);
+
+        // Look for invalidations (if we care), unless someone else will
+        if (!mInvalidateName.empty() && !mReading)
+        {
+            rv = Drain();
+            if (rv < 0) goto done;
+        }
+
+        {
+            EntryMap::iterator it = mEntries.find(key);
+            if (it != mEntries.end())
+            {
+                entry = it->second;
+                if (entry->mState == Entry::Ready && entry->mExpiresMs <= now)
+                {
+                    Unlink(entry);
+                    entry = NULL;
+                }
+            }
+        }
+
+        if (entry && entry->mState == Entry::Ready)
+        {
+            mStats.mHits ++;
+            entry->mUsers ++;
+        }
+        else if (entry)
+        {
+            mStats.mCoalesced ++;
+            entry->mUsers ++;
+        }
+        else
+        {
+            mStats.mMisses ++;
+
+            entry = new Entry;
+            entry->mState = Entry::Pending;
+            entry->mKey = key;
+            entry->mExpiresMs = 0;
+            entry->mInTable = false;
+            entry->mUsers = 1;
+
+            std::map<std::string, uint32_t>::const_iterator ttl = mTtls.find(inName);
+            entry->mTtlMs = (ttl == mTtls.end()) ? mDefaultTtlMs : ttl->second;
+
+            Message request(inName, data, nr_bytes, 0, false, true);
+            rv = mKsock.SendRequest(request, &entry->mRequestId);
+            if (rv < 0)
+            {
+                // No-one else can be waiting for it yet
+                delete entry;
+                goto done;
+            }
+            mPending[entry->mRequestId] = entry;
+
+            if (mEntries.size() >= mMaxEntries)
+                Purge(now);
+            if (mEntries.size() < mMaxEntries)
+            {
+                mEntries[key] = entry;
+                entry->mInTable = true;
+            }
+        }
+
+        rv = Wait(entry);
+        if (rv == 0)
+            outReply = entry->mReply;
+        Release(entry);
+
+done:
+        pthread_mutex_unlock(&mLock);
+        return rv;
+    }
+
+    // REPLIER DIRECTORY ==================================================
+
+    // How many Replier bind events we ask KBUS to queue for us to start
+    // with, so that a burst of binds doesn't fill our queue before our thread
+    // empties it
+    static const uint32_t kReplierDirectoryMinQueueLen = 1024;
+
+    // The most Replier bind events we will ask KBUS to queue for us, when
+    // asking it to tell us about all the current Repliers
+    static const uint32_t kReplierDirectoryMaxQueueLen = 64 * 1024;
+
+    ReplierDirectory::ReplierDirectory(const unsigned inDeviceNumber) :
+        mKsock(inDeviceNumber),
+        mStopFd(-1)
+    {
+        pthread_rwlock_init(&mLock, NULL);
+    }
+
+    ReplierDirectory::~ReplierDirectory()
+    {
+        (void) Close();
+        pthread_rwlock_destroy(&mLock);
+    }
+
+    // Ask KBUS to report Replier binds, which also reports all the Repliers
+    // bound at the moment.
+    int ReplierDirectory::ReportReplierBinds()
+    {
+        int fd = -1;
+        uint32_t array[1] = { 1 };
+
+        (void) mKsock.GetFd(fd);
+        int rv = ::ioctl(fd, KBUS_IOC_REPORTREPLIERBINDS, array);
+        if (rv < 0)
+            return -errno;
+        return 0;
+    }
+
+    // Our thread, which reads the Replier bind events as they arrive, so that
+    // our Ksock's message queue does not fill up
+    void *ReplierDirectory::ThreadMain(void *inArg)
+    {
+        ReplierDirectory *self = static_cast<ReplierDirectory *>(inArg);
+        struct pollfd fds[2];
+
+        fds[0].fd = -1;
+        (void) self->mKsock.GetFd(fds[0].fd);
+        fds[0].events = POLLIN;
+        fds[1].fd = self->mStopFd;
+        fds[1].events = POLLIN;
+
+        for (;;)
+        {
+            fds[0].revents = fds[1].revents = 0;
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (fds[1].revents)
+                break;
+            if (fds[0].revents & POLLIN)
+                (void) self->Update();
+        }
+        return NULL;
+    }
+
+    int ReplierDirectory::Open()
+    {
+        int rv = mKsock.Open();
+        if (rv < 0) return rv;
+
+        mStopFd = eventfd(0, EFD_CLOEXEC);
+        if (mStopFd < 0)
+        {
+            rv = -errno;
+            goto fail;
+        }
+
+        rv = mKsock.Bind(KBUS_MSG_NAME_REPLIER_BIND_EVENT);
+        if (rv < 0) goto fail;
+
+        rv = mKsock.SetMaxUnreadMessages(kReplierDirectoryMinQueueLen);
+        if (rv < 0) goto fail;
+
+        // If the current Repliers don't fit in our message queue, make it
+        // bigger and ask again
+        for (;;)
+        {
+            rv = ReportReplierBinds();
+            if (rv != -EBUSY) break;
+
+            rv = Drain();
+            if (rv < 0) goto fail;
+            mRepliers.clear();
+
+            uint32_t qlen;
+            rv = mKsock.GetMaxUnreadMessages(qlen);
+            if (rv < 0) goto fail;
+            if (qlen >= kReplierDirectoryMaxQueueLen)
+            {
+                rv = -EBUSY;
+                goto fail;
+            }
+            rv = mKsock.SetMaxUnreadMessages(qlen * 2);
+            if (rv < 0) goto fail;
+        }
+        if (rv >= 0)
+            rv = Drain();
+        if (rv >= 0)
+            rv = -pthread_create(&mThread, NULL, ThreadMain, this);
+        if (rv >= 0)
+            return 0;
+
+fail:
+        if (mStopFd >= 0) { close(mStopFd); mStopFd = -1; }
+        mRepliers.clear();
+        (void) mKsock.Close();
+        return rv;
+    }
+
+    int ReplierDirectory::Close()
+    {
+        if (!mKsock.IsOpen())
+        {
+            mRepliers.clear();
+            return 0;
+        }
+
+        eventfd_write(mStopFd, 1);
+        pthread_join(mThread, NULL);
+        close(mStopFd);
+        mStopFd = -1;
+        mRepliers.clear();
+
+        // Reporting is left on, since someone else may be relying on it
+        return mKsock.Close();
+    }
+
+    // Deal with a message read from our Ksock
+    void ReplierDirectory::Apply(const Message& msg)
+    {
+        if (!msg.IsReplierBindEvent())
+            return;
+
+        bool isBind;
+        uint32_t binder;
+        std::string name;
+        if (msg.GetReplierBindEventData(isBind, binder, name) < 0)
+            return;
+
+        if (isBind)
+        {
+            mRepliers[name] = binder;
+        }
+        else
+        {
+            // Only the current Replier can unbind
+            std::map<std::string, uint32_t>::iterator it = mRepliers.find(name);
+            if (it != mRepliers.end() && it->second == binder)
+                mRepliers.erase(it);
+        }
+    }
+
+    // Deal with any messages waiting on our Ksock, without waiting for more.
+    // Must be called with mLock held for writing.
+    int ReplierDirectory::Drain()
+    {
+        int count = 0;
+
+        for (;;)
+        {
+            Message msg;
+            int rv = mKsock.Receive(msg);
+            if (rv < 0) return rv;
+            if (rv == 0) return count;
+
+            Apply(msg);
+            count ++;
+
+            // If KBUS had to throw away unbind events, we no longer know
+            // who is bound, and have to ask again
+            if (msg.GetName() == KBUS_MSG_NAME_UNBIND_EVENTS_LOST)
+            {
+                mRepliers.clear();
+                rv = ReportReplierBinds();
+                if (rv < 0) return rv;
+            }
+        }
+    }
+
+    int ReplierDirectory::Update()
+    {
+        pthread_rwlock_wrlock(&mLock);
+        int rv = Drain();
+        pthread_rwlock_unlock(&mLock);
+        return rv;
+    }
+
+    int ReplierDirectory::FindReplier(uint32_t &outKsockId,
+            const std::string& inMessageName)
+    {
+        outKsockId = 0;
+
+        // Only read our Ksock if there is something to read
+        struct pollfd fds[1];
+        fds[0].fd = -1;
+        (void) mKsock.GetFd(fds[0].fd);
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        int rv = poll(fds, 1, 0);
+        if (rv < 0) return -errno;
+        if (rv > 0 && (fds[0].revents & POLLIN))
+        {
+            rv = Update();
+            if (rv < 0) return rv;
+        }
+
+        pthread_rwlock_rdlock(&mLock);
+        std::map<std::string, uint32_t>::const_iterator it =
+            mRepliers.find(inMessageName);
+        if (it != mRepliers.end())
+            outKsockId = it->second;
+        pthread_rwlock_unlock(&mLock);
+
+        return outKsockId != 0;
+    }
+
+    size_t ReplierDirectory::NumRepliers()
+    {
+        pthread_rwlock_rdlock(&mLock);
+        size_t count = mRepliers.size();
+        pthread_rwlock_unlock(&mLock);
+        return count;
+    }
 }
 
 // OPERATORS ==============================================================
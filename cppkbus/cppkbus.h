@@ -49,12 +49,14 @@
 #include <stdint.h>
 #include <string>
 #include <vector>
+#include <map>
 #include <iostream>
 #include <sstream>
 
 #include <sys/eventfd.h>
 #include <limits.h>     // for the Errors
 #include <errno.h>      // ditto
+#include <pthread.h>    // for the RequestCache and ReplierDirectory
 
 namespace cppkbus
 {
@@ -843,19 +845,19 @@ namespace cppkbus
     class Ksock
     {
         public:
-            Ksock() : mDevice(Device(0)) { }
+            Ksock() : mDevice(Device(0)), mAutoSend(false) { }
 
             Ksock(const Device& inDevice) :
-                mDevice(inDevice) { }
+                mDevice(inDevice), mAutoSend(false) { }
 
             // NB: Only the ios::in and ios::out modes are "listened" to
             Ksock(const unsigned inDeviceNumber,
                  std::ios::openmode inMode=(std::ios::in | std::ios::out)) :
-                mDevice(inDeviceNumber, inMode) { }
+                mDevice(inDeviceNumber, inMode), mAutoSend(false) { }
 
             Ksock(const std::string& inDeviceName,
                   std::ios::openmode inMode=(std::ios::in | std::ios::out)) :
-                mDevice(inDeviceName, inMode) { }
+                mDevice(inDeviceName, inMode), mAutoSend(false) { }
 
             ~Ksock();
 
@@ -950,6 +952,21 @@ namespace cppkbus
             /** Will messages be received only once? */
             int WillReceiveOnlyOnce(bool& onlyOnce) const;
 
+            /** Should writing a complete message also send it?
+             *
+             * In auto send mode, Send() writes the message and KBUS sends
+             * it as part of the same system call. The message id then
+             * costs a second call, so is only fetched if it is asked for.
+             *
+             * @param[in] shouldAutoSend  true for auto send mode, false for
+             *                             the default (explicit send).
+             * @return 0 on success, < 0 on error.
+             */
+            int SetAutoSend(const bool shouldAutoSend);
+
+            /** Will writing a complete message also send it? */
+            int WillAutoSend(bool& autoSend) const;
+
             /** Send a message
              */
             int Send(Message& ioMessage, MessageId *msgId=NULL);
@@ -1011,6 +1028,231 @@ namespace cppkbus
         private:
             // Our own copy of a representation of the underlying device.
             Device mDevice;
+
+            // Have we put the Ksock into auto send mode?
+            bool mAutoSend;
+    };
+
+    /**
+     * A cache of the Replies to idempotent Requests.
+     *
+     * Requests made through the cache are sent on its own Ksock. A Reply is
+     * remembered, keyed on the Request's name and data, for the TTL ("time
+     * to live") given for that name, and any identical Request in that time
+     * is answered from the cache. Identical Requests made (by different
+     * threads) whilst the first is still waiting for its Reply all share
+     * that Reply, so only one of them is actually sent.
+     *
+     * If an invalidation name is given, the cache listens for Announcements
+     * with that name. If such an Announcement has data, it is taken as a
+     * message name, and the Replies to Requests with that name are
+     * forgotten. Otherwise all Replies are forgotten.
+     *
+     * Synthetic Replies (for instance, because the Replier went away) are
+     * passed on, but never cached.
+     *
+     * This is the same scheme as libkbus's kbus_reqcache_t.
+     */
+    class RequestCache : private NoCopy
+    {
+        public:
+            //! The default maximum number of cached Replies
+            static const uint32_t DefaultMaxEntries = 1024;
+
+            //! What the cache has been doing
+            struct Stats
+            {
+                uint64_t mHits;             // Requests answered from the cache
+                uint64_t mMisses;           // Requests actually sent
+                uint64_t mCoalesced;        // Requests that shared another's Reply
+                uint64_t mInvalidations;    // Invalidations
+                uint32_t mEntries;          // Replies currently cached
+            };
+
+            /**
+             * inDefaultTtlMs is how long a Reply is kept (in milliseconds),
+             * unless SetTtl() says otherwise for its name. A TTL of 0 means
+             * Replies are not kept, but concurrent identical Requests still
+             * share a single Reply.
+             *
+             * An empty inInvalidateName means there is no invalidation
+             * Announcement.
+             *
+             * If the cache is full (of Replies that have not expired), new
+             * Requests still work, but their Replies are not kept.
+             */
+            RequestCache(const unsigned inDeviceNumber,
+                    const uint32_t inDefaultTtlMs=0,
+                    const std::string& inInvalidateName="",
+                    const uint32_t inMaxEntries=DefaultMaxEntries);
+
+            ~RequestCache();
+
+            /** Open our Ksock, and bind to the invalidation name (if any)
+             *
+             * @return 0 on success, -errno otherwise.
+             */
+            int Open();
+
+            /** Close our Ksock, forgetting all cached Replies
+             *
+             * No-one may be making a Request when the cache is closed.
+             *
+             * @return 0 on success, -errno otherwise.
+             */
+            int Close();
+
+            /** Set the TTL (in milliseconds) for Replies to Requests with
+             * the given name. It applies to Requests sent from now on.
+             *
+             * @return 0 on success, < 0 on error.
+             */
+            int SetTtl(const std::string& inName, const uint32_t inTtlMs);
+
+            /** Make a Request through the cache.
+             *
+             * outReply is set to the (cached or new) Reply.
+             *
+             * @return 0 on success, < 0 on error - for instance, the error
+             *          from sending the Request.
+             */
+            int Request(const std::string& inName, const uint8_t *data,
+                    const size_t nr_bytes, Message& outReply);
+
+            /** Forget the cached Replies to Requests with the given name */
+            void Invalidate(const std::string& inName);
+
+            /** Forget all the cached Replies */
+            void InvalidateAll();
+
+            void GetStats(Stats& outStats);
+
+        private:
+            // The Request's name and data
+            typedef std::pair<std::string, std::string> Key;
+
+            struct Entry
+            {
+                enum { Pending, Ready } mState;
+                Key mKey;
+                MessageId mRequestId;
+                Message mReply;
+                uint32_t mTtlMs;
+                uint64_t mExpiresMs;
+                bool mInTable;
+                unsigned mUsers;
+            };
+
+            typedef std::map<Key, Entry *> EntryMap;
+            typedef std::map<MessageId, Entry *> PendingMap;
+
+            void Unlink(Entry *entry);
+            void Unlink(EntryMap::iterator it);
+            void Release(Entry *entry);
+            void Purge(const uint64_t now);
+            void DoInvalidate(const std::string *inName);
+            void Dispatch(const Message& msg);
+            int Drain();
+            int Wait(Entry *entry);
+
+            Ksock mKsock;
+            uint32_t mMaxEntries;
+            uint32_t mDefaultTtlMs;
+            std::string mInvalidateName;
+
+            // Protects everything below
+            pthread_mutex_t mLock;
+            // A Reply arrived, or the reader finished reading
+            pthread_cond_t mChanged;
+
+            EntryMap mEntries;
+            PendingMap mPending;
+            std::map<std::string, uint32_t> mTtls;
+            // Is a thread reading our Ksock?
+            bool mReading;
+            Stats mStats;
+    };
+
+    /**
+     * A directory of the Repliers on a KBUS device.
+     *
+     * Rather than asking KBUS who the Replier for a message name is (which
+     * means taking the KBUS device's lock), the directory listens for
+     * Replier bind events on its own Ksock, and keeps its own table of
+     * Repliers. When it is opened, it asks KBUS to report Replier binds,
+     * which also reports all the Repliers already bound. Reporting is for
+     * the whole device, and others may be relying on it, so it is left on
+     * when the directory is closed.
+     *
+     * Each Replier bind event is queued before the bind (or unbind) returns,
+     * so FindReplier() is as up to date as Device::FindReplier(), but only
+     * costs a poll() of the directory's Ksock and a lookup.
+     *
+     * KBUS will not let a Replier bind whilst the directory's message queue
+     * is full, so whilst it is open, the directory has a thread of its own
+     * which calls Update() whenever its Ksock is readable.
+     *
+     * A directory may be shared by any number of threads, for any Ksocks on
+     * the same device. This is the same scheme as libkbus's
+     * kbus_replierdir_t.
+     */
+    class ReplierDirectory : private NoCopy
+    {
+        public:
+            ReplierDirectory(const unsigned inDeviceNumber);
+
+            ~ReplierDirectory();
+
+            /** Open our Ksock, find out who the Repliers are, and start our
+             * thread
+             *
+             * @return 0 on success, -errno otherwise.
+             */
+            int Open();
+
+            /** Stop our thread, and close our Ksock, forgetting all the
+             * Repliers
+             *
+             * No-one may be using the directory when it is closed.
+             *
+             * @return 0 on success, -errno otherwise.
+             */
+            int Close();
+
+            /** Deal with any Replier bind events that have arrived
+             *
+             * @return the number of events, or -errno on error.
+             */
+            int Update();
+
+            /*
+             * Find the Ksock id of the Replier bound to the given message
+             *
+             * Returns 1 if there was one, 0 if there wasn't (in which case
+             * outKsockId will also be 0), -errno on error.
+             */
+            int FindReplier(uint32_t &outKsockId, const std::string& inMessageName);
+
+            /** How many Repliers do we know about? */
+            size_t NumRepliers();
+
+            int GetFd(int& ioFd) { return mKsock.GetFd(ioFd); }
+
+        private:
+            int ReportReplierBinds();
+            int Drain();
+            void Apply(const Message& msg);
+            static void *ThreadMain(void *inArg);
+
+            Ksock mKsock;
+            // Our thread, which keeps mKsock drained, and how to stop it
+            pthread_t mThread;
+            int mStopFd;
+
+            // Protects mRepliers, and reading mKsock
+            pthread_rwlock_t mLock;
+
+            std::map<std::string, uint32_t> mRepliers;
     };
 }
 
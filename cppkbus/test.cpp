@@ -31,6 +31,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "cppkbus.h"
 
@@ -198,7 +201,7 @@ int testMessage()
 
     assert(repBindEvent2.GetReplierBindEventData(boolValue, uint32Value, strValue) == 0);
     assert(!boolValue);
-    assert(uint32Value=24);
+    assert(uint32Value==24);
     assert(strValue == "freddd");
 
     Message msgSimple("$.James");
@@ -420,6 +423,176 @@ int testKsock()
     return 0;
 }
 
+/*
+ * A Replier for "$.Cache.%", which answers each Request with how many
+ * Requests it has had so far. It holds on to Requests for "$.Cache.Slow"
+ * until mHold is cleared.
+ */
+struct CacheReplier
+{
+    Ksock mKsock;
+    pthread_t mThread;
+    volatile bool mStop;
+    volatile bool mHold;
+    volatile uint32_t mCount;
+
+    CacheReplier() : mKsock(1), mStop(false), mHold(false), mCount(0) { }
+};
+
+static void *cacheReplierMain(void *arg)
+{
+    CacheReplier *replier = (CacheReplier *)arg;
+
+    while (!replier->mStop)
+    {
+        unsigned pollFlags;
+        if (replier->mKsock.WaitForMessage(pollFlags, POLLIN, 10) <= 0)
+            continue;
+
+        Message request;
+        if (replier->mKsock.Receive(request) != 1)
+            continue;
+        assert(request.WantsUsToReply());
+
+        if (request.GetName() == "$.Cache.Slow")
+            while (replier->mHold)
+                usleep(1000);
+
+        uint32_t count = ++ replier->mCount;
+        Message reply(request.GetName(), (const uint8_t *)&count, sizeof(count));
+        assert(replier->mKsock.SendReply(reply, request) == 0);
+    }
+    return NULL;
+}
+
+/*
+ * Make a Request through the cache, and return the count in its Reply (or 0
+ * if the Reply was synthetic).
+ */
+static uint32_t cacheRequest(RequestCache& cache, const std::string& name)
+{
+    Message reply;
+    uint32_t count = 0;
+
+    assert(cache.Request(name, (const uint8_t *)"key", 3, reply) == 0);
+    if (reply.GetName().compare(0, 7, "$.KBUS.") != 0)
+    {
+        assert(reply.GetDataLength() == sizeof(count));
+        memcpy(&count, reply.GetData(), sizeof(count));
+    }
+    return count;
+}
+
+struct CacheRequester
+{
+    RequestCache *mCache;
+    std::string mName;
+    pthread_t mThread;
+    uint32_t mCount;
+};
+
+static void *cacheRequesterMain(void *arg)
+{
+    CacheRequester *requester = (CacheRequester *)arg;
+    requester->mCount = cacheRequest(*requester->mCache, requester->mName);
+    return NULL;
+}
+
+static void startRequester(CacheRequester& requester, RequestCache& cache,
+        const std::string& name)
+{
+    requester.mCache = &cache;
+    requester.mName = name;
+    requester.mCount = 0;
+    assert(pthread_create(&requester.mThread, NULL, cacheRequesterMain,
+                &requester) == 0);
+}
+
+int testRequestCache()
+{
+    CacheReplier replier;
+    RequestCache::Stats stats;
+    uint32_t count;
+
+    assert(replier.mKsock.Open() == 0);
+    assert(replier.mKsock.Bind("$.Cache.%", true) == 0);
+    assert(pthread_create(&replier.mThread, NULL, cacheReplierMain, &replier) == 0);
+
+    RequestCache cache(1, 60000, "$.Cache.Invalidate");
+    assert(cache.Open() == 0);
+
+    std::cout << "A miss, and then a hit with the same Reply" << std::endl;
+    count = cacheRequest(cache, "$.Cache.A");
+    assert(count == replier.mCount);
+    assert(cacheRequest(cache, "$.Cache.A") == count);
+    cache.GetStats(stats);
+    assert(stats.mHits == 1 && stats.mMisses == 1 && stats.mEntries == 1);
+
+    std::cout << "Identical Requests whilst waiting share a Reply" << std::endl;
+    CacheRequester first, second;
+    replier.mHold = true;
+    startRequester(first, cache, "$.Cache.Slow");
+    do
+    {
+        usleep(1000);
+        cache.GetStats(stats);
+    } while (stats.mMisses < 2);
+    startRequester(second, cache, "$.Cache.Slow");
+    do
+    {
+        usleep(1000);
+        cache.GetStats(stats);
+    } while (stats.mCoalesced < 1);
+    replier.mHold = false;
+    assert(pthread_join(first.mThread, NULL) == 0);
+    assert(pthread_join(second.mThread, NULL) == 0);
+    assert(first.mCount == replier.mCount);
+    assert(second.mCount == first.mCount);
+    cache.GetStats(stats);
+    assert(stats.mHits == 1 && stats.mMisses == 2 && stats.mCoalesced == 1);
+
+    std::cout << "A Reply is only kept for its TTL" << std::endl;
+    assert(cache.SetTtl("$.Cache.Short", 50) == 0);
+    count = cacheRequest(cache, "$.Cache.Short");
+    assert(cacheRequest(cache, "$.Cache.Short") == count);
+    usleep(100 * 1000);
+    assert(cacheRequest(cache, "$.Cache.Short") == count + 1);
+
+    std::cout << "Invalidating by name forgets just those Replies" << std::endl;
+    count = cacheRequest(cache, "$.Cache.B");
+    Ksock announcer(1);
+    assert(announcer.Open() == 0);
+    Message invalidate("$.Cache.Invalidate", (const uint8_t *)"$.Cache.A", 9);
+    assert(announcer.Send(invalidate) == 0);
+    assert(cacheRequest(cache, "$.Cache.A") == replier.mCount);
+    assert(cacheRequest(cache, "$.Cache.B") == count);
+    cache.Invalidate("$.Cache.B");
+    assert(cacheRequest(cache, "$.Cache.B") == replier.mCount);
+
+    std::cout << "Synthetic Replies are passed on, but not kept" << std::endl;
+    Ksock gone(1);
+    assert(gone.Open() == 0);
+    assert(gone.Bind("$.Gone", true) == 0);
+    startRequester(first, cache, "$.Gone");
+    unsigned pollFlags;
+    while (gone.WaitForMessage(pollFlags, POLLIN, 10) <= 0)
+        ;
+    cache.GetStats(stats);
+    uint32_t entries = stats.mEntries;
+    assert(gone.Close() == 0);
+    assert(pthread_join(first.mThread, NULL) == 0);
+    assert(first.mCount == 0);
+    cache.GetStats(stats);
+    assert(stats.mEntries == entries);
+
+    assert(cache.Close() == 0);
+    assert(announcer.Close() == 0);
+    replier.mStop = true;
+    assert(pthread_join(replier.mThread, NULL) == 0);
+    assert(replier.mKsock.Close() == 0);
+    return 0;
+}
+
 int main()
 {
     std::cout << "=== MessageId tests ===" << std::endl;
@@ -450,6 +623,13 @@ int main()
         return 1;
     }
 
+    std::cout << "=== RequestCache tests ===" << std::endl;
+    if (testRequestCache())
+    {
+        std::cout << "Error testing RequestCache code" << std::endl;
+        return 1;
+    }
+
     std::cout << "Green light: all tests passed" << std::endl;
 
     return 0;
@@ -125,14 +125,93 @@
 
 /* ========================================================================= */
 
+/*
+ * A Listener binding may also restrict who it wants messages from, or how
+ * many of them it wants (see KBUS_IOC_BINDFILTER). 'flags' says which of the
+ * other fields apply, and those that don't are always zero, so that two
+ * filters are the same if all their fields are.
+ */
+struct kbus_binding_filter {
+	u32 flags;			/* KBUS_BIND_FILTER_xxx */
+	u32 from;			/* the sender's Ksock id */
+	struct kbus_orig_from orig_from;	/* where it originally came from */
+	u32 max_rate;			/* messages per second */
+	u32 sample_every;		/* take one message in this many */
+};
+
 /* We need a way of remembering message bindings */
 struct kbus_message_binding {
-	struct list_head list;
+	struct list_head list;		/* on the device's list of bindings */
+	struct list_head ksock_list;	/* and on our own Ksock's list */
 	struct kbus_private_data *bound_to;	/* who we're bound to */
 	u32 bound_to_id;	/* but the id is often useful */
 	u32 is_replier;		/* bound as a replier */
 	u32 name_len;
 	char *name;		/* the message name */
+	struct kbus_binding_filter filter;	/* which messages we want */
+
+	/*
+	 * For a rate limited or sampled binding, what the filter has seen.
+	 * The rate limit allows 'max_rate' messages in each second (in
+	 * jiffies) starting at 'window_start'.
+	 */
+	u32 num_seen;		/* messages offered to a sampled binding */
+	unsigned long window_start;
+	u32 window_count;	/* messages accepted since window_start */
+	u64 num_suppressed;	/* messages dropped by the rate or sample */
+};
+
+/*
+ * A broadcast topic - see KBUS_IOC_SUBSCRIBE.
+ *
+ * Each message published on the topic is given the next sequence number, and
+ * lives in ring[seq & (size - 1)] until it is overwritten 'size' messages
+ * later. Thus the messages still available are those numbered from
+ * next_seq - size (or 0) up to next_seq - 1, and publishing a message never
+ * costs more than freeing the one it replaces, however many subscribers
+ * there are.
+ *
+ * If 'backpressure' is set, we may not overwrite a message until every
+ * subscriber has read it. Finding the slowest subscriber means looking at
+ * all of them, so we remember the answer in 'tail' and only look again when
+ * the ring seems to be full.
+ *
+ * A subscriber that has read everything on the topic sits on its 'wait'
+ * queue. Publishing a message does a single wake up of that queue, which
+ * takes each subscriber on it off again (until it has caught up once more)
+ * and wakes its Ksock's own read_wait - so it is only those who were waiting
+ * who cost anything.
+ *
+ * A topic is freed when its last subscriber leaves.
+ */
+struct kbus_topic {
+	struct list_head list;		/* on the device's list of topics */
+	u32 name_len;
+	char *name;
+	int backpressure;
+	u32 size;			/* a power of two */
+	struct kbus_msg **ring;
+	u64 next_seq;			/* for the next message published */
+	u64 tail;			/* no subscriber has read less than this */
+	int blocked;			/* a send is waiting for room */
+	wait_queue_head_t wait;		/* subscribers that have caught up */
+	struct list_head subscribers;
+	u32 num_subscribers;
+};
+
+/*
+ * A Ksock's subscription to a broadcast topic.
+ *
+ * 'cursor' is the sequence number of the next message for us to read.
+ * 'wait' is on the topic's wait queue whenever we have read everything.
+ */
+struct kbus_topic_subscription {
+	struct list_head list;		/* on our Ksock's list */
+	struct list_head topic_list;	/* and on the topic's list */
+	struct kbus_topic *topic;
+	struct kbus_private_data *priv;
+	u64 cursor;
+	wait_queue_entry_t wait;
 };
 
 /*
@@ -163,7 +242,7 @@ struct kbus_unreplied_item {
 	struct list_head list;
 	struct kbus_msg_id id;	/* the request's id */
 	u32 from;		/* the sender's id */
-	struct kbus_name_ptr *name_ref;	/* and its name... */
+	struct kbus_name_ptr *name_ref;	/* and its name (NULL if inline) */
 	u32 name_len;
 };
 
@@ -314,6 +393,24 @@ struct kbus_name_ptr {
 	struct kref refcount;
 };
 
+/*
+ * Tracks the copies of a message sent with KBUS_BIT_DELIVERY_NOTICE.
+ *
+ * Each in-kernel copy of the message holds a reference, so when the last one
+ * is freed (because it has been read, or thrown away), the message has left
+ * the system, and its sender can be told. Since that can happen without the
+ * device mutex held (for instance, when a Ksock is released), the release
+ * callback just puts the tracker on its device's 'delivered' list, and the
+ * device's 'delivery_work' tells the sender.
+ */
+struct kbus_delivery {
+	struct kref refcount;
+	struct llist_node node;		/* on the device's 'delivered' list */
+	struct kbus_dev *dev;
+	u32 sender;			/* Ksock id, or 0 if no-one cares */
+	struct kbus_msg_id msg_id;	/* which message we're tracking */
+};
+
 /*
  * When the user reads a message from us, they receive a kbus_entire_message
  * structure.
@@ -333,8 +430,19 @@ struct kbus_name_ptr {
  *
  * Hmm. If we have the name and data references, perhaps we should move the
  * name and data *lengths* into those same.
+ *
+ * Most messages are small, though, and for them the reference counted name
+ * and data cost more (in allocations) than they save (in copying). So a name
+ * of up to KBUS_INLINE_NAME_LEN bytes is kept in 'inline_name' (with a
+ * terminating '\0'), in which case 'name_ref' is NULL, and data of up to
+ * KBUS_INLINE_DATA_LEN bytes is kept in 'inline_data', in which case
+ * 'data_ref' is NULL. Use kbus_msg_name() to get at the name, wherever it is.
  */
 
+/* The longest message name and data to keep inside the message itself */
+#define KBUS_INLINE_NAME_LEN	63
+#define KBUS_INLINE_DATA_LEN	64
+
 struct kbus_msg {
 	struct kbus_msg_id id;	/* Unique to this message */
 	struct kbus_msg_id in_reply_to;	/* Which message this is a reply to */
@@ -346,8 +454,11 @@ struct kbus_msg {
 	u32 flags;	/* Message type/flags */
 	u32 name_len;	/* Message name's length, in bytes */
 	u32 data_len;	/* Message length, also in bytes */
-	struct kbus_name_ptr *name_ref;
-	struct kbus_data_ptr *data_ref;
+	struct kbus_name_ptr *name_ref;	/* or NULL if the name is inline */
+	struct kbus_data_ptr *data_ref;	/* or NULL if the data is inline */
+	struct kbus_delivery *delivery;	/* or NULL if not being tracked */
+	u8 inline_data[KBUS_INLINE_DATA_LEN] __aligned(sizeof(u32));
+	char inline_name[KBUS_INLINE_NAME_LEN + 1];
 };
 
 /*
@@ -451,6 +562,31 @@ struct kbus_unsent_message_item {
 	struct kbus_message_binding *binding;	/* and why we remembered it */
 };
 
+/*
+ * Each entry in a message queue holds a single message, and a pointer to
+ * the message name binding that caused it to be added to the queue. This
+ * makes it simple to remove messages from the queue if the message name
+ * binding is unbound. The binding shall be NULL for:
+ *
+ *  * Replies
+ *  * KBUS "synthetic" messages, which are also (essentialy) Replies
+ */
+struct kbus_message_queue_item {
+	struct kbus_msg *msg;
+	struct kbus_message_binding *binding;
+};
+
+/*
+ * A ring of message queue items. 'size' is always 0 (before the ring is
+ * allocated) or a power of two, and the number of items in the ring is kept
+ * in the owning Ksock's 'message_count'.
+ */
+struct kbus_message_queue {
+	struct kbus_message_queue_item *items;
+	u32 size;		/* How many items there is room for */
+	u32 head;		/* Which item is the next to be read */
+};
+
 /*
  * This is the data for an individual Ksock
  *
@@ -475,6 +611,17 @@ struct kbus_unsent_message_item {
  * 'message_count' is how many messages are in the queue, and 'max_messages'
  * is an indication of how many messages we shall allow in the queue.
  *
+ * The queue itself is a ring of message queue items, indexed from 'head'.
+ * Normal messages are added at the tail, and URGENT messages are added just
+ * before the head, so neither needs an allocation (unless the ring has to
+ * grow). Note that the ring is not allocated until the first message is
+ * pushed, so a Ksock that is only used for sending never needs one.
+ *
+ * 'message_count' and 'sending' are only ever changed with the device mutex
+ * held, but kbus_poll() (and a blocking receive) look at them without it, so
+ * that checking whether a Ksock is ready does not contend with everyone else
+ * using the device.
+ *
  * Note that, however a message was originally sent to us, messages held
  * internally are always a message header plus pointers to a message name and
  * (optionally) message data. See kbus_send() for details.
@@ -484,9 +631,10 @@ struct kbus_private_data {
 	struct kbus_dev *dev;	/* Which device we are on */
 	u32 id;		/* Our own id */
 	struct kbus_msg_id last_msg_id_sent;	/* As it says - see above */
-	u32 message_count;	/* How many messages for us */
+	u32 message_count;	/* How many messages for us - see below */
 	u32 max_messages;	/* How many messages allowed */
-	struct list_head message_queue;	/* Messages for us */
+	struct kbus_message_queue message_queue;	/* Messages for us */
+	struct list_head bindings;	/* Our own message bindings */
 
 	/*
 	 * It's useful (for /proc/kbus/bindings) to remember the PID of the
@@ -609,6 +757,57 @@ struct kbus_private_data {
 	 * before any "normal" messages (on our message_queue) get read.
 	 */
 	int maybe_got_unsent_unbind_msgs;
+
+	/*
+	 * Traffic statistics, for /proc/kbus/stats. These are only ever
+	 * changed with the device mutex held.
+	 */
+	u64 num_sent;		/* Messages we have successfully sent */
+	u64 bytes_sent;		/* Their total (entire message) length */
+	u64 num_received;	/* Messages added to our message queue */
+	u32 max_queued;		/* The most messages we have had queued */
+	u32 num_blocked;	/* Sends that had to wait (-EAGAIN) */
+	u32 num_refused;	/* Sends that failed with -EBUSY */
+
+	/*
+	 * If "blocking" is set (by the BLOCKING ioctl), then NEXTMSG, and a
+	 * read() when there is no current message, will wait until there
+	 * is a message to return - unless the Ksock is O_NONBLOCK, in which
+	 * case they behave as they always have.
+	 *
+	 * Before actually going to sleep, such a wait will spin for up to
+	 * "busy_poll_usecs" microseconds (as set by the BUSYPOLL ioctl),
+	 * which can save the cost of being woken up again if the next
+	 * message is expected very soon.
+	 */
+	int blocking;
+	u32 busy_poll_usecs;
+
+	/*
+	 * If "auto_send" is set (by the AUTOSEND ioctl), then a write()
+	 * that completes a message also sends it, as if SEND had been
+	 * called. Any error from the send is returned by the write(), and
+	 * the message id is available via LASTSENT.
+	 */
+	int auto_send;
+
+	/*
+	 * Our subscriptions to broadcast topics (see KBUS_IOC_SUBSCRIBE).
+	 * Messages on these are read after those in our message queue.
+	 */
+	struct list_head subscriptions;
+	u32 num_subscriptions;
+
+	/*
+	 * The ids of messages we sent with KBUS_BIT_DELIVERY_NOTICE that have
+	 * since left the system, waiting to be reported (all at once) by the
+	 * next $.KBUS.Delivered message we read. If there are more than we
+	 * have room for, we just count the rest. 'delivered' is allocated
+	 * when we first send such a message.
+	 */
+	struct kbus_msg_id *delivered;
+	u32 num_delivered;
+	u32 num_delivered_missed;
 };
 
 /* What is a sensible number for the default maximum number of messages? */
@@ -616,6 +815,46 @@ struct kbus_private_data {
 #define CONFIG_KBUS_DEF_MAX_MESSAGES	100
 #endif
 
+/*
+ * What is the longest busy poll window (in microseconds) we allow? Spinning
+ * for longer than this is just wasting CPU that someone else could use.
+ */
+#ifndef CONFIG_KBUS_MAX_BUSY_POLL_USECS
+#define CONFIG_KBUS_MAX_BUSY_POLL_USECS	10000
+#endif
+
+/*
+ * How many items should a Ksock's message queue ring start with? It starts
+ * with room for 'max_messages' (rounded up to a power of two), within these
+ * limits, and grows (by doubling) if it needs to.
+ */
+#ifndef CONFIG_KBUS_MIN_QUEUE_RING
+#define CONFIG_KBUS_MIN_QUEUE_RING	8
+#endif
+#ifndef CONFIG_KBUS_MAX_INITIAL_QUEUE_RING
+#define CONFIG_KBUS_MAX_INITIAL_QUEUE_RING	1024
+#endif
+
+/*
+ * How many messages does a broadcast topic keep, by default, and at most?
+ * Requested sizes are rounded up to a power of two.
+ */
+#ifndef CONFIG_KBUS_DEF_TOPIC_RING
+#define CONFIG_KBUS_DEF_TOPIC_RING	256
+#endif
+#ifndef CONFIG_KBUS_MAX_TOPIC_RING
+#define CONFIG_KBUS_MAX_TOPIC_RING	65536
+#endif
+
+/*
+ * How many message ids may a single $.KBUS.Delivered message list? Any more
+ * than this are just counted, so a sender wanting to keep track of every
+ * message should not keep more than this many "in flight".
+ */
+#ifndef CONFIG_KBUS_MAX_DELIVERED
+#define CONFIG_KBUS_MAX_DELIVERED	256
+#endif
+
 /*
  * What about the maximum number of unsent unbind event messages?
  * This may want to be quite large, to allow for Limpets with momentary
@@ -658,9 +897,26 @@ struct kbus_dev {
 	 */
 	struct list_head open_ksock_list;
 
+	/* Broadcast topics (see KBUS_IOC_SUBSCRIBE) */
+	struct list_head topic_list;
+	u32 num_topics;
+
+	/*
+	 * Messages sent with KBUS_BIT_DELIVERY_NOTICE that have left the
+	 * system, for 'delivery_work' to tell their senders about.
+	 */
+	struct llist_head delivered;
+	struct work_struct delivery_work;
+
 	/* Has one of our Ksocks made space available in its message queue? */
 	wait_queue_head_t write_wait;
 
+	/*
+	 * And if so, might that let a Ksock that was blocked sending
+	 * (with -EAGAIN) finish its send? See kbus_retry_blocked_sends().
+	 */
+	int maybe_blocked_sends;
+
 	/*
 	 * Each open file descriptor needs an internal id - this is used
 	 * when binding messages to listeners, but is also needed when we
@@ -714,21 +970,6 @@ struct kbus_dev {
 	u32 max_message_size;
 };
 
-/*
- * Each entry in a message queue holds a single message, and a pointer to
- * the message name binding that caused it to be added to the list. This
- * makes it simple to remove messages from the queue if the message name
- * binding is unbound. The binding shall be NULL for:
- *
- *  * Replies
- *  * KBUS "synthetic" messages, which are also (essentialy) Replies
- */
-struct kbus_message_queue_item {
-	struct list_head list;
-	struct kbus_msg *msg;
-	struct kbus_message_binding *binding;
-};
-
 /* The sizes of the parts in our reference counted data */
 #define KBUS_PART_LEN		PAGE_SIZE
 #define KBUS_PAGE_THRESHOLD	(PAGE_SIZE >> 1)
@@ -53,6 +53,11 @@
 #include <linux/poll.h>
 #include <linux/slab.h>		/* for kmalloc, etc. */
 #include <linux/sched.h>	/* for current->pid */
+#include <linux/sched/signal.h>	/* for signal_pending() */
+#include <linux/ktime.h>	/* for ktime_get_ns(), when busy polling */
+#include <linux/log2.h>		/* for roundup_pow_of_two() */
+#include <linux/llist.h>	/* for delivered messages */
+#include <linux/workqueue.h>	/* and telling their senders */
 #include <linux/uaccess.h>	/* copy_*_user() functions */
 #include <asm/page.h>		/* PAGE_SIZE */
 
@@ -93,6 +98,15 @@ static void kbus_forget_unbound_unsent_unbind_msgs(struct kbus_private_data
 						   struct kbus_message_binding
 						   *binding);
 
+/* kbus_read() needs to be able to do an implicit NEXTMSG */
+static int kbus_ready_next_msg(struct kbus_private_data *priv, u32 *msg_len);
+
+/* And kbus_release() and kbus_ioctl() need to be able to unblock senders */
+static void kbus_retry_blocked_sends(struct kbus_dev *dev);
+
+/* kbus_write() needs to be able to do an implicit SEND */
+static int kbus_send_msg(struct kbus_private_data *priv, struct kbus_dev *dev);
+
 static int kbus_alloc_ref_data(struct kbus_private_data *priv,
 			       u32 data_len,
 			       struct kbus_data_ptr **ret_ref_data);
@@ -252,6 +266,74 @@ static void kbus_lower_name_ref(struct kbus_name_ptr *refname)
 	kref_put(&refname->refcount, kbus_release_name_ref);
 }
 
+/*
+ * Start tracking the copies of a message sent with KBUS_BIT_DELIVERY_NOTICE.
+ *
+ * The tracker starts with one reference, for the message being sent.
+ */
+static struct kbus_delivery *kbus_new_delivery(struct kbus_dev *dev,
+					       u32 sender,
+					       struct kbus_msg_id msg_id)
+{
+	struct kbus_delivery *new;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	new->dev = dev;
+	new->sender = sender;
+	new->msg_id = msg_id;
+	kref_init(&new->refcount);
+	return new;
+}
+
+/*
+ * Increment the reference count for a delivery tracker
+ *
+ * Returns the (same) reference, for convenience.
+ */
+static struct kbus_delivery
+*kbus_raise_delivery_ref(struct kbus_delivery *delivery)
+{
+	if (delivery != NULL)
+		kref_get(&delivery->refcount);
+	return delivery;
+}
+
+/*
+ * Release callback for delivery trackers - the last copy of the message has
+ * gone. We may not have the device mutex, so we leave telling the sender to
+ * the device's delivery work (see kbus_delivery_work()).
+ */
+static void kbus_release_delivery_ref(struct kref *ref)
+{
+	struct kbus_delivery *delivery = container_of(ref,
+						      struct kbus_delivery,
+						      refcount);
+	struct kbus_dev *dev = delivery->dev;
+
+	if (delivery->sender == 0) {
+		kfree(delivery);
+		return;
+	}
+
+	/* Only the first addition to the list needs to ask for work */
+	if (llist_add(&delivery->node, &dev->delivered))
+		schedule_work(&dev->delivery_work);
+}
+
+/*
+ * Forget a reference to a delivery tracker.
+ */
+static void kbus_lower_delivery_ref(struct kbus_delivery *delivery)
+{
+	if (delivery == NULL)
+		return;
+
+	kref_put(&delivery->refcount, kbus_release_delivery_ref);
+}
+
 /*
  * Return a stab at the next size for an array
  */
@@ -424,6 +506,14 @@ static int kbus_message_is_reply(struct kbus_msg *msg)
 	return !kbus_same_message_id(&msg->in_reply_to, 0, 0);
 }
 
+/*
+ * Return a message's name, whether it is kept inline or by reference.
+ */
+static inline char *kbus_msg_name(struct kbus_msg *msg)
+{
+	return msg->name_ref ? msg->name_ref->name : msg->inline_name;
+}
+
 /*
  * Build a KBUS synthetic message/exception. We assume no data.
  *
@@ -440,7 +530,7 @@ static struct kbus_msg
 			 u32 to, struct kbus_msg_id in_reply_to)
 {
 	struct kbus_msg *new_msg;
-	struct kbus_name_ptr *name_ref;
+	struct kbus_name_ptr *name_ref = NULL;
 
 	size_t msg_name_len = strlen(msg_name);
 	char *msg_name_copy;
@@ -451,26 +541,35 @@ static struct kbus_msg
 		return NULL;
 	}
 
-	msg_name_copy = kmalloc(msg_name_len + 1, GFP_KERNEL);
-	if (!msg_name_copy) {
-		dev_err(dev->dev, "Cannot kmalloc synthetic message's name\n");
-		kfree(new_msg);
-		return NULL;
+	memset(new_msg, 0, sizeof(*new_msg));
+
+	/* All of our own message names are short, but just in case... */
+	if (msg_name_len <= KBUS_INLINE_NAME_LEN) {
+		msg_name_copy = new_msg->inline_name;
+	} else {
+		msg_name_copy = kmalloc(msg_name_len + 1, GFP_KERNEL);
+		if (!msg_name_copy) {
+			dev_err(dev->dev,
+				"Cannot kmalloc synthetic message's name\n");
+			kfree(new_msg);
+			return NULL;
+		}
 	}
 
 	strncpy(msg_name_copy, msg_name, msg_name_len);
 	msg_name_copy[msg_name_len] = '\0';
 
-	name_ref = kbus_wrap_name_in_ref(msg_name_copy);
-	if (!name_ref) {
-		dev_err(dev->dev, "Cannot kmalloc synthetic message's string ref\n");
-		kfree(new_msg);
-		kfree(msg_name_copy);
-		return NULL;
+	if (msg_name_copy != new_msg->inline_name) {
+		name_ref = kbus_wrap_name_in_ref(msg_name_copy);
+		if (!name_ref) {
+			dev_err(dev->dev,
+				"Cannot kmalloc synthetic message's string ref\n");
+			kfree(new_msg);
+			kfree(msg_name_copy);
+			return NULL;
+		}
 	}
 
-	memset(new_msg, 0, sizeof(*new_msg));
-
 	new_msg->from = from;
 	new_msg->to = to;
 	new_msg->in_reply_to = in_reply_to;
@@ -705,27 +804,29 @@ static void kbus_maybe_report_message(struct kbus_dev *dev __maybe_unused,
 {
 	if (msg->data_len) {
 		struct kbus_data_ptr *data_p = msg->data_ref;
-		uint8_t *part0 __maybe_unused = (uint8_t *) data_p->parts[0];
+		uint8_t *part0 __maybe_unused =
+		    data_p ? (uint8_t *) data_p->parts[0] : msg->inline_data;
 		kbus_maybe_dbg(dev, "=== %u:%u '%.*s'"
 		       " to %u from %u in-reply-to %u:%u orig %u,%u "
 		       "final %u:%u flags %04x:%04x"
 		       " data/%u<in%u> %02x.%02x.%02x.%02x\n",
 		       msg->id.network_id, msg->id.serial_num,
-		       msg->name_len, msg->name_ref->name,
+		       msg->name_len, kbus_msg_name(msg),
 		       msg->to, msg->from,
 		       msg->in_reply_to.network_id, msg->in_reply_to.serial_num,
 		       msg->orig_from.network_id, msg->orig_from.local_id,
 		       msg->final_to.network_id, msg->final_to.local_id,
 		       (msg->flags & 0xFFFF0000) >> 4,
 		       (msg->flags & 0x0000FFFF), msg->data_len,
-		       data_p->num_parts, part0[0], part0[1], part0[2],
+		       data_p ? data_p->num_parts : 0,
+		       part0[0], part0[1], part0[2],
 		       part0[3]);
 	} else {
 		kbus_maybe_dbg(dev, "=== %u:%u '%.*s'"
 		       " to %u from %u in-reply-to %u:%u orig %u,%u "
 		       "final %u,%u flags %04x:%04x\n",
 		       msg->id.network_id, msg->id.serial_num,
-		       msg->name_len, msg->name_ref->name,
+		       msg->name_len, kbus_msg_name(msg),
 		       msg->to, msg->from,
 		       msg->in_reply_to.network_id, msg->in_reply_to.serial_num,
 		       msg->orig_from.network_id, msg->orig_from.local_id,
@@ -740,7 +841,8 @@ static void kbus_maybe_report_message(struct kbus_dev *dev __maybe_unused,
  *
  * Copies the message header, and also copies the message name and any
  * data. The message must be a 'pointy' message with reference counted
- * name and data.
+ * name and data, or with its name and data inline (which get copied along
+ * with the header).
  */
 static struct kbus_msg *kbus_copy_message(struct kbus_dev *dev,
 					  struct kbus_msg *old_msg)
@@ -767,6 +869,10 @@ static struct kbus_msg *kbus_copy_message(struct kbus_dev *dev,
 	if (new_msg->data_len)
 		/* Take a new reference to the data */
 		new_msg->data_ref = kbus_raise_data_ref(old_msg->data_ref);
+
+	/* Only the sender cares whether the message has been delivered */
+	new_msg->delivery = kbus_raise_delivery_ref(old_msg->delivery);
+	new_msg->flags &= ~KBUS_BIT_DELIVERY_NOTICE;
 	return new_msg;
 }
 
@@ -787,6 +893,9 @@ static void kbus_free_message(struct kbus_msg *msg)
 
 	msg->data_len = 0;
 	msg->data_ref = NULL;
+
+	kbus_lower_delivery_ref(msg->delivery);
+	msg->delivery = NULL;
 	kfree(msg);
 }
 
@@ -832,6 +941,73 @@ static void kbus_empty_write_msg(struct kbus_private_data *priv)
 	this->which = 0;
 }
 
+/*
+ * Return the n'th item in a Ksock's message queue, counting from the head.
+ */
+static inline struct kbus_message_queue_item
+*kbus_queue_item(struct kbus_message_queue *queue, u32 n)
+{
+	return &queue->items[(queue->head + n) & (queue->size - 1)];
+}
+
+/*
+ * Make more room in a Ksock's message queue, or allocate it in the first
+ * place.
+ *
+ * The queue starts with room for 'max_messages' items, and doubles in size
+ * whenever it fills up - which only happens if 'max_messages' is increased,
+ * or messages (such as Replies) are pushed in spite of the queue being
+ * "full". The messages keep their order, but start at item 0 again.
+ *
+ * Returns 0 if all goes well, -ENOMEM if we can't allocate the new ring.
+ */
+static int kbus_grow_message_queue(struct kbus_private_data *priv)
+{
+	struct kbus_message_queue *queue = &priv->message_queue;
+	struct kbus_message_queue_item *items;
+	u32 new_size;
+	u32 ii;
+
+	if (queue->size == 0)
+		new_size = roundup_pow_of_two(clamp_t(u32, priv->max_messages,
+					CONFIG_KBUS_MIN_QUEUE_RING,
+					CONFIG_KBUS_MAX_INITIAL_QUEUE_RING));
+	else
+		new_size = queue->size * 2;
+
+	kbus_maybe_dbg(priv->dev, "  %u Growing message queue from %u to %u\n",
+		       priv->id, queue->size, new_size);
+
+	items = kmalloc_array(new_size, sizeof(*items), GFP_KERNEL);
+	if (!items)
+		return -ENOMEM;
+
+	for (ii = 0; ii < priv->message_count; ii++)
+		items[ii] = *kbus_queue_item(queue, ii);
+
+	kfree(queue->items);
+	queue->items = items;
+	queue->size = new_size;
+	queue->head = 0;
+	return 0;
+}
+
+/*
+ * Take the item at the head of a Ksock's message queue.
+ *
+ * The caller must check that there is one.
+ */
+static struct kbus_message_queue_item
+kbus_queue_take_head(struct kbus_private_data *priv)
+{
+	struct kbus_message_queue *queue = &priv->message_queue;
+	struct kbus_message_queue_item item = queue->items[queue->head];
+
+	queue->head = (queue->head + 1) & (queue->size - 1);
+	priv->message_count--;
+	return item;
+}
+
 /*
  * Copy the given message, and add it to the end of the queue.
  *
@@ -862,7 +1038,7 @@ static int kbus_push_message(struct kbus_private_data *priv,
 							 struct kbus_message_binding *binding,
 							 enum kbus_recipient_type for_whom)
 {
-	struct list_head *queue = &priv->message_queue;
+	struct kbus_message_queue *queue = &priv->message_queue;
 	struct kbus_msg *new_msg = NULL;
 	struct kbus_message_queue_item *item;
 
@@ -917,11 +1093,13 @@ static int kbus_push_message(struct kbus_private_data *priv,
 	if (!new_msg)
 		return -EFAULT;
 
-	item = kmalloc(sizeof(*item), GFP_KERNEL);
-	if (!item) {
-		dev_err(priv->dev->dev, "Cannot kmalloc new message item\n");
-		kbus_free_message(new_msg);
-		return -ENOMEM;
+	if (priv->message_count == queue->size) {
+		if (kbus_grow_message_queue(priv)) {
+			dev_err(priv->dev->dev,
+				"Cannot kmalloc bigger message queue\n");
+			kbus_free_message(new_msg);
+			return -ENOMEM;
+		}
 	}
 	kbus_maybe_report_message(priv->dev, new_msg);
 
@@ -946,7 +1124,7 @@ static int kbus_push_message(struct kbus_private_data *priv,
 			       "%u Trying to send FOR_REPLIER but message flags %08x"
 				   " don't have KBUS_BIT_WANT_A_REPLY set. Message '%.*s"
 				   " in reply to %u:%u\n", priv->id, msg->flags,
-				   msg->name_len, msg->name_ref->name,
+				   msg->name_len, kbus_msg_name(msg),
 			       msg->in_reply_to.network_id,
 			       msg->in_reply_to.serial_num);
 	   }
@@ -958,24 +1136,29 @@ static int kbus_push_message(struct kbus_private_data *priv,
 		new_msg->flags &= ~KBUS_BIT_WANT_YOU_TO_REPLY;
 	}
 
-	/* And join it up... */
-	item->msg = new_msg;
-	item->binding = binding;
-
-	/* By default, we're using the list as a FIFO, so we want to add our
-	 * new message to the end (just before the first item). However, if the
+	/* By default, we're using the queue as a FIFO, so we want to add our
+	 * new message to the end (just after the last item). However, if the
 	 * URGENT flag is set, then we instead want to add it to the start.
 	 */
 	if (msg->flags & KBUS_BIT_URGENT) {
 		kbus_maybe_dbg(priv->dev, "  Message is URGENT\n");
-		list_add(&item->list, queue);
+		queue->head = (queue->head - 1) & (queue->size - 1);
+		item = &queue->items[queue->head];
 	} else {
-		list_add_tail(&item->list, queue);
+		item = kbus_queue_item(queue, priv->message_count);
 	}
 
+	/* And join it up... */
+	item->msg = new_msg;
+	item->binding = binding;
+
 	priv->message_count++;
 	priv->msg_id_just_pushed = msg->id;
 
+	priv->num_received++;
+	if (priv->message_count > priv->max_queued)
+		priv->max_queued = priv->message_count;
+
 	if (!kbus_same_message_id(&msg->in_reply_to, 0, 0) &&
 		for_whom == FOR_SENDER) {
 		/*
@@ -1069,46 +1252,44 @@ static void kbus_push_synthetic_message(struct kbus_dev *dev,
 }
 
 /*
- * Add the data part to a bind/unbind synthetic message.
+ * Find room for 'data_len' bytes of data for a synthetic message.
  *
- * 'is_bind' is true if this was a "bind" event, false if it was an "unbind".
+ * If it's short enough, the data can live in the message itself, otherwise
+ * we allocate it. Either way, once it has been filled in, it should be handed
+ * to kbus_set_synthetic_data().
  *
- * 'name' is the message name (or wildcard) that was bound (or unbound) to.
+ * Returns the data, or NULL if we couldn't allocate it.
+ */
+static void *kbus_alloc_synthetic_data(struct kbus_msg *new_msg, u32 data_len)
+{
+	if (data_len <= KBUS_INLINE_DATA_LEN)
+		return new_msg->inline_data;
+	else
+		return kmalloc(data_len, GFP_KERNEL);
+}
+
+/*
+ * Attach data from kbus_alloc_synthetic_data() to its synthetic message.
+ *
+ * The message takes over the data, and will free it when it is freed. If
+ * something goes wrong, the data is freed here (but the message is not).
  *
  * Returns 0 if all goes well, or a negative value if something goes wrong.
  */
-static int kbus_add_bind_message_data(struct kbus_private_data *priv,
-				      struct kbus_msg *new_msg,
-				      u32 is_bind,
-				      u32 name_len, char *name)
+static int kbus_set_synthetic_data(struct kbus_msg *new_msg,
+				   void *data, u32 data_len)
 {
-	struct kbus_replier_bind_event_data *data;
 	struct kbus_data_ptr *wrapped_data;
-	u32 padded_name_len = KBUS_PADDED_NAME_LEN(name_len);
-	u32 data_len = sizeof(*data) + padded_name_len;
-	u32 rest_len = padded_name_len / 4;
-	char *name_p;
-
 	unsigned long *parts;
 	unsigned *lengths;
 
-	data = kmalloc(data_len, GFP_KERNEL);
-	if (!data) {
-		kbus_free_message(new_msg);
-		return -ENOMEM;
+	if (data == new_msg->inline_data) {
+		new_msg->data_len = data_len;
+		return 0;
 	}
 
-	name_p = (char *)&data->rest[0];
-
-	data->is_bind = is_bind;
-	data->binder = priv->id;
-	data->name_len = name_len;
-
-	data->rest[rest_len - 1] = 0;	/* terminating with enough '\0' */
-	strncpy(name_p, name, name_len);
-
 	/*
-	 * And that data, unfortunately for our simple mindedness,
+	 * Otherwise that data, unfortunately for our simple mindedness,
 	 * needs wrapping up in a reference count...
 	 *
 	 * Note/remember that we are happy for the reference counting
@@ -1145,6 +1326,42 @@ static int kbus_add_bind_message_data(struct kbus_private_data *priv,
 	return 0;
 }
 
+/*
+ * Add the data part to a bind/unbind synthetic message.
+ *
+ * 'is_bind' is true if this was a "bind" event, false if it was an "unbind".
+ *
+ * 'name' is the message name (or wildcard) that was bound (or unbound) to.
+ *
+ * Returns 0 if all goes well, or a negative value if something goes wrong.
+ */
+static int kbus_add_bind_message_data(struct kbus_private_data *priv,
+				      struct kbus_msg *new_msg,
+				      u32 is_bind,
+				      u32 name_len, char *name)
+{
+	struct kbus_replier_bind_event_data *data;
+	u32 padded_name_len = KBUS_PADDED_NAME_LEN(name_len);
+	u32 data_len = sizeof(*data) + padded_name_len;
+	u32 rest_len = padded_name_len / 4;
+	char *name_p;
+
+	data = kbus_alloc_synthetic_data(new_msg, data_len);
+	if (!data)
+		return -ENOMEM;
+
+	name_p = (char *)&data->rest[0];
+
+	data->is_bind = is_bind;
+	data->binder = priv->id;
+	data->name_len = name_len;
+
+	data->rest[rest_len - 1] = 0;	/* terminating with enough '\0' */
+	strncpy(name_p, name, name_len);
+
+	return kbus_set_synthetic_data(new_msg, data, data_len);
+}
+
 /*
  * Create a new Replier Bind Event synthetic message.
  *
@@ -1272,30 +1489,22 @@ static int kbus_push_synthetic_bind_message(struct kbus_private_data *priv,
  */
 static struct kbus_msg *kbus_pop_message(struct kbus_private_data *priv)
 {
-	struct list_head *queue = &priv->message_queue;
-	struct kbus_message_queue_item *item;
 	struct kbus_msg *msg = NULL;
 
 	kbus_maybe_dbg(priv->dev, "  %u Popping message from queue\n",
 				   priv->id);
 
-	if (list_empty(queue))
+	if (priv->message_count == 0)
 		return NULL;
 
-	/* Retrieve the next message */
-	item = list_first_entry(queue, struct kbus_message_queue_item, list);
-
-	/* And straightway remove it from the list */
-	list_del(&item->list);
-
-	priv->message_count--;
-
-	msg = item->msg;
-	kfree(item);
+	/* Retrieve the next message, and straightway remove it */
+	msg = kbus_queue_take_head(priv).msg;
 
 	/* If doing that made us go from no-room to some-room, wake up */
-	if (priv->message_count == (priv->max_messages - 1))
+	if (priv->message_count == (priv->max_messages - 1)) {
+		priv->dev->maybe_blocked_sends = true;
 		wake_up_interruptible(&priv->dev->write_wait);
+	}
 
 	kbus_maybe_report_message(priv->dev, msg);
 	kbus_maybe_dbg(priv->dev,
@@ -1309,17 +1518,29 @@ static struct kbus_msg *kbus_pop_message(struct kbus_private_data *priv)
 /*
  * Empty a message queue. Send synthetic messages for any outstanding
  * request messages that are now not going to be delivered/replied to.
+ *
+ * The messages themselves are not freed here. Instead, the whole queue is
+ * handed over to 'doomed' (with 'doomed_count' messages in it), so that our
+ * caller can free it with kbus_free_message_queue() once it has released the
+ * device mutex - there is no need to hold everyone else up whilst we do that.
  */
-static void kbus_empty_message_queue(struct kbus_private_data *priv)
+static void kbus_detach_message_queue(struct kbus_private_data *priv,
+				      struct kbus_message_queue *doomed,
+				      u32 *doomed_count)
 {
-	struct list_head *queue = &priv->message_queue;
-	struct kbus_message_queue_item *ptr;
-	struct kbus_message_queue_item *next;
+	u32 ii;
+	u32 old_count = priv->message_count;
 
 	kbus_maybe_dbg(priv->dev, "  %u Emptying message queue\n", priv->id);
 
-	list_for_each_entry_safe(ptr, next, queue, list) {
-		struct kbus_msg *msg = ptr->msg;
+	/*
+	 * Note that pushing a synthetic message may add to our own queue
+	 * (and even grow it), but it will always add it after the messages
+	 * we're looking at, and won't change their order.
+	 */
+	for (ii = 0; ii < old_count; ii++) {
+		struct kbus_msg *msg =
+		    kbus_queue_item(&priv->message_queue, ii)->msg;
 		int is_OUR_request = (KBUS_BIT_WANT_YOU_TO_REPLY & msg->flags);
 
 		kbus_maybe_report_message(priv->dev, msg);
@@ -1333,17 +1554,30 @@ static void kbus_empty_message_queue(struct kbus_private_data *priv)
 			kbus_push_synthetic_message(priv->dev, priv->id,
 					    msg->from, msg->id,
 					    KBUS_MSG_NAME_REPLIER_GONEAWAY);
+	}
 
-		list_del(&ptr->list);
-		kbus_free_message(ptr->msg);
+	*doomed = priv->message_queue;
+	*doomed_count = priv->message_count;
 
-		priv->message_count--;
-	}
+	priv->message_queue.items = NULL;
+	priv->message_queue.size = 0;
+	priv->message_queue.head = 0;
+	priv->message_count = 0;
+}
 
-	kbus_maybe_dbg(priv->dev,
-		       "  %u Leaving %d message%s in queue\n",
-		       priv->id, priv->message_count,
-		       priv->message_count == 1 ? "" : "s");
+/*
+ * Free a message queue detached by kbus_detach_message_queue().
+ *
+ * Does not need the device mutex.
+ */
+static void kbus_free_message_queue(struct kbus_message_queue *queue,
+				    u32 count)
+{
+	u32 ii;
+
+	for (ii = 0; ii < count; ii++)
+		kbus_free_message(kbus_queue_item(queue, ii)->msg);
+	kfree(queue->items);
 }
 
 /*
@@ -1374,6 +1608,8 @@ static int kbus_reply_needed(struct kbus_private_data *priv,
 	/*
 	 * It seems sensible to use a reference to the name. I believe
 	 * we are safe to do this because we have the message "in hand".
+	 * (If the name is inline, we just don't remember it - it is only
+	 * used for debugging.)
 	 */
 	item->name_ref = kbus_raise_name_ref(msg->name_ref);
 
@@ -1413,7 +1649,9 @@ static int kbus_reply_now_sent(struct kbus_private_data *priv,
 		kbus_maybe_dbg(priv->dev,
 		       "  %u Reply to %u:%u %.*s now sent\n",
 		       priv->id, msg_id->network_id,
-		       msg_id->serial_num, ptr->name_len, ptr->name_ref->name);
+		       msg_id->serial_num,
+		       ptr->name_ref ? ptr->name_len : 0,
+		       ptr->name_ref ? ptr->name_ref->name : "");
 
 		list_del(&ptr->list);
 		kbus_lower_name_ref(ptr->name_ref);
@@ -1502,6 +1740,86 @@ static int kbus_find_replier(struct kbus_dev *dev,
 	return 0;
 }
 
+/* The filter used by BIND, UNBIND and Replier bindings: accepts anything */
+static const struct kbus_binding_filter kbus_no_filter;
+
+/*
+ * Does this binding's sender filter accept the message?
+ *
+ * Fields whose flag is not set are always zero in a filter, so an unfiltered
+ * binding accepts everything.
+ */
+static int kbus_filter_accepts(const struct kbus_binding_filter *filter,
+			       const struct kbus_msg *msg)
+{
+	if ((filter->flags & KBUS_BIND_FILTER_FROM) &&
+	    msg->from != filter->from)
+		return false;
+	if ((filter->flags & KBUS_BIND_FILTER_ORIG_FROM) &&
+	    (msg->orig_from.network_id != filter->orig_from.network_id ||
+	     msg->orig_from.local_id != filter->orig_from.local_id))
+		return false;
+	return true;
+}
+
+/*
+ * Would a rate limited or sampled binding drop the next message?
+ *
+ * This doesn't change the binding, since the send may yet fail (and be tried
+ * again) - kbus_throttle_message() does that when the message is sent.
+ */
+static int kbus_binding_throttled(const struct kbus_message_binding *binding,
+				  unsigned long now)
+{
+	const struct kbus_binding_filter *filter = &binding->filter;
+
+	if ((filter->flags & KBUS_BIND_FILTER_SAMPLE) && binding->num_seen)
+		return true;
+	if ((filter->flags & KBUS_BIND_FILTER_MAX_RATE) &&
+	    time_before(now, binding->window_start + HZ) &&
+	    binding->window_count >= filter->max_rate)
+		return true;
+	return false;
+}
+
+/*
+ * Offer a message that is being sent to a binding's rate limit and sample.
+ *
+ * Returns true if the binding drops the message (and counts it as such),
+ * false if it should be queued.
+ */
+static int kbus_throttle_message(struct kbus_message_binding *binding,
+				 unsigned long now)
+{
+	const struct kbus_binding_filter *filter = &binding->filter;
+	int drop;
+
+	if (!(filter->flags & (KBUS_BIND_FILTER_MAX_RATE |
+			       KBUS_BIND_FILTER_SAMPLE)))
+		return false;
+
+	drop = kbus_binding_throttled(binding, now);
+
+	if (filter->flags & KBUS_BIND_FILTER_SAMPLE) {
+		if (++binding->num_seen == filter->sample_every)
+			binding->num_seen = 0;
+	}
+
+	if (drop) {
+		binding->num_suppressed++;
+		return true;
+	}
+
+	if (filter->flags & KBUS_BIND_FILTER_MAX_RATE) {
+		if (!time_before(now, binding->window_start + HZ)) {
+			binding->window_start = now;
+			binding->window_count = 0;
+		}
+		binding->window_count++;
+	}
+	return false;
+}
+
 /*
  * Find out who, if anyone, is bound as listener/replier to this message name.
  *
@@ -1517,6 +1835,10 @@ static int kbus_find_replier(struct kbus_dev *dev,
  * particular listener has bound to the message more than once (but no
  * *binding* will be represented more than once).
  *
+ * A listener binding that was made with a sender filter is only included if
+ * the message passes that filter - so a filtered listener never has the
+ * message queued for it at all.
+ *
  * Returns the number of listeners found (i.e., the length of the array), or a
  * negative value if something went wrong. This is a bit clumsy, because the
  * caller needs to check the return value *and* the 'replier' value, but there
@@ -1525,8 +1847,10 @@ static int kbus_find_replier(struct kbus_dev *dev,
 static int kbus_find_listeners(struct kbus_dev *dev,
 			       struct kbus_message_binding **listeners[],
 			       struct kbus_message_binding **replier,
-			       u32 name_len, char *name)
+			       struct kbus_msg *msg)
 {
+	u32 name_len = msg->name_len;
+	char *name = kbus_msg_name(msg);
 	int count = 0;
 	int array_size = KBUS_INIT_LISTENER_ARRAY_SIZE;
 	struct kbus_message_binding *ptr;
@@ -1603,6 +1927,11 @@ static int kbus_find_listeners(struct kbus_dev *dev,
 			}
 		} else {
 			/* It is a listener */
+			if (!kbus_filter_accepts(&ptr->filter, msg)) {
+				kbus_maybe_dbg(dev, "     ..but its sender "
+					       "filter rejects the message\n");
+				continue;
+			}
 			if (count == array_size) {
 				u32 new_size = kbus_next_size(array_size);
 
@@ -1634,6 +1963,8 @@ static int kbus_find_listeners(struct kbus_dev *dev,
  *
  * Doesn't allow more than one replier to be bound for a message name.
  *
+ * 'filter' is copied into the binding. Repliers are never filtered.
+ *
  * NB: If it succeeds, then it wants to keep hold of 'name', so don't
  *     free it...
  *
@@ -1644,7 +1975,8 @@ static int kbus_find_listeners(struct kbus_dev *dev,
 static int kbus_remember_binding(struct kbus_dev *dev,
 				 struct kbus_private_data *priv,
 				 u32 replier,
-				 u32 name_len, char *name)
+				 u32 name_len, char *name,
+				 const struct kbus_binding_filter *filter)
 {
 	int retval = 0;
 	struct kbus_message_binding *new;
@@ -1676,6 +2008,11 @@ static int kbus_remember_binding(struct kbus_dev *dev,
 	new->is_replier = replier;
 	new->name_len = name_len;
 	new->name = name;
+	new->filter = *filter;
+	new->num_seen = 0;
+	new->window_start = jiffies;
+	new->window_count = 0;
+	new->num_suppressed = 0;
 
 	if (replier && dev->report_replier_binds) {
 		/*
@@ -1693,31 +2030,37 @@ static int kbus_remember_binding(struct kbus_dev *dev,
 	}
 
 	list_add(&new->list, &dev->bound_message_list);
+	list_add(&new->ksock_list, &priv->bindings);
 	return 0;
 }
 
 /*
  * Find a particular binding.
  *
+ * A binding only matches if it was made with exactly the same sender filter.
+ *
+ * Since we're only interested in our own bindings, we only need to look at
+ * our own list of them, not at every binding on the device.
+ *
  * Return a pointer to the binding, or NULL if it was not found.
  */
 static struct kbus_message_binding
-*kbus_find_binding(struct kbus_dev *dev,
+*kbus_find_binding(struct kbus_dev *dev __maybe_unused,
 		   struct kbus_private_data *priv,
-		   u32 replier, u32 name_len, char *name)
+		   u32 replier, u32 name_len, char *name,
+		   const struct kbus_binding_filter *filter)
 {
 	struct kbus_message_binding *ptr;
-	struct kbus_message_binding *next;
 
-	list_for_each_entry_safe(ptr, next, &dev->bound_message_list, list) {
-		if (priv != ptr->bound_to)
-			continue;
+	list_for_each_entry(ptr, &priv->bindings, ksock_list) {
 		if (replier != ptr->is_replier)
 			continue;
 		if (name_len != ptr->name_len)
 			continue;
 		if (strncmp(name, ptr->name, name_len))
 			continue;
+		if (memcmp(filter, &ptr->filter, sizeof(*filter)))
+			continue;
 
 		kbus_maybe_dbg(priv->dev, "  %u Found %c '%.*s'\n",
 			       priv->id, (ptr->is_replier ? 'R' : 'L'),
@@ -1737,23 +2080,35 @@ static struct kbus_message_binding
 static void kbus_forget_matching_messages(struct kbus_private_data *priv,
 					  struct kbus_message_binding *binding)
 {
-	struct list_head *queue = &priv->message_queue;
-	struct kbus_message_queue_item *ptr;
-	struct kbus_message_queue_item *next;
+	u32 ii;
+	u32 old_count = priv->message_count;
 
 	kbus_maybe_dbg(priv->dev,
 		       "  %u Forgetting matching messages\n", priv->id);
 
-	list_for_each_entry_safe(ptr, next, queue, list) {
-		struct kbus_msg *msg = ptr->msg;
+	/*
+	 * We go once round the queue, taking each message off the head, and
+	 * putting the ones we want to keep back on the tail. This keeps them
+	 * in order, and since we can only ever put back as many messages as
+	 * we have taken off, it never needs the queue to grow - even if one
+	 * of the synthetic messages below gets pushed onto our own queue.
+	 */
+	for (ii = 0; ii < old_count; ii++) {
+		struct kbus_message_queue_item item =
+		    kbus_queue_take_head(priv);
+		struct kbus_msg *msg = item.msg;
 		int is_OUR_request = (KBUS_BIT_WANT_YOU_TO_REPLY & msg->flags);
 
 		/*
 		 * If this message was not added to the queue because of this
 		 * binding, then we are not interested in it...
 		 */
-		if (ptr->binding != binding)
+		if (item.binding != binding) {
+			*kbus_queue_item(&priv->message_queue,
+					 priv->message_count) = item;
+			priv->message_count++;
 			continue;
+		}
 
 		kbus_maybe_dbg(priv->dev,
 				"  Deleting message from queue\n");
@@ -1774,16 +2129,24 @@ static void kbus_forget_matching_messages(struct kbus_private_data *priv,
 					    KBUS_MSG_NAME_REPLIER_UNBOUND);
 		}
 
-		list_del(&ptr->list);
-		kbus_free_message(ptr->msg);
-
-		priv->message_count--;
+		kbus_free_message(msg);
+	}
 
-		/* If that made us go from no-room to some-room, wake up */
-		if (priv->message_count == (priv->max_messages - 1))
-			wake_up_interruptible(&priv->dev->write_wait);
+	/* If that made us go from no-room to some-room, wake up */
+	if (old_count >= priv->max_messages &&
+	    priv->message_count < priv->max_messages) {
+		priv->dev->maybe_blocked_sends = true;
+		wake_up_interruptible(&priv->dev->write_wait);
 	}
 
+	/*
+	 * Since we've been taking messages off and putting them back, someone
+	 * looking at our message count without the device mutex might have
+	 * seen it reach 0 and gone to sleep, so make sure they look again.
+	 */
+	if (priv->message_count)
+		wake_up_interruptible(&priv->read_wait);
+
 	kbus_maybe_dbg(priv->dev,
 		       "  %u Leaving %d message%s in queue\n",
 		       priv->id, priv->message_count,
@@ -1797,11 +2160,13 @@ static void kbus_forget_matching_messages(struct kbus_private_data *priv,
  */
 static int kbus_forget_binding(struct kbus_dev *dev,
 			       struct kbus_private_data *priv,
-			       u32 replier, u32 name_len, char *name)
+			       u32 replier, u32 name_len, char *name,
+			       const struct kbus_binding_filter *filter)
 {
 	struct kbus_message_binding *binding;
 
-	binding = kbus_find_binding(dev, priv, replier, name_len, name);
+	binding = kbus_find_binding(dev, priv, replier, name_len, name,
+				    filter);
 	if (binding == NULL) {
 		kbus_maybe_dbg(priv->dev,
 			       "  %u Could not find/unbind "
@@ -1857,6 +2222,7 @@ static int kbus_forget_binding(struct kbus_dev *dev,
 
 	/* And remove the binding once that has been done. */
 	list_del(&binding->list);
+	list_del(&binding->ksock_list);
 	kfree(binding->name);
 	kfree(binding);
 	return 0;
@@ -1883,7 +2249,7 @@ static int kbus_remember_unsent_unbind_event(struct kbus_dev *dev,
 		       "  Remembering unsent unbind event "
 		       "%u '%.*s' to %u\n",
 		       dev->unsent_unbind_msg_count, msg->name_len,
-		       msg->name_ref->name, priv->id);
+		       kbus_msg_name(msg), priv->id);
 
 	new = kmalloc(sizeof(*new), GFP_KERNEL);
 	if (!new)
@@ -1931,7 +2297,7 @@ static int kbus_listener_already_got_tragic_msg(struct kbus_dev *dev,
 					 &dev->unsent_unbind_msg_list, list) {
 
 		if (kbus_message_name_matches(
-					ptr->msg->name_ref->name,
+					kbus_msg_name(ptr->msg),
 					ptr->msg->name_len,
 					KBUS_MSG_NAME_REPLIER_BIND_EVENT))
 			/*
@@ -2012,7 +2378,7 @@ static void kbus_safe_report_unbinding(struct kbus_private_data *priv,
 	 * whether we suddenly have a replier popping up unexpectedly...
 	 */
 	num_listeners = kbus_find_listeners(priv->dev, &listeners, &replier,
-					    msg->name_len, msg->name_ref->name);
+					    msg);
 	if (num_listeners < 0) {
 		kbus_maybe_dbg(priv->dev,
 			       "  Error %d finding listeners\n",
@@ -2259,7 +2625,7 @@ static void kbus_forget_unsent_unbind_msgs(struct kbus_dev *dev)
 			list) {
 
 		if (!kbus_message_name_matches(
-					    ptr->msg->name_ref->name,
+					    kbus_msg_name(ptr->msg),
 					    ptr->msg->name_len,
 					    KBUS_MSG_NAME_REPLIER_BIND_EVENT))
 			kbus_maybe_report_message(dev, ptr->msg);
@@ -2280,17 +2646,13 @@ static void kbus_forget_unsent_unbind_msgs(struct kbus_dev *dev)
 static void kbus_forget_my_bindings(struct kbus_private_data *priv)
 {
 	struct kbus_dev *dev = priv->dev;
-	u32 bound_to_id = priv->id;
 
 	struct kbus_message_binding *ptr;
 	struct kbus_message_binding *next;
 
 	kbus_maybe_dbg(dev, "%u Forgetting my bindings\n", priv->id);
 
-	list_for_each_entry_safe(ptr, next, &dev->bound_message_list, list) {
-		if (bound_to_id != ptr->bound_to_id)
-			continue;
-
+	list_for_each_entry_safe(ptr, next, &priv->bindings, ksock_list) {
 		kbus_maybe_dbg(dev, "  Unbound %u %c '%.*s'\n",
 			       ptr->bound_to_id, (ptr->is_replier ? 'R' : 'L'),
 			       ptr->name_len, ptr->name);
@@ -2300,6 +2662,7 @@ static void kbus_forget_my_bindings(struct kbus_private_data *priv)
 							 ptr->name);
 
 		list_del(&ptr->list);
+		list_del(&ptr->ksock_list);
 		kfree(ptr->name);
 		kfree(ptr);
 	}
@@ -2371,27 +2734,19 @@ static struct kbus_private_data *kbus_find_open_ksock(struct kbus_dev *dev,
 /*
  * Remove an open file remembrance.
  *
- * Returns 0 if all went well, -EINVAL if we couldn't find the open Ksock
+ * Returns 0 (it always works, since we're given the Ksock itself)
  */
-static int kbus_forget_open_ksock(struct kbus_dev *dev, u32 id)
+static int kbus_forget_open_ksock(struct kbus_dev *dev,
+				  struct kbus_private_data *priv)
 {
-	struct kbus_private_data *ptr;
-	struct kbus_private_data *next;
-
-	list_for_each_entry_safe(ptr, next, &dev->open_ksock_list, list) {
-		if (id != ptr->id)
-			continue;
-
-		kbus_maybe_dbg(dev, "  Forgetting open Ksock %u\n", id);
-
-		/* So remove it from our list */
-		list_del(&ptr->list);
-		/* But *we* mustn't free the actual datastructure! */
-		return 0;
-	}
-	kbus_maybe_dbg(dev, "  Could not forget open Ksock %u\n", id);
+	kbus_maybe_dbg(dev, "  Forgetting open Ksock %u\n", priv->id);
 
-	return -EINVAL;
+	/*
+	 * We already know where it is, so just remove it from our list.
+	 * But *we* mustn't free the actual datastructure!
+	 */
+	list_del(&priv->list);
+	return 0;
 }
 
 /*
@@ -2462,8 +2817,9 @@ static int kbus_open(struct inode *inode, struct file *filp)
 		kfree(priv);
 		return -EFAULT;
 	}
-	INIT_LIST_HEAD(&priv->message_queue);
 	INIT_LIST_HEAD(&priv->replies_unsent);
+	INIT_LIST_HEAD(&priv->bindings);
+	INIT_LIST_HEAD(&priv->subscriptions);
 
 	init_waitqueue_head(&priv->read_wait);
 
@@ -2486,30 +2842,556 @@ static int kbus_release(struct inode *inode __always_unused, struct file *filp)
 	int retval2 = 0;
 	struct kbus_private_data *priv = filp->private_data;
 	struct kbus_dev *dev = priv->dev;
+	struct kbus_message_queue doomed;
+	u32 doomed_count;
 
 	if (mutex_lock_interruptible(&dev->mux))
 		return -ERESTARTSYS;
 
 	kbus_maybe_dbg(dev, "%u RELEASE\n", priv->id);
 
-	kbus_empty_read_msg(priv);
-	kbus_empty_write_msg(priv);
-
-	kbus_empty_msg_id_memory(priv);
-
-	kbus_empty_message_queue(priv);
+	/*
+	 * Everything here should only cost us in proportion to our own
+	 * bindings and messages, not to how busy the rest of the device is,
+	 * since lots of Ksocks may be closing at once. And the things that
+	 * only affect us (freeing our messages, mostly) are left until we've
+	 * released the mutex.
+	 */
+	kbus_detach_message_queue(priv, &doomed, &doomed_count);
 	kbus_forget_my_bindings(priv);
+	kbus_forget_my_subscriptions(priv);
 	if (priv->maybe_got_unsent_unbind_msgs)
 		kbus_forget_my_unsent_unbind_msgs(priv);
 	kbus_empty_replies_unsent(priv);
-	retval2 = kbus_forget_open_ksock(dev, priv->id);
-	kfree(priv);
+	retval2 = kbus_forget_open_ksock(dev, priv);
+
+	/*
+	 * Emptying our message queue may have made room for someone, and
+	 * losing our bindings may mean a blocked Request now has no Replier
+	 */
+	dev->maybe_blocked_sends = true;
+	kbus_retry_blocked_sends(dev);
 
 	mutex_unlock(&dev->mux);
 
+	/* No-one else can find us now, so we can tidy up at our leisure */
+	kbus_empty_read_msg(priv);
+	kbus_empty_write_msg(priv);
+	kbus_empty_msg_id_memory(priv);
+	kbus_free_message_queue(&doomed, doomed_count);
+	/* Including anything that arrived after we emptied our queue */
+	kbus_free_message_queue(&priv->message_queue, priv->message_count);
+	kfree(priv->delivered);
+	kfree(priv);
+
 	return retval2;
 }
 
+/* ========================================================================= */
+/* Broadcast topics */
+
+/*
+ * Find the broadcast topic with the given name.
+ *
+ * Returns the topic, or NULL if there is none.
+ */
+static struct kbus_topic *kbus_find_topic(struct kbus_dev *dev,
+					  u32 name_len, char *name)
+{
+	struct kbus_topic *topic;
+
+	list_for_each_entry(topic, &dev->topic_list, list) {
+		if (topic->name_len == name_len &&
+		    !strncmp(topic->name, name, name_len))
+			return topic;
+	}
+	return NULL;
+}
+
+/*
+ * Forget all the messages a topic is holding.
+ */
+static void kbus_empty_topic(struct kbus_topic *topic)
+{
+	u32 ii;
+
+	for (ii = 0; ii < topic->size; ii++) {
+		if (topic->ring[ii]) {
+			kbus_free_message(topic->ring[ii]);
+			topic->ring[ii] = NULL;
+		}
+	}
+	topic->tail = topic->next_seq;
+	topic->blocked = false;
+}
+
+/*
+ * Create a new broadcast topic, and add it to the device's list.
+ *
+ * The topic takes over 'name', if we succeed.
+ *
+ * Returns the new topic, or an ERR_PTR() if something goes wrong.
+ */
+static struct kbus_topic *kbus_new_topic(struct kbus_dev *dev,
+					 u32 name_len, char *name,
+					 u32 flags, u32 ring_size)
+{
+	struct kbus_topic *topic;
+
+	if (ring_size == 0)
+		ring_size = CONFIG_KBUS_DEF_TOPIC_RING;
+	else if (ring_size > CONFIG_KBUS_MAX_TOPIC_RING)
+		return ERR_PTR(-EINVAL);
+	ring_size = roundup_pow_of_two(ring_size);
+
+	topic = kmalloc(sizeof(*topic), GFP_KERNEL);
+	if (!topic)
+		return ERR_PTR(-ENOMEM);
+	memset(topic, 0, sizeof(*topic));
+
+	topic->ring = kcalloc(ring_size, sizeof(*topic->ring), GFP_KERNEL);
+	if (!topic->ring) {
+		kfree(topic);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	topic->name_len = name_len;
+	topic->name = name;
+	topic->backpressure = (flags & KBUS_TOPIC_BACKPRESSURE) != 0;
+	topic->size = ring_size;
+	init_waitqueue_head(&topic->wait);
+	INIT_LIST_HEAD(&topic->subscribers);
+
+	list_add(&topic->list, &dev->topic_list);
+	dev->num_topics++;
+
+	kbus_maybe_dbg(dev, "  New topic '%.*s', ring %u%s\n",
+		       name_len, name, ring_size,
+		       topic->backpressure ? ", backpressure" : "");
+	return topic;
+}
+
+/*
+ * Take a topic off its device's list, and free it.
+ */
+static void kbus_free_topic(struct kbus_dev *dev, struct kbus_topic *topic)
+{
+	kbus_maybe_dbg(dev, "  Freeing topic '%.*s'\n",
+		       topic->name_len, topic->name);
+
+	list_del(&topic->list);
+	dev->num_topics--;
+	kbus_empty_topic(topic);
+	kfree(topic->ring);
+	kfree(topic->name);
+	kfree(topic);
+}
+
+/*
+ * Forget all of a device's topics (which should have no subscribers left).
+ */
+static void kbus_forget_all_topics(struct kbus_dev *dev)
+{
+	struct kbus_topic *topic;
+	struct kbus_topic *next;
+
+	list_for_each_entry_safe(topic, next, &dev->topic_list, list)
+		kbus_free_topic(dev, topic);
+}
+
+/*
+ * Would publishing another message on this topic overwrite one that a
+ * subscriber has not yet read, when it is not allowed to?
+ */
+static int kbus_topic_is_full(struct kbus_topic *topic)
+{
+	struct kbus_topic_subscription *sub;
+	u64 tail = topic->next_seq;
+
+	if (!topic->backpressure ||
+	    topic->next_seq - topic->tail < topic->size)
+		return false;
+
+	/* It looks full, but our subscribers may have caught up since */
+	list_for_each_entry(sub, &topic->subscribers, topic_list) {
+		if (sub->cursor < tail)
+			tail = sub->cursor;
+	}
+	topic->tail = tail;
+
+	if (topic->next_seq - topic->tail < topic->size)
+		return false;
+
+	/* Remember to look again when a subscriber reads something */
+	topic->blocked = true;
+	return true;
+}
+
+/*
+ * Publish a message on a topic.
+ *
+ * The topic keeps its own copy of the message, in place of the oldest
+ * message in its ring.
+ *
+ * Returns 0 for success, or a negative value if something goes wrong.
+ */
+static int kbus_publish_to_topic(struct kbus_dev *dev,
+				 struct kbus_topic *topic,
+				 struct kbus_msg *msg)
+{
+	struct kbus_msg **slot;
+	struct kbus_msg *new_msg;
+
+	new_msg = kbus_copy_message(dev, msg);
+	if (!new_msg)
+		return -EFAULT;
+
+	slot = &topic->ring[topic->next_seq & (topic->size - 1)];
+	if (*slot)
+		kbus_free_message(*slot);
+	*slot = new_msg;
+
+	kbus_maybe_dbg(dev, "  Published message %llu on topic '%.*s'\n",
+		       topic->next_seq, topic->name_len, topic->name);
+
+	topic->next_seq++;
+	topic->blocked = false;
+
+	/* Wake those subscribers who had read everything (see kbus_topic_wake) */
+	wake_up_interruptible(&topic->wait);
+	return 0;
+}
+
+/*
+ * Called, via the topic's wait queue, when a message is published on a topic
+ * we had read everything from (and so with the device mutex held).
+ *
+ * We come off the topic's wait queue until we have caught up again, so
+ * that publishing costs nothing for subscribers who are still behind, and
+ * wake anyone polling or waiting for a message on our Ksock.
+ */
+static int kbus_topic_wake(wait_queue_entry_t *wait, unsigned mode, int sync,
+			   void *key)
+{
+	struct kbus_topic_subscription *sub =
+	    container_of(wait, struct kbus_topic_subscription, wait);
+
+	list_del_init(&wait->entry);
+	wake_up_interruptible(&sub->priv->read_wait);
+	return 1;
+}
+
+/*
+ * We have read everything on a topic, so get on its wait queue, to be told
+ * when there is something new. Must be called with the device mutex held.
+ */
+static void kbus_topic_caught_up(struct kbus_topic_subscription *sub)
+{
+	if (list_empty(&sub->wait.entry))
+		add_wait_queue(&sub->topic->wait, &sub->wait);
+}
+
+/*
+ * Create a $.KBUS.TopicLapped message, telling a subscriber that it lost
+ * 'lost' messages on the given topic.
+ *
+ * Returns the new message, or NULL.
+ */
+static struct kbus_msg *kbus_new_lapped_message(struct kbus_private_data *priv,
+						struct kbus_topic *topic,
+						u64 lost)
+{
+	struct kbus_topic_lapped_data *data;
+	struct kbus_msg *new_msg;
+	struct kbus_msg_id in_reply_to = { 0, 0 };	/* no-one */
+	u32 padded_name_len = KBUS_PADDED_NAME_LEN(topic->name_len);
+	u32 data_len = sizeof(*data) + padded_name_len;
+	u32 rest_len = padded_name_len / 4;
+
+	new_msg = kbus_build_kbus_message(priv->dev,
+					  KBUS_MSG_NAME_TOPIC_LAPPED,
+					  0, priv->id, in_reply_to);
+	if (!new_msg)
+		return NULL;
+
+	data = kbus_alloc_synthetic_data(new_msg, data_len);
+	if (!data) {
+		kbus_free_message(new_msg);
+		return NULL;
+	}
+
+	data->lost = min_t(u64, lost, U32_MAX);
+	data->name_len = topic->name_len;
+
+	data->rest[rest_len - 1] = 0;	/* terminating with enough '\0' */
+	memcpy(&data->rest[0], topic->name, topic->name_len);
+
+	if (kbus_set_synthetic_data(new_msg, data, data_len)) {
+		kbus_free_message(new_msg);
+		return NULL;
+	}
+	return new_msg;
+}
+
+/*
+ * How many messages are waiting to be read on our broadcast topics?
+ */
+static u32 kbus_topic_messages_pending(struct kbus_private_data *priv)
+{
+	struct kbus_topic_subscription *sub;
+	u32 count = 0;
+
+	list_for_each_entry(sub, &priv->subscriptions, list) {
+		struct kbus_topic *topic = sub->topic;
+		count += min_t(u64, topic->next_seq - sub->cursor, topic->size);
+	}
+	return count;
+}
+
+/*
+ * Take the next message from our broadcast topics, if there is one.
+ *
+ * We look at each topic in turn, and move the one we take a message from to
+ * the end of our list, so that one busy topic can't starve the others.
+ *
+ * The message is our own copy. If we have been lapped on the topic, then
+ * it is a $.KBUS.TopicLapped message instead, and the next message will be
+ * the oldest that the topic still has.
+ *
+ * Returns 1 (and sets 'msg') if there was a message, 0 if there was not, or
+ * a negative value if something went wrong.
+ */
+static int kbus_next_topic_message(struct kbus_private_data *priv,
+				   struct kbus_msg **msg)
+{
+	struct kbus_topic_subscription *sub;
+
+	*msg = NULL;
+
+	list_for_each_entry(sub, &priv->subscriptions, list) {
+		struct kbus_topic *topic = sub->topic;
+		u64 oldest = 0;
+
+		if (sub->cursor == topic->next_seq)
+			continue;
+
+		if (topic->next_seq > topic->size)
+			oldest = topic->next_seq - topic->size;
+
+		if (sub->cursor < oldest) {
+			kbus_maybe_dbg(priv->dev,
+				       "  %u Lapped on topic '%.*s', lost %llu\n",
+				       priv->id, topic->name_len, topic->name,
+				       oldest - sub->cursor);
+			*msg = kbus_new_lapped_message(priv, topic,
+						       oldest - sub->cursor);
+			if (!*msg)
+				return -ENOMEM;
+			sub->cursor = oldest;
+		} else {
+			*msg = kbus_copy_message(priv->dev,
+				topic->ring[sub->cursor & (topic->size - 1)]);
+			if (!*msg)
+				return -ENOMEM;
+			sub->cursor++;
+
+			/* Which may be what a blocked send was waiting for */
+			if (topic->blocked)
+				priv->dev->maybe_blocked_sends = true;
+
+			if (sub->cursor == topic->next_seq)
+				kbus_topic_caught_up(sub);
+		}
+
+		list_move_tail(&sub->list, &priv->subscriptions);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Forget one of our subscriptions.
+ */
+static void kbus_forget_subscription(struct kbus_private_data *priv,
+				     struct kbus_topic_subscription *sub)
+{
+	struct kbus_topic *topic = sub->topic;
+
+	kbus_maybe_dbg(priv->dev, "  %u Unsubscribing from topic '%.*s'\n",
+		       priv->id, topic->name_len, topic->name);
+
+	if (!list_empty(&sub->wait.entry))
+		remove_wait_queue(&topic->wait, &sub->wait);
+	list_del(&sub->list);
+	list_del(&sub->topic_list);
+	priv->num_subscriptions--;
+	topic->num_subscribers--;
+
+	/* If we were holding up a send, we aren't any more */
+	if (topic->blocked)
+		priv->dev->maybe_blocked_sends = true;
+
+	/*
+	 * No-one is left to read its messages, and keeping it would let
+	 * anyone grow the device's topic list without limit
+	 */
+	if (topic->num_subscribers == 0)
+		kbus_free_topic(priv->dev, topic);
+
+	kfree(sub);
+}
+
+/*
+ * Forget all of our subscriptions.
+ */
+static void kbus_forget_my_subscriptions(struct kbus_private_data *priv)
+{
+	struct kbus_topic_subscription *sub;
+	struct kbus_topic_subscription *next;
+
+	list_for_each_entry_safe(sub, next, &priv->subscriptions, list)
+		kbus_forget_subscription(priv, sub);
+}
+
+/* ========================================================================= */
+/* Delivery notices */
+
+/*
+ * Start tracking a message sent with KBUS_BIT_DELIVERY_NOTICE (unless we
+ * already are, from an earlier attempt to send it).
+ *
+ * Returns 0 if all goes well, or a negative value if something goes wrong.
+ */
+static int kbus_track_delivery(struct kbus_private_data *priv,
+			       struct kbus_msg *msg)
+{
+	if (msg->delivery)
+		return 0;
+
+	if (!priv->delivered) {
+		priv->delivered = kmalloc(CONFIG_KBUS_MAX_DELIVERED *
+					  sizeof(*priv->delivered),
+					  GFP_KERNEL);
+		if (!priv->delivered)
+			return -ENOMEM;
+	}
+
+	msg->delivery = kbus_new_delivery(priv->dev, priv->id, msg->id);
+	if (!msg->delivery)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Tell the sender of a tracked message that it has left the system. If the
+ * sender has gone away, there is no-one to tell.
+ *
+ * Must be called with the device mutex held.
+ */
+static void kbus_note_delivery(struct kbus_dev *dev,
+			       struct kbus_delivery *delivery)
+{
+	struct kbus_private_data *priv;
+
+	priv = kbus_find_open_ksock(dev, delivery->sender);
+	if (priv == NULL || priv->delivered == NULL) {
+		kbus_maybe_dbg(dev, "  Sender %u of delivered %u:%u has gone\n",
+			       delivery->sender, delivery->msg_id.network_id,
+			       delivery->msg_id.serial_num);
+		return;
+	}
+
+	if (priv->num_delivered < CONFIG_KBUS_MAX_DELIVERED)
+		priv->delivered[priv->num_delivered++] = delivery->msg_id;
+	else
+		priv->num_delivered_missed++;
+
+	wake_up_interruptible(&priv->read_wait);
+}
+
+/*
+ * Tell the senders of tracked messages that have left the system about them.
+ * This is our device's 'delivery_work', scheduled by
+ * kbus_release_delivery_ref().
+ */
+static void kbus_delivery_work(struct work_struct *work)
+{
+	struct kbus_dev *dev = container_of(work, struct kbus_dev,
+					    delivery_work);
+	struct llist_node *list;
+	struct kbus_delivery *delivery;
+	struct kbus_delivery *next;
+
+	mutex_lock(&dev->mux);
+
+	/* The list is newest first, but senders want them in order */
+	list = llist_reverse_order(llist_del_all(&dev->delivered));
+	llist_for_each_entry_safe(delivery, next, list, node) {
+		kbus_note_delivery(dev, delivery);
+		kfree(delivery);
+	}
+
+	mutex_unlock(&dev->mux);
+}
+
+/*
+ * Forget any delivered messages no-one has been told about yet, as our
+ * device is going away.
+ */
+static void kbus_forget_deliveries(struct kbus_dev *dev)
+{
+	struct kbus_delivery *delivery;
+	struct kbus_delivery *next;
+
+	cancel_work_sync(&dev->delivery_work);
+
+	llist_for_each_entry_safe(delivery, next,
+				  llist_del_all(&dev->delivered), node)
+		kfree(delivery);
+}
+
+/*
+ * Build a $.KBUS.Delivered message, listing everything we've been told has
+ * left the system, and forget the list.
+ *
+ * Returns the new message, or NULL if we couldn't allocate it (in which case
+ * we still remember the list).
+ */
+static struct kbus_msg
+*kbus_new_delivered_message(struct kbus_private_data *priv)
+{
+	struct kbus_delivered_data *data;
+	struct kbus_msg *new_msg;
+	struct kbus_msg_id in_reply_to = { 0, 0 };	/* no-one */
+	u32 data_len = sizeof(*data) +
+	    priv->num_delivered * sizeof(data->ids[0]);
+
+	new_msg = kbus_build_kbus_message(priv->dev, KBUS_MSG_NAME_DELIVERED,
+					  0, priv->id, in_reply_to);
+	if (!new_msg)
+		return NULL;
+
+	data = kbus_alloc_synthetic_data(new_msg, data_len);
+	if (!data) {
+		kbus_free_message(new_msg);
+		return NULL;
+	}
+
+	data->count = priv->num_delivered;
+	data->missed = priv->num_delivered_missed;
+	memcpy(data->ids, priv->delivered,
+	       priv->num_delivered * sizeof(data->ids[0]));
+
+	if (kbus_set_synthetic_data(new_msg, data, data_len)) {
+		kbus_free_message(new_msg);
+		return NULL;
+	}
+
+	priv->num_delivered = 0;
+	priv->num_delivered_missed = 0;
+	return new_msg;
+}
+
 /*
  * Determine the private data for the given listener/replier id.
  *
@@ -2611,10 +3493,12 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 	struct kbus_message_binding **listeners = NULL;
 	struct kbus_message_binding *replier = NULL;
 	struct kbus_private_data *reply_to = NULL;
+	struct kbus_topic *topic = NULL;
 	ssize_t retval = 0;
 	int num_listeners;
 	int ii;
 	int num_sent = 0;	/* # successfully "sent" */
+	unsigned long now = jiffies;
 
 	int all_or_fail = msg->flags & KBUS_BIT_ALL_OR_FAIL;
 	int all_or_wait = msg->flags & KBUS_BIT_ALL_OR_WAIT;
@@ -2628,8 +3512,7 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 	 * (b) we have 0 or 1 repliers, but
 	 * (c) the replier is *not* one of the listeners.
 	 */
-	num_listeners = kbus_find_listeners(dev, &listeners, &replier,
-					    msg->name_len, msg->name_ref->name);
+	num_listeners = kbus_find_listeners(dev, &listeners, &replier, msg);
 	if (num_listeners < 0) {
 		kbus_maybe_dbg(priv->dev,
 			       "  Error %d finding listeners\n",
@@ -2745,6 +3628,13 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 		kbus_maybe_dbg(priv->dev, "  Considering listener %u\n",
 			       listeners[ii]->bound_to_id);
 
+		/*
+		 * If the binding is going to drop the message anyway, it
+		 * doesn't matter whether its queue is full
+		 */
+		if (kbus_binding_throttled(listeners[ii], now))
+			continue;
+
 		if (kbus_queue_is_full
 		    (listeners[ii]->bound_to, "listener", false)) {
 			if (all_or_wait) {
@@ -2761,6 +3651,28 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 		}
 	}
 
+	/*
+	 * Is it an Announcement for a broadcast topic with subscribers? If
+	 * so, the only way it can't be published is if the topic applies
+	 * backpressure, and a subscriber hasn't caught up yet.
+	 */
+	if (dev->num_topics && !(msg->flags & KBUS_BIT_WANT_A_REPLY) &&
+	    !kbus_message_is_reply(msg)) {
+		topic = kbus_find_topic(dev, msg->name_len, kbus_msg_name(msg));
+		if (topic && topic->num_subscribers == 0)
+			topic = NULL;
+	}
+
+	if (topic && kbus_topic_is_full(topic)) {
+		kbus_maybe_dbg(priv->dev, "  Topic '%.*s' is full\n",
+			       topic->name_len, topic->name);
+		if (all_or_wait)
+			retval = -EAGAIN;	/* try again later */
+		else
+			retval = -EBUSY;
+		goto done_sending;
+	}
+
 	/*
 	 * ===================================================================
 	 * Actually send the messages
@@ -2828,6 +3740,12 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 	/* For each listener, if they're still interested, send it */
 	for (ii = 0; ii < num_listeners; ii++) {
 		struct kbus_message_binding *listener = listeners[ii];
+		if (listener && kbus_throttle_message(listener, now)) {
+			kbus_maybe_dbg(priv->dev, "  Listener %u drops it"
+				       " (rate limit or sample)\n",
+				       listener->bound_to_id);
+			continue;
+		}
 		if (listener) {
 			retval = kbus_push_message(listener->bound_to, msg,
 						   listener, FOR_LISTENER);
@@ -2838,6 +3756,14 @@ static int kbus_write_to_recipients(struct kbus_private_data *priv,
 		}
 	}
 
+	/* And however many subscribers it has, the topic only needs it once */
+	if (topic) {
+		retval = kbus_publish_to_topic(dev, topic, msg);
+		if (retval)
+			goto done_sending;
+		num_sent++;
+	}
+
 	retval = 0;
 
 done_sending:
@@ -2918,6 +3844,7 @@ static int kbus_write_parts(struct kbus_private_data *priv,
 
 	size_t bytes_needed;	/* ...to fill the current part */
 	size_t bytes_to_use;	/* ...from the user's data */
+	char *name;
 
 	struct kbus_msg *msg = this->msg;
 	struct kbus_message_header *user_msg =
@@ -2986,32 +3913,39 @@ static int kbus_write_parts(struct kbus_private_data *priv,
 		break;
 
 	case KBUS_PART_NAME:
-		if (this->ref_name == NULL) {
-			char *name = kmalloc(msg->name_len + 1, GFP_KERNEL);
-			if (!name) {
-				dev_err(priv->dev->dev,
-					"Cannot kmalloc message name\n");
-				return -ENOMEM;
-			}
+		if (msg->name_len <= KBUS_INLINE_NAME_LEN) {
+			/* A short name goes straight into the message */
+			name = msg->inline_name;
 			name[msg->name_len] = 0;	/* always */
-			name[0] = 0;	/* we don't know the name yet */
-			this->ref_name = kbus_wrap_name_in_ref(name);
-			if (!this->ref_name) {
-				kfree(name);
-				dev_err(priv->dev->dev,
+		} else {
+			if (this->ref_name == NULL) {
+				name = kmalloc(msg->name_len + 1, GFP_KERNEL);
+				if (!name) {
+					dev_err(priv->dev->dev,
+					"Cannot kmalloc message name\n");
+					return -ENOMEM;
+				}
+				name[msg->name_len] = 0;	/* always */
+				name[0] = 0;	/* we don't know the name yet */
+				this->ref_name = kbus_wrap_name_in_ref(name);
+				if (!this->ref_name) {
+					kfree(name);
+					dev_err(priv->dev->dev,
 					"Cannot kmalloc ref to message name\n");
-				return -ENOMEM;
+					return -ENOMEM;
+				}
 			}
+			name = this->ref_name->name;
 		}
 		bytes_needed = msg->name_len - this->pos;
 		bytes_to_use = min(bytes_needed, *count);
 
-		if (copy_from_user(this->ref_name->name + this->pos,
+		if (copy_from_user(name + this->pos,
 				   buf + *buf_pos, bytes_to_use)) {
 			dev_err(priv->dev->dev, "copy from user failed"
 			       " (name: %d of %d to %p + %u)\n",
 			       (unsigned)bytes_to_use, (unsigned)*count,
-			       this->ref_name->name, this->pos);
+			       name, this->pos);
 			return -EFAULT;
 		}
 		if (bytes_needed == bytes_to_use) {
@@ -3020,13 +3954,14 @@ static int kbus_write_parts(struct kbus_private_data *priv,
 			 * want to do this before we sort out the data, since
 			 * that can involve a *lot* of copying...
 			 */
-			if (kbus_invalid_message_name(priv->dev,
-						      this->ref_name->name,
+			if (kbus_invalid_message_name(priv->dev, name,
 						      msg->name_len))
 				return -EBADMSG;
 
-			this->msg->name_ref = this->ref_name;
-			this->ref_name = NULL;
+			if (this->ref_name) {
+				this->msg->name_ref = this->ref_name;
+				this->ref_name = NULL;
+			}
 		}
 		break;
 
@@ -3042,6 +3977,21 @@ static int kbus_write_parts(struct kbus_private_data *priv,
 			bytes_to_use = 0;
 			break;
 		}
+		if (msg->data_len <= KBUS_INLINE_DATA_LEN) {
+			/* Short data goes straight into the message */
+			bytes_needed = msg->data_len - this->pos;
+			bytes_to_use = min(bytes_needed, *count);
+			if (copy_from_user(msg->inline_data + this->pos,
+					   buf + *buf_pos, bytes_to_use)) {
+				dev_err(priv->dev->dev, "copy from user failed"
+					" (inline data: %u of %u to %p + %u)\n",
+					(unsigned)bytes_to_use,
+					(unsigned)*count, msg->inline_data,
+					this->pos);
+				return -EFAULT;
+			}
+			break;
+		}
 		if (this->ref_data == NULL) {
 			if (kbus_alloc_ref_data(priv, msg->data_len,
 						&this->ref_data))
@@ -3159,12 +4109,26 @@ static ssize_t kbus_write(struct file *filp, const char __user *buf,
 			goto done;
 	}
 
+	/*
+	 * In "auto send" mode, a write that completes a message also sends
+	 * it. The send has already dealt with the message (either discarding
+	 * it, or keeping it because we're still trying to send it), so we
+	 * mustn't empty it again if that goes wrong.
+	 */
+	if (priv->auto_send && this->is_finished) {
+		retval = kbus_send_msg(priv, dev);
+		kbus_maybe_dbg(priv->dev, "%u WRITE auto send retval %d\n",
+			       priv->id, (int)retval);
+		goto unlock;
+	}
+
 done:
 	kbus_maybe_dbg(priv->dev, "%u WRITE ends with retval %d\n",
 		       priv->id, (int)retval);
 
 	if (retval)
 		kbus_empty_write_msg(priv);
+unlock:
 	mutex_unlock(&dev->mux);
 	if (retval)
 		return retval;
@@ -3172,6 +4136,115 @@ done:
 		return count;
 }
 
+/*
+ * Should a receive on this Ksock wait for a message to arrive?
+ *
+ * Only if the user has asked for blocking receives (with the BLOCKING ioctl),
+ * and the Ksock was not opened (or fcntl'ed) with O_NONBLOCK.
+ */
+static int kbus_should_block(struct kbus_private_data *priv,
+			     struct file *filp)
+{
+	return priv->blocking && !(filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Is there a message for us to read, in our message queue, on one of our
+ * broadcast topics, or as a delivery notice?
+ *
+ * Must be called with the device mutex held.
+ */
+static int kbus_have_message(struct kbus_private_data *priv)
+{
+	return priv->message_count != 0 || priv->num_delivered != 0 ||
+	    (priv->num_subscriptions != 0 &&
+	     kbus_topic_messages_pending(priv) != 0);
+}
+
+/*
+ * Spin (with the device mutex released) for up to our busy poll window, or
+ * until there is a message for us.
+ *
+ * Our broadcast topics can only be looked at with the mutex held, so we
+ * just try for it each time round, rather than getting in the way of
+ * whoever is publishing.
+ */
+static void kbus_busy_poll_for_message(struct kbus_private_data *priv)
+{
+	struct kbus_dev *dev = priv->dev;
+	u64 end = ktime_get_ns() + (u64)priv->busy_poll_usecs * NSEC_PER_USEC;
+
+	while (!need_resched() && !signal_pending(current) &&
+	       ktime_get_ns() < end) {
+		if (READ_ONCE(priv->message_count) != 0 ||
+		    READ_ONCE(priv->num_delivered) != 0)
+			return;
+		if (READ_ONCE(priv->num_subscriptions) &&
+		    mutex_trylock(&dev->mux)) {
+			int pending = kbus_topic_messages_pending(priv) != 0;
+			mutex_unlock(&dev->mux);
+			if (pending)
+				return;
+		}
+		cpu_relax();
+	}
+}
+
+/*
+ * Wait for there to be a message in our message queue (or on one of our
+ * broadcast topics, or a delivery notice).
+ *
+ * Must be called with the device mutex held, and always returns with it held
+ * again - but note that it is dropped whilst we are waiting, so the caller
+ * cannot assume anything about the Ksock's state has stayed the same.
+ *
+ * If we have a busy poll window, we first spin (with the mutex released) for
+ * up to that many microseconds, in the hope that a message will arrive
+ * without our needing to sleep and be woken up again. Otherwise (or if that
+ * doesn't work) we sleep on our read queue until kbus_push_message() wakes us,
+ * or kbus_topic_wake() does so for one of our topics.
+ *
+ * Returns 0 if there is now a message, or -ERESTARTSYS if we were interrupted
+ * by a signal.
+ */
+static int kbus_wait_for_message(struct kbus_private_data *priv)
+{
+	struct kbus_dev *dev = priv->dev;
+	DEFINE_WAIT(wait);
+	int retval = 0;
+
+	if (kbus_have_message(priv))
+		return 0;
+
+	kbus_maybe_dbg(dev, "%u Waiting for a message (busy poll %u)\n",
+		       priv->id, priv->busy_poll_usecs);
+
+	if (priv->busy_poll_usecs) {
+		mutex_unlock(&dev->mux);
+		kbus_busy_poll_for_message(priv);
+		mutex_lock(&dev->mux);
+	}
+
+	for (;;) {
+		/*
+		 * Get on our read queue before looking, so that a message
+		 * arriving in between still wakes us
+		 */
+		prepare_to_wait(&priv->read_wait, &wait, TASK_INTERRUPTIBLE);
+		if (kbus_have_message(priv))
+			break;
+		if (signal_pending(current)) {
+			retval = -ERESTARTSYS;
+			break;
+		}
+		mutex_unlock(&dev->mux);
+		schedule();
+		mutex_lock(&dev->mux);
+	}
+	finish_wait(&priv->read_wait, &wait);
+	return retval;
+}
+
 static ssize_t kbus_read(struct file *filp, char __user *buf, size_t count,
 			 loff_t *f_pos __maybe_unused)
 {
@@ -3188,6 +4261,23 @@ static ssize_t kbus_read(struct file *filp, char __user *buf, size_t count,
 	kbus_maybe_dbg(priv->dev, "%u READ count %u, pos %d\n",
 		       priv->id, (unsigned)count, (int)*f_pos);
 
+	if (this->msg == NULL && kbus_should_block(priv, filp)) {
+		/*
+		 * In blocking mode, a read with no current message waits
+		 * for the next message, and then starts reading it (just as
+		 * if NEXTMSG had been called first).
+		 */
+		u32 msg_len;
+
+		retval = kbus_wait_for_message(priv);
+		if (retval == 0)
+			retval = kbus_ready_next_msg(priv, &msg_len);
+		if (retval < 0)
+			goto done;
+		retval = 0;
+		which = this->which;
+	}
+
 	if (this->msg == NULL) {
 		/* No message to read at the moment */
 		kbus_maybe_dbg(priv->dev, "  Nothing to read\n");
@@ -3209,7 +4299,7 @@ static ssize_t kbus_read(struct file *filp, char __user *buf, size_t count,
 			continue;
 		}
 
-		if (which == KBUS_PART_DATA) {
+		if (which == KBUS_PART_DATA && this->msg->data_ref) {
 			struct kbus_data_ptr *dp = this->msg->data_ref;
 
 			left = dp->lengths[this->ref_data_index] - this->pos;
@@ -3271,123 +4361,87 @@ static ssize_t kbus_read(struct file *filp, char __user *buf, size_t count,
 		kbus_empty_read_msg(priv);
 
 done:
+	/* An implicit NEXTMSG may have made room for a blocked send */
+	kbus_retry_blocked_sends(dev);
 	mutex_unlock(&dev->mux);
 	return retval;
 }
 
-static int kbus_bind(struct kbus_private_data *priv,
-		     struct kbus_dev *dev, unsigned long arg)
+/*
+ * Copy a message name (to bind to, etc.) from user space, and check it.
+ *
+ * Returns 0 (and sets 'name' to the copy, which the caller must free) for
+ * success, or a negative value if something goes wrong.
+ */
+static int kbus_copy_bind_name(struct kbus_private_data *priv,
+			       char __user *user_name, u32 name_len,
+			       char **name)
 {
-	int retval = 0;
-	struct kbus_bind_request *bind;
-	char *name = NULL;
+	char *new_name;
 
-	bind = kmalloc(sizeof(*bind), GFP_KERNEL);
-	if (!bind)
-		return -ENOMEM;
-	if (copy_from_user(bind, (void __user *)arg, sizeof(*bind))) {
-		retval = -EFAULT;
-		goto done;
+	if (name_len == 0) {
+		kbus_maybe_dbg(priv->dev, "name is length 0\n");
+		return -EBADMSG;
+	} else if (name_len > KBUS_MAX_NAME_LEN) {
+		kbus_maybe_dbg(priv->dev, "name is length %d\n", name_len);
+		return -ENAMETOOLONG;
 	}
 
-	if (bind->name_len == 0) {
-		kbus_maybe_dbg(dev, "bind name is length 0\n");
-		retval = -EBADMSG;
-		goto done;
-	} else if (bind->name_len > KBUS_MAX_NAME_LEN) {
-		kbus_maybe_dbg(dev, "bind name is length %d\n",
-			       bind->name_len);
-		retval = -ENAMETOOLONG;
-		goto done;
+	new_name = kmalloc(name_len + 1, GFP_KERNEL);
+	if (!new_name)
+		return -ENOMEM;
+	if (copy_from_user(new_name, user_name, name_len)) {
+		kfree(new_name);
+		return -EFAULT;
 	}
+	new_name[name_len] = 0;
 
-	name = kmalloc(bind->name_len + 1, GFP_KERNEL);
-	if (!name) {
-		retval = -ENOMEM;
-		goto done;
-	}
-	if (copy_from_user(name, (char __user *) bind->name, bind->name_len)) {
-		retval = -EFAULT;
-		goto done;
+	if (kbus_bad_message_name(new_name, name_len)) {
+		kfree(new_name);
+		return -EBADMSG;
 	}
-	name[bind->name_len] = 0;
 
-	if (kbus_bad_message_name(name, bind->name_len)) {
-		retval = -EBADMSG;
-		goto done;
-	}
+	*name = new_name;
+	return 0;
+}
 
-	if (bind->is_replier && !strcmp(name,
-					KBUS_MSG_NAME_REPLIER_BIND_EVENT)) {
+/*
+ * Bind to the given name, which we take over if we succeed.
+ */
+static int kbus_bind_name(struct kbus_private_data *priv,
+			  struct kbus_dev *dev, u32 replier,
+			  u32 name_len, char *name,
+			  const struct kbus_binding_filter *filter)
+{
+	if (replier && !strcmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT)) {
 		kbus_maybe_dbg(priv->dev, "cannot bind %s as a Replier\n",
 			       KBUS_MSG_NAME_REPLIER_BIND_EVENT);
-		retval = -EBADMSG;
-		goto done;
+		return -EBADMSG;
 	}
 
 	kbus_maybe_dbg(priv->dev, "%u BIND %c '%.*s'\n", priv->id,
-		       (bind->is_replier ? 'R' : 'L'), bind->name_len, name);
-
-	retval = kbus_remember_binding(dev, priv,
-				       bind->is_replier, bind->name_len, name);
-	if (retval == 0)
-		/* The binding will use our copy of the message name */
-		name = NULL;
+		       (replier ? 'R' : 'L'), name_len, name);
 
-done:
-	kfree(name);
-	kfree(bind);
-	return retval;
+	return kbus_remember_binding(dev, priv, replier, name_len, name,
+				     filter);
 }
 
-static int kbus_unbind(struct kbus_private_data *priv,
-		       struct kbus_dev *dev, unsigned long arg)
+/*
+ * Unbind from the given name. We don't take over the name.
+ */
+static int kbus_unbind_name(struct kbus_private_data *priv,
+			    struct kbus_dev *dev, u32 replier,
+			    u32 name_len, char *name,
+			    const struct kbus_binding_filter *filter)
 {
 	int retval = 0;
-	struct kbus_bind_request *bind;
-	char *name = NULL;
 	u32 old_message_count = priv->message_count;
 
-	bind = kmalloc(sizeof(*bind), GFP_KERNEL);
-	if (!bind)
-		return -ENOMEM;
-	if (copy_from_user(bind, (void __user *)arg, sizeof(*bind))) {
-		retval = -EFAULT;
-		goto done;
-	}
-
-	if (bind->name_len == 0) {
-		kbus_maybe_dbg(priv->dev, "unbind name is length 0\n");
-		retval = -EBADMSG;
-		goto done;
-	} else if (bind->name_len > KBUS_MAX_NAME_LEN) {
-		kbus_maybe_dbg(priv->dev, "unbind name is length %d\n",
-			       bind->name_len);
-		retval = -ENAMETOOLONG;
-		goto done;
-	}
-
-	name = kmalloc(bind->name_len + 1, GFP_KERNEL);
-	if (!name) {
-		retval = -ENOMEM;
-		goto done;
-	}
-	if (copy_from_user(name, (char __user *) bind->name, bind->name_len)) {
-		retval = -EFAULT;
-		goto done;
-	}
-	name[bind->name_len] = 0;
-
-	if (kbus_bad_message_name(name, bind->name_len)) {
-		retval = -EBADMSG;
-		goto done;
-	}
-
 	kbus_maybe_dbg(priv->dev, "%u UNBIND %c '%.*s'\n", priv->id,
-		       (bind->is_replier ? 'R' : 'L'), bind->name_len, name);
+		       (replier ? 'R' : 'L'), name_len, name);
 
-	retval = kbus_forget_binding(dev, priv,
-				     bind->is_replier, bind->name_len, name);
+	retval = kbus_forget_binding(dev, priv, replier, name_len, name,
+				     filter);
 
 	/*
 	 * If we're unbinding from $.KBUS.ReplierBindEvent, and there
@@ -3419,9 +4473,294 @@ static int kbus_unbind(struct kbus_private_data *priv,
 			       "unbind (error %d)\n", -rv);
 	}
 
+	return retval;
+}
+
+static int kbus_bind(struct kbus_private_data *priv,
+		     struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_bind_request bind;
+	char *name = NULL;
+
+	if (copy_from_user(&bind, (void __user *)arg, sizeof(bind)))
+		return -EFAULT;
+
+	retval = kbus_copy_bind_name(priv, (char __user *) bind.name,
+				     bind.name_len, &name);
+	if (retval)
+		return retval;
+
+	retval = kbus_bind_name(priv, dev, bind.is_replier,
+				bind.name_len, name, &kbus_no_filter);
+	if (retval)
+		/* Otherwise, the binding will use our copy of the name */
+		kfree(name);
+	return retval;
+}
+
+static int kbus_unbind(struct kbus_private_data *priv,
+		       struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_bind_request bind;
+	char *name = NULL;
+
+	if (copy_from_user(&bind, (void __user *)arg, sizeof(bind)))
+		return -EFAULT;
+
+	retval = kbus_copy_bind_name(priv, (char __user *) bind.name,
+				     bind.name_len, &name);
+	if (retval)
+		return retval;
+
+	retval = kbus_unbind_name(priv, dev, bind.is_replier,
+				  bind.name_len, name, &kbus_no_filter);
+	kfree(name);
+	return retval;
+}
+
+/*
+ * Read a BINDFILTER or UNBINDFILTER request, and the name and filter it
+ * describes.
+ *
+ * Returns 0 (and sets 'name' to a copy of the name, which the caller must
+ * free) for success, or a negative value if something goes wrong.
+ */
+static int kbus_get_bind_filter(struct kbus_private_data *priv,
+				unsigned long arg,
+				struct kbus_binding_filter *filter,
+				u32 *name_len, char **name)
+{
+	struct kbus_bind_filter_request request;
+
+	if (copy_from_user(&request, (void __user *)arg, sizeof(request)))
+		return -EFAULT;
+
+	if (request.flags & ~(KBUS_BIND_FILTER_FROM |
+			      KBUS_BIND_FILTER_ORIG_FROM |
+			      KBUS_BIND_FILTER_MAX_RATE |
+			      KBUS_BIND_FILTER_SAMPLE)) {
+		kbus_maybe_dbg(priv->dev, "unknown bind filter flags %#x\n",
+			       request.flags);
+		return -EINVAL;
+	}
+	if ((request.flags & KBUS_BIND_FILTER_MAX_RATE) &&
+	    request.max_rate == 0) {
+		kbus_maybe_dbg(priv->dev, "bind filter max rate is 0\n");
+		return -EINVAL;
+	}
+	if ((request.flags & KBUS_BIND_FILTER_SAMPLE) &&
+	    request.sample_every == 0) {
+		kbus_maybe_dbg(priv->dev, "bind filter sample is 0\n");
+		return -EINVAL;
+	}
+
+	memset(filter, 0, sizeof(*filter));
+	filter->flags = request.flags;
+	if (request.flags & KBUS_BIND_FILTER_FROM)
+		filter->from = request.from;
+	if (request.flags & KBUS_BIND_FILTER_ORIG_FROM)
+		filter->orig_from = request.orig_from;
+	if (request.flags & KBUS_BIND_FILTER_MAX_RATE)
+		filter->max_rate = request.max_rate;
+	if (request.flags & KBUS_BIND_FILTER_SAMPLE)
+		filter->sample_every = request.sample_every;
+
+	*name_len = request.name_len;
+	return kbus_copy_bind_name(priv, (char __user *) request.name,
+				   request.name_len, name);
+}
+
+static int kbus_bind_filter(struct kbus_private_data *priv,
+			    struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_binding_filter filter;
+	u32 name_len;
+	char *name = NULL;
+
+	retval = kbus_get_bind_filter(priv, arg, &filter, &name_len, &name);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u BINDFILTER flags %#x from %u"
+		       " orig_from %u:%u max rate %u sample %u\n", priv->id,
+		       filter.flags, filter.from, filter.orig_from.network_id,
+		       filter.orig_from.local_id, filter.max_rate,
+		       filter.sample_every);
+
+	retval = kbus_bind_name(priv, dev, false, name_len, name, &filter);
+	if (retval)
+		/* Otherwise, the binding will use our copy of the name */
+		kfree(name);
+	return retval;
+}
+
+static int kbus_unbind_filter(struct kbus_private_data *priv,
+			      struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_binding_filter filter;
+	u32 name_len;
+	char *name = NULL;
+
+	retval = kbus_get_bind_filter(priv, arg, &filter, &name_len, &name);
+	if (retval)
+		return retval;
+
+	retval = kbus_unbind_name(priv, dev, false, name_len, name, &filter);
+	kfree(name);
+	return retval;
+}
+
+/*
+ * Read a SUBSCRIBE or UNSUBSCRIBE request, and the topic name it refers to.
+ *
+ * Returns 0 (and sets 'name' to a copy of the name, which the caller must
+ * free) for success, or a negative value if something goes wrong.
+ */
+static int kbus_get_topic_request(struct kbus_private_data *priv,
+				  unsigned long arg,
+				  struct kbus_topic_request *request,
+				  char **name)
+{
+	char *new_name;
+
+	if (copy_from_user(request, (void __user *)arg, sizeof(*request)))
+		return -EFAULT;
+
+	if (request->name_len == 0) {
+		kbus_maybe_dbg(priv->dev, "topic name is length 0\n");
+		return -EBADMSG;
+	} else if (request->name_len > KBUS_MAX_NAME_LEN) {
+		kbus_maybe_dbg(priv->dev, "topic name is length %d\n",
+			       request->name_len);
+		return -ENAMETOOLONG;
+	}
+
+	new_name = kmalloc(request->name_len + 1, GFP_KERNEL);
+	if (!new_name)
+		return -ENOMEM;
+	if (copy_from_user(new_name, (char __user *) request->name,
+			   request->name_len)) {
+		kfree(new_name);
+		return -EFAULT;
+	}
+	new_name[request->name_len] = 0;
+
+	/* A topic is a single message name, so no wildcards */
+	if (kbus_bad_message_name(new_name, request->name_len) ||
+	    kbus_wildcarded_message_name(new_name, request->name_len)) {
+		kfree(new_name);
+		return -EBADMSG;
+	}
+
+	*name = new_name;
+	return 0;
+}
+
+/*
+ * Find our subscription to the given topic, or NULL if we don't have one.
+ */
+static struct kbus_topic_subscription
+*kbus_find_subscription(struct kbus_private_data *priv,
+			struct kbus_topic *topic)
+{
+	struct kbus_topic_subscription *sub;
+
+	list_for_each_entry(sub, &priv->subscriptions, list) {
+		if (sub->topic == topic)
+			return sub;
+	}
+	return NULL;
+}
+
+static int kbus_subscribe(struct kbus_private_data *priv,
+			  struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_topic_request request;
+	struct kbus_topic *topic;
+	struct kbus_topic_subscription *sub;
+	char *name = NULL;
+
+	retval = kbus_get_topic_request(priv, arg, &request, &name);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u SUBSCRIBE '%.*s' (flags %#x, ring %u)\n",
+		       priv->id, request.name_len, name, request.flags,
+		       request.ring_size);
+
+	topic = kbus_find_topic(dev, request.name_len, name);
+	if (topic && kbus_find_subscription(priv, topic)) {
+		retval = -EALREADY;
+		goto done;
+	}
+
+	sub = kmalloc(sizeof(*sub), GFP_KERNEL);
+	if (!sub) {
+		retval = -ENOMEM;
+		goto done;
+	}
+	memset(sub, 0, sizeof(*sub));
+
+	if (!topic) {
+		topic = kbus_new_topic(dev, request.name_len, name,
+				       request.flags, request.ring_size);
+		if (IS_ERR(topic)) {
+			retval = PTR_ERR(topic);
+			kfree(sub);
+			goto done;
+		}
+		/* The topic will use our copy of the name */
+		name = NULL;
+	}
+
+	/* We only see what is published from now on */
+	sub->topic = topic;
+	sub->priv = priv;
+	sub->cursor = topic->next_seq;
+	init_waitqueue_func_entry(&sub->wait, kbus_topic_wake);
+	INIT_LIST_HEAD(&sub->wait.entry);
+	kbus_topic_caught_up(sub);
+
+	list_add_tail(&sub->list, &priv->subscriptions);
+	list_add_tail(&sub->topic_list, &topic->subscribers);
+	priv->num_subscriptions++;
+	topic->num_subscribers++;
+
 done:
 	kfree(name);
-	kfree(bind);
+	return retval;
+}
+
+static int kbus_unsubscribe(struct kbus_private_data *priv,
+			    struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = 0;
+	struct kbus_topic_request request;
+	struct kbus_topic *topic;
+	struct kbus_topic_subscription *sub = NULL;
+	char *name = NULL;
+
+	retval = kbus_get_topic_request(priv, arg, &request, &name);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u UNSUBSCRIBE '%.*s'\n",
+		       priv->id, request.name_len, name);
+
+	topic = kbus_find_topic(dev, request.name_len, name);
+	if (topic)
+		sub = kbus_find_subscription(priv, topic);
+	if (sub)
+		kbus_forget_subscription(priv, sub);
+	else
+		retval = -EINVAL;
+
+	kfree(name);
 	return retval;
 }
 
@@ -3488,18 +4827,20 @@ done:
 /*
  * Make the next message ready for reading by the user.
  *
+ * Sets 'msg_len' to the length of the "entire" message, or 0 if there is no
+ * next message.
+ *
  * Returns 0 if there is no next message, 1 if there is, and a negative value
  * if there's an error.
  */
-static int kbus_nextmsg(struct kbus_private_data *priv,
-			unsigned long arg)
+static int kbus_ready_next_msg(struct kbus_private_data *priv, u32 *msg_len)
 {
 	int retval = 0;
 	struct kbus_msg *msg;
 	struct kbus_read_msg *this = &(priv->read);
 	struct kbus_message_header *user_msg;
 
-	kbus_maybe_dbg(priv->dev, "%u NEXTMSG\n", priv->id);
+	*msg_len = 0;
 
 	/* If we were partway through a message, lose it */
 	if (this->msg) {
@@ -3507,15 +4848,30 @@ static int kbus_nextmsg(struct kbus_private_data *priv,
 		kbus_empty_read_msg(priv);
 	}
 
-	/* Have we got a next message? */
-	msg = kbus_pop_message(priv);
+	/*
+	 * Have we got a next message? If we've been told that messages we
+	 * sent have left the system, that comes first.
+	 */
+	msg = NULL;
+	if (priv->num_delivered) {
+		msg = kbus_new_delivered_message(priv);
+		if (msg == NULL)
+			return -ENOMEM;
+		kbus_maybe_report_message(priv->dev, msg);
+	}
+	if (msg == NULL)
+		msg = kbus_pop_message(priv);
+	if (msg == NULL && priv->num_subscriptions) {
+		/* Our broadcast topics come after our message queue */
+		retval = kbus_next_topic_message(priv, &msg);
+		if (retval < 0)
+			return retval;
+		if (msg)
+			kbus_maybe_report_message(priv->dev, msg);
+	}
 	if (msg == NULL) {
 		kbus_maybe_dbg(priv->dev, "  No next message\n");
-		/*
-		 * A return value of 0 means no message, and that's
-		 * what __put_user returns for success.
-		 */
-		return __put_user(0, (u32 __user *) arg);
+		return 0;
 	}
 
 	user_msg = (struct kbus_message_header *)&this->user_hdr;
@@ -3537,13 +4893,19 @@ static int kbus_nextmsg(struct kbus_private_data *priv,
 	this->msg = msg;	/* Remember it so we can free it later */
 
 	this->parts[KBUS_PART_HDR] = (char *)user_msg;
-	this->parts[KBUS_PART_NAME] = msg->name_ref->name;
+	this->parts[KBUS_PART_NAME] = kbus_msg_name(msg);
 	/* direct to the string */
 
 	this->parts[KBUS_PART_NPAD] = static_zero_padding;
 
-	/* The data is treated specially - see kbus_read() */
-	this->parts[KBUS_PART_DATA] = (char *)msg->data_ref;
+	/*
+	 * Reference counted data is treated specially - see kbus_read() -
+	 * but inline data is just like any other part
+	 */
+	if (msg->data_ref)
+		this->parts[KBUS_PART_DATA] = (char *)msg->data_ref;
+	else
+		this->parts[KBUS_PART_DATA] = (char *)msg->inline_data;
 
 	this->parts[KBUS_PART_DPAD] = static_zero_padding;
 	this->parts[KBUS_PART_FINAL_GUARD] = (char *)&static_end_guard;
@@ -3599,11 +4961,142 @@ static int kbus_nextmsg(struct kbus_private_data *priv,
 			return retval;
 	}
 
-	retval = __put_user(KBUS_ENTIRE_MSG_LEN(msg->name_len, msg->data_len),
-			    (u32 __user *) arg);
+	*msg_len = KBUS_ENTIRE_MSG_LEN(msg->name_len, msg->data_len);
+	return 1;	/* We had a message */
+}
+
+/*
+ * The NEXTMSG ioctl: make the next message ready for reading, and tell the
+ * user how long it is.
+ *
+ * If we're in blocking mode, wait for a message if there isn't one yet.
+ *
+ * Returns 0 if there is no next message, 1 if there is, and a negative value
+ * if there's an error.
+ */
+static int kbus_nextmsg(struct kbus_private_data *priv, struct file *filp,
+			unsigned long arg)
+{
+	int retval;
+	int had_msg;
+	u32 msg_len;
+
+	kbus_maybe_dbg(priv->dev, "%u NEXTMSG\n", priv->id);
+
+	if (kbus_should_block(priv, filp)) {
+		/* Waiting means we must lose any partial message first */
+		if (priv->read.msg) {
+			kbus_maybe_dbg(priv->dev,
+				       "  Dropping partial message\n");
+			kbus_empty_read_msg(priv);
+		}
+		retval = kbus_wait_for_message(priv);
+		if (retval)
+			return retval;
+	}
+
+	had_msg = kbus_ready_next_msg(priv, &msg_len);
+	if (had_msg < 0)
+		return had_msg;
+
+	retval = __put_user(msg_len, (u32 __user *) arg);
 	if (retval)
 		return retval;
-	return 1;	/* We had a message */
+	return had_msg;
+}
+
+/*
+ * Set (or query) whether NEXTMSG and read() should wait for a message.
+ */
+static int kbus_set_blocking(struct kbus_private_data *priv,
+			     unsigned long arg)
+{
+	int retval = 0;
+	u32 blocking;
+	int old_value = priv->blocking;
+
+	retval = __get_user(blocking, (u32 __user *) arg);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u BLOCKING requests %u (was %d)\n",
+		       priv->id, blocking, old_value);
+
+	switch (blocking) {
+	case 0:
+		priv->blocking = false;
+		break;
+	case 1:
+		priv->blocking = true;
+		break;
+	case 0xFFFFFFFF:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return __put_user(old_value, (u32 __user *) arg);
+}
+
+/*
+ * Set (or query) how long a blocking receive should spin, in microseconds,
+ * before going to sleep.
+ */
+static int kbus_set_busy_poll(struct kbus_private_data *priv,
+			      unsigned long arg)
+{
+	int retval = 0;
+	u32 usecs;
+	u32 old_value = priv->busy_poll_usecs;
+
+	retval = __get_user(usecs, (u32 __user *) arg);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u BUSYPOLL requests %u (was %u)\n",
+		       priv->id, usecs, old_value);
+
+	if (usecs != 0xFFFFFFFF) {
+		if (usecs > CONFIG_KBUS_MAX_BUSY_POLL_USECS)
+			return -EINVAL;
+		priv->busy_poll_usecs = usecs;
+	}
+
+	return __put_user(old_value, (u32 __user *) arg);
+}
+
+/*
+ * Set (or query) whether a write() that completes a message should also
+ * send it.
+ */
+static int kbus_set_auto_send(struct kbus_private_data *priv,
+			      unsigned long arg)
+{
+	int retval = 0;
+	u32 auto_send;
+	int old_value = priv->auto_send;
+
+	retval = __get_user(auto_send, (u32 __user *) arg);
+	if (retval)
+		return retval;
+
+	kbus_maybe_dbg(priv->dev, "%u AUTOSEND requests %u (was %d)\n",
+		       priv->id, auto_send, old_value);
+
+	switch (auto_send) {
+	case 0:
+		priv->auto_send = false;
+		break;
+	case 1:
+		priv->auto_send = true;
+		break;
+	case 0xFFFFFFFF:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return __put_user(old_value, (u32 __user *) arg);
 }
 
 /* How much of the current message is left to read? */
@@ -3618,7 +5111,7 @@ extern u32 kbus_lenleft(struct kbus_private_data *priv)
 		/* Add up the items we're read all of, so far */
 		for (ii = 0; ii < this->which; ii++) {
 			if (this->which == KBUS_PART_DATA &&
-			    this->msg->data_len > 0) {
+			    this->msg->data_ref) {
 				struct kbus_data_ptr *dp = this->msg->data_ref;
 				for (jj = 0; jj < this->ref_data_index; jj++)
 					sofar += dp->lengths[jj];
@@ -3631,7 +5124,7 @@ extern u32 kbus_lenleft(struct kbus_private_data *priv)
 		/* Plus what we're read of the last one */
 		if (this->which < KBUS_NUM_PARTS) {
 			if (this->which == KBUS_PART_DATA &&
-			    this->msg->data_len > 0) {
+			    this->msg->data_ref) {
 				struct kbus_data_ptr *dp = this->msg->data_ref;
 				for (jj = 0; jj < this->ref_data_index; jj++)
 					sofar += dp->lengths[jj];
@@ -3811,18 +5304,25 @@ static int kbus_copy_pointy_parts(struct kbus_private_data *priv,
 {
 	struct kbus_msg *msg = this->msg;
 	char *new_name = NULL;
-	struct kbus_name_ptr *name_ref;
+	struct kbus_name_ptr *name_ref = NULL;
 	struct kbus_data_ptr *new_data = NULL;
+	int is_inline = (msg->name_len <= KBUS_INLINE_NAME_LEN);
 
-	/* First, let's deal with the name */
-	new_name = kmalloc(msg->name_len + 1, GFP_KERNEL);
-	if (!new_name)
-		return -ENOMEM;
+	/* First, let's deal with the name - if it's short, it goes inline */
+	if (is_inline) {
+		new_name = msg->inline_name;
+	} else {
+		new_name = kmalloc(msg->name_len + 1, GFP_KERNEL);
+		if (!new_name)
+			return -ENOMEM;
+	}
 	if (copy_from_user
 	    (new_name, (void __user *)this->user_name_ptr, msg->name_len + 1)) {
-		kfree(new_name);
+		if (!is_inline)
+			kfree(new_name);
 		return -EFAULT;
 	}
+	new_name[msg->name_len] = 0;	/* always */
 
 	/*
 	 * We can check the name now it is in kernel space - we want
@@ -3830,17 +5330,27 @@ static int kbus_copy_pointy_parts(struct kbus_private_data *priv,
 	 * a *lot* of copying...
 	 */
 	if (kbus_invalid_message_name(priv->dev, new_name, msg->name_len)) {
-		kfree(new_name);
+		if (!is_inline)
+			kfree(new_name);
 		return -EBADMSG;
 	}
-	name_ref = kbus_wrap_name_in_ref(new_name);
-	if (!name_ref) {
-		kfree(new_name);
-		return -ENOMEM;
+	if (!is_inline) {
+		name_ref = kbus_wrap_name_in_ref(new_name);
+		if (!name_ref) {
+			kfree(new_name);
+			return -ENOMEM;
+		}
 	}
 
 	/* Now for the data. */
-	if (msg->data_len) {
+	if (msg->data_len && msg->data_len <= KBUS_INLINE_DATA_LEN) {
+		if (copy_from_user(msg->inline_data,
+				   (void __user *)this->user_data_ptr,
+				   msg->data_len)) {
+			kbus_lower_name_ref(name_ref);
+			return -EFAULT;
+		}
+	} else if (msg->data_len) {
 		int retval = kbus_wrap_user_data(priv, msg->data_len,
 						 this->user_data_ptr,
 						 &new_data);
@@ -3869,10 +5379,25 @@ static void kbus_discard(struct kbus_private_data *priv)
 }
 
 /*
+ * Remember that we have sent a message, for /proc/kbus/stats
+ */
+static void kbus_count_sent(struct kbus_private_data *priv,
+			    struct kbus_msg *msg)
+{
+	priv->num_sent++;
+	priv->bytes_sent += KBUS_ENTIRE_MSG_LEN(msg->name_len, msg->data_len);
+}
+
+/*
+ * Send the message we have just written.
+ *
+ * This is the work of the SEND ioctl, and is also used by kbus_write() when
+ * the Ksock is in "auto send" mode. The id of the message is left in
+ * priv->last_msg_id_sent.
+ *
  * Returns 0 for success, and a negative value if there's an error.
  */
-static int kbus_send(struct kbus_private_data *priv,
-		     struct kbus_dev *dev, unsigned long arg)
+static int kbus_send_msg(struct kbus_private_data *priv, struct kbus_dev *dev)
 {
 	ssize_t retval = 0;
 	struct kbus_msg *msg = priv->write.msg;
@@ -3934,7 +5459,7 @@ static int kbus_send(struct kbus_private_data *priv,
 	 * We do this check here, rather than in kbus_write_to_recipients,
 	 * because:
 	 *
-	 * a) kbus_write_to_recipients gets (re)called by the POLL interface,
+	 * a) kbus_write_to_recipients gets (re)called to retry blocked sends,
 	 *    and at that stage KBUS *knows* that there is room for the
 	 *    message concerned (so the checking code would need to know not
 	 *    to check)
@@ -3977,22 +5502,55 @@ static int kbus_send(struct kbus_private_data *priv,
 	/* Also, remember this as the "message we last (tried to) send" */
 	priv->last_msg_id_sent = msg->id;
 
+	/* Does the sender want to know when it has left the system? */
+	if (msg->flags & KBUS_BIT_DELIVERY_NOTICE) {
+		retval = kbus_track_delivery(priv, msg);
+		if (retval)
+			goto done;
+	}
+
 	/*
 	 * Figure out who should receive this message, and write it to them
 	 */
 	retval = kbus_write_to_recipients(priv, dev, msg);
 
 done:
+	if (retval == 0)
+		kbus_count_sent(priv, msg);
+	else if (retval == -EAGAIN && !priv->sending)
+		priv->num_blocked++;
+	else if (retval == -EBUSY)
+		priv->num_refused++;
+
 	/*
 	 * -EAGAIN means we were blocked from sending, and the caller
 	 *  should try again (as one might expect).
 	 */
-	if (retval == -EAGAIN)
+	if (retval == -EAGAIN) {
 		/* Remember we're still trying to send this message */
 		priv->sending = true;
-	else
+	} else {
+		/*
+		 * If the send failed, the sender doesn't want to be told
+		 * that the message has left the system as well
+		 */
+		if (retval && msg && msg->delivery)
+			msg->delivery->sender = 0;
+
 		/* We've now finished with our copy of the message header */
 		kbus_discard(priv);
+	}
+
+	return retval;
+}
+
+/*
+ * Returns 0 for success, and a negative value if there's an error.
+ */
+static int kbus_send(struct kbus_private_data *priv,
+		     struct kbus_dev *dev, unsigned long arg)
+{
+	int retval = kbus_send_msg(priv, dev);
 
 	if (retval == 0 || retval == -EAGAIN)
 		if (copy_to_user((void __user *)arg, &priv->last_msg_id_sent,
@@ -4015,8 +5573,12 @@ static int kbus_maxmsgs(struct kbus_private_data *priv,
 		       priv->id, requested_max, priv->max_messages);
 
 	/* A value of 0 is just a query for what the current length is */
-	if (requested_max > 0)
+	if (requested_max > 0) {
+		/* Making our queue longer may make room for someone's send */
+		if (requested_max > priv->max_messages)
+			priv->dev->maybe_blocked_sends = true;
 		priv->max_messages = requested_max;
+	}
 
 	return __put_user(priv->max_messages, (u32 __user *) arg);
 }
@@ -4032,6 +5594,13 @@ static int kbus_nummsgs(struct kbus_private_data *priv,
 		count += kbus_count_unsent_unbind_msgs(priv);
 	}
 
+	if (priv->num_subscriptions)
+		count += kbus_topic_messages_pending(priv);
+
+	/* All our delivery notices are read as a single message */
+	if (priv->num_delivered)
+		count++;
+
 	kbus_maybe_dbg(dev, "%u NUMMSGS %u\n", priv->id, count);
 
 	return __put_user(count, (u32 __user *) arg);
@@ -4265,6 +5834,9 @@ static long kbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		 * messages of a given name
 		 */
 		retval = kbus_unbind(priv, dev, arg);
+		/* A Request that was blocked may now have no Replier */
+		if (retval == 0)
+			dev->maybe_blocked_sends = true;
 		break;
 
 	case KBUS_IOC_KSOCKID:
@@ -4298,7 +5870,7 @@ static long kbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		 * retval:  0 if no next message, 1 if there is a next message,
 		 *          negative value if there's an error.
 		 */
-		retval = kbus_nextmsg(priv, arg);
+		retval = kbus_nextmsg(priv, filp, arg);
 		break;
 
 	case KBUS_IOC_LENLEFT:
@@ -4433,12 +6005,94 @@ static long kbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		retval = kbus_maxmsgsize(priv, arg);
 		break;
 
+	case KBUS_IOC_BLOCKING:
+		/*
+		 * Should NEXTMSG (and read() with no current message) wait
+		 * for a message, if the Ksock was not opened O_NONBLOCK?
+		 *
+		 * arg in: 0 (for no), 1 (for yes), 0xFFFFFFFF (for query)
+		 * arg out: the previous value, before we were called
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_set_blocking(priv, arg);
+		break;
+
+	case KBUS_IOC_BUSYPOLL:
+		/*
+		 * How long should a blocking receive spin before sleeping?
+		 *
+		 * arg in: microseconds (0 for no spinning), 0xFFFFFFFF (for
+		 * query)
+		 * arg out: the previous value, before we were called
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_set_busy_poll(priv, arg);
+		break;
+
+	case KBUS_IOC_AUTOSEND:
+		/*
+		 * Should a write() that completes a message also send it?
+		 *
+		 * arg in: 0 (for no), 1 (for yes), 0xFFFFFFFF (for query)
+		 * arg out: the previous value, before we were called
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_set_auto_send(priv, arg);
+		break;
+
+	case KBUS_IOC_SUBSCRIBE:
+		/*
+		 * Subscribe to a broadcast topic
+		 *
+		 * arg in: a struct kbus_topic_request
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_subscribe(priv, dev, arg);
+		break;
+
+	case KBUS_IOC_UNSUBSCRIBE:
+		/*
+		 * Unsubscribe from a broadcast topic
+		 *
+		 * arg in: a struct kbus_topic_request
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_unsubscribe(priv, dev, arg);
+		break;
+
+	case KBUS_IOC_BINDFILTER:
+		/*
+		 * Bind as a Listener to a message name, but only for
+		 * messages from a particular sender
+		 *
+		 * arg in: a struct kbus_bind_filter_request
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_bind_filter(priv, dev, arg);
+		break;
+
+	case KBUS_IOC_UNBINDFILTER:
+		/*
+		 * Unbind a binding made with BINDFILTER
+		 *
+		 * arg in: a struct kbus_bind_filter_request
+		 * return: 0 means OK, otherwise not OK
+		 */
+		retval = kbus_unbind_filter(priv, dev, arg);
+		break;
+
 	default:
 		/* *Should* be redundant, if we got our range checks right */
 		retval = -ENOTTY;
 		break;
 	}
 
+	/*
+	 * If that made room in someone's message queue, anyone who was
+	 * blocked trying to send to them may now be able to do so.
+	 */
+	kbus_retry_blocked_sends(dev);
+
 	mutex_unlock(&dev->mux);
 	return retval;
 }
@@ -4453,8 +6107,8 @@ static long kbus_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
  * Returns false if we hit EAGAIN (again) and we're still trying to send the
  * current message.
  */
-static int kbus_poll_try_send_again(struct kbus_private_data *priv,
-				    struct kbus_dev *dev)
+static int kbus_try_send_again(struct kbus_private_data *priv,
+			       struct kbus_dev *dev)
 {
 	int retval;
 	struct kbus_msg *msg = priv->write.msg;
@@ -4463,6 +6117,7 @@ static int kbus_poll_try_send_again(struct kbus_private_data *priv,
 
 	switch (-retval) {
 	case 0:		/* All is well, nothing to do */
+		kbus_count_sent(priv, msg);
 		break;
 	case EAGAIN:		/* Still blocked by *someone* - nowt to do */
 		break;
@@ -4496,47 +6151,92 @@ static int kbus_poll_try_send_again(struct kbus_private_data *priv,
 	return false;
 }
 
+/*
+ * Retry the sends of any Ksocks that are blocked (with -EAGAIN) part way
+ * through sending a message.
+ *
+ * This only does anything if someone has made room in their message queue
+ * (or otherwise changed things) since we last looked. It is called at the
+ * end of each ioctl, and on release, with the device mutex held.
+ *
+ * Doing this here, rather than in kbus_poll(), means that a poll never has
+ * to take the device mutex. Any Ksock that finishes sending is woken up, and
+ * its next poll will find that it is writable.
+ */
+static void kbus_retry_blocked_sends(struct kbus_dev *dev)
+{
+	struct kbus_private_data *ptr;
+	int any_finished = false;
+
+	if (!dev->maybe_blocked_sends)
+		return;
+	dev->maybe_blocked_sends = false;
+
+	list_for_each_entry(ptr, &dev->open_ksock_list, list) {
+		if (!ptr->sending)
+			continue;
+		kbus_maybe_dbg(dev, "%u Retrying blocked send\n", ptr->id);
+		if (kbus_try_send_again(ptr, dev))
+			any_finished = true;
+	}
+
+	if (any_finished)
+		wake_up_interruptible(&dev->write_wait);
+}
+
 static unsigned int kbus_poll(struct file *filp, poll_table * wait)
 {
 	struct kbus_private_data *priv = filp->private_data;
 	struct kbus_dev *dev = priv->dev;
 	unsigned mask = 0;
 
-	mutex_lock(&dev->mux);
-
+	/*
+	 * Note that we do not (normally) take the device mutex - we only look
+	 * at a couple of (naturally atomic) values, which are only ever changed
+	 * with the mutex held, and which will wake us up when they change.
+	 * We must register on the wait queues *before* looking at them,
+	 * so that we can't miss a wake up in between.
+	 */
 	kbus_maybe_dbg(priv->dev, "%u POLL\n", priv->id);
 
+	/* Wait until someone has a message waiting to be read */
+	poll_wait(filp, &priv->read_wait, wait);
+
+	/*
+	 * Wait until our blocked send finishes. Any retrying of the send is
+	 * done as soon as someone makes space for it in their message queue
+	 * (see kbus_retry_blocked_sends()), so we just need to look to see
+	 * if it has been done.
+	 */
+	if (READ_ONCE(priv->sending))
+		poll_wait(filp, &dev->write_wait, wait);
+
 	/*
 	 * Did I wake up because there's a message available to be read?
 	 */
-	if (priv->message_count != 0)
+	if (READ_ONCE(priv->message_count) != 0 ||
+	    READ_ONCE(priv->num_delivered) != 0)
 		mask |= POLLIN | POLLRDNORM;	/* readable */
 
 	/*
-	 * Did I wake up because someone said they had space for a message on
-	 * their message queue (where there wasn't space before)?
-	 *
-	 * And if that is the case, if we're opened for write and have a
-	 * message waiting to be sent, can we now send it?
-	 *
-	 * The simplest way to find out is just to try again.
+	 * Or on one of our broadcast topics? We do need the mutex to look
+	 * at those, but only Ksocks that have subscribed pay for it.
+	 * Publishing on a topic we have caught up on wakes our read_wait
+	 * (see kbus_topic_wake), so there is nothing else to wait on.
 	 */
-	if (filp->f_mode & FMODE_WRITE) {
-		int writable = true;
-		if (priv->sending)
-			writable = kbus_poll_try_send_again(priv, dev);
-		if (writable)
-			mask |= POLLOUT | POLLWRNORM;
+	if (READ_ONCE(priv->num_subscriptions)) {
+		mutex_lock(&dev->mux);
+		if (kbus_topic_messages_pending(priv))
+			mask |= POLLIN | POLLRDNORM;
+		mutex_unlock(&dev->mux);
 	}
 
-	/* Wait until someone has a message waiting to be read */
-	poll_wait(filp, &priv->read_wait, wait);
-
-	/* Wait until someone has a space into which a message can be pushed */
-	if (priv->sending)
-		poll_wait(filp, &dev->write_wait, wait);
+	/*
+	 * We're writable unless we're still trying to send a message
+	 */
+	if ((filp->f_mode & FMODE_WRITE) && !READ_ONCE(priv->sending))
+		mask |= POLLOUT | POLLWRNORM;
 
-	mutex_unlock(&dev->mux);
 	return mask;
 }
 
@@ -4568,6 +6268,9 @@ static void kbus_setup_cdev(struct kbus_dev *dev, int devno)
 	INIT_LIST_HEAD(&dev->bound_message_list);
 	INIT_LIST_HEAD(&dev->open_ksock_list);
 	INIT_LIST_HEAD(&dev->unsent_unbind_msg_list);
+	INIT_LIST_HEAD(&dev->topic_list);
+	init_llist_head(&dev->delivered);
+	INIT_WORK(&dev->delivery_work, kbus_delivery_work);
 
 	init_waitqueue_head(&dev->write_wait);
 
@@ -4588,6 +6291,9 @@ static void kbus_teardown_cdev(struct kbus_dev *dev)
 	kbus_forget_all_bindings(dev);
 	kbus_forget_all_open_ksocks(dev);
 	kbus_forget_unsent_unbind_msgs(dev);
+	kbus_forget_all_topics(dev);
+	/* Which may have been the last copies of some tracked messages */
+	kbus_forget_deliveries(dev);
 
 	cdev_del(&dev->cdev);
 }
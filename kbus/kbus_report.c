@@ -159,6 +159,7 @@ static int kbus_stats_seq_show(struct seq_file *s, void *v __always_unused)
 
 		struct kbus_private_data *ptr;
 		struct kbus_private_data *next;
+		struct kbus_message_binding *binding;
 
 		if (mutex_lock_interruptible(&dev->mux))
 			return -ERESTARTSYS;
@@ -205,6 +206,33 @@ static int kbus_stats_seq_show(struct seq_file *s, void *v __always_unused)
 					ptr->outstanding_requests.max_count,
 					ptr->num_replies_unsent,
 					ptr->max_replies_unsent);
+
+			seq_printf(s, "      pid %lu sent %llu msgs %llu bytes, "
+					"received %llu msgs (max queued %u), "
+					"blocked %u refused %u\n",
+					(long unsigned)ptr->pid,
+					(unsigned long long)ptr->num_sent,
+					(unsigned long long)ptr->bytes_sent,
+					(unsigned long long)ptr->num_received,
+					ptr->max_queued,
+					ptr->num_blocked,
+					ptr->num_refused);
+
+			list_for_each_entry(binding, &ptr->bindings,
+					    ksock_list) {
+				u32 flags = binding->filter.flags;
+				if (!(flags & (KBUS_BIND_FILTER_MAX_RATE |
+					       KBUS_BIND_FILTER_SAMPLE)))
+					continue;
+				seq_printf(s, "      binding '%.*s' max rate "
+						"%u/s sample 1 in %u, "
+						"suppressed %llu\n",
+					binding->name_len, binding->name,
+					binding->filter.max_rate,
+					binding->filter.sample_every ?: 1,
+					(unsigned long long)
+					binding->num_suppressed);
+			}
 		}
 		mutex_unlock(&dev->mux);
 	}
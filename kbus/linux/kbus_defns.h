@@ -105,6 +105,51 @@ struct kbus_bind_request {
 	char *name;
 };
 
+/*
+ * When the user asks to bind (or unbind) as a Listener, but only to some of
+ * the messages with that name, they use the following. 'flags' says which of
+ * the other fields apply - if more than one is given, a message must satisfy
+ * them all:
+ *
+ * - 'from' and 'orig_from' must match the message's fields of the same name
+ * - at most 'max_rate' messages a second are accepted
+ * - only every 'sample_every'th message is accepted (starting with the first)
+ */
+struct kbus_bind_filter_request {
+	__u32 flags;		/* KBUS_BIND_FILTER_xxx */
+	__u32 name_len;
+	char *name;
+	__u32 from;		/* only messages sent by this Ksock id */
+	struct kbus_orig_from orig_from;	/* only messages from here */
+	__u32 max_rate;		/* at most this many messages a second */
+	__u32 sample_every;	/* only one message in this many */
+};
+
+#define KBUS_BIND_FILTER_FROM		0x00000001
+#define KBUS_BIND_FILTER_ORIG_FROM	0x00000002
+#define KBUS_BIND_FILTER_MAX_RATE	0x00000004
+#define KBUS_BIND_FILTER_SAMPLE		0x00000008
+
+/*
+ * When the user asks to subscribe to (or unsubscribe from) a broadcast topic,
+ * they use the following. The 'flags' and 'ring_size' are only used when
+ * the topic is created, by its first subscriber, and are otherwise ignored.
+ */
+struct kbus_topic_request {
+	__u32 flags;		/* KBUS_TOPIC_xxx */
+	__u32 ring_size;	/* number of messages kept, 0 for the default */
+	__u32 name_len;
+	char *name;
+};
+
+/*
+ * If a broadcast topic has the KBUS_TOPIC_BACKPRESSURE flag, then a message
+ * may not be published until every subscriber has read the message it will
+ * replace in the ring. Otherwise (the default), slow subscribers are lapped,
+ * and lose the messages they were too slow to read.
+ */
+#define KBUS_TOPIC_BACKPRESSURE		0x00000001
+
 /* When the user requests the id of the replier to a message, they use: */
 struct kbus_bind_query {
 	__u32 return_id;
@@ -370,6 +415,8 @@ static inline __u32 *kbus_msg_end_ptr(struct kbus_entire_message
  * - the KBUS_BIT_WANT_YOU_TO_REPLY bit in the flags (set or cleared
  *   as appropriate)
  * - the SYNTHETIC bit, which KBUS will always unset in a user message
+ * - the DELIVERY_NOTICE bit, which KBUS unsets in the copies of a message
+ *   that it gives to its recipients
  */
 
 /*
@@ -426,6 +473,13 @@ static inline __u32 *kbus_msg_end_ptr(struct kbus_entire_message
  * recipients cannot be sent the message. Specifically, before the message is
  * sent, all recipients must have room on their message queues for this
  * message, and if they do not, the send will fail.
+ *
+ * If the KBUS_BIT_DELIVERY_NOTICE bit is set, then once the message has "left
+ * the system" - that is, once every copy of it that was queued for a
+ * recipient has been read or thrown away - the sender will be told, by a
+ * $.KBUS.Delivered message. This lets a sender keep a bounded number of
+ * messages "in flight", rather than waiting to be told -EAGAIN. The bit is
+ * not set in the copies that the recipients read.
  */
 
 /*
@@ -448,6 +502,38 @@ struct kbus_replier_bind_event_data {
 	__u32 rest[];	/* Message name */
 };
 
+/*
+ * When a $.KBUS.TopicLapped message is constructed, we use the following to
+ * encapsulate its data.
+ *
+ * This indicates how many messages a subscriber lost, and on which topic.
+ * As for the Replier Bind Event data, the topic name is padded out to a
+ * multiple of four bytes, allowing for a terminating null byte, and goes off
+ * the end of the datastructure.
+ */
+struct kbus_topic_lapped_data {
+	__u32 lost;	/* How many messages we missed */
+	__u32 name_len;	/* Length of topic name */
+	__u32 rest[];	/* Topic name */
+};
+
+/*
+ * When a $.KBUS.Delivered message is constructed, we use the following to
+ * encapsulate its data.
+ *
+ * This lists the ids of the messages (sent with KBUS_BIT_DELIVERY_NOTICE)
+ * that have left the system since the last such message. If there were too
+ * many to list, 'missed' says how many more there were.
+ *
+ * As for the message header data structure, the actual ids "go off the end"
+ * of the datastructure.
+ */
+struct kbus_delivered_data {
+	__u32 count;	/* How many ids follow */
+	__u32 missed;	/* How many more we couldn't fit in */
+	struct kbus_msg_id ids[];
+};
+
 #if !__KERNEL__
 #define BIT(num)                 (((unsigned)1) << (num))
 #endif
@@ -459,6 +545,7 @@ struct kbus_replier_bind_event_data {
 
 #define KBUS_BIT_ALL_OR_WAIT		BIT(8)
 #define KBUS_BIT_ALL_OR_FAIL		BIT(9)
+#define KBUS_BIT_DELIVERY_NOTICE	BIT(10)
 
 /*
  * Standard message names
@@ -510,6 +597,29 @@ struct kbus_replier_bind_event_data {
  */
 #define KBUS_MSG_NAME_REPLIER_BIND_EVENT	"$.KBUS.ReplierBindEvent"
 
+/*
+ * Topic Lapped
+ * ------------
+ * This is read by a subscriber to a broadcast topic (see KBUS_IOC_SUBSCRIBE)
+ * instead of the next message on that topic, if it has fallen so far behind
+ * that the messages it had not read have been overwritten. Its data is a
+ * kbus_topic_lapped_data, saying how many messages were lost. Reading carries
+ * on with the oldest message still available.
+ */
+#define KBUS_MSG_NAME_TOPIC_LAPPED		"$.KBUS.TopicLapped"
+
+/*
+ * Delivered
+ * ---------
+ * This is read by a Ksock that sent messages with KBUS_BIT_DELIVERY_NOTICE
+ * set, once some of them have left the system. Its data is a
+ * kbus_delivered_data, listing their ids. Notices are gathered together until
+ * the Ksock reads the next message, and then all sent at once, so there is
+ * never more than one of these waiting to be read - it is always read before
+ * anything in the message queue.
+ */
+#define KBUS_MSG_NAME_DELIVERED			"$.KBUS.Delivered"
+
 #define KBUS_IOC_MAGIC	'k'	/* 0x6b - which seems fair enough for now */
 /*
  * RESET: reserved for future use
@@ -669,8 +779,130 @@ struct kbus_replier_bind_event_data {
  */
 #define KBUS_IOC_MAXMSGSIZE _IOWR(KBUS_IOC_MAGIC, 18, char *)
 
+/*
+ * BLOCKING - should NEXTMSG and read() wait for a message to arrive?
+ *
+ * If this is set, then NEXTMSG will wait until there is a message, and a
+ * read() when there is no current message will wait for the next message and
+ * then start reading it (as if NEXTMSG had been called first). This does not
+ * apply if the Ksock has been opened (or set) O_NONBLOCK, in which case both
+ * still return at once. A wait that is interrupted by a signal fails with
+ * -EINTR (unless the system call is restarted).
+ *
+ * arg(in): __u32, 1 to change to "blocking", 0 to change to the default,
+ * 0xFFFFFFFF to just return the current/previous state.
+ * arg(out): __u32, the previous state.
+ * retval: 0 for success, negative for failure (-EINVAL if arg in was not one
+ * of the specified values)
+ */
+#define KBUS_IOC_BLOCKING _IOWR(KBUS_IOC_MAGIC, 19, char *)
+/*
+ * BUSYPOLL - how long should a blocking receive spin before it sleeps?
+ *
+ * When waiting for a message in blocking mode, KBUS will first spin for up to
+ * this many microseconds, checking for a message, before going to sleep. The
+ * default is 0 (do not spin), and it may not be set to more than
+ * CONFIG_KBUS_MAX_BUSY_POLL_USECS.
+ *
+ * arg(in): __u32, the number of microseconds, or 0xFFFFFFFF to just return
+ * the current/previous value.
+ * arg(out): __u32, the previous value.
+ * retval: 0 for success, negative for failure
+ */
+#define KBUS_IOC_BUSYPOLL _IOWR(KBUS_IOC_MAGIC, 20, char *)
+
+/*
+ * AUTOSEND - should a write() that completes a message also send it?
+ *
+ * In auto send mode, the write() that supplies the last bytes of a message
+ * (its end guard) also sends it, exactly as SEND would. If the send fails,
+ * write() returns the error that SEND would have returned (so -EAGAIN means
+ * the message is still being sent, and should be finished with SEND or
+ * DISCARD in the normal manner). The message id can be retrieved with
+ * LASTSENT. The default is not to auto send.
+ *
+ * arg(in): __u32, 1 to change to auto send mode, 0 to change back to the
+ * default, 0xFFFFFFFF to just return the current/previous state.
+ * arg(out): __u32, the previous state.
+ * retval: 0 for success, negative for failure (-EINVAL if arg in was not
+ * one of the specified values)
+ */
+#define KBUS_IOC_AUTOSEND _IOWR(KBUS_IOC_MAGIC, 21, char *)
+
+/*
+ * SUBSCRIBE - subscribe to a broadcast topic
+ *
+ * A broadcast topic is an alternative to binding as a Listener, for message
+ * names with very many listeners. A message sent with that name is added
+ * just once to the topic's ring of recent messages (so sending it costs the
+ * same however many subscribers there are), and each subscriber reads it from
+ * there in its own time, as if it were in its message queue. Messages from
+ * the ordinary message queue are read first.
+ *
+ * Only Announcements are published to a topic (Requests and Replies are
+ * delivered as normal), topic names may not be wildcards, and a subscriber
+ * only sees messages sent after it subscribed. Listeners bound to the same
+ * name still receive the message as normal.
+ *
+ * The topic is created by its first subscriber, which decides its ring size
+ * and whether it applies backpressure (see KBUS_TOPIC_BACKPRESSURE). When a
+ * subscriber has been lapped, it reads a $.KBUS.TopicLapped message saying
+ * how many messages it lost. With backpressure, sending a message whose
+ * topic ring is full fails with -EAGAIN if it is ALL_OR_WAIT (and can be
+ * completed later, as usual), and with -EBUSY otherwise.
+ *
+ * arg: struct kbus_topic_request, indicating what to subscribe to
+ * retval: 0 for success, negative for failure (-EALREADY if we are already
+ * subscribed)
+ */
+#define KBUS_IOC_SUBSCRIBE  _IOW(KBUS_IOC_MAGIC, 22, char *)
+
+/*
+ * UNSUBSCRIBE - unsubscribe from a broadcast topic
+ *
+ * Any messages on the topic that we had not yet read are forgotten.
+ *
+ * arg: struct kbus_topic_request, indicating what to unsubscribe from (only
+ * the name is used)
+ * retval: 0 for success, negative for failure (-EINVAL if we were not
+ * subscribed)
+ */
+#define KBUS_IOC_UNSUBSCRIBE _IOW(KBUS_IOC_MAGIC, 23, char *)
+
+/*
+ * BINDFILTER - bind a Ksock to a message name as a Listener, but only for
+ * messages from a particular sender
+ *
+ * The sender may be given as a Ksock id (which the message's "from" field
+ * must match), or as a network id and local id (which the message's
+ * "orig_from" field must match, for messages that have come via Limpets), or
+ * both. Messages from anyone else are not even considered for the Ksock's
+ * message queue. Otherwise, this is just like BIND (as a Listener).
+ *
+ * The binding may also be rate limited (to at most so many messages a second)
+ * or sampled (only every so many messages), which is useful for monitoring
+ * high-rate messages without having to read them all. Such messages are
+ * dropped before they are queued, whether or not the queue has room, and the
+ * number dropped is shown in /proc/kbus/stats.
+ *
+ * arg: struct kbus_bind_filter_request, indicating what to bind to
+ * retval: 0 for success, negative for failure
+ */
+#define KBUS_IOC_BINDFILTER _IOW(KBUS_IOC_MAGIC, 24, char *)
+
+/*
+ * UNBINDFILTER - unbind a Ksock from a BINDFILTER binding
+ *
+ * The name and filter must match the binding exactly. (Likewise, UNBIND
+ * only unbinds bindings made with BIND.)
+ *
+ * arg: struct kbus_bind_filter_request, indicating what to unbind from
+ * retval: 0 for success, negative for failure
+ */
+#define KBUS_IOC_UNBINDFILTER _IOW(KBUS_IOC_MAGIC, 25, char *)
+
 /* If adding another IOCTL, remember to increment the next number! */
-#define KBUS_IOC_MAXNR	18
+#define KBUS_IOC_MAXNR	25
 
 #if !__KERNEL__ && defined(__cplusplus)
 }
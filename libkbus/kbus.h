@@ -68,17 +68,36 @@ typedef struct kbus_msg_id              kbus_msg_id_t;
 typedef struct kbus_orig_from           kbus_orig_from_t;
 typedef struct kbus_bind_request        kbus_bind_request_t;
 typedef struct kbus_bind_query          kbus_bind_query_t;
+typedef struct kbus_bind_filter_request kbus_bind_filter_request_t;
+typedef struct kbus_topic_request       kbus_topic_request_t;
 
 typedef struct kbus_message_header      kbus_message_t;
 
 typedef struct kbus_entire_message      kbus_entire_message_t;
 
 typedef struct kbus_replier_bind_event_data     kbus_replier_bind_event_data_t;
+typedef struct kbus_topic_lapped_data           kbus_topic_lapped_data_t;
+typedef struct kbus_delivered_data              kbus_delivered_data_t;
 
 /** A Ksock is just a file descriptor, an integer, as returned by 'open'.
  */
 typedef int kbus_ksock_t;
 
+/*
+ * A message arena, in which messages may be built without using the heap.
+ * Set one up on your own memory with kbus_msg_arena_init(), or use the
+ * current thread's arena, from kbus_msg_arena_for_thread().
+ */
+struct kbus_msg_arena {
+  uint8_t       *base;          // The memory messages are built in
+  size_t         size;          // How big it is
+  size_t         used;          // How much of it has been used
+};
+typedef struct kbus_msg_arena kbus_msg_arena_t;
+
+// The size of each thread's own message arena
+#define KBUS_MSG_ARENA_THREAD_SIZE      (64 * 1024)
+
 /*
  * Please, however, do consult the kbus_defns.h header file for many useful
  * definitions, and also some key functions, such as:
@@ -97,6 +116,40 @@ typedef int kbus_ksock_t;
 #define KBUS_KSOCK_READABLE 1
 #define KBUS_KSOCK_WRITABLE 2
 
+// The number of buckets in each latency histogram. Bucket 0 counts operations
+// that took less than a microsecond, and bucket N those that took at least
+// 2**(N-1) but less than 2**N microseconds. The last bucket also counts
+// anything longer.
+#define KBUS_LATENCY_BUCKETS 24
+
+/*
+ * How long one kind of operation has been taking, as kept by an instrumented
+ * Ksock (see kbus_ksock_instrument()).
+ */
+struct kbus_latency_stats {
+  uint64_t      count;          // How many times it has been done
+  uint64_t      total_ns;       // And how long that took in total
+  uint64_t      max_ns;         // The longest it has taken
+  uint64_t      buckets[KBUS_LATENCY_BUCKETS];
+};
+typedef struct kbus_latency_stats kbus_latency_stats_t;
+
+/*
+ * The statistics kept by an instrumented Ksock, as returned by
+ * kbus_ksock_get_stats().
+ */
+struct kbus_ksock_stats {
+  kbus_latency_stats_t  write;          // Writing a message
+  kbus_latency_stats_t  send;           // Sending a written message
+  kbus_latency_stats_t  receive;        // Reading a message
+  kbus_latency_stats_t  wait;           // Waiting in kbus_wait_for_message()
+  kbus_latency_stats_t  rpc;            // From sending a Request to reading
+                                        // its Reply
+  uint64_t              num_eagain;     // Writes or sends that got -EAGAIN
+  uint64_t              num_errors;     // And those that failed otherwise
+};
+typedef struct kbus_ksock_stats kbus_ksock_stats_t;
+
 /* Ksock Functions */
 
 /** @file
@@ -144,6 +197,43 @@ extern kbus_ksock_t kbus_ksock_open(uint32_t device_number,
 extern kbus_ksock_t kbus_ksock_open_by_name(const char *device_name,
                                             int         flags);
 
+/*
+ * Open a Ksock on an in-process loopback bus.
+ *
+ * A loopback bus behaves like a KBUS device, but lives entirely within this
+ * process, so messages never go through the kernel. All the Ksocks opened
+ * with the same `bus_number` share a bus, which exists for as long as any of
+ * them are open. Loopback buses are quite separate from KBUS devices, so
+ * loopback bus 0 has nothing to do with ``/dev/kbus0``.
+ *
+ * A loopback Ksock may be used with all of the ``kbus_ksock_*`` functions,
+ * and waited for with ``kbus_wait_for_message()`` or ``poll()``. The rules
+ * for message names, wildcards, Repliers and synthetic messages are the same
+ * as for KBUS. However, filtered bindings, broadcast topics, blocking reads,
+ * busy polling, Replier bind events and ``kbus_new_device()`` are not
+ * supported, and fail with -EOPNOTSUPP.
+ *
+ * Messages are shared between their recipients, and only copied when each
+ * recipient reads its message. The maximum message size for a loopback bus
+ * starts at 1024 bytes, as for KBUS, but may be set as high as 1MB.
+ *
+ * This is intended for testing, and for components that talk to each other
+ * within one process.
+ *
+ * `flags` may be one of ``O_RDONLY``, ``O_WRONLY`` or ``O_RDWR``.
+ *
+ * The Ksock is one end of a Unix socket pair. It is readable when it has
+ * messages to read, and writable unless a send is blocked (after -EAGAIN),
+ * but should only be polled, never read or written directly. Each loopback
+ * Ksock uses three file descriptors, since libkbus keeps the other end, and
+ * its own duplicate of the one returned.
+ *
+ * Returns the file descriptor for the new Ksock, or a negative value on error.
+ * The negative value will be ``-errno``.
+ */
+extern kbus_ksock_t kbus_ksock_open_loopback(uint32_t   bus_number,
+                                             int        flags);
+
 /*
  * Close a Ksock.
  *
@@ -178,6 +268,80 @@ extern int kbus_ksock_unbind(kbus_ksock_t         ksock,
                              const char          *name,
                              uint32_t             is_replier);
 
+/*
+ * Bind the given message name to the specified Ksock, as a Listener, but only
+ * for some of the messages with that name.
+ *
+ * `flags` says which of the constraints to apply:
+ *
+ * * KBUS_BIND_FILTER_FROM - the message must be from the Ksock with id `from`
+ * * KBUS_BIND_FILTER_ORIG_FROM - the message's ``orig_from`` must equal
+ *   `orig_from` (i.e., it must have originated at that Ksock, on the far side
+ *   of that Limpet network)
+ * * KBUS_BIND_FILTER_MAX_RATE - accept at most `max_rate` messages a second
+ * * KBUS_BIND_FILTER_SAMPLE - accept only every `sample_every`th message,
+ *   starting with the first
+ *
+ * Messages that fail the filter are never queued for this binding (the number
+ * dropped by the rate limit or sample is shown in /proc/kbus/stats). Unused
+ * constraints are ignored.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_bind_filtered(kbus_ksock_t         ksock,
+                                    const char          *name,
+                                    uint32_t             flags,
+                                    uint32_t             from,
+                                    kbus_orig_from_t     orig_from,
+                                    uint32_t             max_rate,
+                                    uint32_t             sample_every);
+
+/*
+ * Unbind a binding made with ``kbus_ksock_bind_filtered()``.
+ *
+ * The name, `flags` and the constraints that `flags` selects must exactly
+ * match those of the binding.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_unbind_filtered(kbus_ksock_t         ksock,
+                                      const char          *name,
+                                      uint32_t             flags,
+                                      uint32_t             from,
+                                      kbus_orig_from_t     orig_from,
+                                      uint32_t             max_rate,
+                                      uint32_t             sample_every);
+
+/*
+ * Subscribe to a broadcast topic.
+ *
+ * A broadcast topic is a message name (not a wildcard) whose Announcements
+ * are kept once, in a ring of recent messages, instead of being copied onto
+ * the message queue of every Listener - so sending one costs the same however
+ * many subscribers there are. Subscribers read them (after any messages in
+ * their message queue) with ``kbus_ksock_next_msg()`` and friends, as usual.
+ *
+ * `flags` and `ring_size` are only used if this creates the topic (i.e., we
+ * are its first subscriber). If `flags` includes KBUS_TOPIC_BACKPRESSURE, a
+ * sender has to wait for the slowest subscriber, otherwise slow subscribers
+ * are lapped, and read a "$.KBUS.TopicLapped" message saying how many
+ * messages they lost. A `ring_size` of 0 means the default.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_subscribe(kbus_ksock_t         ksock,
+                                const char          *name,
+                                uint32_t             flags,
+                                uint32_t             ring_size);
+
+/*
+ * Unsubscribe from a broadcast topic.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_unsubscribe(kbus_ksock_t         ksock,
+                                  const char          *name);
+
 /*
  * Return the internal (to KBUS) Ksock id for this Ksock.
  *
@@ -394,6 +558,72 @@ extern int kbus_ksock_kernel_module_verbose(kbus_ksock_t       ksock,
 extern int kbus_ksock_max_message_size(kbus_ksock_t ksock,
                                        uint32_t    *max_bytes);
 
+/*
+ * Determine whether receiving a message should wait for one to arrive.
+ *
+ * If `request` is 1, then ``kbus_ksock_next_msg()`` (and so
+ * ``kbus_ksock_read_next_msg()``) will wait until there is a message to
+ * return, rather than returning a length of 0 at once. A ``read`` when there
+ * is no current message will likewise wait for the next message, and then
+ * start reading it.
+ *
+ * If `request` is 0, then receiving a message does not wait (the default).
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ * This may be used to query the current state of the "blocking" flag.
+ *
+ * Note that none of this applies if the Ksock was opened with O_NONBLOCK
+ * - a non-blocking Ksock never waits.
+ *
+ * Returns 0 or 1, according to the state of the "blocking" flag *before* this
+ * function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_blocking(kbus_ksock_t     ksock,
+                               uint32_t         request);
+
+/*
+ * Determine how long a blocking receive should spin before sleeping.
+ *
+ * When waiting for a message (see ``kbus_ksock_blocking()``), KBUS will first
+ * spin for up to `usecs` microseconds, checking for a message, before putting
+ * the caller to sleep. This costs CPU time, but can save the latency of being
+ * woken up again when messages are expected very soon. The default is 0 (do
+ * not spin).
+ *
+ * If `usecs` is 0xFFFFFFFF, then the current value should not be changed.
+ * This may be used to query the current busy poll window.
+ *
+ * Returns the busy poll window (in microseconds) *before* this function was
+ * called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_busy_poll(kbus_ksock_t    ksock,
+                                uint32_t        usecs);
+
+/*
+ * Determine whether writing a complete message to this Ksock also sends it.
+ *
+ * If `request` is 1, then a ``write()`` that completes a message also sends
+ * it, as if ``kbus_ksock_send()`` had been called, saving a system call per
+ * message. Any error from the send is returned by the ``write()``, and
+ * ``kbus_ksock_send_msg()`` will automatically take advantage of this.
+ *
+ * If `request` is 0, then messages must be sent explicitly (the default).
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ * This may be used to query the current state of the "auto send" flag.
+ *
+ * libkbus remembers which Ksocks are in auto send mode, so that
+ * ``kbus_ksock_send_msg()`` knows not to send the message again. It forgets
+ * when the Ksock is closed with ``kbus_ksock_close()``, or when another Ksock
+ * is opened with the same file descriptor - so only change the mode with
+ * this function.
+ *
+ * Returns 0 or 1, according to the state of the "auto send" flag *before* this
+ * function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_auto_send(kbus_ksock_t     ksock,
+                                uint32_t         request);
+
 /*
  * Request the KBUS kernel module to create a new device (``/dev/kbus<n>``).
  *
@@ -411,6 +641,78 @@ extern int kbus_ksock_max_message_size(kbus_ksock_t ksock,
 extern int kbus_ksock_new_device(kbus_ksock_t  ksock,
                                  uint32_t     *device_number);
 
+/*
+ * Turn instrumentation of a Ksock on or off.
+ *
+ * An instrumented Ksock keeps counts, and latency histograms, for writing,
+ * sending and receiving messages, waiting in ``kbus_wait_for_message()``,
+ * and the round trip from sending a Request (with ``kbus_ksock_send_msg()``)
+ * to reading its Reply. It also counts how often writing or sending a
+ * message fails, distinguishing -EAGAIN from other errors. These may be
+ * retrieved with ``kbus_ksock_get_stats()``.
+ *
+ * The statistics are kept by libkbus, in this process - they do not involve
+ * KBUS itself, and other processes using the same Ksock will not see them.
+ * They are kept until the Ksock is closed, so turning instrumentation off and
+ * on again continues where it left off. (If the Ksock is closed other than by
+ * ``kbus_ksock_close()``, they are thrown away when a new Ksock is opened with
+ * the same file descriptor, or when they are next asked for.)
+ *
+ * Ksocks that are not instrumented do not pay for it, beyond a check of
+ * whether they are.
+ *
+ * If `request` is 1, then the Ksock is instrumented, if 0 it is not (the
+ * default).
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ *
+ * Returns 0 or 1, according to whether the Ksock was instrumented *before*
+ * this function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_instrument(kbus_ksock_t     ksock,
+                                 uint32_t         request);
+
+/*
+ * Take a snapshot of the statistics for an instrumented Ksock.
+ *
+ * The statistics are those gathered whilst the Ksock was instrumented (see
+ * ``kbus_ksock_instrument()``). They may still be changing as they are read,
+ * so the different fields are not necessarily exactly consistent with each
+ * other.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ * Specifically, -ENOENT is returned if the Ksock has never been instrumented.
+ */
+extern int kbus_ksock_get_stats(kbus_ksock_t            ksock,
+                                kbus_ksock_stats_t     *stats);
+
+/*
+ * Print out the statistics for an instrumented Ksock.
+ *
+ * Each kind of operation gets a line giving how many there have been, their
+ * mean and maximum times, and the non-empty buckets of their histogram.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ * Specifically, -ENOENT is returned if the Ksock has never been instrumented.
+ */
+extern int kbus_ksock_print_stats(FILE                  *stream,
+                                  kbus_ksock_t           ksock);
+
+/*
+ * Print out the statistics for all instrumented Ksocks, every so often.
+ *
+ * This starts a thread which, every `interval_ms` milliseconds, does
+ * ``kbus_ksock_print_stats()`` to `stream` for each Ksock that is currently
+ * being instrumented.
+ *
+ * Calling this again changes the stream and interval. An `interval_ms` of 0
+ * stops the dumping (and the thread).
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_dump_stats_every(FILE             *stream,
+                                       uint32_t          interval_ms);
+
 /*
  * Wait until either the Ksock may be read from or written to.
  *
@@ -509,6 +811,12 @@ extern int kbus_ksock_write_data(kbus_ksock_t    ksock,
  *
  * `msg_id` returns the message id assigned to the message by KBUS.
  *
+ * If the Ksock is in auto send mode (see ``kbus_ksock_auto_send()``), then
+ * the write also sends the message, and the message id is only asked for if
+ * `msg_id` is not NULL - so passing NULL sends the message with a single
+ * system call. (If the Ksock is instrumented, see ``kbus_ksock_instrument()``,
+ * then the id of a Request is always asked for, to time its Reply.)
+ *
  * Returns 0 for success, or a negative number (``-errno``) for failure.
  */
 extern int kbus_ksock_send_msg(kbus_ksock_t             ksock,
@@ -765,6 +1073,129 @@ extern void kbus_msg_delete(kbus_message_t **msg_p);
  */
 extern void kbus_msg_delete_all(kbus_message_t **msg_p);
 
+/*
+ * Set up a message arena, using the memory `buf` of `size` bytes.
+ *
+ * The memory is not copied, and must stay around as long as the arena (and
+ * any messages built in it) are in use. It is up to the caller to free it
+ * afterwards, if necessary.
+ */
+extern void kbus_msg_arena_init(kbus_msg_arena_t      *arena,
+                                void                  *buf,
+                                size_t                 size);
+
+/*
+ * Return this thread's own message arena.
+ *
+ * The arena has room for KBUS_MSG_ARENA_THREAD_SIZE bytes of messages. It is
+ * allocated the first time this is called in a thread, and freed when the
+ * thread exits - after that, building messages in it does no heap allocation.
+ *
+ * Returns NULL if the arena could not be allocated.
+ */
+extern kbus_msg_arena_t *kbus_msg_arena_for_thread(void);
+
+/*
+ * Reset a message arena, so that its memory can be reused.
+ *
+ * All the messages built in the arena are thus discarded. This would
+ * normally be done when a batch of messages has been sent.
+ */
+extern void kbus_msg_arena_reset(kbus_msg_arena_t *arena);
+
+/*
+ * Create a "pointy" message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create()``, except that the
+ * message is built in `arena`, and so must not be freed with
+ * ``kbus_msg_delete()``. It lasts until the arena is reset.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create(kbus_msg_arena_t      *arena,
+                                 kbus_message_t       **msg,
+                                 const char            *name,
+                                 uint32_t               name_len, /* bytes */
+                                 const void            *data,
+                                 uint32_t               data_len, /* bytes */
+                                 uint32_t               flags);
+
+/*
+ * Create an "entire" message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_entire()``, except that
+ * the message is built in `arena`, and so must not be freed with
+ * ``kbus_msg_delete()``. It lasts until the arena is reset.
+ *
+ * Since the name and data are copied into the arena, they may be freed (or
+ * reused) as soon as the message has been created.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_entire(kbus_msg_arena_t       *arena,
+                                        kbus_message_t        **msg,
+                                        const char             *name,
+                                        uint32_t                name_len, /* bytes */
+                                        const void             *data,
+                                        uint32_t                data_len, /* bytes */
+                                        uint32_t                flags);
+
+/*
+ * Create a "pointy" Request message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_request()``, except
+ * that the message is built in `arena`.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_request(kbus_msg_arena_t      *arena,
+                                         kbus_message_t       **msg,
+                                         const char            *name,
+                                         uint32_t               name_len, /* bytes */
+                                         const void            *data,
+                                         uint32_t               data_len, /* bytes */
+                                         uint32_t               flags);
+
+/*
+ * Create a "pointy" Reply message in a message arena, based on a previous
+ * Request.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_reply_to()``, except
+ * that the message is built in `arena`. As there, the new message's name is
+ * that inside `in_reply_to`, so `in_reply_to` should not be freed until the
+ * Reply has been sent.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure -
+ * -EBADMSG if `in_reply_to` does not want us to reply, -ENOMEM if there is not
+ * room in the arena.
+ */
+extern int kbus_msg_arena_create_reply_to(kbus_msg_arena_t         *arena,
+                                          kbus_message_t          **msg,
+                                          const kbus_message_t     *in_reply_to,
+                                          const void               *data,
+                                          uint32_t                  data_len, /* bytes */
+                                          uint32_t                  flags);
+
+/*
+ * Create a "pointy" Stateful Request message in a message arena, based on a
+ * previous Reply or Request.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_stateful_request()``,
+ * except that the message is built in `arena`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure -
+ * -EBADMSG if `earlier_msg` is neither a Reply nor a Stateful Request,
+ * -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_stateful_request(kbus_msg_arena_t       *arena,
+                                                  kbus_message_t        **msg,
+                                                  const kbus_message_t   *earlier_msg,
+                                                  const char             *name,
+                                                  uint32_t                name_len,
+                                                  const void             *data,
+                                                  uint32_t                data_len, /* bytes */
+                                                  uint32_t                flags);
+
 /*
  * Determine the size of a KBUS message.
  *
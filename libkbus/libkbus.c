@@ -41,10 +41,468 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
 #include "kbus.h"
+#include "loopback.h"
 
 #define DEBUG 0
 
+// How many Requests an instrumented Ksock remembers, to time their Replies
+#define KBUS_RPC_SLOTS  64
+
+/*
+ * What libkbus keeps for a Ksock that is in auto send mode, or has been
+ * instrumented.
+ *
+ * The statistics are updated with (relaxed) atomic operations, so any number
+ * of threads may use the Ksock at once without locking.
+ */
+struct kbus_ksock_state {
+  bool                  auto_send;      // does writing a message send it?
+  bool                  instrumented;   // is the Ksock being instrumented?
+  bool                  has_stats;      // has it ever been?
+  kbus_ksock_stats_t    stats;
+  struct {
+    uint32_t            serial_num;     // 0 if the slot is free
+    uint64_t            sent_ns;
+  } rpc[KBUS_RPC_SLOTS];                // Requests awaiting Replies
+  uint32_t              ksock_id;       // to tell if the fd has been reused
+  struct kbus_ksock_state *next_free;   // on kbus_state_free_list
+};
+
+// The smallest table of Ksock states (it doubles as needed)
+#define KBUS_STATE_MIN_TABLE  64
+
+/*
+ * The state for each Ksock that needs one, indexed by file descriptor. It is
+ * kept until the Ksock is closed (so turning instrumentation off and on again
+ * continues where it left off), and is dropped if the file descriptor turns
+ * out to have been reused for another Ksock.
+ *
+ * The normal code paths look entries up without locking, so nothing they
+ * might still be looking at is ever freed: when the table grows the old one
+ * is kept (on the `retired` list), and states that are thrown away go on
+ * kbus_state_free_list, to be reused for the next Ksock that needs one.
+ * Everything else is protected by kbus_state_lock.
+ */
+struct kbus_state_table {
+  int                           size;
+  struct kbus_state_table      *retired;
+  struct kbus_ksock_state      *ksocks[];
+};
+static struct kbus_state_table *kbus_state_table;
+static struct kbus_ksock_state *kbus_state_free_list;
+static pthread_mutex_t kbus_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Periodically dumping the statistics, also protected by kbus_state_lock
+static pthread_cond_t  kbus_instr_dump_cond = PTHREAD_COND_INITIALIZER;
+static FILE           *kbus_instr_dump_stream;
+static uint32_t        kbus_instr_dump_interval_ms;
+static bool            kbus_instr_dump_running;
+
+/*
+ * Return the state for a Ksock, or NULL if it does not have one.
+ */
+static inline struct kbus_ksock_state *kbus_state(kbus_ksock_t ksock)
+{
+  struct kbus_state_table *table = __atomic_load_n(&kbus_state_table,
+                                                   __ATOMIC_ACQUIRE);
+
+  if (table == NULL || ksock < 0 || ksock >= table->size)
+    return NULL;
+  return __atomic_load_n(&table->ksocks[ksock], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return the state for a Ksock, or NULL if it is not being instrumented.
+ */
+static inline struct kbus_ksock_state *kbus_instr(kbus_ksock_t ksock)
+{
+  struct kbus_ksock_state *instr = kbus_state(ksock);
+
+  if (instr && __atomic_load_n(&instr->instrumented, __ATOMIC_RELAXED))
+    return instr;
+  return NULL;
+}
+
+/*
+ * Return the state for a Ksock, or NULL if it does not have one.
+ * Call with kbus_state_lock held.
+ */
+static struct kbus_ksock_state *kbus_state_find(kbus_ksock_t ksock)
+{
+  if (kbus_state_table == NULL || ksock < 0 || ksock >= kbus_state_table->size)
+    return NULL;
+  return kbus_state_table->ksocks[ksock];
+}
+
+/*
+ * Throw away the state for a Ksock. Call with kbus_state_lock held.
+ */
+static void kbus_state_forget_locked(kbus_ksock_t ksock)
+{
+  struct kbus_ksock_state *state = kbus_state_find(ksock);
+
+  if (state) {
+    __atomic_store_n(&kbus_state_table->ksocks[ksock], NULL, __ATOMIC_RELEASE);
+    state->next_free = kbus_state_free_list;
+    kbus_state_free_list = state;
+  }
+}
+
+/*
+ * Throw away the state for a Ksock, because it is being closed, or because
+ * its file descriptor has just been reused for a new Ksock (so the old one
+ * must have been closed behind our back).
+ */
+static void kbus_state_forget(kbus_ksock_t ksock)
+{
+  if (kbus_state(ksock) == NULL)
+    return;
+
+  pthread_mutex_lock(&kbus_state_lock);
+  kbus_state_forget_locked(ksock);
+  pthread_mutex_unlock(&kbus_state_lock);
+}
+
+/*
+ * Return the state for a Ksock, or NULL if it does not have one - throwing
+ * it away if the file descriptor is no longer the Ksock it was kept for.
+ * Call with kbus_state_lock held.
+ */
+static struct kbus_ksock_state *kbus_state_find_current(kbus_ksock_t ksock)
+{
+  struct kbus_ksock_state *state = kbus_state_find(ksock);
+  uint32_t ksock_id;
+
+  if (state && (kbus_ksock_id(ksock, &ksock_id) ||
+                ksock_id != state->ksock_id)) {
+    kbus_state_forget_locked(ksock);
+    state = NULL;
+  }
+  return state;
+}
+
+/*
+ * Make sure the table of Ksock states has room for `ksock`.
+ * Call with kbus_state_lock held.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+static int kbus_state_grow(kbus_ksock_t ksock)
+{
+  struct kbus_state_table *old = kbus_state_table;
+  struct kbus_state_table *table;
+  int size = old ? old->size : KBUS_STATE_MIN_TABLE;
+
+  if (old && ksock < old->size)
+    return 0;
+  while (size <= ksock)
+    size = (size > INT_MAX / 2) ? INT_MAX : size * 2;
+
+  table = calloc(1, sizeof(*table) + size * sizeof(table->ksocks[0]));
+  if (table == NULL)
+    return -ENOMEM;
+  table->size = size;
+  table->retired = old;
+  if (old)
+    memcpy(table->ksocks, old->ksocks, old->size * sizeof(old->ksocks[0]));
+  __atomic_store_n(&kbus_state_table, table, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Return the state for a Ksock in `state`, making it a new one if it does
+ * not have one yet. Call with kbus_state_lock held.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+static int kbus_state_make(kbus_ksock_t                  ksock,
+                           struct kbus_ksock_state     **state)
+{
+  struct kbus_ksock_state *new_state = kbus_state_free_list;
+  int rv;
+
+  *state = kbus_state_find_current(ksock);
+  if (*state)
+    return 0;
+
+  if (new_state) {
+    kbus_state_free_list = new_state->next_free;
+    memset(new_state, 0, sizeof(*new_state));
+  } else {
+    new_state = calloc(1, sizeof(*new_state));
+    if (new_state == NULL)
+      return -ENOMEM;
+  }
+
+  rv = kbus_ksock_id(ksock, &new_state->ksock_id);
+  if (rv == 0)
+    rv = kbus_state_grow(ksock);
+  if (rv) {
+    new_state->next_free = kbus_state_free_list;
+    kbus_state_free_list = new_state;
+    return rv;
+  }
+
+  __atomic_store_n(&kbus_state_table->ksocks[ksock], new_state,
+                   __ATOMIC_RELEASE);
+  *state = new_state;
+  return 0;
+}
+
+static uint64_t kbus_instr_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Note that an operation started at `start_ns` has just finished.
+ */
+static void kbus_instr_note(kbus_latency_stats_t       *latency,
+                            uint64_t                    start_ns)
+{
+  uint64_t ns = kbus_instr_now_ns() - start_ns;
+  uint64_t us = ns / 1000;
+  uint64_t max;
+  int      bucket = 0;
+
+  while (us && bucket < KBUS_LATENCY_BUCKETS - 1) {
+    us >>= 1;
+    bucket ++;
+  }
+
+  __atomic_fetch_add(&latency->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&latency->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&latency->max_ns, __ATOMIC_RELAXED);
+  while (ns > max &&
+         !__atomic_compare_exchange_n(&latency->max_ns, &max, ns, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Note that an operation failed with `rv` (``-errno``).
+ */
+static void kbus_instr_note_error(struct kbus_ksock_state      *instr,
+                                  int                           rv)
+{
+  if (rv == -EAGAIN)
+    __atomic_fetch_add(&instr->stats.num_eagain, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&instr->stats.num_errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Remember when a Request was sent, so we can time its Reply. If the slot
+ * is still in use by an older Request, then that Request won't be timed.
+ */
+static void kbus_instr_note_request(struct kbus_ksock_state    *instr,
+                                    const kbus_msg_id_t        *msg_id,
+                                    uint64_t                    start_ns)
+{
+  int slot = msg_id->serial_num % KBUS_RPC_SLOTS;
+
+  __atomic_store_n(&instr->rpc[slot].sent_ns, start_ns, __ATOMIC_RELAXED);
+  __atomic_store_n(&instr->rpc[slot].serial_num, msg_id->serial_num,
+                   __ATOMIC_RELEASE);
+}
+
+/*
+ * If `msg` is the Reply to a Request we remember, time the round trip.
+ */
+static void kbus_instr_note_reply(struct kbus_ksock_state      *instr,
+                                  const kbus_message_t         *msg)
+{
+  uint32_t serial_num = msg->in_reply_to.serial_num;
+  int      slot = serial_num % KBUS_RPC_SLOTS;
+
+  if (serial_num == 0 || msg->in_reply_to.network_id != 0)
+    return;
+
+  if (__atomic_compare_exchange_n(&instr->rpc[slot].serial_num, &serial_num,
+                                  0, false, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_RELAXED))
+    kbus_instr_note(&instr->stats.rpc,
+                    __atomic_load_n(&instr->rpc[slot].sent_ns,
+                                    __ATOMIC_RELAXED));
+}
+
+/*
+ * Take a copy of one set of latency statistics.
+ */
+static void kbus_instr_copy(kbus_latency_stats_t               *to,
+                            kbus_latency_stats_t               *from)
+{
+  int ii;
+
+  to->count    = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+  to->total_ns = __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+  to->max_ns   = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+  for (ii = 0; ii < KBUS_LATENCY_BUCKETS; ii++)
+    to->buckets[ii] = __atomic_load_n(&from->buckets[ii], __ATOMIC_RELAXED);
+}
+
+/*
+ * Print one set of latency statistics, on one line.
+ */
+static void kbus_instr_print(FILE                       *stream,
+                             const char                 *what,
+                             const kbus_latency_stats_t *latency)
+{
+  int ii;
+
+  fprintf(stream, "  %-7s %" PRIu64, what, latency->count);
+  if (latency->count) {
+    fprintf(stream, ", mean %" PRIu64 "us, max %" PRIu64 "us:",
+            latency->total_ns / latency->count / 1000,
+            latency->max_ns / 1000);
+    for (ii = 0; ii < KBUS_LATENCY_BUCKETS; ii++) {
+      if (latency->buckets[ii] == 0)
+        continue;
+      if (ii == KBUS_LATENCY_BUCKETS - 1)
+        fprintf(stream, " >=%uus %" PRIu64, 1u << (ii - 1),
+                latency->buckets[ii]);
+      else
+        fprintf(stream, " <%uus %" PRIu64, 1u << ii, latency->buckets[ii]);
+    }
+  }
+  fprintf(stream, "\n");
+}
+
+/*
+ * Print the statistics for a Ksock. Call with kbus_state_lock held.
+ */
+static void kbus_instr_print_stats(FILE                    *stream,
+                                   kbus_ksock_t             ksock,
+                                   struct kbus_ksock_state *instr)
+{
+  kbus_ksock_stats_t    stats;
+
+  kbus_instr_copy(&stats.write,   &instr->stats.write);
+  kbus_instr_copy(&stats.send,    &instr->stats.send);
+  kbus_instr_copy(&stats.receive, &instr->stats.receive);
+  kbus_instr_copy(&stats.wait,    &instr->stats.wait);
+  kbus_instr_copy(&stats.rpc,     &instr->stats.rpc);
+  stats.num_eagain = __atomic_load_n(&instr->stats.num_eagain,
+                                     __ATOMIC_RELAXED);
+  stats.num_errors = __atomic_load_n(&instr->stats.num_errors,
+                                     __ATOMIC_RELAXED);
+
+  fprintf(stream, "Ksock %d: %" PRIu64 " -EAGAIN, %" PRIu64 " other errors\n",
+          ksock, stats.num_eagain, stats.num_errors);
+  kbus_instr_print(stream, "write",   &stats.write);
+  kbus_instr_print(stream, "send",    &stats.send);
+  kbus_instr_print(stream, "receive", &stats.receive);
+  kbus_instr_print(stream, "wait",    &stats.wait);
+  kbus_instr_print(stream, "rpc",     &stats.rpc);
+}
+
+/*
+ * The thread that periodically dumps the statistics.
+ */
+static void *kbus_instr_dump_thread(void *unused)
+{
+  pthread_mutex_lock(&kbus_state_lock);
+  while (kbus_instr_dump_interval_ms) {
+    struct timespec until;
+    int             ksock;
+    int             rv;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec  += kbus_instr_dump_interval_ms / 1000;
+    until.tv_nsec += (kbus_instr_dump_interval_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec ++;
+      until.tv_nsec -= 1000000000;
+    }
+    rv = pthread_cond_timedwait(&kbus_instr_dump_cond, &kbus_state_lock,
+                                &until);
+    if (rv != ETIMEDOUT || kbus_instr_dump_interval_ms == 0)
+      continue;
+
+    for (ksock = 0; kbus_state_table && ksock < kbus_state_table->size;
+         ksock++) {
+      // Not kbus_state_find_current(), which would ask whatever now has
+      // each file descriptor for its Ksock id
+      struct kbus_ksock_state *instr = kbus_state_find(ksock);
+      if (instr && instr->instrumented)
+        kbus_instr_print_stats(kbus_instr_dump_stream, ksock, instr);
+    }
+    fflush(kbus_instr_dump_stream);
+  }
+  kbus_instr_dump_running = false;
+  pthread_mutex_unlock(&kbus_state_lock);
+  return NULL;
+}
+
+/*
+ * Forget what we knew about a Ksock that had this file descriptor - which
+ * must have been closed other than by kbus_ksock_close(), since the file
+ * descriptor has just been reused for a new Ksock.
+ */
+static void kbus_forget_stale_ksock(kbus_ksock_t ksock)
+{
+  kbus_state_forget(ksock);
+  kbus_lb_forget(ksock);
+}
+
+/*
+ * The system calls for a Ksock, which go to the loopback bus for a loopback
+ * Ksock. Like the real system calls, they return -1 and set errno on error.
+ */
+static int kbus_ioctl(kbus_ksock_t ksock, unsigned long cmd, void *arg)
+{
+  int rv;
+
+  if (!kbus_lb_is_ksock(ksock))
+    return ioctl(ksock, cmd, arg);
+
+  rv = kbus_lb_ioctl(ksock, cmd, arg);
+  if (rv < 0) {
+    errno = -rv;
+    return -1;
+  }
+  return rv;
+}
+
+static ssize_t kbus_read(kbus_ksock_t ksock, void *buf, size_t count)
+{
+  ssize_t rv;
+
+  if (!kbus_lb_is_ksock(ksock))
+    return read(ksock, buf, count);
+
+  rv = kbus_lb_read(ksock, buf, count);
+  if (rv < 0) {
+    errno = -rv;
+    return -1;
+  }
+  return rv;
+}
+
+static ssize_t kbus_write(kbus_ksock_t ksock, const void *buf, size_t count)
+{
+  ssize_t rv;
+
+  if (!kbus_lb_is_ksock(ksock))
+    return write(ksock, buf, count);
+
+  rv = kbus_lb_write(ksock, buf, count);
+  if (rv < 0) {
+    errno = -rv;
+    return -1;
+  }
+  return rv;
+}
+
 // ===========================================================================
 // Ksock specific functions
 
@@ -76,8 +534,9 @@ extern kbus_ksock_t kbus_ksock_open(uint32_t device_number,
   rv = open(filename, flags & mask);
   if (rv < 0)
     return -errno;
-  else
-    return rv;
+
+  kbus_forget_stale_ksock(rv);
+  return rv;
 }
 
 /*
@@ -101,8 +560,53 @@ extern kbus_ksock_t kbus_ksock_open_by_name(const char *device_name,
   int rv = open(device_name, flags & mask);
   if (rv < 0)
     return -errno;
-  else
-    return rv;
+
+  kbus_forget_stale_ksock(rv);
+  return rv;
+}
+
+/*
+ * Open a Ksock on an in-process loopback bus.
+ *
+ * A loopback bus behaves like a KBUS device, but lives entirely within this
+ * process, so messages never go through the kernel. All the Ksocks opened
+ * with the same `bus_number` share a bus, which exists for as long as any of
+ * them are open. Loopback buses are quite separate from KBUS devices, so
+ * loopback bus 0 has nothing to do with ``/dev/kbus0``.
+ *
+ * A loopback Ksock may be used with all of the ``kbus_ksock_*`` functions,
+ * and waited for with ``kbus_wait_for_message()`` or ``poll()``. The rules
+ * for message names, wildcards, Repliers and synthetic messages are the same
+ * as for KBUS. However, filtered bindings, broadcast topics, blocking reads,
+ * busy polling, Replier bind events and ``kbus_new_device()`` are not
+ * supported, and fail with -EOPNOTSUPP.
+ *
+ * Messages are shared between their recipients, and only copied when each
+ * recipient reads its message. The maximum message size for a loopback bus
+ * starts at 1024 bytes, as for KBUS, but may be set as high as 1MB.
+ *
+ * This is intended for testing, and for components that talk to each other
+ * within one process.
+ *
+ * `flags` may be one of ``O_RDONLY``, ``O_WRONLY`` or ``O_RDWR``.
+ *
+ * The Ksock is one end of a Unix socket pair. It is readable when it has
+ * messages to read, and writable unless a send is blocked (after -EAGAIN),
+ * but should only be polled, never read or written directly. Each loopback
+ * Ksock uses three file descriptors, since libkbus keeps the other end, and
+ * its own duplicate of the one returned.
+ *
+ * Returns the file descriptor for the new Ksock, or a negative value on error.
+ * The negative value will be ``-errno``.
+ */
+extern kbus_ksock_t kbus_ksock_open_loopback(uint32_t   bus_number,
+                                             int        flags)
+{
+  // (which forgets any stale loopback Ksock with the same file descriptor)
+  int rv = kbus_lb_open(bus_number, flags);
+  if (rv >= 0)
+    kbus_state_forget(rv);
+  return rv;
 }
 
 /*
@@ -112,7 +616,14 @@ extern kbus_ksock_t kbus_ksock_open_by_name(const char *device_name,
  */
 extern int kbus_ksock_close(kbus_ksock_t ksock)
 {
-  int rv = close(ksock);
+  int rv;
+
+  kbus_state_forget(ksock);
+
+  if (kbus_lb_is_ksock(ksock))
+    return kbus_lb_close(ksock);
+
+  rv = close(ksock);
   if (rv < 0)
     return -errno;
   else
@@ -142,7 +653,7 @@ extern int kbus_ksock_bind(kbus_ksock_t         ksock,
   bind_request.name_len = strlen(name);
   bind_request.is_replier = is_replier;
 
-  rv = ioctl(ksock, KBUS_IOC_BIND, &bind_request);
+  rv = kbus_ioctl(ksock, KBUS_IOC_BIND, &bind_request);
   if (rv < 0)
     return -errno;
   else
@@ -170,13 +681,154 @@ extern int kbus_ksock_unbind(kbus_ksock_t         ksock,
   bind_request.name_len = strlen(name);
   bind_request.is_replier = is_replier;
 
-  rv = ioctl(ksock, KBUS_IOC_UNBIND, &bind_request);
+  rv = kbus_ioctl(ksock, KBUS_IOC_UNBIND, &bind_request);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
+}
+
+/*
+ * Bind the given message name to the specified Ksock, as a Listener, but only
+ * for some of the messages with that name.
+ *
+ * `flags` says which of the constraints to apply:
+ *
+ * * KBUS_BIND_FILTER_FROM - the message must be from the Ksock with id `from`
+ * * KBUS_BIND_FILTER_ORIG_FROM - the message's ``orig_from`` must equal
+ *   `orig_from` (i.e., it must have originated at that Ksock, on the far side
+ *   of that Limpet network)
+ * * KBUS_BIND_FILTER_MAX_RATE - accept at most `max_rate` messages a second
+ * * KBUS_BIND_FILTER_SAMPLE - accept only every `sample_every`th message,
+ *   starting with the first
+ *
+ * Messages that fail the filter are never queued for this binding (the number
+ * dropped by the rate limit or sample is shown in /proc/kbus/stats). Unused
+ * constraints are ignored.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_bind_filtered(kbus_ksock_t         ksock,
+                                    const char          *name,
+                                    uint32_t             flags,
+                                    uint32_t             from,
+                                    kbus_orig_from_t     orig_from,
+                                    uint32_t             max_rate,
+                                    uint32_t             sample_every)
+{
+  int                           rv;
+  kbus_bind_filter_request_t    filter_request;
+
+  filter_request.flags = flags;
+  filter_request.name = (char *) name;
+  filter_request.name_len = strlen(name);
+  filter_request.from = from;
+  filter_request.orig_from = orig_from;
+  filter_request.max_rate = max_rate;
+  filter_request.sample_every = sample_every;
+
+  rv = kbus_ioctl(ksock, KBUS_IOC_BINDFILTER, &filter_request);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
+}
+
+/*
+ * Unbind a binding made with ``kbus_ksock_bind_filtered()``.
+ *
+ * The name, `flags` and the constraints that `flags` selects must exactly
+ * match those of the binding.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_unbind_filtered(kbus_ksock_t         ksock,
+                                      const char          *name,
+                                      uint32_t             flags,
+                                      uint32_t             from,
+                                      kbus_orig_from_t     orig_from,
+                                      uint32_t             max_rate,
+                                      uint32_t             sample_every)
+{
+  int                           rv;
+  kbus_bind_filter_request_t    filter_request;
+
+  filter_request.flags = flags;
+  filter_request.name = (char *) name;
+  filter_request.name_len = strlen(name);
+  filter_request.from = from;
+  filter_request.orig_from = orig_from;
+  filter_request.max_rate = max_rate;
+  filter_request.sample_every = sample_every;
+
+  rv = kbus_ioctl(ksock, KBUS_IOC_UNBINDFILTER, &filter_request);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
+}
+
+/*
+ * Subscribe to a broadcast topic.
+ *
+ * A broadcast topic is a message name (not a wildcard) whose Announcements
+ * are kept once, in a ring of recent messages, instead of being copied onto
+ * the message queue of every Listener - so sending one costs the same however
+ * many subscribers there are. Subscribers read them (after any messages in
+ * their message queue) with ``kbus_ksock_next_msg()`` and friends, as usual.
+ *
+ * `flags` and `ring_size` are only used if this creates the topic (i.e., we
+ * are its first subscriber). If `flags` includes KBUS_TOPIC_BACKPRESSURE, a
+ * sender has to wait for the slowest subscriber, otherwise slow subscribers
+ * are lapped, and read a "$.KBUS.TopicLapped" message saying how many
+ * messages they lost. A `ring_size` of 0 means the default.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_subscribe(kbus_ksock_t         ksock,
+                                const char          *name,
+                                uint32_t             flags,
+                                uint32_t             ring_size)
+{
+  int                   rv;
+  kbus_topic_request_t  topic_request;
+
+  topic_request.name = (char *) name;
+  topic_request.name_len = strlen(name);
+  topic_request.flags = flags;
+  topic_request.ring_size = ring_size;
+
+  rv = kbus_ioctl(ksock, KBUS_IOC_SUBSCRIBE, &topic_request);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
+}
+
+/*
+ * Unsubscribe from a broadcast topic.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_unsubscribe(kbus_ksock_t         ksock,
+                                  const char          *name)
+{
+  int                   rv;
+  kbus_topic_request_t  topic_request;
+
+  topic_request.name = (char *) name;
+  topic_request.name_len = strlen(name);
+  topic_request.flags = 0;
+  topic_request.ring_size = 0;
+
+  rv = kbus_ioctl(ksock, KBUS_IOC_UNSUBSCRIBE, &topic_request);
   if (rv < 0)
     return -errno;
   else
     return rv;
 }
 
+
 /*
  * Return the internal (to KBUS) Ksock id for this Ksock.
  *
@@ -188,7 +840,7 @@ extern int kbus_ksock_unbind(kbus_ksock_t         ksock,
 extern int kbus_ksock_id(kbus_ksock_t   ksock,
                          uint32_t      *ksock_id)
 {
-  int rv = ioctl(ksock, KBUS_IOC_KSOCKID, ksock_id);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_KSOCKID, ksock_id);
   if (rv < 0)
     return -errno;
   else
@@ -212,7 +864,7 @@ extern int kbus_ksock_id(kbus_ksock_t   ksock,
 extern int kbus_ksock_next_msg(kbus_ksock_t     ksock,
                                uint32_t        *message_length)
 {
-  int rv = ioctl(ksock, KBUS_IOC_NEXTMSG, message_length);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_NEXTMSG, message_length);
   if (rv < 0)
     return -errno;
   else
@@ -232,7 +884,7 @@ extern int kbus_ksock_next_msg(kbus_ksock_t     ksock,
 extern int kbus_ksock_len_left(kbus_ksock_t   ksock,
                                uint32_t      *len_left)
 {
-  int rv = ioctl(ksock, KBUS_IOC_LENLEFT, len_left);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_LENLEFT, len_left);
   if (rv < 0)
     return -errno;
   else
@@ -249,7 +901,7 @@ extern int kbus_ksock_len_left(kbus_ksock_t   ksock,
 extern int kbus_ksock_last_msg_id(kbus_ksock_t          ksock,
                                   kbus_msg_id_t        *msg_id)
 {
-  int rv = ioctl(ksock, KBUS_IOC_LASTSENT, msg_id);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_LASTSENT, msg_id);
   if (rv < 0)
     return -errno;
   else
@@ -274,7 +926,7 @@ extern int kbus_ksock_find_replier(kbus_ksock_t   ksock,
   bind_query.name = (char *) name;
   bind_query.name_len = strlen(name);
 
-  rv = ioctl(ksock, KBUS_IOC_REPLIER, &bind_query);
+  rv = kbus_ioctl(ksock, KBUS_IOC_REPLIER, &bind_query);
   if (rv < 0)
     return -errno;
   else if (rv == 0)
@@ -298,7 +950,7 @@ extern int kbus_ksock_find_replier(kbus_ksock_t   ksock,
 extern int kbus_ksock_max_messages(kbus_ksock_t   ksock,
                                    uint32_t      *max_messages)
 {
-  int rv = ioctl(ksock, KBUS_IOC_MAXMSGS, max_messages);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_MAXMSGS, max_messages);
   if (rv < 0)
     return -errno;
   else
@@ -315,7 +967,7 @@ extern int kbus_ksock_max_messages(kbus_ksock_t   ksock,
 extern int kbus_ksock_num_messages(kbus_ksock_t   ksock,
                                    uint32_t      *num_messages)
 {
-  int rv = ioctl(ksock, KBUS_IOC_NUMMSGS, num_messages);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_NUMMSGS, num_messages);
   if (rv < 0)
     return -errno;
   else
@@ -331,7 +983,7 @@ extern int kbus_ksock_num_messages(kbus_ksock_t   ksock,
 extern int kbus_ksock_num_unreplied_to(kbus_ksock_t   ksock,
                                        uint32_t      *num_messages)
 {
-  int rv = ioctl(ksock, KBUS_IOC_UNREPLIEDTO, num_messages);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_UNREPLIEDTO, num_messages);
   if (rv < 0)
     return -errno;
   else
@@ -353,11 +1005,20 @@ extern int kbus_ksock_num_unreplied_to(kbus_ksock_t   ksock,
 extern int kbus_ksock_send(kbus_ksock_t         ksock,
                            kbus_msg_id_t       *msg_id)
 {
-  int rv = ioctl(ksock, KBUS_IOC_SEND, msg_id);
+  struct kbus_ksock_state *instr = kbus_instr(ksock);
+  uint64_t start = instr ? kbus_instr_now_ns() : 0;
+
+  int rv = kbus_ioctl(ksock, KBUS_IOC_SEND, msg_id);
   if (rv < 0)
-    return -errno;
-  else
-    return rv;
+    rv = -errno;
+
+  if (instr) {
+    if (rv < 0)
+      kbus_instr_note_error(instr, rv);
+    else
+      kbus_instr_note(&instr->stats.send, start);
+  }
+  return rv;
 }
 
 /*
@@ -372,7 +1033,7 @@ extern int kbus_ksock_send(kbus_ksock_t         ksock,
  */
 extern int kbus_ksock_discard(kbus_ksock_t         ksock)
 {
-  int rv = ioctl(ksock, KBUS_IOC_DISCARD);
+  int rv = kbus_ioctl(ksock, KBUS_IOC_DISCARD, NULL);
   if (rv < 0)
     return -errno;
   else
@@ -422,10 +1083,8 @@ extern int kbus_ksock_only_once(kbus_ksock_t   ksock,
   }
 
   array[0] = request;
-  rv = ioctl(ksock, KBUS_IOC_MSGONLYONCE, array);
-  if (rv == 0)
-    return rv;
-  else if (rv < 0)
+  rv = kbus_ioctl(ksock, KBUS_IOC_MSGONLYONCE, array);
+  if (rv < 0)
     return -errno;
   else
     return array[0];
@@ -468,41 +1127,288 @@ extern int kbus_ksock_report_replier_binds(kbus_ksock_t       ksock,
   }
 
   array[0] = request;
-  rv = ioctl(ksock, KBUS_IOC_REPORTREPLIERBINDS, array);
+  rv = kbus_ioctl(ksock, KBUS_IOC_REPORTREPLIERBINDS, array);
+  if (rv < 0)
+    return -errno;
+  else
+    return array[0];
+}
+
+/*
+ * Request verbose kernel module messages.
+ *
+ * KBUS writes message via the normal kernel module mechanisms (which may be
+ * inspected, for instance, via the ``dmesg`` command). Normal output is meant
+ * to be reasonably minimal. Verbose messages can be useful for debugging the
+ * kernel module.
+ *
+ * If `request` is 1, then verbose kernel messages are wanted.
+ *
+ * If `request` is 0, then verbose kernel messages are not wanted.
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ * This may be used to query the current state of the "verbose" flag.
+ *
+ * Note that although this call is made via an individual Ksock, it affects the
+ * behaviour of the entire KBUS kernel module.
+ *
+ * Returns 0 or 1, according to the state of the "verbose" flag *before* this
+ * function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_kernel_module_verbose(kbus_ksock_t       ksock,
+                                            uint32_t           request)
+{
+  int           rv;
+  uint32_t      array[1];
+
+  switch (request)
+  {
+  case 0:
+  case 1:
+  case 0xFFFFFFFF:
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  array[0] = request;
+  rv = kbus_ioctl(ksock, KBUS_IOC_VERBOSE, array);
   if (rv == 0)
     return rv;
   else if (rv < 0)
     return -errno;
   else
-    return array[0];
+    return array[0];
+}
+
+/*
+ * Determine the maximum size of a message in bytes that can be written to
+ * this KBUS device.
+ *
+ * A 'max_bytes' of 0 does not actually change the value - on returning,
+ * 'max_bytes' will be set to the maximum message size.
+ *
+ * A 'max_bytes' of 1 also does not change the value, instead it returns the
+ * absolute maximum size that the value may be set to in 'max_bytes'.
+ *
+ * Otherwise sets the maximum message size to 'max_bytes'.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_max_message_size(kbus_ksock_t ksock,
+                                       uint32_t    *max_bytes)
+{
+  int rv = kbus_ioctl(ksock, KBUS_IOC_MAXMSGSIZE, max_bytes);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
+}
+
+/*
+ * Determine whether receiving a message should wait for one to arrive.
+ *
+ * If `request` is 1, then ``kbus_ksock_next_msg()`` (and so
+ * ``kbus_ksock_read_next_msg()``) will wait until there is a message to
+ * return, rather than returning a length of 0 at once. A ``read`` when there
+ * is no current message will likewise wait for the next message, and then
+ * start reading it.
+ *
+ * If `request` is 0, then receiving a message does not wait (the default).
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ * This may be used to query the current state of the "blocking" flag.
+ *
+ * Note that none of this applies if the Ksock was opened with O_NONBLOCK
+ * - a non-blocking Ksock never waits.
+ *
+ * Returns 0 or 1, according to the state of the "blocking" flag *before* this
+ * function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_blocking(kbus_ksock_t     ksock,
+                               uint32_t         request)
+{
+  int           rv;
+  uint32_t      array[1];
+
+  switch (request)
+  {
+  case 0:
+  case 1:
+  case 0xFFFFFFFF:
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  array[0] = request;
+  rv = kbus_ioctl(ksock, KBUS_IOC_BLOCKING, array);
+  if (rv < 0)
+    return -errno;
+  else
+    return array[0];
+}
+
+/*
+ * Determine how long a blocking receive should spin before sleeping.
+ *
+ * When waiting for a message (see ``kbus_ksock_blocking()``), KBUS will first
+ * spin for up to `usecs` microseconds, checking for a message, before putting
+ * the caller to sleep. This costs CPU time, but can save the latency of being
+ * woken up again when messages are expected very soon. The default is 0 (do
+ * not spin).
+ *
+ * If `usecs` is 0xFFFFFFFF, then the current value should not be changed.
+ * This may be used to query the current busy poll window.
+ *
+ * Returns the busy poll window (in microseconds) *before* this function was
+ * called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_busy_poll(kbus_ksock_t    ksock,
+                                uint32_t        usecs)
+{
+  int           rv;
+  uint32_t      array[1];
+
+  array[0] = usecs;
+  rv = kbus_ioctl(ksock, KBUS_IOC_BUSYPOLL, array);
+  if (rv < 0)
+    return -errno;
+  else
+    return array[0];
+}
+/*
+ * Determine whether writing a complete message to this Ksock also sends it.
+ *
+ * If `request` is 1, then a ``write()`` that completes a message also sends
+ * it, as if ``kbus_ksock_send()`` had been called, saving a system call per
+ * message. Any error from the send is returned by the ``write()``, and
+ * ``kbus_ksock_send_msg()`` will automatically take advantage of this.
+ *
+ * If `request` is 0, then messages must be sent explicitly (the default).
+ *
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
+ * This may be used to query the current state of the "auto send" flag.
+ *
+ * libkbus remembers which Ksocks are in auto send mode, so that
+ * ``kbus_ksock_send_msg()`` knows not to send the message again. It forgets
+ * when the Ksock is closed with ``kbus_ksock_close()``, or when another Ksock
+ * is opened with the same file descriptor - so only change the mode with
+ * this function.
+ *
+ * Returns 0 or 1, according to the state of the "auto send" flag *before* this
+ * function was called, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_auto_send(kbus_ksock_t     ksock,
+                                uint32_t         request)
+{
+  struct kbus_ksock_state *state = NULL;
+  int           rv;
+  uint32_t      array[1];
+
+  switch (request)
+  {
+  case 0:
+  case 1:
+  case 0xFFFFFFFF:
+    break;
+  default:
+    return -EINVAL;
+  }
+
+  if (request == 0xFFFFFFFF) {
+    array[0] = request;
+    rv = kbus_ioctl(ksock, KBUS_IOC_AUTOSEND, array);
+    if (rv < 0)
+      return -errno;
+    return array[0];
+  }
+
+  // Remember the mode before we change it, so we can't lose track of it
+  pthread_mutex_lock(&kbus_state_lock);
+  if (request == 1) {
+    rv = kbus_state_make(ksock, &state);
+  } else {
+    state = kbus_state_find_current(ksock);
+    rv = 0;
+  }
+  if (rv == 0) {
+    array[0] = request;
+    rv = kbus_ioctl(ksock, KBUS_IOC_AUTOSEND, array);
+    if (rv < 0)
+      rv = -errno;
+    else if (state)
+      __atomic_store_n(&state->auto_send, request == 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&kbus_state_lock);
+
+  if (rv < 0)
+    return rv;
+  return array[0];
+}
+
+
+/*
+ * Request the KBUS kernel module to create a new device (``/dev/kbus<n>``).
+ *
+ * `device_number` is the ``<n>`` for the new device.
+ *
+ * Note that it takes the kernel's hotplugging mechanisms a little while to
+ * notice/activate the device, so do not expect it to be available immediately
+ * on return.
+ *
+ * Note that although this call is made via an individual Ksock, it affects the
+ * behaviour of the entire KBUS kernel module.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_ksock_new_device(kbus_ksock_t  ksock,
+                                 uint32_t     *device_number)
+{
+  int rv = kbus_ioctl(ksock, KBUS_IOC_NEWDEVICE, device_number);
+  if (rv < 0)
+    return -errno;
+  else
+    return rv;
 }
 
+// ===========================================================================
+// Instrumentation
+
 /*
- * Request verbose kernel module messages.
+ * Turn instrumentation of a Ksock on or off.
  *
- * KBUS writes message via the normal kernel module mechanisms (which may be
- * inspected, for instance, via the ``dmesg`` command). Normal output is meant
- * to be reasonably minimal. Verbose messages can be useful for debugging the
- * kernel module.
+ * An instrumented Ksock keeps counts, and latency histograms, for writing,
+ * sending and receiving messages, waiting in ``kbus_wait_for_message()``,
+ * and the round trip from sending a Request (with ``kbus_ksock_send_msg()``)
+ * to reading its Reply. It also counts how often writing or sending a
+ * message fails, distinguishing -EAGAIN from other errors. These may be
+ * retrieved with ``kbus_ksock_get_stats()``.
  *
- * If `request` is 1, then verbose kernel messages are wanted.
+ * The statistics are kept by libkbus, in this process - they do not involve
+ * KBUS itself, and other processes using the same Ksock will not see them.
+ * They are kept until the Ksock is closed, so turning instrumentation off and
+ * on again continues where it left off. (If the Ksock is closed other than by
+ * ``kbus_ksock_close()``, they are thrown away when a new Ksock is opened with
+ * the same file descriptor, or when they are next asked for.)
  *
- * If `request` is 0, then verbose kernel messages are not wanted.
+ * Ksocks that are not instrumented do not pay for it, beyond a check of
+ * whether they are.
  *
- * If `request` is 0xFFFFFFFF, then the current state should not be changed.
- * This may be used to query the current state of the "verbose" flag.
+ * If `request` is 1, then the Ksock is instrumented, if 0 it is not (the
+ * default).
  *
- * Note that although this call is made via an individual Ksock, it affects the
- * behaviour of the entire KBUS kernel module.
+ * If `request` is 0xFFFFFFFF, then the current state should not be changed.
  *
- * Returns 0 or 1, according to the state of the "verbose" flag *before* this
- * function was called, or a negative number (``-errno``) for failure.
+ * Returns 0 or 1, according to whether the Ksock was instrumented *before*
+ * this function was called, or a negative number (``-errno``) for failure.
  */
-extern int kbus_ksock_kernel_module_verbose(kbus_ksock_t       ksock,
-                                            uint32_t           request)
+extern int kbus_ksock_instrument(kbus_ksock_t     ksock,
+                                 uint32_t         request)
 {
-  int           rv;
-  uint32_t      array[1];
+  struct kbus_ksock_state *instr;
+  bool  was_enabled;
+  int   rv;
 
   switch (request)
   {
@@ -514,62 +1420,125 @@ extern int kbus_ksock_kernel_module_verbose(kbus_ksock_t       ksock,
     return -EINVAL;
   }
 
-  array[0] = request;
-  rv = ioctl(ksock, KBUS_IOC_VERBOSE, array);
-  if (rv == 0)
-    return rv;
-  else if (rv < 0)
-    return -errno;
-  else
-    return array[0];
+  if (ksock < 0)
+    return -EBADF;
+
+  pthread_mutex_lock(&kbus_state_lock);
+  instr = kbus_state_find_current(ksock);
+  was_enabled = instr && instr->instrumented;
+
+  if (request == 1 && !instr) {
+    rv = kbus_state_make(ksock, &instr);
+    if (rv) {
+      pthread_mutex_unlock(&kbus_state_lock);
+      return rv;
+    }
+  }
+  if (request == 1)
+    instr->has_stats = true;
+  if (request != 0xFFFFFFFF && instr)
+    __atomic_store_n(&instr->instrumented, request == 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&kbus_state_lock);
+  return was_enabled;
 }
 
 /*
- * Determine the maximum size of a message in bytes that can be written to
- * this KBUS device.
+ * Take a snapshot of the statistics for an instrumented Ksock.
  *
- * A 'max_bytes' of 0 does not actually change the value - on returning,
- * 'max_bytes' will be set to the maximum message size.
+ * The statistics are those gathered whilst the Ksock was instrumented (see
+ * ``kbus_ksock_instrument()``). They may still be changing as they are read,
+ * so the different fields are not necessarily exactly consistent with each
+ * other.
  *
- * A 'max_bytes' of 1 also does not change the value, instead it returns the
- * absolute maximum size that the value may be set to in 'max_bytes'.
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ * Specifically, -ENOENT is returned if the Ksock has never been instrumented.
+ */
+extern int kbus_ksock_get_stats(kbus_ksock_t            ksock,
+                                kbus_ksock_stats_t     *stats)
+{
+  struct kbus_ksock_state *instr;
+
+  pthread_mutex_lock(&kbus_state_lock);
+  instr = kbus_state_find_current(ksock);
+  if (!instr || !instr->has_stats) {
+    pthread_mutex_unlock(&kbus_state_lock);
+    return -ENOENT;
+  }
+  kbus_instr_copy(&stats->write,   &instr->stats.write);
+  kbus_instr_copy(&stats->send,    &instr->stats.send);
+  kbus_instr_copy(&stats->receive, &instr->stats.receive);
+  kbus_instr_copy(&stats->wait,    &instr->stats.wait);
+  kbus_instr_copy(&stats->rpc,     &instr->stats.rpc);
+  stats->num_eagain = __atomic_load_n(&instr->stats.num_eagain,
+                                      __ATOMIC_RELAXED);
+  stats->num_errors = __atomic_load_n(&instr->stats.num_errors,
+                                      __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&kbus_state_lock);
+  return 0;
+}
+
+/*
+ * Print out the statistics for an instrumented Ksock.
  *
- * Otherwise sets the maximum message size to 'max_bytes'.
+ * Each kind of operation gets a line giving how many there have been, their
+ * mean and maximum times, and the non-empty buckets of their histogram.
  *
  * Returns 0 for success, or a negative number (``-errno``) for failure.
+ * Specifically, -ENOENT is returned if the Ksock has never been instrumented.
  */
-extern int kbus_ksock_max_message_size(kbus_ksock_t ksock,
-                                       uint32_t    *max_bytes)
+extern int kbus_ksock_print_stats(FILE                  *stream,
+                                  kbus_ksock_t           ksock)
 {
-  int rv = ioctl(ksock, KBUS_IOC_MAXMSGSIZE, max_bytes);
-  if (rv < 0)
-    return -errno;
-  else
-    return rv;
+  struct kbus_ksock_state *instr;
+
+  pthread_mutex_lock(&kbus_state_lock);
+  instr = kbus_state_find_current(ksock);
+  if (!instr || !instr->has_stats) {
+    pthread_mutex_unlock(&kbus_state_lock);
+    return -ENOENT;
+  }
+  kbus_instr_print_stats(stream, ksock, instr);
+  pthread_mutex_unlock(&kbus_state_lock);
+  return 0;
 }
 
 /*
- * Request the KBUS kernel module to create a new device (``/dev/kbus<n>``).
- *
- * `device_number` is the ``<n>`` for the new device.
+ * Print out the statistics for all instrumented Ksocks, every so often.
  *
- * Note that it takes the kernel's hotplugging mechanisms a little while to
- * notice/activate the device, so do not expect it to be available immediately
- * on return.
+ * This starts a thread which, every `interval_ms` milliseconds, does
+ * ``kbus_ksock_print_stats()`` to `stream` for each Ksock that is currently
+ * being instrumented.
  *
- * Note that although this call is made via an individual Ksock, it affects the
- * behaviour of the entire KBUS kernel module.
+ * Calling this again changes the stream and interval. An `interval_ms` of 0
+ * stops the dumping (and the thread).
  *
  * Returns 0 for success, or a negative number (``-errno``) for failure.
  */
-extern int kbus_ksock_new_device(kbus_ksock_t  ksock,
-                                 uint32_t     *device_number)
+extern int kbus_ksock_dump_stats_every(FILE             *stream,
+                                       uint32_t          interval_ms)
 {
-  int rv = ioctl(ksock, KBUS_IOC_NEWDEVICE, device_number);
-  if (rv < 0)
-    return -errno;
-  else
-    return rv;
+  pthread_attr_t attr;
+  pthread_t      thread;
+  int            rv = 0;
+
+  pthread_mutex_lock(&kbus_state_lock);
+  kbus_instr_dump_stream = stream;
+  kbus_instr_dump_interval_ms = interval_ms;
+
+  if (interval_ms && !kbus_instr_dump_running) {
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rv = -pthread_create(&thread, &attr, kbus_instr_dump_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (rv == 0)
+      kbus_instr_dump_running = true;
+    else
+      kbus_instr_dump_interval_ms = 0;
+  }
+  pthread_cond_broadcast(&kbus_instr_dump_cond);
+  pthread_mutex_unlock(&kbus_state_lock);
+  return rv;
 }
 
 // ===========================================================================
@@ -599,12 +1568,16 @@ extern int kbus_wait_for_message(kbus_ksock_t  ksock,
 {
   struct pollfd fds[1];
   int rv;
+  struct kbus_ksock_state *instr = kbus_instr(ksock);
+  uint64_t start = instr ? kbus_instr_now_ns() : 0;
 
   fds[0].fd = (int)ksock;
   fds[0].events = ((wait_for & KBUS_KSOCK_READABLE) ? POLLIN  : 0) |
                   ((wait_for & KBUS_KSOCK_WRITABLE) ? POLLOUT : 0);
   fds[0].revents =0;
   rv = poll(fds, 1, -1);
+  if (instr)
+    kbus_instr_note(&instr->stats.wait, start);
   if (rv < 0)
     return -errno;
   else
@@ -633,12 +1606,14 @@ extern int kbus_ksock_read_msg(kbus_ksock_t      ksock,
   ssize_t        so_far = 0;
   ssize_t        length = 0;
   char          *buf;
+  struct kbus_ksock_state *instr = kbus_instr(ksock);
+  uint64_t       start = instr ? kbus_instr_now_ns() : 0;
 
   buf = malloc(msg_len);
   if (!buf) return -ENOMEM;
 
   while (msg_len > 0) {
-    length = read(ksock, buf+so_far, msg_len-so_far);
+    length = kbus_read(ksock, buf+so_far, msg_len-so_far);
 #if DEBUG
     printf("attemping to read %d bytes, read %d\n", msg_len-so_far, length);
 #endif
@@ -658,6 +1633,10 @@ extern int kbus_ksock_read_msg(kbus_ksock_t      ksock,
     }
   }
   *msg = (kbus_message_t *)buf;
+  if (instr) {
+    kbus_instr_note(&instr->stats.receive, start);
+    kbus_instr_note_reply(instr, *msg);
+  }
   return 0;
 }
 
@@ -713,6 +1692,8 @@ extern int kbus_ksock_write_msg(kbus_ksock_t             ksock,
   size_t         written = 0;
   ssize_t        rv;
   uint8_t       *data = (uint8_t *)msg;
+  struct kbus_ksock_state *instr = kbus_instr(ksock);
+  uint64_t       start = instr ? kbus_instr_now_ns() : 0;
 
   if (kbus_msg_is_entire(msg))
     length = KBUS_ENTIRE_MSG_LEN(msg->name_len, msg->data_len);
@@ -720,12 +1701,18 @@ extern int kbus_ksock_write_msg(kbus_ksock_t             ksock,
     length = sizeof(*msg);
 
   while (written < length) {
-    rv = write(ksock, data + written, length - written);
+    rv = kbus_write(ksock, data + written, length - written);
     if (rv > 0)
       written += rv;
-    else if (rv < 0)
-      return -errno;
+    else if (rv < 0) {
+      rv = -errno;
+      if (instr)
+        kbus_instr_note_error(instr, rv);
+      return rv;
+    }
   }
+  if (instr)
+    kbus_instr_note(&instr->stats.write, start);
   return 0;
 }
 
@@ -745,7 +1732,7 @@ extern int kbus_ksock_write_data(kbus_ksock_t    ksock,
   ssize_t        rv;
 
   while (written < data_len) {
-    rv = write(ksock, data + written, data_len - written);
+    rv = kbus_write(ksock, data + written, data_len - written);
     if (rv > 0)
       written += rv;
     else if (rv < 0)
@@ -767,16 +1754,46 @@ extern int kbus_ksock_write_data(kbus_ksock_t    ksock,
  *
  * `msg_id` returns the message id assigned to the message by KBUS.
  *
+ * If the Ksock is in auto send mode (see ``kbus_ksock_auto_send()``), then
+ * the write also sends the message, and the message id is only asked for if
+ * `msg_id` is not NULL - so passing NULL sends the message with a single
+ * system call. (If the Ksock is instrumented, see ``kbus_ksock_instrument()``,
+ * then the id of a Request is always asked for, to time its Reply.)
+ *
  * Returns 0 for success, or a negative number (``-errno``) for failure.
  */
 extern int kbus_ksock_send_msg(kbus_ksock_t             ksock,
                                const kbus_message_t    *msg,
                                kbus_msg_id_t           *msg_id)
 {
-  int rv = kbus_ksock_write_msg(ksock, msg);
+  struct kbus_ksock_state *state = kbus_state(ksock);
+  struct kbus_ksock_state *instr = kbus_instr(ksock);
+  kbus_msg_id_t  id;
+  uint64_t       start = 0;
+  int            rv;
+
+  if (instr && (msg->flags & KBUS_BIT_WANT_A_REPLY)) {
+    // We need to know the Request's id to time its Reply
+    if (msg_id == NULL)
+      msg_id = &id;
+    start = kbus_instr_now_ns();
+  }
+
+  rv = kbus_ksock_write_msg(ksock, msg);
   if (rv) return rv;
 
-  return kbus_ksock_send(ksock, msg_id);
+  if (state && __atomic_load_n(&state->auto_send, __ATOMIC_RELAXED)) {
+    // The write has already sent the message
+    if (msg_id == NULL)
+      return 0;
+    rv = kbus_ksock_last_msg_id(ksock, msg_id);
+  } else {
+    rv = kbus_ksock_send(ksock, msg_id);
+  }
+
+  if (rv == 0 && start)
+    kbus_instr_note_request(instr, msg_id, start);
+  return rv;
 }
 
 // ===========================================================================
@@ -1040,6 +2057,25 @@ extern int kbus_msg_create_entire_reply_to(kbus_message_t          **msg,
   return 0;
 }
 
+/*
+ * Work out who a Stateful Request based on `earlier_msg` should go to.
+ */
+static int kbus_msg_stateful_target(const kbus_message_t   *earlier_msg,
+                                    uint32_t               *to,
+                                    struct kbus_orig_from  *final_to)
+{
+  if (kbus_msg_is_reply(earlier_msg)) {
+    *final_to = earlier_msg->orig_from;
+    *to = earlier_msg->from;
+  } else if (kbus_msg_is_stateful_request(earlier_msg)) {
+    *final_to = earlier_msg->final_to;
+    *to = earlier_msg->to;
+  } else {
+    return -EBADMSG;
+  }
+  return 0;
+}
+
 /*
  * Create a Stateful Request message, based on a previous Reply or Request.
  *
@@ -1087,17 +2123,8 @@ extern int kbus_msg_create_stateful_request(kbus_message_t         **msg,
   uint32_t              to;
   struct kbus_orig_from final_to;
 
-  if (kbus_msg_is_reply(earlier_msg)) {
-    final_to = earlier_msg->orig_from;
-    to = earlier_msg->from;
-  }
-  else if (kbus_msg_is_stateful_request(earlier_msg)) {
-    final_to = earlier_msg->final_to;
-    to = earlier_msg->to;
-  }
-  else {
-    return -EBADMSG;
-  }
+  rv = kbus_msg_stateful_target(earlier_msg, &to, &final_to);
+  if (rv) return rv;
 
   rv = kbus_msg_create(msg, name, name_len, data, data_len, flags);
   if (rv) return rv;
@@ -1134,15 +2161,8 @@ extern int kbus_msg_create_entire_stateful_request(kbus_message_t       **msg,
   uint32_t              to;
   struct kbus_orig_from final_to;
 
-  if (kbus_msg_is_reply(earlier_msg)) {
-    final_to = earlier_msg->orig_from;
-    to = earlier_msg->from;
-  } else if (kbus_msg_is_stateful_request(earlier_msg)) {
-    final_to = earlier_msg->final_to;
-    to = earlier_msg->to;
-  } else {
-    return -EBADMSG;
-  }
+  rv = kbus_msg_stateful_target(earlier_msg, &to, &final_to);
+  if (rv) return rv;
 
   rv = kbus_msg_create_entire(msg, name, name_len, data, data_len, flags);
   if (rv) return rv;
@@ -1201,6 +2221,283 @@ extern void kbus_msg_delete_all(kbus_message_t **msg_p)
   return;
 }
 
+
+// ===========================================================================
+// Building messages without using the heap
+//
+// The kbus_msg_create*() functions each malloc a new message. Code that
+// builds a great many messages can instead build them in a message arena,
+// which is just a piece of memory that messages are allocated from, one
+// after another, until it is reset (typically once per batch of messages).
+// Messages in an arena must *not* be freed with ``kbus_msg_delete()``.
+
+// Messages in an arena are aligned to this many bytes
+#define KBUS_MSG_ARENA_ALIGN    8
+
+static pthread_key_t  kbus_msg_arena_key;
+static pthread_once_t kbus_msg_arena_once = PTHREAD_ONCE_INIT;
+
+static void kbus_msg_arena_free_thread(void *arena)
+{
+  free(arena);
+}
+
+static void kbus_msg_arena_make_key(void)
+{
+  (void) pthread_key_create(&kbus_msg_arena_key, kbus_msg_arena_free_thread);
+}
+
+/*
+ * Allocate `length` bytes from a message arena.
+ *
+ * Returns a pointer to the (zeroed) bytes, or NULL if there is not room.
+ */
+static void *kbus_msg_arena_alloc(kbus_msg_arena_t    *arena,
+                                  size_t               length)
+{
+  size_t  start = (arena->used + KBUS_MSG_ARENA_ALIGN - 1) &
+                  ~(size_t)(KBUS_MSG_ARENA_ALIGN - 1);
+  void   *ptr;
+
+  if (start > arena->size || length > arena->size - start)
+    return NULL;
+
+  ptr = arena->base + start;
+  arena->used = start + length;
+  memset(ptr, 0, length);
+  return ptr;
+}
+
+/*
+ * Set up a message arena, using the memory `buf` of `size` bytes.
+ *
+ * The memory is not copied, and must stay around as long as the arena (and
+ * any messages built in it) are in use. It is up to the caller to free it
+ * afterwards, if necessary.
+ */
+extern void kbus_msg_arena_init(kbus_msg_arena_t      *arena,
+                                void                  *buf,
+                                size_t                 size)
+{
+  arena->base = buf;
+  arena->size = size;
+  arena->used = 0;
+}
+
+/*
+ * Return this thread's own message arena.
+ *
+ * The arena has room for KBUS_MSG_ARENA_THREAD_SIZE bytes of messages. It is
+ * allocated the first time this is called in a thread, and freed when the
+ * thread exits - after that, building messages in it does no heap allocation.
+ *
+ * Returns NULL if the arena could not be allocated.
+ */
+extern kbus_msg_arena_t *kbus_msg_arena_for_thread(void)
+{
+  kbus_msg_arena_t *arena;
+
+  if (pthread_once(&kbus_msg_arena_once, kbus_msg_arena_make_key))
+    return NULL;
+
+  arena = pthread_getspecific(kbus_msg_arena_key);
+  if (arena)
+    return arena;
+
+  arena = malloc(sizeof(*arena) + KBUS_MSG_ARENA_THREAD_SIZE);
+  if (!arena)
+    return NULL;
+
+  kbus_msg_arena_init(arena, arena + 1, KBUS_MSG_ARENA_THREAD_SIZE);
+  if (pthread_setspecific(kbus_msg_arena_key, arena)) {
+    free(arena);
+    return NULL;
+  }
+  return arena;
+}
+
+/*
+ * Reset a message arena, so that its memory can be reused.
+ *
+ * All the messages built in the arena are thus discarded. This would
+ * normally be done when a batch of messages has been sent.
+ */
+extern void kbus_msg_arena_reset(kbus_msg_arena_t *arena)
+{
+  arena->used = 0;
+}
+
+/*
+ * Create a "pointy" message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create()``, except that the
+ * message is built in `arena`, and so must not be freed with
+ * ``kbus_msg_delete()``. It lasts until the arena is reset.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create(kbus_msg_arena_t      *arena,
+                                 kbus_message_t       **msg,
+                                 const char            *name,
+                                 uint32_t               name_len, /* bytes */
+                                 const void            *data,
+                                 uint32_t               data_len, /* bytes */
+                                 uint32_t               flags)
+{
+  kbus_message_t *buf = kbus_msg_arena_alloc(arena, sizeof(*buf));
+
+  *msg = NULL;
+  if (!buf) return -ENOMEM;
+
+  buf->start_guard = KBUS_MSG_START_GUARD;
+  buf->flags    = flags;
+  buf->name_len = name_len;
+  buf->data_len = data_len;
+  buf->name = (char *) name;
+  buf->data = (void *) data;
+  buf->end_guard = KBUS_MSG_END_GUARD;
+
+  *msg = buf;
+  return 0;
+}
+
+/*
+ * Create an "entire" message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_entire()``, except that
+ * the message is built in `arena`, and so must not be freed with
+ * ``kbus_msg_delete()``. It lasts until the arena is reset.
+ *
+ * Since the name and data are copied into the arena, they may be freed (or
+ * reused) as soon as the message has been created.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_entire(kbus_msg_arena_t       *arena,
+                                        kbus_message_t        **msg,
+                                        const char             *name,
+                                        uint32_t                name_len, /* bytes */
+                                        const void             *data,
+                                        uint32_t                data_len, /* bytes */
+                                        uint32_t                flags)
+{
+  int data_index = KBUS_ENTIRE_MSG_DATA_INDEX(name_len);
+  int end_guard_index = KBUS_ENTIRE_MSG_END_GUARD_INDEX(name_len,data_len);
+  kbus_entire_message_t *buf;
+
+  *msg = NULL;
+
+  buf = kbus_msg_arena_alloc(arena, KBUS_ENTIRE_MSG_LEN(name_len, data_len));
+  if (!buf) return -ENOMEM;
+
+  buf->header.start_guard = KBUS_MSG_START_GUARD;
+  buf->header.flags       = flags;
+  buf->header.name_len    = name_len;
+  buf->header.data_len    = data_len;
+  buf->header.end_guard   = KBUS_MSG_END_GUARD;
+
+  memcpy(&buf->rest[0],  name, name_len);
+  if (data_len)
+    memcpy(&buf->rest[data_index], data, data_len);
+
+  buf->rest[end_guard_index] = KBUS_MSG_END_GUARD;
+
+  *msg = (kbus_message_t *) buf;
+  return 0;
+}
+
+/*
+ * Create a "pointy" Request message in a message arena.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_request()``, except
+ * that the message is built in `arena`.
+ *
+ * Returns 0 for success, or -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_request(kbus_msg_arena_t      *arena,
+                                         kbus_message_t       **msg,
+                                         const char            *name,
+                                         uint32_t               name_len, /* bytes */
+                                         const void            *data,
+                                         uint32_t               data_len, /* bytes */
+                                         uint32_t               flags)
+{
+  return kbus_msg_arena_create(arena, msg, name, name_len, data, data_len,
+                               flags | KBUS_BIT_WANT_A_REPLY);
+}
+
+/*
+ * Create a "pointy" Reply message in a message arena, based on a previous
+ * Request.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_reply_to()``, except
+ * that the message is built in `arena`. As there, the new message's name is
+ * that inside `in_reply_to`, so `in_reply_to` should not be freed until the
+ * Reply has been sent.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure -
+ * -EBADMSG if `in_reply_to` does not want us to reply, -ENOMEM if there is not
+ * room in the arena.
+ */
+extern int kbus_msg_arena_create_reply_to(kbus_msg_arena_t         *arena,
+                                          kbus_message_t          **msg,
+                                          const kbus_message_t     *in_reply_to,
+                                          const void               *data,
+                                          uint32_t                  data_len, /* bytes */
+                                          uint32_t                  flags)
+{
+  int rv;
+
+  *msg = NULL;
+  if (!kbus_msg_wants_us_to_reply(in_reply_to))
+    return -EBADMSG;
+
+  rv = kbus_msg_arena_create(arena, msg, kbus_msg_name_ptr(in_reply_to),
+                             in_reply_to->name_len, data, data_len, flags);
+  if (rv) return rv;
+
+  (*msg)->to          = in_reply_to->from;
+  (*msg)->in_reply_to = in_reply_to->id;
+  return 0;
+}
+
+/*
+ * Create a "pointy" Stateful Request message in a message arena, based on a
+ * previous Reply or Request.
+ *
+ * This is identical in behaviour to ``kbus_msg_create_stateful_request()``,
+ * except that the message is built in `arena`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure -
+ * -EBADMSG if `earlier_msg` is neither a Reply nor a Stateful Request,
+ * -ENOMEM if there is not room in the arena.
+ */
+extern int kbus_msg_arena_create_stateful_request(kbus_msg_arena_t       *arena,
+                                                  kbus_message_t        **msg,
+                                                  const kbus_message_t   *earlier_msg,
+                                                  const char             *name,
+                                                  uint32_t                name_len,
+                                                  const void             *data,
+                                                  uint32_t                data_len, /* bytes */
+                                                  uint32_t                flags)
+{
+  int                   rv;
+  uint32_t              to;
+  struct kbus_orig_from final_to;
+
+  *msg = NULL;
+  rv = kbus_msg_stateful_target(earlier_msg, &to, &final_to);
+  if (rv) return rv;
+
+  rv = kbus_msg_arena_create(arena, msg, name, name_len, data, data_len,
+                             flags);
+  if (rv) return rv;
+
+  (*msg)->final_to = final_to;
+  (*msg)->to       = to;
+  return 0;
+}
+
 /*
  * Determine the size of a KBUS message.
  *
@@ -1346,6 +2643,7 @@ extern void kbus_msg_print2(FILE                 *stream,
     if (msg->flags & KBUS_BIT_URGENT) fprintf(stream," URG");
     if (msg->flags & KBUS_BIT_ALL_OR_FAIL) fprintf(stream," aFL");
     if (msg->flags & KBUS_BIT_ALL_OR_WAIT) fprintf(stream," aWT");
+    if (msg->flags & KBUS_BIT_DELIVERY_NOTICE) fprintf(stream," DLV");
   }
 
   if (msg->data_len > 0) {
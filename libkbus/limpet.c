@@ -45,6 +45,7 @@
 #include <netinet/in.h> // for sockaddr_in
 #include <netdb.h>
 #include <poll.h>
+#include <time.h>
 
 #include "libkbus/kbus.h"
 #include "limpet.h"
@@ -65,6 +66,25 @@ struct request_from {
 };
 typedef struct request_from request_from_t;
 
+// A way of reaching another Limpet's KBUS, crossing `hops` Limpet links. Each
+// link is named (in `path`) by the network id of the Limpet at the near end.
+struct limpet_route {
+    uint32_t             dest;      // the Limpet we can reach
+    uint32_t             via;       // the Limpet on our KBUS that told us
+    uint32_t             hops;
+    uint32_t             path[KBUS_LIMPET_MAX_HOPS];
+    struct limpet_route *next;
+};
+typedef struct limpet_route limpet_route_t;
+
+// Another Limpet on our KBUS, which we have heard advertising its routes
+struct limpet_peer {
+    uint32_t             network_id;
+    uint32_t             ksock_id;
+    time_t               heard;     // when we last heard from it
+    struct limpet_peer  *next;
+};
+typedef struct limpet_peer limpet_peer_t;
 
 struct kbus_limpet_context {
     int              socket;             // Our connection to the other limpet
@@ -75,6 +95,10 @@ struct kbus_limpet_context {
     char            *message_name;       // The message name we're filtering on
     replier_for_t   *replier_for;        // Message repliers
     request_from_t  *request_from;       // Requests we're expecting replies for
+    limpet_route_t  *routes;             // Ways to reach other Limpets
+    limpet_peer_t   *peers;              // Other Limpets on our KBUS
+    uint32_t        *advertised;         // The routes we last advertised
+    size_t           advertised_len;     // (in bytes)
     int              verbosity;          // 0=quiet, 1=normal, 2=lots
 };
 
@@ -265,6 +289,398 @@ static void forget_all_request_from(kbus_limpet_context_t *context)
     }
 }
 
+static time_t now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static bool is_routes_msg(kbus_message_t *msg)
+{
+    return msg->name_len == strlen(KBUS_MSG_NAME_LIMPET_ROUTES) &&
+        !strncmp(kbus_msg_name_ptr(msg), KBUS_MSG_NAME_LIMPET_ROUTES,
+                 msg->name_len);
+}
+
+// Is this message addressed to us in particular (as opposed to being a copy
+// for anyone listening)?
+static bool is_addressed_to_us(kbus_limpet_context_t   *context,
+                               kbus_message_t          *msg)
+{
+    if (kbus_msg_is_request(msg))
+        return kbus_msg_wants_us_to_reply(msg);
+    else if (kbus_msg_is_reply(msg))
+        return msg->to == context->ksock_id;
+    else
+        return false;
+}
+
+static void forget_routes_via(kbus_limpet_context_t    *context,
+                              uint32_t                  via)
+{
+    limpet_route_t  **prev = &context->routes;
+
+    while (*prev) {
+        limpet_route_t *this = *prev;
+        if (this->via == via) {
+            *prev = this->next;
+            free(this);
+        } else {
+            prev = &this->next;
+        }
+    }
+}
+
+static void forget_all_routes(kbus_limpet_context_t *context)
+{
+    while (context->routes) {
+        limpet_route_t  *next = context->routes->next;
+        free(context->routes);
+        context->routes = next;
+    }
+    while (context->peers) {
+        limpet_peer_t   *next = context->peers->next;
+        free(context->peers);
+        context->peers = next;
+    }
+    free(context->advertised);
+    context->advertised = NULL;
+    context->advertised_len = 0;
+}
+
+/*
+ * Find the shortest way from our KBUS to Limpet `dest` -- via our own link if
+ * `via_link` is true, or via the other Limpets on our KBUS if it is false.
+ *
+ * Of equally short routes, we prefer the one advertised by the Limpet with the
+ * lowest network id, so that all the Limpets on a KBUS make the same choice.
+ *
+ * Returns NULL if there is no such route. We are a route to ourselves, but we
+ * don't have an entry for that.
+ */
+static limpet_route_t *best_route(kbus_limpet_context_t *context,
+                                  uint32_t               dest,
+                                  bool                   via_link)
+{
+    limpet_route_t  *this;
+    limpet_route_t  *best = NULL;
+
+    for (this = context->routes; this; this = this->next) {
+        if (this->dest != dest || (this->via == context->network_id) != via_link)
+            continue;
+        if (best == NULL || this->hops < best->hops ||
+            (this->hops == best->hops && this->via < best->via))
+            best = this;
+    }
+    return best;
+}
+
+/*
+ * Is Limpet `network_id` on the same KBUS as us?
+ */
+static bool is_on_our_kbus(kbus_limpet_context_t    *context,
+                           uint32_t                  network_id)
+{
+    limpet_route_t  *route;
+
+    if (network_id == context->network_id)
+        return true;
+    route = best_route(context, network_id, false);
+    return route != NULL && route->hops == 0;
+}
+
+/*
+ * Is our link (one of) the shortest ways to Limpet `network_id`?
+ *
+ * If it is, then a message that came from that Limpet will have reached our
+ * KBUS by way of the other side of our link, so the other side has already
+ * seen it.
+ */
+static bool link_leads_to(kbus_limpet_context_t *context,
+                          uint32_t               network_id)
+{
+    limpet_route_t  *ours = best_route(context, network_id, true);
+    limpet_route_t  *theirs = best_route(context, network_id, false);
+
+    if (ours == NULL || is_on_our_kbus(context, network_id))
+        return false;
+    return theirs == NULL || ours->hops <= theirs->hops;
+}
+
+/*
+ * Should a message from Limpet `network_id`, arriving over our link, be
+ * passed on to our KBUS?
+ *
+ * Only if our link is *the* shortest way back to that Limpet -- otherwise
+ * another Limpet on our KBUS will deliver it (or already has), or it has
+ * come round in a loop. If we know no way back at all, we assume that
+ * routes are not being advertised, and just pass the message on.
+ */
+static bool link_is_best_route(kbus_limpet_context_t    *context,
+                               uint32_t                  network_id)
+{
+    limpet_route_t  *ours;
+    limpet_route_t  *theirs;
+
+    if (network_id == 0)
+        return true;
+    if (is_on_our_kbus(context, network_id))
+        return false;
+
+    ours = best_route(context, network_id, true);
+    theirs = best_route(context, network_id, false);
+    if (theirs == NULL)
+        return true;
+    if (ours == NULL)
+        return false;
+    return ours->hops < theirs->hops ||
+        (ours->hops == theirs->hops && context->network_id < theirs->via);
+}
+
+static bool path_contains(const uint32_t   *path,
+                          uint32_t          hops,
+                          uint32_t          network_id)
+{
+    uint32_t    ii;
+    for (ii=0; ii<hops; ii++)
+        if (path[ii] == network_id)
+            return true;
+    return false;
+}
+
+// Order routes by their destination, for qsort()
+static int compare_route_dests(const void *a, const void *b)
+{
+    const limpet_route_t *route_a = *(limpet_route_t * const *)a;
+    const limpet_route_t *route_b = *(limpet_route_t * const *)b;
+
+    if (route_a->dest < route_b->dest)
+        return -1;
+    else if (route_a->dest > route_b->dest)
+        return 1;
+    else
+        return 0;
+}
+
+/*
+ * Work out the routes we should advertise: ourselves, and the best route we
+ * know to each other Limpet.
+ *
+ * The result is an array of (network order) integers::
+ *
+ *    the network id of the advertising Limpet
+ *    the number of routes
+ *    for each route:
+ *        the network id of the Limpet it leads to
+ *        the number of hops
+ *        the path, one network id per hop
+ *
+ * The routes are in order of destination, so that the same routes always
+ * give the same data, however they were learnt.
+ *
+ * `data` is allocated by this function, and `len` is its length in bytes.
+ */
+static int build_routes_data(kbus_limpet_context_t  *context,
+                             uint32_t              **data,
+                             size_t                 *len)
+{
+    limpet_route_t  *this;
+    limpet_route_t **best_routes;
+    uint32_t        *array;
+    size_t           max_words = 2 + 2;     // for ourselves
+    size_t           max_routes = 0;
+    size_t           num_routes = 0;
+    size_t           words;
+    size_t           rr;
+    uint32_t         ii;
+
+    *data = NULL;
+    *len = 0;
+
+    for (this = context->routes; this; this = this->next) {
+        max_words += 2 + this->hops;
+        max_routes ++;
+    }
+
+    array = malloc(max_words * sizeof(uint32_t));
+    if (array == NULL)
+        return -ENOMEM;
+    best_routes = malloc((max_routes ? max_routes : 1) * sizeof(*best_routes));
+    if (best_routes == NULL) {
+        free(array);
+        return -ENOMEM;
+    }
+
+    for (this = context->routes; this; this = this->next) {
+        limpet_route_t  *ours = best_route(context, this->dest, true);
+        limpet_route_t  *theirs = best_route(context, this->dest, false);
+        limpet_route_t  *best;
+
+        if (ours == NULL)
+            best = theirs;
+        else if (theirs == NULL || ours->hops < theirs->hops ||
+                 (ours->hops == theirs->hops && context->network_id < theirs->via))
+            best = ours;
+        else
+            best = theirs;
+
+        // Only say each thing once
+        if (best == this)
+            best_routes[num_routes++] = this;
+    }
+    qsort(best_routes, num_routes, sizeof(*best_routes), compare_route_dests);
+
+    array[0] = htonl(context->network_id);
+    array[1] = htonl(num_routes + 1);
+    words = 2;
+
+    array[words++] = htonl(context->network_id);
+    array[words++] = htonl(0);
+
+    for (rr=0; rr<num_routes; rr++) {
+        this = best_routes[rr];
+        array[words++] = htonl(this->dest);
+        array[words++] = htonl(this->hops);
+        for (ii=0; ii<this->hops; ii++)
+            array[words++] = htonl(this->path[ii]);
+    }
+    free(best_routes);
+
+    *data = array;
+    *len = words * sizeof(uint32_t);
+    return 0;
+}
+
+/*
+ * Learn the routes advertised in a "$.KBUS.LimpetRoutes" message.
+ *
+ * If `from_link` is true, the message came from the other Limpet, otherwise
+ * it came from another Limpet on our KBUS. Either way, it replaces whatever
+ * that Limpet told us before.
+ *
+ * Routes that would pass through us (or, from the other Limpet, come straight
+ * back over our link) are loops, and are ignored.
+ *
+ * Returns 0 if all goes well, or a negative number (``-errno``) for failure.
+ */
+static int learn_routes(kbus_limpet_context_t   *context,
+                        kbus_message_t          *msg,
+                        bool                     from_link)
+{
+    uint32_t        *data = kbus_msg_data_ptr(msg);
+    size_t           words = msg->data_len / sizeof(uint32_t);
+    size_t           next = 2;
+    uint32_t         advertiser;
+    uint32_t         via;
+    uint32_t         count;
+    uint32_t         ii, jj;
+
+    if (data == NULL || words < 2) {
+        if (context->verbosity)
+            printf("Limpet %u: Ignoring %s message that is too short\n",
+                   context->network_id, KBUS_MSG_NAME_LIMPET_ROUTES);
+        return 0;
+    }
+    advertiser = ntohl(data[0]);
+    count = ntohl(data[1]);
+
+    if (from_link) {
+        if (advertiser != context->other_network_id) {
+            if (context->verbosity)
+                printf("Limpet %u: Ignoring routes from %u over link to %u\n",
+                       context->network_id, advertiser,
+                       context->other_network_id);
+            return 0;
+        }
+        via = context->network_id;
+    } else {
+        limpet_peer_t   *peer;
+
+        if (advertiser == context->network_id || advertiser == 0)
+            return 0;
+
+        for (peer = context->peers; peer; peer = peer->next)
+            if (peer->network_id == advertiser)
+                break;
+        if (peer == NULL) {
+            peer = malloc(sizeof(*peer));
+            if (peer == NULL)
+                return -ENOMEM;
+            peer->network_id = advertiser;
+            peer->next = context->peers;
+            context->peers = peer;
+            if (context->verbosity > 1)
+                printf("%u .. Limpet %u is also on our KBUS\n",
+                       context->network_id, advertiser);
+        }
+        peer->ksock_id = msg->from;
+        peer->heard = now_seconds();
+        via = advertiser;
+    }
+
+    forget_routes_via(context, via);
+
+    for (ii=0; ii<count; ii++) {
+        limpet_route_t  *new;
+        uint32_t         dest;
+        uint32_t         hops;
+        uint32_t         offset = from_link ? 1 : 0;
+
+        if (next + 2 > words)
+            break;
+        dest = ntohl(data[next]);
+        hops = ntohl(data[next+1]);
+        next += 2;
+        if (hops > words - next)
+            break;
+
+        if (dest == context->network_id || hops + offset > KBUS_LIMPET_MAX_HOPS) {
+            next += hops;
+            continue;
+        }
+
+        new = malloc(sizeof(*new));
+        if (new == NULL)
+            return -ENOMEM;
+        new->dest = dest;
+        new->via = via;
+        new->hops = hops + offset;
+        // Crossing our own link is the first hop of anything we hear over it
+        if (from_link)
+            new->path[0] = context->network_id;
+        for (jj=0; jj<hops; jj++)
+            new->path[offset+jj] = ntohl(data[next+jj]);
+        next += hops;
+
+        // Don't go through anywhere twice
+        if (path_contains(new->path + offset, hops, context->network_id) ||
+            (from_link && path_contains(new->path + offset, hops,
+                                        context->other_network_id))) {
+            free(new);
+            continue;
+        }
+
+        new->next = context->routes;
+        context->routes = new;
+    }
+
+    if (ii != count && context->verbosity)
+        printf("Limpet %u: %s message from %u is malformed\n",
+               context->network_id, KBUS_MSG_NAME_LIMPET_ROUTES, advertiser);
+
+    if (context->verbosity > 1) {
+        limpet_route_t  *this;
+        for (this = context->routes; this; this = this->next) {
+            if (this->via != via)
+                continue;
+            printf("%u .. %u is %u hop%s away, via %u\n", context->network_id,
+                   this->dest, this->hops, this->hops==1?"":"s", this->via);
+        }
+    }
+    return 0;
+}
+
 /*
  * Given a KBUS message, set the `result` array to its content, suitable for
  * sending across the network
@@ -418,9 +834,11 @@ static int amend_request_from_other_limpet(kbus_limpet_context_t   *context,
     // The Request will have been marked as "to" our Limpet pair (otherwise
     // we would not have received it).
     //
-    // If the "final_to" has a network id that matches ours, then we need to
-    // unset that, as it has clearly now reached its "local" network
-    if (msg->final_to.network_id == context->network_id) {
+    // If the "final_to" has a network id that matches ours (or that of
+    // another Limpet on our KBUS), then we need to unset that, as it has
+    // clearly now reached its "local" network
+    if (msg->final_to.network_id != 0 &&
+        is_on_our_kbus(context, msg->final_to.network_id)) {
         msg->final_to.network_id = 0;       // Do we really need to do this?
         is_local = true;
     }
@@ -557,9 +975,19 @@ static int setup_kbus(kbus_limpet_context_t *context,
         return rv;
     }
 
+    // And for the routes advertised by any other Limpets on our KBUS
+    rv = kbus_ksock_bind(context->ksock, KBUS_MSG_NAME_LIMPET_ROUTES, false);
+    if (rv) {
+        if (context->verbosity)
+            printf("Limpet %u: Error binding as listener for '%s': %d/%s\n",
+                   context->network_id, KBUS_MSG_NAME_LIMPET_ROUTES,
+               -rv, strerror(-rv));
+        return rv;
+    }
+
     // And *ask* for Replier Bind Events to be issued
     rv = kbus_ksock_report_replier_binds(context->ksock, 1);
-    if (rv) {
+    if (rv < 0) {
         if (context->verbosity)
             printf("Limpet %u: Error asking for Replier Bind Events: %d/%s\n",
                    context->network_id, -rv, strerror(-rv));
@@ -657,6 +1085,10 @@ extern int kbus_limpet_new_context(kbus_ksock_t              ksock,
 
     new->replier_for = NULL;
     new->request_from = NULL;
+    new->routes = NULL;
+    new->peers = NULL;
+    new->advertised = NULL;
+    new->advertised_len = 0;
 
     // And set up to do what we want
     rv = setup_kbus(new, message_name);
@@ -699,6 +1131,7 @@ extern void kbus_limpet_free_context(kbus_limpet_context_t  **context)
 
     forget_all_replier_for(*context);
     forget_all_request_from(*context);
+    forget_all_routes(*context);
 
     free(*context);
     *context = NULL;
@@ -720,6 +1153,15 @@ extern int kbus_limpet_amend_msg_from_kbus(kbus_limpet_context_t *context,
     int                  rv;
     char                *name = kbus_msg_name_ptr(msg);
 
+    if (is_routes_msg(msg)) {
+        // Routes are for the Limpets on our KBUS, and are never passed on
+        // as such. Our own advertisements come back to us, as well.
+        if (msg->from == context->ksock_id)
+            return 1;
+        rv = learn_routes(context, msg, false);
+        return rv < 0 ? rv : 1;
+    }
+
     if (!strncmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len)) {
 
         void                            *data = kbus_msg_data_ptr(msg);
@@ -762,6 +1204,17 @@ extern int kbus_limpet_amend_msg_from_kbus(kbus_limpet_context_t *context,
         return 1;
     }
 
+    // More generally, if a message that isn't addressed to us came from a
+    // Limpet that our link is the shortest way to, then it came to our KBUS
+    // from that direction, and the other side of our link has already had it.
+    if (msg->orig_from.network_id != 0 && !is_addressed_to_us(context, msg) &&
+        link_leads_to(context, msg->orig_from.network_id)) {
+        if (context->verbosity > 1)
+            printf("%u .. Ignoring message from %u, which is back over our link\n",
+                   context->network_id, msg->orig_from.network_id);
+        return 1;
+    }
+
     // If KBUS gave us a message with an unset network id, then it is a local
     // message, and we set its network id to our own before we pass it on.
     // This combination of (network id, local id) should then be unique across
@@ -829,17 +1282,46 @@ extern int kbus_limpet_amend_msg_to_kbus(kbus_limpet_context_t  *context,
         printf("\n");
     }
 
+    if (is_routes_msg(msg)) {
+        rv = learn_routes(context, msg, true);
+        return rv < 0 ? rv : 1;
+    }
+
     if (!strncmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len)) {
         // We have to bind/unbind as a Replier in proxy
         uint32_t     is_bind, binder;
         rv = kbus_msg_split_bind_event(msg, &is_bind, &binder, &bind_name);
         if (rv) return rv;
 
+        if (is_bind && !link_is_best_route(context, msg->orig_from.network_id)) {
+            // Another Limpet on our KBUS is nearer, and will be the proxy
+            if (context->verbosity > 1)
+                printf("%u .. Not binding '%s', %u is nearer via another Limpet\n",
+                       context->network_id, bind_name, msg->orig_from.network_id);
+            free(bind_name);
+            return 1;
+        } else if (!is_bind && find_replier_for(context, bind_name) == 0) {
+            // We never were the proxy for it
+            if (context->verbosity > 1)
+                printf("%u .. Not unbinding '%s', we are not bound to it\n",
+                       context->network_id, bind_name);
+            free(bind_name);
+            return 1;
+        }
+
         if (is_bind) {
             if (context->verbosity > 1)
                 printf("%u .. BIND '%s'\n", context->network_id, bind_name);
             rv = kbus_ksock_bind(context->ksock, bind_name, true);
-            if (rv) {
+            if (rv == -EADDRINUSE) {
+                // Something on our KBUS got there first -- maybe a proxy
+                // for the same Replier, by a way that we don't know about
+                if (context->verbosity > 1)
+                    printf("%u .. '%s' already has a Replier on our KBUS\n",
+                           context->network_id, bind_name);
+                free(bind_name);
+                return 1;
+            } else if (rv) {
                 if (context->verbosity)
                     printf("Limpet %u: Error binding as replier to '%s': %u/%s\n",
                            context->network_id, bind_name, -rv, strerror(-rv));
@@ -881,6 +1363,17 @@ extern int kbus_limpet_amend_msg_to_kbus(kbus_limpet_context_t  *context,
         return 1;
     }
 
+    // If a message that isn't addressed to us in particular didn't take the
+    // shortest way here, then it has come round a loop, or another Limpet on
+    // our KBUS is passing it on
+    if (!is_addressed_to_us(context, msg) && !kbus_msg_is_reply(msg) &&
+        !link_is_best_route(context, msg->orig_from.network_id)) {
+        if (context->verbosity > 1)
+            printf("%u .. Ignoring message from %u, which is nearer another way\n",
+                   context->network_id, msg->orig_from.network_id);
+        return 1;
+    }
+
     if (kbus_msg_is_reply(msg))
         rv = amend_reply_from_other_limpet(context, msg);
     else if (kbus_msg_is_stateful_request(msg) &&
@@ -997,6 +1490,104 @@ extern int kbus_limpet_could_not_send_to_kbus_msg(kbus_limpet_context_t  *contex
     return 1;
 }
 
+/*
+ * Create a message advertising the routes this Limpet knows.
+ *
+ * The same message should be sent both to KBUS (for any other Limpets on our
+ * KBUS) and to the other Limpet. Limpets that receive it pass on what it tells
+ * them, but never the message itself. It should be sent when the Limpet
+ * starts, whenever kbus_limpet_routes_changed() says so, and every so often
+ * regardless, so that the other Limpets on our KBUS know we are still there.
+ *
+ * Each route it contains is the network id of a Limpet, and the "path" of
+ * Limpet links that leads to that Limpet's KBUS from ours. Limpets ignore
+ * routes whose path they are on already, so routes do not loop.
+ *
+ * 'msg' is the new message. The caller is responsible for freeing it, with
+ * kbus_msg_delete().
+ *
+ * Returns 0 if all goes well, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_limpet_new_routes_msg(kbus_limpet_context_t  *context,
+                                      kbus_message_t        **msg)
+{
+    int          rv;
+    uint32_t    *data;
+    size_t       len;
+
+    *msg = NULL;
+
+    rv = build_routes_data(context, &data, &len);
+    if (rv) return rv;
+
+    rv = kbus_msg_create_entire(msg, KBUS_MSG_NAME_LIMPET_ROUTES,
+                                strlen(KBUS_MSG_NAME_LIMPET_ROUTES),
+                                data, len, 0);
+    if (rv) {
+        free(data);
+        return rv;
+    }
+
+    free(context->advertised);
+    context->advertised = data;
+    context->advertised_len = len;
+    return 0;
+}
+
+/*
+ * Have the routes this Limpet would advertise changed since it last called
+ * kbus_limpet_new_routes_msg()?
+ *
+ * Returns 1 if they have, 0 if they have not, or a negative number
+ * (``-errno``) for failure.
+ */
+extern int kbus_limpet_routes_changed(kbus_limpet_context_t *context)
+{
+    int          rv;
+    uint32_t    *data;
+    size_t       len;
+
+    rv = build_routes_data(context, &data, &len);
+    if (rv) return rv;
+
+    rv = len != context->advertised_len ||
+        memcmp(data, context->advertised, len) != 0;
+    free(data);
+    return rv;
+}
+
+/*
+ * Forget the routes advertised by any other Limpet on our KBUS that has not
+ * advertised them for more than 'max_age' seconds -- presumably it has gone
+ * away.
+ *
+ * Returns the number of Limpets forgotten.
+ */
+extern int kbus_limpet_expire_routes(kbus_limpet_context_t  *context,
+                                     uint32_t                max_age)
+{
+    limpet_peer_t  **prev = &context->peers;
+    time_t           now = now_seconds();
+    int              count = 0;
+
+    while (*prev) {
+        limpet_peer_t   *this = *prev;
+        if (now - this->heard > max_age) {
+            if (context->verbosity)
+                printf("Limpet %u: Forgetting routes via Limpet %u, not heard"
+                       " from for %ld seconds\n", context->network_id,
+                       this->network_id, (long)(now - this->heard));
+            forget_routes_via(context, this->network_id);
+            *prev = this->next;
+            free(this);
+            count ++;
+        } else {
+            prev = &this->next;
+        }
+    }
+    return count;
+}
+
 
 // Local Variables:
 // tab-width: 8
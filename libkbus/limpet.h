@@ -71,6 +71,17 @@ typedef struct kbus_limpet_context kbus_limpet_context_t;
 #define KBUS_MSG_NOT_SAME_KSOCK         "$.KBUS.Replier.NotSameKsock"
 #define KBUS_MSG_REMOTE_ERROR_PREFIX    "$.KBUS.RemoteError."
 
+/*
+ * The message Limpets use to advertise the routes they know -- see
+ * kbus_limpet_new_routes_msg().
+ */
+#define KBUS_MSG_NAME_LIMPET_ROUTES     "$.KBUS.LimpetRoutes"
+
+/*
+ * The most Limpet links a route may cross.
+ */
+#define KBUS_LIMPET_MAX_HOPS            16
+
 // -------- TEXT AFTER THIS AUTOGENERATED - DO NOT EDIT --------
 // Autogenerated by extract_hdrs.py on 2013-01-16 (Wed 16 Jan 2013) at 11:47
 
@@ -238,6 +249,46 @@ extern int kbus_limpet_could_not_send_to_kbus_msg(kbus_limpet_context_t  *contex
                                                   kbus_message_t      *msg,
                                                   int                  errnum,
                                                   kbus_message_t     **error);
+
+/*
+ * Create a message advertising the routes this Limpet knows.
+ *
+ * The same message should be sent both to KBUS (for any other Limpets on our
+ * KBUS) and to the other Limpet. Limpets that receive it pass on what it tells
+ * them, but never the message itself. It should be sent when the Limpet
+ * starts, whenever kbus_limpet_routes_changed() says so, and every so often
+ * regardless, so that the other Limpets on our KBUS know we are still there.
+ *
+ * Each route it contains is the network id of a Limpet, and the "path" of
+ * Limpet links that leads to that Limpet's KBUS from ours. Limpets ignore
+ * routes whose path they are on already, so routes do not loop.
+ *
+ * 'msg' is the new message. The caller is responsible for freeing it, with
+ * kbus_msg_delete().
+ *
+ * Returns 0 if all goes well, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_limpet_new_routes_msg(kbus_limpet_context_t  *context,
+                                      kbus_message_t        **msg);
+
+/*
+ * Have the routes this Limpet would advertise changed since it last called
+ * kbus_limpet_new_routes_msg()?
+ *
+ * Returns 1 if they have, 0 if they have not, or a negative number
+ * (``-errno``) for failure.
+ */
+extern int kbus_limpet_routes_changed(kbus_limpet_context_t *context);
+
+/*
+ * Forget the routes advertised by any other Limpet on our KBUS that has not
+ * advertised them for more than 'max_age' seconds -- presumably it has gone
+ * away.
+ *
+ * Returns the number of Limpets forgotten.
+ */
+extern int kbus_limpet_expire_routes(kbus_limpet_context_t  *context,
+                                     uint32_t                max_age);
 // -------- TEXT BEFORE THIS AUTOGENERATED - DO NOT EDIT --------
 
 #ifdef __cplusplus
@@ -0,0 +1,1349 @@
+/*
+ * An in-process KBUS, for Ksocks opened with kbus_ksock_open_loopback().
+ *
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * A loopback bus does, within a single process, what the KBUS kernel module
+ * does for a KBUS device. It is reached through the same system calls (well,
+ * their equivalents in loopback.h), so that all of libkbus works the same on
+ * a loopback Ksock as on a real one.
+ *
+ * Each loopback Ksock is one end of a Unix socket pair, so that it can be
+ * polled like a real Ksock. It is readable whenever there are messages in
+ * its queue, because the bus has written a byte to it from the other end.
+ * Whilst a send is blocked (after -EAGAIN) it is not writable, because the
+ * bus has filled the other end from it. Since these are different buffers,
+ * a blocked send never makes the Ksock look readable. The bus keeps the
+ * other end, and its own duplicate of the Ksock's end, so that if the
+ * Ksock's file descriptor is closed behind our back (and reused), we never
+ * touch whatever now has that file descriptor.
+ *
+ * A message is only copied once, when it is sent. Everyone it is sent to
+ * then shares that copy, until they read it.
+ *
+ * Each bus has a single lock, like the kernel module's device mutex.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "libkbus/kbus.h"
+#include "loopback.h"
+
+// The same defaults as the kernel module, except that a loopback bus allows
+// larger messages
+#define KBUS_LB_DEF_MAX_MESSAGES        100
+#define KBUS_LB_DEF_MAX_MESSAGE_SIZE    1024
+#define KBUS_LB_ABS_MAX_MESSAGE_SIZE    (1024 * 1024)
+
+// How much we write at a time when filling the other end of a Ksock's socket
+// pair (its send buffer is as small as it can be, so this is little)
+#define KBUS_LB_FILL_CHUNK              4096
+
+// The smallest table of loopback Ksocks (it doubles as needed)
+#define KBUS_LB_MIN_TABLE               64
+
+// A message, shared by everyone it has been sent to
+struct kbus_lb_msg {
+  unsigned               refs;
+  size_t                 length;        // of the "entire" message
+  kbus_message_t        *msg;           // which follows this structure
+};
+typedef struct kbus_lb_msg kbus_lb_msg_t;
+
+struct kbus_lb_binding {
+  struct kbus_lb_ksock          *ksock;
+  bool                           is_replier;
+  uint32_t                       name_len;
+  char                          *name;
+  struct kbus_lb_binding        *next;
+};
+typedef struct kbus_lb_binding kbus_lb_binding_t;
+
+// A message in a Ksock's queue
+struct kbus_lb_item {
+  kbus_lb_msg_t                 *lbm;
+  kbus_lb_binding_t             *binding;       // NULL for Replies
+  bool                           for_replier;
+  struct kbus_lb_item           *next;
+};
+typedef struct kbus_lb_item kbus_lb_item_t;
+
+// A Request we are expecting a Reply to, or must Reply to
+struct kbus_lb_request {
+  kbus_msg_id_t                  id;
+  uint32_t                       from;
+  struct kbus_lb_request        *next;
+};
+typedef struct kbus_lb_request kbus_lb_request_t;
+
+struct kbus_lb_bus;
+
+struct kbus_lb_ksock {
+  struct kbus_lb_bus    *bus;
+  int                    fd;            // our duplicate of its socket
+  int                    peer;          // the other end of its socket pair
+  bool                   readable;      // we wrote a byte to fd from peer
+  bool                   unwritable;    // we filled peer from fd
+  uint32_t               id;
+  bool                   can_read;
+  bool                   can_write;
+
+  kbus_lb_item_t        *queue;         // messages waiting to be read
+  kbus_lb_item_t        *queue_tail;
+  uint32_t               num_messages;
+  uint32_t               max_messages;
+  kbus_msg_id_t          just_pushed;   // for "only once"
+
+  kbus_lb_item_t        *reading;       // the message being read
+  size_t                 read_pos;
+  kbus_message_t         read_hdr;      // its header, as we deliver it
+
+  uint8_t               *wbuf;          // the message being written
+  size_t                 wlen;
+  size_t                 wsize;
+  kbus_lb_msg_t         *sending;       // the message being sent, after
+                                        // -EAGAIN
+  kbus_msg_id_t          last_sent;
+
+  kbus_lb_request_t     *awaiting;      // Requests we want Replies to
+  uint32_t               num_awaiting;
+  kbus_lb_request_t     *unreplied;     // Requests we should Reply to
+  uint32_t               num_unreplied;
+
+  bool                   only_once;
+  bool                   auto_send;
+  bool                   verbose;
+
+  struct kbus_lb_ksock  *next;
+};
+typedef struct kbus_lb_ksock kbus_lb_ksock_t;
+
+struct kbus_lb_bus {
+  uint32_t               number;
+  pthread_mutex_t        lock;          // protects everything on the bus
+  uint32_t               last_ksock_id;
+  uint32_t               last_serial_num;
+  uint32_t               max_message_size;
+  kbus_lb_ksock_t       *ksocks;
+  kbus_lb_binding_t     *bindings;
+  kbus_lb_binding_t    **listeners;     // reused by each send
+  size_t                 listeners_size;
+  bool                   maybe_blocked_sends;   // is it worth retrying them?
+  struct kbus_lb_bus    *next;
+};
+typedef struct kbus_lb_bus kbus_lb_bus_t;
+
+typedef struct kbus_lb_table kbus_lb_table_t;
+kbus_lb_table_t *kbus_lb_table;
+
+// The buses in use, and changes to the table above, are protected by this
+static kbus_lb_bus_t   *kbus_lb_buses;
+static pthread_mutex_t  kbus_lb_buses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool kbus_lb_is_reply(const kbus_message_t *msg)
+{
+  return msg->in_reply_to.network_id != 0 || msg->in_reply_to.serial_num != 0;
+}
+
+static bool kbus_lb_same_id(const kbus_msg_id_t *id1,
+                            const kbus_msg_id_t *id2)
+{
+  return id1->network_id == id2->network_id &&
+         id1->serial_num == id2->serial_num;
+}
+
+/*
+ * Is this message name (or wildcard) invalid? The same rules as KBUS.
+ */
+static bool kbus_lb_bad_name(const char *name, size_t name_len)
+{
+  size_t ii;
+  size_t dot_at = 1;
+
+  if (name == NULL || name_len < 3 || name[0] != '$' || name[1] != '.')
+    return true;
+
+  if (name[name_len - 2] == '.' &&
+      (name[name_len - 1] == '*' || name[name_len - 1] == '%'))
+    name_len -= 2;
+
+  if (name[name_len - 1] == '.')
+    return true;
+
+  for (ii = 2; ii < name_len; ii++) {
+    if (name[ii] == '.') {
+      if (dot_at == ii - 1)
+        return true;
+      dot_at = ii;
+    } else if (!isalnum((unsigned char)name[ii])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool kbus_lb_wildcarded(const char *name, size_t name_len)
+{
+  return name[name_len - 1] == '*' || name[name_len - 1] == '%';
+}
+
+/*
+ * Does this message name match the given binding? The same rules as KBUS.
+ */
+static bool kbus_lb_name_matches(const char                    *name,
+                                 size_t                         name_len,
+                                 const kbus_lb_binding_t       *binding)
+{
+  const char *other = binding->name;
+  size_t      other_len = binding->name_len;
+  char        last = other[other_len - 1];
+
+  if (last == '*' || last == '%') {
+    if (name_len < other_len || memcmp(other, name, other_len - 1))
+      return false;
+    if (last == '*')
+      return true;
+    return memchr(name + other_len - 1, '.', name_len - other_len + 1) == NULL;
+  } else {
+    return name_len == other_len && !memcmp(name, other, name_len);
+  }
+}
+
+// ===========================================================================
+// Messages and message queues
+
+static kbus_lb_msg_t *kbus_lb_new_msg(const char       *name,
+                                      uint32_t          name_len,
+                                      const void       *data,
+                                      uint32_t          data_len)
+{
+  size_t                 length = KBUS_ENTIRE_MSG_LEN(name_len, data_len);
+  kbus_lb_msg_t         *lbm;
+  kbus_entire_message_t *buf;
+
+  lbm = malloc(sizeof(*lbm) + length);
+  if (!lbm) return NULL;
+
+  buf = (kbus_entire_message_t *)(lbm + 1);
+  memset(buf, 0, length);
+  buf->header.start_guard = KBUS_MSG_START_GUARD;
+  buf->header.name_len    = name_len;
+  buf->header.data_len    = data_len;
+  buf->header.end_guard   = KBUS_MSG_END_GUARD;
+  memcpy(&buf->rest[0], name, name_len);
+  if (data_len)
+    memcpy(&buf->rest[KBUS_ENTIRE_MSG_DATA_INDEX(name_len)], data, data_len);
+  buf->rest[KBUS_ENTIRE_MSG_END_GUARD_INDEX(name_len, data_len)] =
+      KBUS_MSG_END_GUARD;
+
+  lbm->refs = 1;
+  lbm->length = length;
+  lbm->msg = (kbus_message_t *)buf;
+  return lbm;
+}
+
+static void kbus_lb_put_msg(kbus_lb_msg_t *lbm)
+{
+  if (lbm && --lbm->refs == 0)
+    free(lbm);
+}
+
+static void kbus_lb_free_item(kbus_lb_item_t *item)
+{
+  kbus_lb_put_msg(item->lbm);
+  free(item);
+}
+
+/*
+ * Make a Ksock's socket readable if it has messages, and writable unless its
+ * send is blocked.
+ */
+static void kbus_lb_set_ready(kbus_lb_ksock_t *ks)
+{
+  static const uint8_t  zeroes[KBUS_LB_FILL_CHUNK];
+  uint8_t               junk[KBUS_LB_FILL_CHUNK];
+  bool                  readable = ks->num_messages != 0;
+  bool                  unwritable = ks->sending != NULL;
+
+  if (readable != ks->readable) {
+    if (readable)
+      (void) !write(ks->peer, zeroes, 1);
+    else
+      (void) !read(ks->fd, junk, 1);
+    ks->readable = readable;
+  }
+
+  if (unwritable != ks->unwritable) {
+    if (unwritable)
+      while (write(ks->fd, zeroes, sizeof(zeroes)) > 0)
+        ;
+    else
+      while (read(ks->peer, junk, sizeof(junk)) > 0)
+        ;
+    ks->unwritable = unwritable;
+  }
+}
+
+static bool kbus_lb_queue_is_full(kbus_lb_ksock_t *ks, bool is_reply)
+{
+  // Room is kept for the Replies to our own Requests
+  uint32_t accounted_for = ks->num_messages + ks->num_awaiting;
+
+  if (is_reply)
+    accounted_for --;
+  return accounted_for >= ks->max_messages;
+}
+
+static int kbus_lb_push(kbus_lb_ksock_t        *ks,
+                        kbus_lb_msg_t          *lbm,
+                        kbus_lb_binding_t      *binding,
+                        bool                    for_replier)
+{
+  kbus_lb_item_t *item = malloc(sizeof(*item));
+
+  if (!item) return -ENOMEM;
+
+  item->lbm = lbm;
+  item->binding = binding;
+  item->for_replier = for_replier;
+  item->next = NULL;
+  lbm->refs ++;
+
+  if (ks->queue_tail)
+    ks->queue_tail->next = item;
+  else
+    ks->queue = item;
+  ks->queue_tail = item;
+  ks->num_messages ++;
+  ks->just_pushed = lbm->msg->id;
+
+  kbus_lb_set_ready(ks);
+  return 0;
+}
+
+/*
+ * A message has been taken out of a Ksock's queue.
+ */
+static void kbus_lb_dequeued(kbus_lb_ksock_t *ks)
+{
+  ks->num_messages --;
+  kbus_lb_set_ready(ks);
+
+  // Which may have made room for a blocked send
+  ks->bus->maybe_blocked_sends = true;
+}
+
+static int kbus_lb_remember_request(kbus_lb_request_t         **list,
+                                    const kbus_msg_id_t        *id,
+                                    uint32_t                    from)
+{
+  kbus_lb_request_t *new = malloc(sizeof(*new));
+
+  if (!new) return -ENOMEM;
+  new->id = *id;
+  new->from = from;
+  new->next = *list;
+  *list = new;
+  return 0;
+}
+
+/*
+ * Forget a Request. Returns true if it was there to forget.
+ */
+static bool kbus_lb_forget_request(kbus_lb_request_t       **list,
+                                   const kbus_msg_id_t      *id)
+{
+  kbus_lb_request_t **prev;
+
+  for (prev = list; *prev; prev = &(*prev)->next) {
+    kbus_lb_request_t *this = *prev;
+    if (kbus_lb_same_id(&this->id, id)) {
+      *prev = this->next;
+      free(this);
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Is this Request in the list?
+ */
+static bool kbus_lb_has_request(const kbus_lb_request_t        *list,
+                                const kbus_msg_id_t            *id)
+{
+  for (; list; list = list->next)
+    if (kbus_lb_same_id(&list->id, id))
+      return true;
+  return false;
+}
+
+static kbus_lb_ksock_t *kbus_lb_find_ksock(kbus_lb_bus_t       *bus,
+                                           uint32_t             id)
+{
+  kbus_lb_ksock_t *ks;
+
+  for (ks = bus->ksocks; ks; ks = ks->next)
+    if (ks->id == id)
+      return ks;
+  return NULL;
+}
+
+/*
+ * Send a synthetic Reply (saying why a Request won't get a real one) to the
+ * sender of the Request.
+ */
+static void kbus_lb_push_synthetic(kbus_lb_bus_t       *bus,
+                                   uint32_t             from,
+                                   uint32_t             to,
+                                   kbus_msg_id_t        in_reply_to,
+                                   const char          *name)
+{
+  kbus_lb_ksock_t *ks = kbus_lb_find_ksock(bus, to);
+  kbus_lb_msg_t   *lbm;
+
+  if (ks == NULL)
+    return;
+
+  lbm = kbus_lb_new_msg(name, strlen(name), NULL, 0);
+  if (lbm == NULL)
+    return;
+
+  lbm->msg->from = from;
+  lbm->msg->to = to;
+  lbm->msg->in_reply_to = in_reply_to;
+  lbm->msg->flags = KBUS_BIT_SYNTHETIC;
+  lbm->msg->id.serial_num = ++ bus->last_serial_num;
+
+  if (kbus_lb_forget_request(&ks->awaiting, &in_reply_to))
+    ks->num_awaiting --;
+  (void) kbus_lb_push(ks, lbm, NULL, false);
+  kbus_lb_put_msg(lbm);
+}
+
+/*
+ * Find the Replier bound to exactly this name, if any.
+ */
+static kbus_lb_binding_t *kbus_lb_find_replier(kbus_lb_bus_t   *bus,
+                                               const char      *name,
+                                               uint32_t         name_len)
+{
+  kbus_lb_binding_t *binding;
+
+  for (binding = bus->bindings; binding; binding = binding->next)
+    if (binding->is_replier && binding->name_len == name_len &&
+        !memcmp(binding->name, name, name_len))
+      return binding;
+  return NULL;
+}
+
+// ===========================================================================
+// Sending
+
+/*
+ * Find who should get a message. The Listeners are put into bus->listeners.
+ *
+ * Returns the number of Listeners, or -ENOMEM.
+ */
+static int kbus_lb_find_listeners(kbus_lb_bus_t                *bus,
+                                  const kbus_message_t         *msg,
+                                  kbus_lb_binding_t           **replier)
+{
+  const char        *name = kbus_msg_name_ptr(msg);
+  kbus_lb_binding_t *binding;
+  int                replier_type = 0;
+  int                count = 0;
+
+  *replier = NULL;
+
+  for (binding = bus->bindings; binding; binding = binding->next) {
+    if (!kbus_lb_name_matches(name, msg->name_len, binding))
+      continue;
+
+    if (binding->is_replier) {
+      // The most specific Replier wins
+      char last = binding->name[binding->name_len - 1];
+      int  type = last == '*' ? 1 : last == '%' ? 2 : 3;
+      if (type > replier_type) {
+        *replier = binding;
+        replier_type = type;
+      }
+      continue;
+    }
+
+    if (count == bus->listeners_size) {
+      size_t              new_size = bus->listeners_size ? 2 * count : 8;
+      kbus_lb_binding_t **new = realloc(bus->listeners,
+                                        new_size * sizeof(*new));
+      if (!new) return -ENOMEM;
+      bus->listeners = new;
+      bus->listeners_size = new_size;
+    }
+    bus->listeners[count ++] = binding;
+  }
+  return count;
+}
+
+/*
+ * Deliver a message to everyone who should get it, following the same rules
+ * (and returning the same errors) as KBUS.
+ */
+static int kbus_lb_route(kbus_lb_ksock_t       *sender,
+                         kbus_lb_msg_t         *lbm)
+{
+  kbus_lb_bus_t         *bus = sender->bus;
+  kbus_message_t        *msg = lbm->msg;
+  kbus_lb_binding_t     *replier;
+  kbus_lb_ksock_t       *reply_to = NULL;
+  bool                   all_or_fail = msg->flags & KBUS_BIT_ALL_OR_FAIL;
+  bool                   all_or_wait = msg->flags & KBUS_BIT_ALL_OR_WAIT;
+  int                    num_listeners;
+  int                    ii;
+  int                    rv;
+
+  num_listeners = kbus_lb_find_listeners(bus, msg, &replier);
+  if (num_listeners < 0)
+    return num_listeners;
+
+  if ((msg->flags & KBUS_BIT_WANT_A_REPLY) && replier == NULL)
+    return -EADDRNOTAVAIL;
+
+  // Check that everyone *can* receive it
+
+  if (kbus_lb_is_reply(msg)) {
+    reply_to = kbus_lb_find_ksock(bus, msg->to);
+    if (reply_to == NULL)
+      return -EADDRNOTAVAIL;
+    if (!kbus_lb_has_request(reply_to->awaiting, &msg->in_reply_to))
+      return -ECONNREFUSED;
+    // (which means there is room kept for it)
+    if (kbus_lb_queue_is_full(reply_to, true))
+      return all_or_wait ? -EAGAIN : -EBUSY;
+  }
+
+  // Repliers only get Requests
+  if (replier && !(msg->flags & KBUS_BIT_WANT_A_REPLY))
+    replier = NULL;
+
+  if (replier) {
+    if (msg->to && replier->ksock->id != msg->to)
+      return -EPIPE;
+    if (kbus_lb_queue_is_full(replier->ksock, false))
+      return all_or_wait ? -EAGAIN : -EBUSY;
+  }
+
+  for (ii = 0; ii < num_listeners; ii++) {
+    if (kbus_lb_queue_is_full(bus->listeners[ii]->ksock, false)) {
+      if (all_or_wait)
+        return -EAGAIN;
+      else if (all_or_fail)
+        return -EBUSY;
+      else
+        bus->listeners[ii] = NULL;
+    }
+  }
+
+  // And actually deliver it
+
+  if (reply_to) {
+    rv = kbus_lb_push(reply_to, lbm, NULL, false);
+    if (rv) return rv;
+    // Only now is the Reply no longer awaited
+    if (kbus_lb_forget_request(&reply_to->awaiting, &msg->in_reply_to))
+      reply_to->num_awaiting --;
+    if (kbus_lb_forget_request(&sender->unreplied, &msg->in_reply_to))
+      sender->num_unreplied --;
+  }
+
+  if (replier) {
+    rv = kbus_lb_push(replier->ksock, lbm, replier, true);
+    if (rv) return rv;
+    rv = kbus_lb_remember_request(&sender->awaiting, &msg->id, 0);
+    if (rv) return rv;
+    sender->num_awaiting ++;
+  }
+
+  for (ii = 0; ii < num_listeners; ii++) {
+    kbus_lb_ksock_t *ks;
+
+    if (bus->listeners[ii] == NULL)
+      continue;
+    ks = bus->listeners[ii]->ksock;
+    if (ks->only_once && kbus_lb_same_id(&ks->just_pushed, &msg->id))
+      continue;
+    rv = kbus_lb_push(ks, lbm, bus->listeners[ii], false);
+    if (rv) return rv;
+  }
+  return 0;
+}
+
+/*
+ * Check the message that has been written, and make our own copy of it.
+ */
+static int kbus_lb_take_msg(kbus_lb_ksock_t    *ks,
+                            kbus_lb_msg_t     **lbm)
+{
+  kbus_message_t *hdr = (kbus_message_t *)ks->wbuf;
+  const char     *name;
+  const void     *data;
+
+  *lbm = NULL;
+
+  if (ks->wlen < sizeof(*hdr))
+    return -EINVAL;
+  if (hdr->start_guard != KBUS_MSG_START_GUARD ||
+      hdr->end_guard != KBUS_MSG_END_GUARD)
+    return -EINVAL;
+  if (hdr->name_len == 0)
+    return -EINVAL;
+  if (hdr->name_len > KBUS_MAX_NAME_LEN)
+    return -ENAMETOOLONG;
+
+  if (hdr->name == NULL) {
+    if (hdr->data != NULL)
+      return -EINVAL;
+    if (ks->wlen < KBUS_ENTIRE_MSG_LEN(hdr->name_len, hdr->data_len))
+      return -EINVAL;
+  } else if (hdr->data == NULL && hdr->data_len != 0) {
+    return -EINVAL;
+  }
+  if (hdr->data_len == 0 && hdr->data != NULL)
+    return -EINVAL;
+
+  if ((hdr->flags & KBUS_BIT_ALL_OR_WAIT) &&
+      (hdr->flags & KBUS_BIT_ALL_OR_FAIL))
+    return -EINVAL;
+
+  if (KBUS_ENTIRE_MSG_LEN(hdr->name_len, hdr->data_len) >
+      ks->bus->max_message_size)
+    return -EMSGSIZE;
+
+  // Pointy or not, the name and data are in our address space
+  name = kbus_msg_name_ptr(hdr);
+  data = kbus_msg_data_ptr(hdr);
+  if (kbus_lb_bad_name(name, hdr->name_len) ||
+      kbus_lb_wildcarded(name, hdr->name_len))
+    return -EBADMSG;
+
+  *lbm = kbus_lb_new_msg(name, hdr->name_len, data, hdr->data_len);
+  if (*lbm == NULL)
+    return -ENOMEM;
+
+  (*lbm)->msg->id          = hdr->id;
+  (*lbm)->msg->in_reply_to = hdr->in_reply_to;
+  (*lbm)->msg->to          = hdr->to;
+  (*lbm)->msg->orig_from   = hdr->orig_from;
+  (*lbm)->msg->final_to    = hdr->final_to;
+  // Users may not send synthetic messages, even ones they received earlier
+  (*lbm)->msg->flags       = hdr->flags & ~KBUS_BIT_SYNTHETIC;
+  return 0;
+}
+
+static void kbus_lb_discard(kbus_lb_ksock_t *ks)
+{
+  ks->wlen = 0;
+  if (ks->sending) {
+    kbus_lb_put_msg(ks->sending);
+    ks->sending = NULL;
+    kbus_lb_set_ready(ks);
+  }
+}
+
+static int kbus_lb_send(kbus_lb_ksock_t        *ks,
+                        kbus_msg_id_t          *msg_id)
+{
+  kbus_lb_msg_t *lbm = ks->sending;
+  int            rv;
+
+  if (lbm == NULL) {
+    if (ks->wlen == 0)
+      return -ENOMSG;
+
+    rv = kbus_lb_take_msg(ks, &lbm);
+    if (rv) {
+      kbus_lb_discard(ks);
+      return rv;
+    }
+
+    // A Request needs room for its Reply
+    if ((lbm->msg->flags & KBUS_BIT_WANT_A_REPLY) &&
+        kbus_lb_queue_is_full(ks, false)) {
+      kbus_lb_put_msg(lbm);
+      kbus_lb_discard(ks);
+      return -ENOLCK;
+    }
+
+    lbm->msg->from = ks->id;
+    if (lbm->msg->id.network_id == 0)
+      lbm->msg->id.serial_num = ++ ks->bus->last_serial_num;
+  }
+  ks->last_sent = lbm->msg->id;
+
+  rv = kbus_lb_route(ks, lbm);
+
+  // After -EAGAIN, we keep the message, so that sending can be retried (by
+  // us, or when someone makes room for it), and we aren't writable until then
+  if (rv == -EAGAIN) {
+    if (ks->sending == NULL) {
+      ks->sending = lbm;
+      kbus_lb_set_ready(ks);
+    }
+  } else {
+    if (ks->sending == NULL)
+      kbus_lb_put_msg(lbm);
+    kbus_lb_discard(ks);
+  }
+  if ((rv == 0 || rv == -EAGAIN) && msg_id)
+    *msg_id = ks->last_sent;
+  return rv;
+}
+
+/*
+ * Try the blocked sends again, now that there may be room for them.
+ *
+ * As in KBUS, a send that fails now can't be reported to its sender, except
+ * that a Request gets a synthetic Reply.
+ */
+static void kbus_lb_retry_blocked_sends(kbus_lb_bus_t *bus)
+{
+  kbus_lb_ksock_t *ks;
+
+  if (!bus->maybe_blocked_sends)
+    return;
+  bus->maybe_blocked_sends = false;
+
+  for (ks = bus->ksocks; ks; ks = ks->next) {
+    kbus_message_t *msg;
+    int             rv;
+
+    if (ks->sending == NULL)
+      continue;
+
+    msg = ks->sending->msg;
+    rv = kbus_lb_route(ks, ks->sending);
+    if (rv == -EAGAIN)
+      continue;
+    if (rv == -EADDRNOTAVAIL)
+      kbus_lb_push_synthetic(bus, 0, ks->id, msg->id,
+                             KBUS_MSG_NAME_REPLIER_DISAPPEARED);
+    else if (rv && (msg->flags & KBUS_BIT_WANT_A_REPLY))
+      kbus_lb_push_synthetic(bus, 0, ks->id, msg->id,
+                             KBUS_MSG_NAME_ERROR_SENDING);
+    kbus_lb_discard(ks);
+  }
+}
+
+// ===========================================================================
+// Binding
+
+static int kbus_lb_bind(kbus_lb_ksock_t                *ks,
+                        const kbus_bind_request_t      *request)
+{
+  kbus_lb_bus_t     *bus = ks->bus;
+  kbus_lb_binding_t *new;
+  kbus_lb_binding_t **last;
+
+  if (request->name_len == 0 || request->name_len > KBUS_MAX_NAME_LEN)
+    return -EBADMSG;
+  if (kbus_lb_bad_name(request->name, request->name_len))
+    return -EBADMSG;
+
+  if (request->is_replier &&
+      kbus_lb_find_replier(bus, request->name, request->name_len))
+    return -EADDRINUSE;
+
+  new = malloc(sizeof(*new) + request->name_len + 1);
+  if (!new) return -ENOMEM;
+
+  new->ksock = ks;
+  new->is_replier = request->is_replier;
+  new->name_len = request->name_len;
+  new->name = (char *)(new + 1);
+  memcpy(new->name, request->name, request->name_len);
+  new->name[request->name_len] = '\0';
+  new->next = NULL;
+
+  // Keep bindings in the order they were made
+  for (last = &bus->bindings; *last; last = &(*last)->next)
+    ;
+  *last = new;
+  return 0;
+}
+
+/*
+ * Take the messages that arrived because of `binding` out of its Ksock's
+ * queue. Requests that it should have replied to get a synthetic Reply.
+ */
+static void kbus_lb_forget_queued(kbus_lb_binding_t    *binding,
+                                  const char           *why)
+{
+  kbus_lb_ksock_t  *ks = binding->ksock;
+  kbus_lb_item_t  **prev = &ks->queue;
+  kbus_lb_item_t   *last = NULL;
+
+  while (*prev) {
+    kbus_lb_item_t *item = *prev;
+    kbus_message_t *msg = item->lbm->msg;
+
+    if (item->binding != binding) {
+      last = item;
+      prev = &item->next;
+      continue;
+    }
+    *prev = item->next;
+    kbus_lb_dequeued(ks);
+    if (item->for_replier && msg->from != ks->id)
+      kbus_lb_push_synthetic(ks->bus, ks->id, msg->from, msg->id, why);
+    kbus_lb_free_item(item);
+  }
+  ks->queue_tail = last;
+}
+
+static int kbus_lb_unbind(kbus_lb_ksock_t              *ks,
+                          const kbus_bind_request_t    *request)
+{
+  kbus_lb_binding_t **prev;
+
+  for (prev = &ks->bus->bindings; *prev; prev = &(*prev)->next) {
+    kbus_lb_binding_t *binding = *prev;
+    if (binding->ksock == ks &&
+        binding->is_replier == (request->is_replier != 0) &&
+        binding->name_len == request->name_len &&
+        !memcmp(binding->name, request->name, request->name_len)) {
+      *prev = binding->next;
+      kbus_lb_forget_queued(binding, KBUS_MSG_NAME_REPLIER_UNBOUND);
+      // A blocked Request may now have no Replier
+      if (binding->is_replier)
+        ks->bus->maybe_blocked_sends = true;
+      free(binding);
+      return 0;
+    }
+  }
+  return -EINVAL;
+}
+
+// ===========================================================================
+// Reading
+
+static void kbus_lb_finish_reading(kbus_lb_ksock_t *ks)
+{
+  if (ks->reading) {
+    kbus_lb_free_item(ks->reading);
+    ks->reading = NULL;
+  }
+}
+
+static int kbus_lb_next_msg(kbus_lb_ksock_t    *ks,
+                            uint32_t           *msg_len)
+{
+  kbus_lb_item_t *item;
+
+  kbus_lb_finish_reading(ks);
+
+  item = ks->queue;
+  if (item == NULL) {
+    *msg_len = 0;
+    return 0;
+  }
+  ks->queue = item->next;
+  if (ks->queue == NULL)
+    ks->queue_tail = NULL;
+  kbus_lb_dequeued(ks);
+
+  // Only the Replier is asked to reply
+  ks->read_hdr = *item->lbm->msg;
+  if (item->for_replier)
+    ks->read_hdr.flags |= KBUS_BIT_WANT_YOU_TO_REPLY;
+  else
+    ks->read_hdr.flags &= ~KBUS_BIT_WANT_YOU_TO_REPLY;
+
+  if (item->for_replier) {
+    int rv = kbus_lb_remember_request(&ks->unreplied, &ks->read_hdr.id,
+                                      ks->read_hdr.from);
+    if (rv) {
+      kbus_lb_free_item(item);
+      return rv;
+    }
+    ks->num_unreplied ++;
+  }
+
+  ks->reading = item;
+  ks->read_pos = 0;
+  *msg_len = item->lbm->length;
+  return 1;
+}
+
+// ===========================================================================
+// The "system calls"
+
+static kbus_lb_ksock_t *kbus_lb_lock_ksock(kbus_ksock_t ksock)
+{
+  kbus_lb_ksock_t *ks = kbus_lb_find(ksock);
+  pthread_mutex_lock(&ks->bus->lock);
+  return ks;
+}
+
+static void kbus_lb_unlock_ksock(kbus_lb_ksock_t *ks)
+{
+  kbus_lb_retry_blocked_sends(ks->bus);
+  pthread_mutex_unlock(&ks->bus->lock);
+}
+
+/*
+ * Handle one of the 0/1/0xFFFFFFFF "set or query" ioctls.
+ */
+static int kbus_lb_set_flag(bool *flag, uint32_t *arg)
+{
+  uint32_t was = *flag;
+
+  switch (*arg) {
+  case 0:
+  case 1:
+    *flag = *arg;
+    break;
+  case 0xFFFFFFFF:
+    break;
+  default:
+    return -EINVAL;
+  }
+  *arg = was;
+  return 0;
+}
+
+/*
+ * Make sure the table of loopback Ksocks has room for `fd`.
+ * Call with kbus_lb_buses_lock held.
+ */
+static int kbus_lb_grow(int fd)
+{
+  kbus_lb_table_t *old = kbus_lb_table;
+  kbus_lb_table_t *table;
+  int size = old ? old->size : KBUS_LB_MIN_TABLE;
+
+  if (old && fd < old->size)
+    return 0;
+  while (size <= fd)
+    size = (size > INT_MAX / 2) ? INT_MAX : size * 2;
+
+  table = calloc(1, sizeof(*table) + size * sizeof(table->ksocks[0]));
+  if (table == NULL)
+    return -ENOMEM;
+  table->size = size;
+  table->retired = old;
+  if (old)
+    memcpy(table->ksocks, old->ksocks, old->size * sizeof(old->ksocks[0]));
+  __atomic_store_n(&kbus_lb_table, table, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Take a Ksock off its bus (freeing the bus if it was the last one) and out
+ * of the table, and free it. This closes our end of its socket pair, but not
+ * the Ksock's own file descriptor. Call with kbus_lb_buses_lock held.
+ */
+static void kbus_lb_remove(kbus_ksock_t ksock)
+{
+  kbus_lb_ksock_t    *ks = kbus_lb_table->ksocks[ksock];
+  kbus_lb_bus_t      *bus = ks->bus;
+  kbus_lb_ksock_t   **kprev;
+  kbus_lb_binding_t **bprev;
+
+  pthread_mutex_lock(&bus->lock);
+
+  for (kprev = &bus->ksocks; *kprev != ks; kprev = &(*kprev)->next)
+    ;
+  *kprev = ks->next;
+
+  bprev = &bus->bindings;
+  while (*bprev) {
+    kbus_lb_binding_t *binding = *bprev;
+    if (binding->ksock == ks) {
+      *bprev = binding->next;
+      free(binding);
+    } else {
+      bprev = &binding->next;
+    }
+  }
+
+  // Requests we haven't read are never going to be replied to...
+  while (ks->queue) {
+    kbus_lb_item_t *item = ks->queue;
+    kbus_message_t *msg = item->lbm->msg;
+    ks->queue = item->next;
+    if (item->for_replier && msg->from != ks->id)
+      kbus_lb_push_synthetic(bus, ks->id, msg->from, msg->id,
+                             KBUS_MSG_NAME_REPLIER_GONEAWAY);
+    kbus_lb_free_item(item);
+  }
+  // ...nor are those we have read
+  while (ks->unreplied) {
+    kbus_lb_request_t *request = ks->unreplied;
+    ks->unreplied = request->next;
+    kbus_lb_push_synthetic(bus, ks->id, request->from, request->id,
+                           KBUS_MSG_NAME_REPLIER_IGNORED);
+    free(request);
+  }
+  while (ks->awaiting) {
+    kbus_lb_request_t *request = ks->awaiting;
+    ks->awaiting = request->next;
+    free(request);
+  }
+  kbus_lb_finish_reading(ks);
+  kbus_lb_discard(ks);
+  free(ks->wbuf);
+
+  // Which may have unblocked someone else's send
+  bus->maybe_blocked_sends = true;
+  kbus_lb_retry_blocked_sends(bus);
+  pthread_mutex_unlock(&bus->lock);
+
+  // The last one out frees the bus
+  if (bus->ksocks == NULL) {
+    kbus_lb_bus_t **prev;
+    for (prev = &kbus_lb_buses; *prev != bus; prev = &(*prev)->next)
+      ;
+    *prev = bus->next;
+    pthread_mutex_destroy(&bus->lock);
+    free(bus->listeners);
+    free(bus);
+  }
+
+  __atomic_store_n(&kbus_lb_table->ksocks[ksock], NULL, __ATOMIC_RELEASE);
+  close(ks->fd);
+  close(ks->peer);
+  free(ks);
+}
+
+extern kbus_ksock_t kbus_lb_open(uint32_t bus_number, int flags)
+{
+  kbus_lb_bus_t   *bus;
+  kbus_lb_ksock_t *ks;
+  int              sv[2];
+  int              fd;
+  int              rv;
+  int              sndbuf = 1;
+  int              mode = flags & (O_RDONLY | O_WRONLY | O_RDWR);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv))
+    return -errno;
+  // So that filling the other end (to make us unwritable) takes little
+  (void) setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  fd = fcntl(sv[0], F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    rv = -errno;
+    close(sv[0]);
+    close(sv[1]);
+    return rv;
+  }
+
+  ks = calloc(1, sizeof(*ks));
+  if (!ks) {
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    return -ENOMEM;
+  }
+  ks->fd = sv[0];
+  ks->peer = sv[1];
+  ks->can_read = mode != O_WRONLY;
+  ks->can_write = mode != O_RDONLY;
+  ks->max_messages = KBUS_LB_DEF_MAX_MESSAGES;
+
+  pthread_mutex_lock(&kbus_lb_buses_lock);
+
+  // If a loopback Ksock still has this file descriptor, it was closed
+  // behind our back
+  if (kbus_lb_is_ksock(fd))
+    kbus_lb_remove(fd);
+
+  rv = kbus_lb_grow(fd);
+  if (rv < 0) {
+    pthread_mutex_unlock(&kbus_lb_buses_lock);
+    free(ks);
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    return rv;
+  }
+
+  for (bus = kbus_lb_buses; bus; bus = bus->next)
+    if (bus->number == bus_number)
+      break;
+  if (bus == NULL) {
+    bus = calloc(1, sizeof(*bus));
+    if (!bus) {
+      pthread_mutex_unlock(&kbus_lb_buses_lock);
+      free(ks);
+      close(fd);
+      close(sv[0]);
+      close(sv[1]);
+      return -ENOMEM;
+    }
+    bus->number = bus_number;
+    bus->max_message_size = KBUS_LB_DEF_MAX_MESSAGE_SIZE;
+    pthread_mutex_init(&bus->lock, NULL);
+    bus->next = kbus_lb_buses;
+    kbus_lb_buses = bus;
+  }
+
+  pthread_mutex_lock(&bus->lock);
+  ks->bus = bus;
+  ks->id = ++ bus->last_ksock_id;
+  ks->next = bus->ksocks;
+  bus->ksocks = ks;
+  pthread_mutex_unlock(&bus->lock);
+
+  __atomic_store_n(&kbus_lb_table->ksocks[fd], ks, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&kbus_lb_buses_lock);
+  return fd;
+}
+
+extern int kbus_lb_close(kbus_ksock_t ksock)
+{
+  pthread_mutex_lock(&kbus_lb_buses_lock);
+  kbus_lb_remove(ksock);
+  pthread_mutex_unlock(&kbus_lb_buses_lock);
+
+  if (close(ksock) < 0)
+    return -errno;
+  return 0;
+}
+
+extern void kbus_lb_forget(kbus_ksock_t ksock)
+{
+  if (!kbus_lb_is_ksock(ksock))
+    return;
+
+  pthread_mutex_lock(&kbus_lb_buses_lock);
+  if (kbus_lb_is_ksock(ksock))
+    kbus_lb_remove(ksock);
+  pthread_mutex_unlock(&kbus_lb_buses_lock);
+}
+
+extern int kbus_lb_ioctl(kbus_ksock_t ksock, unsigned long cmd, void *arg)
+{
+  kbus_lb_ksock_t *ks = kbus_lb_lock_ksock(ksock);
+  uint32_t        *u32_arg = arg;
+  int              rv = 0;
+
+  switch (cmd) {
+  case KBUS_IOC_RESET:
+    break;
+
+  case KBUS_IOC_BIND:
+    rv = kbus_lb_bind(ks, arg);
+    break;
+
+  case KBUS_IOC_UNBIND:
+    rv = kbus_lb_unbind(ks, arg);
+    break;
+
+  case KBUS_IOC_KSOCKID:
+    *u32_arg = ks->id;
+    break;
+
+  case KBUS_IOC_REPLIER:
+    {
+      kbus_bind_query_t *query = arg;
+      kbus_lb_binding_t *replier;
+      if (query->name_len == 0 || query->name_len > KBUS_MAX_NAME_LEN ||
+          kbus_lb_bad_name(query->name, query->name_len)) {
+        rv = -EBADMSG;
+        break;
+      }
+      replier = kbus_lb_find_replier(ks->bus, query->name, query->name_len);
+      query->return_id = replier ? replier->ksock->id : 0;
+      rv = replier != NULL;
+    }
+    break;
+
+  case KBUS_IOC_NEXTMSG:
+    rv = ks->can_read ? kbus_lb_next_msg(ks, u32_arg) : -EBADF;
+    break;
+
+  case KBUS_IOC_LENLEFT:
+    *u32_arg = ks->reading ? ks->reading->lbm->length - ks->read_pos : 0;
+    break;
+
+  case KBUS_IOC_SEND:
+    rv = kbus_lb_send(ks, arg);
+    break;
+
+  case KBUS_IOC_DISCARD:
+    kbus_lb_discard(ks);
+    break;
+
+  case KBUS_IOC_LASTSENT:
+    *(kbus_msg_id_t *)arg = ks->last_sent;
+    break;
+
+  case KBUS_IOC_MAXMSGS:
+    if (*u32_arg > ks->max_messages)
+      ks->bus->maybe_blocked_sends = true;
+    if (*u32_arg > 0)
+      ks->max_messages = *u32_arg;
+    *u32_arg = ks->max_messages;
+    break;
+
+  case KBUS_IOC_NUMMSGS:
+    *u32_arg = ks->num_messages;
+    break;
+
+  case KBUS_IOC_UNREPLIEDTO:
+    *u32_arg = ks->num_unreplied;
+    break;
+
+  case KBUS_IOC_MSGONLYONCE:
+    rv = kbus_lb_set_flag(&ks->only_once, u32_arg);
+    break;
+
+  case KBUS_IOC_VERBOSE:
+    rv = kbus_lb_set_flag(&ks->verbose, u32_arg);
+    break;
+
+  case KBUS_IOC_MAXMSGSIZE:
+    if (*u32_arg == 1)
+      *u32_arg = KBUS_LB_ABS_MAX_MESSAGE_SIZE;
+    else if (*u32_arg == 0)
+      *u32_arg = ks->bus->max_message_size;
+    else if (*u32_arg < 100 || *u32_arg > KBUS_LB_ABS_MAX_MESSAGE_SIZE)
+      rv = -EINVAL;
+    else
+      ks->bus->max_message_size = *u32_arg;
+    break;
+
+  case KBUS_IOC_AUTOSEND:
+    rv = kbus_lb_set_flag(&ks->auto_send, u32_arg);
+    break;
+
+  default:
+    // New devices, blocking reads, busy polling, broadcast topics,
+    // filtered bindings and Replier bind events are not supported
+    rv = -EOPNOTSUPP;
+    break;
+  }
+
+  kbus_lb_unlock_ksock(ks);
+  return rv;
+}
+
+extern ssize_t kbus_lb_read(kbus_ksock_t ksock, void *buf, size_t count)
+{
+  kbus_lb_ksock_t *ks = kbus_lb_lock_ksock(ksock);
+  uint8_t         *to = buf;
+  size_t           done = 0;
+
+  if (!ks->can_read) {
+    kbus_lb_unlock_ksock(ks);
+    return -EBADF;
+  }
+
+  while (ks->reading && done < count) {
+    const uint8_t *from = (const uint8_t *)ks->reading->lbm->msg;
+    size_t         left = ks->reading->lbm->length - ks->read_pos;
+    size_t         this = count - done < left ? count - done : left;
+
+    // The header is the recipient's own version
+    if (ks->read_pos < sizeof(ks->read_hdr)) {
+      size_t hdr_left = sizeof(ks->read_hdr) - ks->read_pos;
+      if (this > hdr_left)
+        this = hdr_left;
+      from = (const uint8_t *)&ks->read_hdr;
+    }
+    memcpy(to + done, from + ks->read_pos, this);
+    ks->read_pos += this;
+    done += this;
+
+    if (ks->read_pos == ks->reading->lbm->length)
+      kbus_lb_finish_reading(ks);
+  }
+
+  kbus_lb_unlock_ksock(ks);
+  return done;
+}
+
+extern ssize_t kbus_lb_write(kbus_ksock_t ksock, const void *buf,
+                             size_t count)
+{
+  kbus_lb_ksock_t *ks = kbus_lb_lock_ksock(ksock);
+  kbus_message_t  *hdr;
+  ssize_t          rv = count;
+
+  if (!ks->can_write) {
+    rv = -EBADF;
+    goto done;
+  }
+  // We can't start another message whilst we're retrying this one
+  if (ks->sending) {
+    rv = -EALREADY;
+    goto done;
+  }
+
+  if (ks->wlen + count > ks->wsize) {
+    size_t   new_size = ks->wlen + count + sizeof(kbus_message_t);
+    uint8_t *new = realloc(ks->wbuf, new_size);
+    if (!new) {
+      rv = -ENOMEM;
+      goto done;
+    }
+    ks->wbuf = new;
+    ks->wsize = new_size;
+  }
+  memcpy(ks->wbuf + ks->wlen, buf, count);
+  ks->wlen += count;
+
+  // In auto send mode, a complete message is sent at once
+  hdr = (kbus_message_t *)ks->wbuf;
+  if (ks->auto_send && ks->wlen >= sizeof(*hdr) &&
+      (hdr->name != NULL ||
+       ks->wlen >= KBUS_ENTIRE_MSG_LEN(hdr->name_len, hdr->data_len))) {
+    int err = kbus_lb_send(ks, NULL);
+    if (err)
+      rv = err;
+  }
+
+done:
+  kbus_lb_unlock_ksock(ks);
+  return rv;
+}
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
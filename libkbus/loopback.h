@@ -0,0 +1,82 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifndef _LOOPBACK_H_INCLUDED_
+#define _LOOPBACK_H_INCLUDED_
+
+// The in-process loopback bus, behind kbus_ksock_open_loopback().
+//
+// This header is private to libkbus - the rest of libkbus uses it to pass
+// the system calls for a loopback Ksock to the loopback bus, instead of to
+// the KBUS kernel module. Each function returns what the equivalent system
+// call would, except that errors are returned as ``-errno``.
+
+struct kbus_lb_ksock;
+
+// Which Ksocks are loopback Ksocks, indexed by file descriptor? NULL for
+// everything else. The table is looked up without locking, so when it grows
+// the old one is kept (on the `retired` list) rather than freed.
+struct kbus_lb_table {
+  int                    size;
+  struct kbus_lb_table  *retired;
+  struct kbus_lb_ksock  *ksocks[];
+};
+extern struct kbus_lb_table *kbus_lb_table;
+
+static inline struct kbus_lb_ksock *kbus_lb_find(kbus_ksock_t ksock)
+{
+  struct kbus_lb_table *table = __atomic_load_n(&kbus_lb_table,
+                                                __ATOMIC_ACQUIRE);
+  if (table == NULL || ksock < 0 || ksock >= table->size)
+    return NULL;
+  return __atomic_load_n(&table->ksocks[ksock], __ATOMIC_ACQUIRE);
+}
+
+static inline int kbus_lb_is_ksock(kbus_ksock_t ksock)
+{
+  return kbus_lb_find(ksock) != NULL;
+}
+
+extern kbus_ksock_t kbus_lb_open(uint32_t bus_number, int flags);
+extern int kbus_lb_close(kbus_ksock_t ksock);
+
+// Forget a loopback Ksock whose file descriptor was closed other than by
+// kbus_lb_close(), and has now been reused for something else.
+extern void kbus_lb_forget(kbus_ksock_t ksock);
+extern int kbus_lb_ioctl(kbus_ksock_t ksock, unsigned long cmd, void *arg);
+extern ssize_t kbus_lb_read(kbus_ksock_t ksock, void *buf, size_t count);
+extern ssize_t kbus_lb_write(kbus_ksock_t ksock, const void *buf,
+                             size_t count);
+
+#endif /* _LOOPBACK_H_INCLUDED_ */
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
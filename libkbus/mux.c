@@ -0,0 +1,400 @@
+/*
+ * Library support for sharing one Ksock between subscribers in a process.
+ *
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libkbus/kbus.h"
+#include "mux.h"
+
+// A message name (or wildcard) that we are bound to, on behalf of however
+// many subscribers want it
+struct kbus_mux_binding {
+  char                          *name;
+  size_t                         name_len;
+  unsigned                       count;         // subscribers to it
+  struct kbus_mux_binding       *next;
+};
+typedef struct kbus_mux_binding kbus_mux_binding_t;
+
+struct kbus_mux_sub {
+  kbus_mux_binding_t            *binding;       // NULL for "anything else"
+  kbus_mux_callback_fn           callback;
+  void                          *arg;
+  bool                           dead;          // unsubscribed
+  struct kbus_mux_sub           *next;
+};
+
+struct kbus_mux {
+  kbus_ksock_t                   ksock;
+  kbus_mux_binding_t            *bindings;
+  kbus_mux_sub_t                *subs;          // in order of subscription
+  bool                           dispatching;   // in kbus_mux_dispatch()
+  bool                           any_dead;      // subscribers to free
+};
+
+/*
+ * Does this message name match the given binding?
+ *
+ * The binding may be a normal message name, or a wildcard - this follows
+ * the rules used by KBUS itself.
+ */
+static bool kbus_mux_name_matches(const char                   *name,
+                                  size_t                        name_len,
+                                  const kbus_mux_binding_t     *binding)
+{
+  const char *other = binding->name;
+  size_t      other_len = binding->name_len;
+  char        last = other[other_len - 1];
+
+  if (last == '*' || last == '%') {
+    // If we have '$.Fred.*', then we need at least '$.Fred.X' to match
+    if (name_len < other_len)
+      return false;
+    if (memcmp(other, name, other_len - 1))
+      return false;
+    // '*' matches anything at all
+    if (last == '*')
+      return true;
+    // '%' only matches if we don't have another dot
+    return memchr(name + other_len - 1, '.', name_len - other_len + 1) == NULL;
+  } else {
+    return name_len == other_len && !memcmp(name, other, name_len);
+  }
+}
+
+/*
+ * Forget subscribers that have unsubscribed.
+ */
+static void kbus_mux_reap(kbus_mux_t *mux)
+{
+  kbus_mux_sub_t **prev = &mux->subs;
+
+  while (*prev) {
+    kbus_mux_sub_t *sub = *prev;
+    if (sub->dead) {
+      *prev = sub->next;
+      free(sub);
+    } else {
+      prev = &sub->next;
+    }
+  }
+  mux->any_dead = false;
+}
+
+/*
+ * Make a new subscription multiplexer, using an open Ksock, which it takes
+ * over (and closes if anything goes wrong).
+ */
+static int kbus_mux_make(kbus_mux_t     **mux,
+                         kbus_ksock_t     ksock)
+{
+  kbus_mux_t *new;
+  int         rv;
+
+  *mux = NULL;
+
+  if (ksock < 0)
+    return ksock;
+
+  new = malloc(sizeof(*new));
+  if (!new) {
+    kbus_ksock_close(ksock);
+    return -ENOMEM;
+  }
+  memset(new, 0, sizeof(*new));
+  new->ksock = ksock;
+
+  // A message that matches several of our bindings is still only wanted once
+  rv = kbus_ksock_only_once(new->ksock, 1);
+  if (rv < 0) {
+    kbus_ksock_close(new->ksock);
+    free(new);
+    return rv;
+  }
+
+  *mux = new;
+  return 0;
+}
+
+/*
+ * Create a new subscription multiplexer.
+ *
+ * `mux` is the new multiplexer.
+ *
+ * `device_number` is the KBUS device to use. The multiplexer opens a Ksock of
+ * its own on it, which it sets to receive each message only once.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_new(kbus_mux_t      **mux,
+                        uint32_t          device_number)
+{
+  return kbus_mux_make(mux, kbus_ksock_open(device_number, O_RDWR));
+}
+
+/*
+ * Create a new subscription multiplexer on a loopback bus.
+ *
+ * This is the same as ``kbus_mux_new()``, except that the multiplexer's Ksock
+ * is opened with ``kbus_ksock_open_loopback()``, on loopback bus
+ * `bus_number`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_new_loopback(kbus_mux_t     **mux,
+                                 uint32_t         bus_number)
+{
+  return kbus_mux_make(mux, kbus_ksock_open_loopback(bus_number, O_RDWR));
+}
+
+/*
+ * Free a subscription multiplexer, and close its Ksock.
+ *
+ * Any remaining subscriptions are freed as well.
+ *
+ * Does nothing if `mux` is NULL, or `*mux` is NULL.
+ */
+extern void kbus_mux_free(kbus_mux_t **mux)
+{
+  kbus_mux_t *this;
+
+  if (mux == NULL || *mux == NULL)
+    return;
+  this = *mux;
+
+  while (this->subs) {
+    kbus_mux_sub_t *next = this->subs->next;
+    free(this->subs);
+    this->subs = next;
+  }
+  while (this->bindings) {
+    kbus_mux_binding_t *next = this->bindings->next;
+    free(this->bindings->name);
+    free(this->bindings);
+    this->bindings = next;
+  }
+
+  kbus_ksock_close(this->ksock);
+  free(this);
+  *mux = NULL;
+}
+
+/*
+ * Return the multiplexer's Ksock.
+ *
+ * This may be used to wait for messages (with ``poll()`` or
+ * ``kbus_wait_for_message()``), before calling ``kbus_mux_dispatch()``, or
+ * to send messages.
+ *
+ * It should not be read from, bound or unbound directly.
+ */
+extern kbus_ksock_t kbus_mux_ksock(kbus_mux_t *mux)
+{
+  return mux->ksock;
+}
+
+/*
+ * Subscribe to messages with the given name.
+ *
+ * `name` is a message name, or wildcard, as for ``kbus_ksock_bind()``. The
+ * multiplexer's Ksock is bound to it (as a Listener) when its first
+ * subscriber arrives, and unbound when its last subscriber leaves.
+ *
+ * Alternatively, `name` may be NULL, to receive any messages that no other
+ * subscriber matches - for instance, Replies to Requests sent on the
+ * multiplexer's Ksock.
+ *
+ * `callback` is called, with `arg`, for each matching message.
+ *
+ * `sub` is the new subscription, to be passed to ``kbus_mux_unsubscribe()``.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_subscribe(kbus_mux_t                *mux,
+                              const char                *name,
+                              kbus_mux_callback_fn       callback,
+                              void                      *arg,
+                              kbus_mux_sub_t           **sub)
+{
+  kbus_mux_binding_t    *binding = NULL;
+  kbus_mux_sub_t        *new;
+  kbus_mux_sub_t       **last;
+  int                    rv;
+
+  *sub = NULL;
+
+  new = malloc(sizeof(*new));
+  if (!new) return -ENOMEM;
+
+  if (name) {
+    for (binding = mux->bindings; binding; binding = binding->next)
+      if (!strcmp(binding->name, name))
+        break;
+
+    if (binding == NULL) {
+      binding = malloc(sizeof(*binding));
+      if (binding) binding->name = strdup(name);
+      if (binding == NULL || binding->name == NULL) {
+        free(binding);
+        free(new);
+        return -ENOMEM;
+      }
+      binding->name_len = strlen(name);
+      binding->count = 0;
+
+      rv = kbus_ksock_bind(mux->ksock, name, false);
+      if (rv < 0) {
+        free(binding->name);
+        free(binding);
+        free(new);
+        return rv;
+      }
+      binding->next = mux->bindings;
+      mux->bindings = binding;
+    }
+    binding->count ++;
+  }
+
+  new->binding = binding;
+  new->callback = callback;
+  new->arg = arg;
+  new->dead = false;
+  new->next = NULL;
+
+  for (last = &mux->subs; *last; last = &(*last)->next)
+    ;
+  *last = new;
+
+  *sub = new;
+  return 0;
+}
+
+/*
+ * Unsubscribe.
+ *
+ * If this was the last subscriber to its message name, the multiplexer's
+ * Ksock is unbound from it.
+ *
+ * This may be called from within a subscriber's callback (including for the
+ * subscription being called back).
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure (in
+ * which case the subscription is gone, but the Ksock may still be bound).
+ */
+extern int kbus_mux_unsubscribe(kbus_mux_t              *mux,
+                                kbus_mux_sub_t          *sub)
+{
+  kbus_mux_binding_t *binding = sub->binding;
+  int                 rv = 0;
+
+  sub->dead = true;
+  sub->binding = NULL;
+
+  if (binding && --binding->count == 0) {
+    kbus_mux_binding_t **prev = &mux->bindings;
+    while (*prev != binding)
+      prev = &(*prev)->next;
+    *prev = binding->next;
+
+    rv = kbus_ksock_unbind(mux->ksock, binding->name, false);
+    free(binding->name);
+    free(binding);
+  }
+
+  if (mux->dispatching)
+    mux->any_dead = true;
+  else
+    kbus_mux_reap(mux);
+  return rv;
+}
+
+/*
+ * Read all the messages waiting on the multiplexer's Ksock, and pass each
+ * one to the subscribers that it matches.
+ *
+ * Each message is read once, and the same message is passed to each
+ * matching subscriber in turn, in the order they subscribed. Messages that
+ * match no named subscriber go to any subscribers to NULL, or are otherwise
+ * ignored.
+ *
+ * This must not be called from within a subscriber's callback.
+ *
+ * Returns the number of messages read, or a negative number (``-errno``) for
+ * failure.
+ */
+extern int kbus_mux_dispatch(kbus_mux_t *mux)
+{
+  int count = 0;
+  int rv = 0;
+
+  mux->dispatching = true;
+  for (;;) {
+    kbus_message_t *msg;
+    kbus_mux_sub_t *sub;
+    const char     *name;
+    bool            matched = false;
+
+    rv = kbus_ksock_read_next_msg(mux->ksock, &msg);
+    if (rv < 0 || msg == NULL)
+      break;
+
+    name = kbus_msg_name_ptr(msg);
+    for (sub = mux->subs; sub; sub = sub->next) {
+      if (sub->dead || sub->binding == NULL ||
+          !kbus_mux_name_matches(name, msg->name_len, sub->binding))
+        continue;
+      sub->callback(msg, sub->arg);
+      matched = true;
+    }
+    if (!matched) {
+      for (sub = mux->subs; sub; sub = sub->next)
+        if (!sub->dead && sub->binding == NULL)
+          sub->callback(msg, sub->arg);
+    }
+    kbus_msg_delete(&msg);
+    count ++;
+  }
+  mux->dispatching = false;
+
+  if (mux->any_dead)
+    kbus_mux_reap(mux);
+  return rv < 0 ? rv : count;
+}
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
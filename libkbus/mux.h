@@ -0,0 +1,191 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifndef _MUX_H_INCLUDED_
+#define _MUX_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NOTE that the middle portion of this file is autogenerated from mux.c
+// so that the function header comments and function prototypes may be
+// automatically kept in-step. This allows me to treat the C file as the main
+// specification of the functions it defines, and also to keep C header
+// comments in the C file, which I find easier when keeping the comments
+// correct as the code is edited.
+//
+// The Python script extract_hdrs.py is used to perform this autogeneration.
+// It should transfer any C function marked as 'extern' and with a header
+// comment (of the '/*...*...*/' form).
+
+/*
+ * A subscription multiplexer, which shares one Ksock between any number of
+ * subscribers within a process.
+ *
+ * Each message name (or wildcard) is bound, as a Listener, only while at
+ * least one subscriber wants it, and each message is read from KBUS once,
+ * and then passed (by reference) to every subscriber that it matches.
+ *
+ * This is created by a call to kbus_mux_new(), and freed by a call to
+ * kbus_mux_free(). It is not thread safe - it is intended to be driven from
+ * a single event loop.
+ */
+struct kbus_mux;
+typedef struct kbus_mux kbus_mux_t;
+
+/*
+ * A single subscription, as returned by kbus_mux_subscribe().
+ */
+struct kbus_mux_sub;
+typedef struct kbus_mux_sub kbus_mux_sub_t;
+
+/*
+ * The function called for each message a subscriber receives.
+ *
+ * `msg` is only valid until the function returns, and is shared with any
+ * other subscribers - it must not be altered or freed.
+ *
+ * `arg` is as given to kbus_mux_subscribe().
+ */
+typedef void (*kbus_mux_callback_fn)(const kbus_message_t *msg, void *arg);
+
+// -------- TEXT AFTER THIS AUTOGENERATED - DO NOT EDIT --------
+// Autogenerated by extract_hdrs.py on 2026-10-18 (Sun 18 Oct 2026) at 14:00
+
+/*
+ * Create a new subscription multiplexer.
+ *
+ * `mux` is the new multiplexer.
+ *
+ * `device_number` is the KBUS device to use. The multiplexer opens a Ksock of
+ * its own on it, which it sets to receive each message only once.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_new(kbus_mux_t      **mux,
+                        uint32_t          device_number);
+
+/*
+ * Create a new subscription multiplexer on a loopback bus.
+ *
+ * This is the same as ``kbus_mux_new()``, except that the multiplexer's Ksock
+ * is opened with ``kbus_ksock_open_loopback()``, on loopback bus
+ * `bus_number`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_new_loopback(kbus_mux_t     **mux,
+                                 uint32_t         bus_number);
+
+/*
+ * Free a subscription multiplexer, and close its Ksock.
+ *
+ * Any remaining subscriptions are freed as well.
+ *
+ * Does nothing if `mux` is NULL, or `*mux` is NULL.
+ */
+extern void kbus_mux_free(kbus_mux_t **mux);
+
+/*
+ * Return the multiplexer's Ksock.
+ *
+ * This may be used to wait for messages (with ``poll()`` or
+ * ``kbus_wait_for_message()``), before calling ``kbus_mux_dispatch()``, or
+ * to send messages.
+ *
+ * It should not be read from, bound or unbound directly.
+ */
+extern kbus_ksock_t kbus_mux_ksock(kbus_mux_t *mux);
+
+/*
+ * Subscribe to messages with the given name.
+ *
+ * `name` is a message name, or wildcard, as for ``kbus_ksock_bind()``. The
+ * multiplexer's Ksock is bound to it (as a Listener) when its first
+ * subscriber arrives, and unbound when its last subscriber leaves.
+ *
+ * Alternatively, `name` may be NULL, to receive any messages that no other
+ * subscriber matches - for instance, Replies to Requests sent on the
+ * multiplexer's Ksock.
+ *
+ * `callback` is called, with `arg`, for each matching message.
+ *
+ * `sub` is the new subscription, to be passed to ``kbus_mux_unsubscribe()``.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_mux_subscribe(kbus_mux_t                *mux,
+                              const char                *name,
+                              kbus_mux_callback_fn       callback,
+                              void                      *arg,
+                              kbus_mux_sub_t           **sub);
+
+/*
+ * Unsubscribe.
+ *
+ * If this was the last subscriber to its message name, the multiplexer's
+ * Ksock is unbound from it.
+ *
+ * This may be called from within a subscriber's callback (including for the
+ * subscription being called back).
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure (in
+ * which case the subscription is gone, but the Ksock may still be bound).
+ */
+extern int kbus_mux_unsubscribe(kbus_mux_t              *mux,
+                                kbus_mux_sub_t          *sub);
+
+/*
+ * Read all the messages waiting on the multiplexer's Ksock, and pass each
+ * one to the subscribers that it matches.
+ *
+ * Each message is read once, and the same message is passed to each
+ * matching subscriber in turn, in the order they subscribed. Messages that
+ * match no named subscriber go to any subscribers to NULL, or are otherwise
+ * ignored.
+ *
+ * This must not be called from within a subscriber's callback.
+ *
+ * Returns the number of messages read, or a negative number (``-errno``) for
+ * failure.
+ */
+extern int kbus_mux_dispatch(kbus_mux_t *mux);
+// -------- TEXT BEFORE THIS AUTOGENERATED - DO NOT EDIT --------
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _MUX_H_INCLUDED_ */
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
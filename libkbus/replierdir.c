@@ -0,0 +1,476 @@
+/*
+ * Library support for a process-wide directory of KBUS Repliers.
+ *
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "libkbus/kbus.h"
+#include "replierdir.h"
+
+// The number of hash buckets - a power of two
+#define REPLIERDIR_NUM_BUCKETS  256
+
+// How many Replier bind events we ask KBUS to queue for us to start with, so
+// that a burst of binds doesn't fill our queue before our thread empties it
+#define REPLIERDIR_MIN_QUEUE_LEN  1024
+
+// The most Replier bind events we will ask KBUS to queue for us, when asking
+// it to tell us about all the current Repliers
+#define REPLIERDIR_MAX_QUEUE_LEN  (64 * 1024)
+
+// A message name (or wildcard) and the Ksock bound to it as Replier
+struct replierdir_entry {
+  struct replierdir_entry       *next;          // in its hash bucket
+  uint32_t                       hash;
+  char                          *name;          // from the bind event
+  uint32_t                       name_len;
+  uint32_t                       replier_id;
+};
+typedef struct replierdir_entry replierdir_entry_t;
+
+struct kbus_replierdir {
+  kbus_ksock_t           ksock;         // our own Ksock
+  pthread_t              thread;        // which keeps our Ksock drained
+  int                    stop_fd;       // an eventfd, to stop the thread
+  pthread_rwlock_t       lock;          // protects everything below
+  replierdir_entry_t    *buckets[REPLIERDIR_NUM_BUCKETS];
+  uint32_t               num_entries;
+};
+
+/*
+ * Hash a message name (FNV-1a)
+ */
+static uint32_t replierdir_hash(const char *name, uint32_t name_len)
+{
+  uint32_t hash = 2166136261u;
+  uint32_t ii;
+
+  for (ii = 0; ii < name_len; ii++)
+    hash = (hash ^ (uint8_t)name[ii]) * 16777619u;
+  return hash;
+}
+
+static replierdir_entry_t **replierdir_find_entry(kbus_replierdir_t   *dir,
+                                                  const char          *name,
+                                                  uint32_t             name_len,
+                                                  uint32_t             hash)
+{
+  replierdir_entry_t **prev;
+
+  prev = &dir->buckets[hash & (REPLIERDIR_NUM_BUCKETS - 1)];
+  for (; *prev; prev = &(*prev)->next) {
+    replierdir_entry_t *entry = *prev;
+    if (entry->hash == hash && entry->name_len == name_len &&
+        !memcmp(entry->name, name, name_len))
+      break;
+  }
+  return prev;
+}
+
+static void replierdir_forget_all(kbus_replierdir_t *dir)
+{
+  int ii;
+
+  for (ii = 0; ii < REPLIERDIR_NUM_BUCKETS; ii++) {
+    while (dir->buckets[ii]) {
+      replierdir_entry_t *next = dir->buckets[ii]->next;
+      free(dir->buckets[ii]->name);
+      free(dir->buckets[ii]);
+      dir->buckets[ii] = next;
+    }
+  }
+  dir->num_entries = 0;
+}
+
+/*
+ * Apply a Replier bind event to the directory.
+ */
+static int replierdir_apply(kbus_replierdir_t          *dir,
+                            const kbus_message_t       *msg)
+{
+  replierdir_entry_t  **prev;
+  uint32_t              is_bind;
+  uint32_t              binder;
+  uint32_t              name_len;
+  uint32_t              hash;
+  char                 *name;
+  int                   rv;
+
+  if (strcmp(kbus_msg_name_ptr(msg), KBUS_MSG_NAME_REPLIER_BIND_EVENT))
+    return 0;
+
+  rv = kbus_msg_split_bind_event(msg, &is_bind, &binder, &name);
+  if (rv) return rv;
+
+  name_len = strlen(name);
+  hash = replierdir_hash(name, name_len);
+  prev = replierdir_find_entry(dir, name, name_len, hash);
+
+  if (is_bind) {
+    if (*prev) {
+      (*prev)->replier_id = binder;
+      free(name);
+    } else {
+      replierdir_entry_t *new = malloc(sizeof(*new));
+      if (!new) {
+        free(name);
+        return -ENOMEM;
+      }
+      new->next = NULL;
+      new->hash = hash;
+      new->name = name;         // which we now own
+      new->name_len = name_len;
+      new->replier_id = binder;
+      *prev = new;
+      dir->num_entries ++;
+    }
+  } else {
+    // Only the current Replier can unbind
+    if (*prev && (*prev)->replier_id == binder) {
+      replierdir_entry_t *entry = *prev;
+      *prev = entry->next;
+      free(entry->name);
+      free(entry);
+      dir->num_entries --;
+    }
+    free(name);
+  }
+  return 0;
+}
+
+/*
+ * Read and apply all the bind events waiting on our Ksock.
+ *
+ * If KBUS had to throw away unbind events, then we no longer know who is
+ * bound, and have to ask again.
+ *
+ * Must be called with the lock held for writing.
+ *
+ * Returns the number of events read, or -errno.
+ */
+static int replierdir_drain(kbus_replierdir_t *dir)
+{
+  int count = 0;
+
+  for (;;) {
+    kbus_message_t *msg;
+    bool            lost;
+    int             rv;
+
+    rv = kbus_ksock_read_next_msg(dir->ksock, &msg);
+    if (rv < 0) return rv;
+    if (msg == NULL) return count;
+
+    lost = !strcmp(kbus_msg_name_ptr(msg), KBUS_MSG_NAME_UNBIND_EVENTS_LOST);
+    rv = replierdir_apply(dir, msg);
+    kbus_msg_delete(&msg);
+    if (rv) return rv;
+    count ++;
+
+    if (lost) {
+      replierdir_forget_all(dir);
+      rv = kbus_ksock_report_replier_binds(dir->ksock, 1);
+      if (rv < 0) return rv;
+    }
+  }
+}
+
+/*
+ * Ask KBUS to report Replier binds, which also reports all the Repliers bound
+ * at the moment. If they don't fit in our message queue, make it bigger and
+ * ask again.
+ */
+static int replierdir_populate(kbus_replierdir_t *dir)
+{
+  uint32_t max_messages = REPLIERDIR_MIN_QUEUE_LEN;
+  int      rv;
+
+  rv = kbus_ksock_max_messages(dir->ksock, &max_messages);
+  if (rv) return rv;
+
+  for (;;) {
+    rv = kbus_ksock_report_replier_binds(dir->ksock, 1);
+    if (rv != -EBUSY)
+      return rv < 0 ? rv : 0;
+
+    // Throw away what we were told so far, and start again
+    rv = replierdir_drain(dir);
+    if (rv < 0) return rv;
+    replierdir_forget_all(dir);
+
+    if (max_messages >= REPLIERDIR_MAX_QUEUE_LEN)
+      return -EBUSY;
+    max_messages *= 2;
+    rv = kbus_ksock_max_messages(dir->ksock, &max_messages);
+    if (rv) return rv;
+  }
+}
+
+/*
+ * Our thread, which reads the Replier bind events as they arrive, so that
+ * our Ksock's message queue does not fill up (and stop Repliers binding).
+ */
+static void *replierdir_thread(void *arg)
+{
+  kbus_replierdir_t *dir = arg;
+  struct pollfd      fds[2];
+
+  fds[0].fd = dir->ksock;
+  fds[0].events = POLLIN;
+  fds[1].fd = dir->stop_fd;
+  fds[1].events = POLLIN;
+
+  for (;;) {
+    fds[0].revents = fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (fds[0].revents & POLLIN)
+      (void) kbus_replierdir_update(dir);
+  }
+  return NULL;
+}
+
+/*
+ * Create a new Replier directory.
+ *
+ * `dir` is the new directory.
+ *
+ * `device_number` is the KBUS device whose Repliers it knows about. The
+ * directory opens a Ksock of its own on it, binds that to Replier bind events,
+ * and asks KBUS to report them (which also reports all the Repliers that are
+ * already bound). Reporting is for the whole device, and other directories
+ * (or Limpets) may be relying on it, so it is left on when the directory is
+ * freed.
+ *
+ * The directory starts a thread of its own, which reads the bind events as
+ * they arrive.
+ *
+ * The directory may be shared by any number of threads, and used to look up
+ * Repliers for any Ksock on the same device.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_replierdir_new(kbus_replierdir_t       **dir,
+                               uint32_t                  device_number)
+{
+  kbus_replierdir_t *new;
+  int                rv;
+
+  *dir = NULL;
+
+  new = malloc(sizeof(*new));
+  if (!new) return -ENOMEM;
+  memset(new, 0, sizeof(*new));
+
+  new->ksock = kbus_ksock_open(device_number, O_RDWR);
+  if (new->ksock < 0) {
+    rv = new->ksock;
+    free(new);
+    return rv;
+  }
+
+  new->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (new->stop_fd < 0) {
+    rv = -errno;
+    kbus_ksock_close(new->ksock);
+    free(new);
+    return rv;
+  }
+
+  rv = kbus_ksock_bind(new->ksock, KBUS_MSG_NAME_REPLIER_BIND_EVENT, false);
+  if (rv == 0)
+    rv = replierdir_populate(new);
+  if (rv == 0)
+    rv = replierdir_drain(new);
+
+  pthread_rwlock_init(&new->lock, NULL);
+  if (rv >= 0)
+    rv = -pthread_create(&new->thread, NULL, replierdir_thread, new);
+
+  if (rv < 0) {
+    replierdir_forget_all(new);
+    pthread_rwlock_destroy(&new->lock);
+    close(new->stop_fd);
+    kbus_ksock_close(new->ksock);
+    free(new);
+    return rv;
+  }
+
+  *dir = new;
+  return 0;
+}
+
+/*
+ * Free a Replier directory, stop its thread, and close its Ksock.
+ *
+ * KBUS is left reporting Replier bind events, since someone else may still
+ * be relying on them.
+ *
+ * No-one may be using the directory when it is freed.
+ *
+ * Does nothing if `dir` is NULL, or `*dir` is NULL.
+ */
+extern void kbus_replierdir_free(kbus_replierdir_t **dir)
+{
+  kbus_replierdir_t *this;
+  uint64_t           one = 1;
+
+  if (dir == NULL || *dir == NULL)
+    return;
+  this = *dir;
+
+  (void) !write(this->stop_fd, &one, sizeof(one));
+  pthread_join(this->thread, NULL);
+  close(this->stop_fd);
+
+  replierdir_forget_all(this);
+  kbus_ksock_close(this->ksock);
+  pthread_rwlock_destroy(&this->lock);
+  free(this);
+  *dir = NULL;
+}
+
+/*
+ * Return the directory's Ksock.
+ *
+ * KBUS will not let a Replier bind (or unbind) whilst this Ksock's message
+ * queue is full, which is why the directory's thread reads from it whenever
+ * it is readable.
+ *
+ * It should not be read from, bound or unbound directly.
+ */
+extern kbus_ksock_t kbus_replierdir_ksock(kbus_replierdir_t *dir)
+{
+  return dir->ksock;
+}
+
+/*
+ * Bring the directory up to date with any Replier bind events that have
+ * arrived.
+ *
+ * This is done by the directory's thread, and by ``kbus_replierdir_find()``,
+ * anyway, so need not normally be called.
+ *
+ * Returns the number of events read, or a negative number (``-errno``) for
+ * failure.
+ */
+extern int kbus_replierdir_update(kbus_replierdir_t *dir)
+{
+  int rv;
+
+  pthread_rwlock_wrlock(&dir->lock);
+  rv = replierdir_drain(dir);
+  pthread_rwlock_unlock(&dir->lock);
+  return rv;
+}
+
+/*
+ * Find the Ksock id of the Replier bound to the given message name.
+ *
+ * This is the same as ``kbus_ksock_find_replier()``, except that it looks in
+ * the directory, rather than asking KBUS. Since each Replier bind event is
+ * queued for the directory before the bind (or unbind) returns, the answer is
+ * as up-to-date as KBUS's own, but it only takes a ``poll()`` of the
+ * directory's Ksock (to see if there are any new events) and a hash lookup,
+ * without taking the KBUS device's lock.
+ *
+ * `name` is the message name (or wildcard) to look up. As with KBUS, it must
+ * match the name the Replier bound to exactly.
+ *
+ * `replier_ksock_id` will be set to the Ksock id of the Replier, or 0 if
+ * there is none.
+ *
+ * Returns 1 if there is a Replier, 0 if there is not, or a negative number
+ * (``-errno``) for failure.
+ */
+extern int kbus_replierdir_find(kbus_replierdir_t      *dir,
+                                const char             *name,
+                                uint32_t               *replier_ksock_id)
+{
+  struct pollfd         fds[1];
+  replierdir_entry_t  **entry;
+  uint32_t              name_len = strlen(name);
+  uint32_t              hash = replierdir_hash(name, name_len);
+  int                   rv;
+
+  *replier_ksock_id = 0;
+
+  fds[0].fd = dir->ksock;
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  rv = poll(fds, 1, 0);
+  if (rv < 0)
+    return -errno;
+  if (rv > 0 && (fds[0].revents & POLLIN)) {
+    rv = kbus_replierdir_update(dir);
+    if (rv < 0)
+      return rv;
+  }
+
+  pthread_rwlock_rdlock(&dir->lock);
+  entry = replierdir_find_entry(dir, name, name_len, hash);
+  if (*entry)
+    *replier_ksock_id = (*entry)->replier_id;
+  pthread_rwlock_unlock(&dir->lock);
+
+  return *replier_ksock_id != 0;
+}
+
+/*
+ * Return how many Repliers the directory knows about.
+ */
+extern uint32_t kbus_replierdir_num_repliers(kbus_replierdir_t *dir)
+{
+  uint32_t count;
+
+  pthread_rwlock_rdlock(&dir->lock);
+  count = dir->num_entries;
+  pthread_rwlock_unlock(&dir->lock);
+  return count;
+}
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
@@ -0,0 +1,160 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifndef _REPLIERDIR_H_INCLUDED_
+#define _REPLIERDIR_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NOTE that the middle portion of this file is autogenerated from replierdir.c
+// so that the function header comments and function prototypes may be
+// automatically kept in-step. This allows me to treat the C file as the main
+// specification of the functions it defines, and also to keep C header
+// comments in the C file, which I find easier when keeping the comments
+// correct as the code is edited.
+//
+// The Python script extract_hdrs.py is used to perform this autogeneration.
+// It should transfer any C function marked as 'extern' and with a header
+// comment (of the '/*...*...*/' form).
+
+/*
+ * A directory of the Repliers on a KBUS device.
+ *
+ * Rather than asking KBUS who the Replier for a message name is (which means
+ * taking the KBUS device's lock), the directory listens for Replier bind
+ * events, and keeps its own table of Repliers.
+ *
+ * This is created by a call to kbus_replierdir_new(), and freed by a call to
+ * kbus_replierdir_free(). It may be used by any number of threads at once.
+ */
+struct kbus_replierdir;
+typedef struct kbus_replierdir kbus_replierdir_t;
+
+// -------- TEXT AFTER THIS AUTOGENERATED - DO NOT EDIT --------
+// Autogenerated by extract_hdrs.py on 2026-10-18 (Sun 18 Oct 2026) at 13:52
+
+/*
+ * Create a new Replier directory.
+ *
+ * `dir` is the new directory.
+ *
+ * `device_number` is the KBUS device whose Repliers it knows about. The
+ * directory opens a Ksock of its own on it, binds that to Replier bind events,
+ * and asks KBUS to report them (which also reports all the Repliers that are
+ * already bound). Reporting is for the whole device, and other directories
+ * (or Limpets) may be relying on it, so it is left on when the directory is
+ * freed.
+ *
+ * The directory starts a thread of its own, which reads the bind events as
+ * they arrive.
+ *
+ * The directory may be shared by any number of threads, and used to look up
+ * Repliers for any Ksock on the same device.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_replierdir_new(kbus_replierdir_t       **dir,
+                               uint32_t                  device_number);
+
+/*
+ * Free a Replier directory, stop its thread, and close its Ksock.
+ *
+ * KBUS is left reporting Replier bind events, since someone else may still
+ * be relying on them.
+ *
+ * No-one may be using the directory when it is freed.
+ *
+ * Does nothing if `dir` is NULL, or `*dir` is NULL.
+ */
+extern void kbus_replierdir_free(kbus_replierdir_t **dir);
+
+/*
+ * Return the directory's Ksock.
+ *
+ * KBUS will not let a Replier bind (or unbind) whilst this Ksock's message
+ * queue is full, which is why the directory's thread reads from it whenever
+ * it is readable.
+ *
+ * It should not be read from, bound or unbound directly.
+ */
+extern kbus_ksock_t kbus_replierdir_ksock(kbus_replierdir_t *dir);
+
+/*
+ * Bring the directory up to date with any Replier bind events that have
+ * arrived.
+ *
+ * This is done by the directory's thread, and by ``kbus_replierdir_find()``,
+ * anyway, so need not normally be called.
+ *
+ * Returns the number of events read, or a negative number (``-errno``) for
+ * failure.
+ */
+extern int kbus_replierdir_update(kbus_replierdir_t *dir);
+
+/*
+ * Find the Ksock id of the Replier bound to the given message name.
+ *
+ * This is the same as ``kbus_ksock_find_replier()``, except that it looks in
+ * the directory, rather than asking KBUS. Since each Replier bind event is
+ * queued for the directory before the bind (or unbind) returns, the answer is
+ * as up-to-date as KBUS's own, but it only takes a ``poll()`` of the
+ * directory's Ksock (to see if there are any new events) and a hash lookup,
+ * without taking the KBUS device's lock.
+ *
+ * `name` is the message name (or wildcard) to look up. As with KBUS, it must
+ * match the name the Replier bound to exactly.
+ *
+ * `replier_ksock_id` will be set to the Ksock id of the Replier, or 0 if
+ * there is none.
+ *
+ * Returns 1 if there is a Replier, 0 if there is not, or a negative number
+ * (``-errno``) for failure.
+ */
+extern int kbus_replierdir_find(kbus_replierdir_t      *dir,
+                                const char             *name,
+                                uint32_t               *replier_ksock_id);
+
+/*
+ * Return how many Repliers the directory knows about.
+ */
+extern uint32_t kbus_replierdir_num_repliers(kbus_replierdir_t *dir);
+// -------- TEXT BEFORE THIS AUTOGENERATED - DO NOT EDIT --------
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _REPLIERDIR_H_INCLUDED_ */
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
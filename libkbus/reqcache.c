@@ -0,0 +1,746 @@
+/*
+ * Library support for caching the Replies to idempotent Requests.
+ *
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libkbus/kbus.h"
+#include "reqcache.h"
+
+// The number of hash buckets - a power of two
+#define REQCACHE_NUM_BUCKETS    256
+
+enum reqcache_state {
+  REQCACHE_PENDING,     // the Request has been sent, no Reply yet
+  REQCACHE_READY,       // we have the Reply
+  REQCACHE_FAILED,      // we're not going to get a Reply
+};
+
+// A Request, and (in due course) its Reply
+struct reqcache_entry {
+  struct reqcache_entry *next;          // in its hash bucket
+  struct reqcache_entry *next_pending;  // on the list awaiting Replies
+  uint32_t               hash;
+  char                  *name;          // the Request's name and data,
+  uint32_t               name_len;      // which are kept in the same
+  uint8_t               *data;          // allocation as the entry itself
+  uint32_t               data_len;
+  enum reqcache_state    state;
+  int                    error;         // why we FAILED
+  kbus_msg_id_t          request_id;    // what the Reply will be in reply to
+  kbus_message_t        *reply;         // an "entire" message
+  uint32_t               ttl_ms;        // how long the Reply is good for
+  uint64_t               expires_ms;    // and thus when it goes stale
+  bool                   in_table;      // is it (still) in a hash bucket?
+  unsigned               users;         // threads waiting on it
+};
+typedef struct reqcache_entry reqcache_entry_t;
+
+// The TTL for Requests with a particular name
+struct reqcache_ttl {
+  char                  *name;
+  uint32_t               ttl_ms;
+  struct reqcache_ttl   *next;
+};
+typedef struct reqcache_ttl reqcache_ttl_t;
+
+struct kbus_reqcache {
+  kbus_ksock_t           ksock;         // our own Ksock
+  pthread_mutex_t        lock;          // protects everything below
+  pthread_cond_t         changed;       // a Reply arrived, or reader left
+
+  reqcache_entry_t      *buckets[REQCACHE_NUM_BUCKETS];
+  uint32_t               num_entries;   // how many are in the buckets
+  uint32_t               max_entries;
+  reqcache_entry_t      *pending;       // entries awaiting Replies
+
+  uint32_t               default_ttl_ms;
+  reqcache_ttl_t        *ttls;          // any exceptions to that
+  char                  *invalidate_name;
+
+  bool                   reading;       // is a thread reading our Ksock?
+
+  kbus_reqcache_stats_t  stats;
+};
+
+/*
+ * Return the current time, in milliseconds, for TTLs.
+ */
+static uint64_t reqcache_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Hash a Request's name and data (FNV-1a)
+ */
+static uint32_t reqcache_hash(const char    *name,
+                              uint32_t       name_len,
+                              const void    *data,
+                              uint32_t       data_len)
+{
+  const uint8_t *bytes = (const uint8_t *)name;
+  uint32_t       hash = 2166136261u;
+  uint32_t       ii;
+
+  for (ii = 0; ii < name_len; ii++)
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  // So that "$.A" + "B" differs from "$.AB" + ""
+  hash = (hash ^ 0xFF) * 16777619u;
+  bytes = data;
+  for (ii = 0; ii < data_len; ii++)
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  return hash;
+}
+
+static void reqcache_free_entry(reqcache_entry_t *entry)
+{
+  kbus_msg_delete(&entry->reply);
+  free(entry);
+}
+
+/*
+ * Take an entry out of its hash bucket. If no-one is waiting on it, it is
+ * also freed.
+ */
+static void reqcache_unlink(kbus_reqcache_t   *cache,
+                            reqcache_entry_t  *entry)
+{
+  reqcache_entry_t **prev;
+
+  if (entry->in_table) {
+    prev = &cache->buckets[entry->hash & (REQCACHE_NUM_BUCKETS - 1)];
+    while (*prev != entry)
+      prev = &(*prev)->next;
+    *prev = entry->next;
+    entry->next = NULL;
+    entry->in_table = false;
+    cache->num_entries --;
+  }
+
+  if (entry->users == 0 && entry->state != REQCACHE_PENDING)
+    reqcache_free_entry(entry);
+}
+
+/*
+ * We've finished with an entry we were waiting on.
+ */
+static void reqcache_release(reqcache_entry_t *entry)
+{
+  entry->users --;
+  if (entry->users == 0 && !entry->in_table &&
+      entry->state != REQCACHE_PENDING)
+    reqcache_free_entry(entry);
+}
+
+/*
+ * Find the entry for a Request, if there is one we can use - that is, one
+ * that is waiting for its Reply, or that has a Reply that hasn't gone stale.
+ * Stale entries are thrown away as we go.
+ */
+static reqcache_entry_t *reqcache_find(kbus_reqcache_t *cache,
+                                       uint32_t         hash,
+                                       const char      *name,
+                                       uint32_t         name_len,
+                                       const void      *data,
+                                       uint32_t         data_len,
+                                       uint64_t         now)
+{
+  reqcache_entry_t *entry = cache->buckets[hash & (REQCACHE_NUM_BUCKETS - 1)];
+
+  while (entry) {
+    reqcache_entry_t *next = entry->next;
+
+    if (entry->state == REQCACHE_READY && entry->expires_ms <= now) {
+      reqcache_unlink(cache, entry);
+    } else if (entry->hash == hash &&
+               entry->name_len == name_len && entry->data_len == data_len &&
+               !memcmp(entry->name, name, name_len) &&
+               !memcmp(entry->data, data, data_len)) {
+      return entry;
+    }
+    entry = next;
+  }
+  return NULL;
+}
+
+/*
+ * Throw away every stale entry.
+ */
+static void reqcache_purge(kbus_reqcache_t *cache,
+                           uint64_t         now)
+{
+  int ii;
+
+  for (ii = 0; ii < REQCACHE_NUM_BUCKETS; ii++) {
+    reqcache_entry_t *entry = cache->buckets[ii];
+    while (entry) {
+      reqcache_entry_t *next = entry->next;
+      if (entry->state == REQCACHE_READY && entry->expires_ms <= now)
+        reqcache_unlink(cache, entry);
+      entry = next;
+    }
+  }
+}
+
+/*
+ * What TTL should Requests with this name have?
+ */
+static uint32_t reqcache_ttl_for(kbus_reqcache_t *cache,
+                                 const char      *name,
+                                 uint32_t         name_len)
+{
+  reqcache_ttl_t *ttl;
+
+  for (ttl = cache->ttls; ttl; ttl = ttl->next)
+    if (strlen(ttl->name) == name_len && !memcmp(ttl->name, name, name_len))
+      return ttl->ttl_ms;
+  return cache->default_ttl_ms;
+}
+
+/*
+ * Make a new entry for a Request we're about to send. If there is room, it
+ * goes into the hash table (so that others can find it), otherwise it is
+ * just for us.
+ *
+ * Returns the new entry, or NULL if we ran out of memory.
+ */
+static reqcache_entry_t *reqcache_new_entry(kbus_reqcache_t *cache,
+                                            uint32_t         hash,
+                                            const char      *name,
+                                            uint32_t         name_len,
+                                            const void      *data,
+                                            uint32_t         data_len,
+                                            uint64_t         now)
+{
+  reqcache_entry_t *entry;
+
+  entry = malloc(sizeof(*entry) + name_len + 1 + data_len);
+  if (!entry) return NULL;
+
+  memset(entry, 0, sizeof(*entry));
+  entry->hash = hash;
+  entry->name = (char *)(entry + 1);
+  entry->name_len = name_len;
+  memcpy(entry->name, name, name_len);
+  entry->name[name_len] = '\0';
+  entry->data = (uint8_t *)entry->name + name_len + 1;
+  entry->data_len = data_len;
+  memcpy(entry->data, data, data_len);
+  entry->state = REQCACHE_PENDING;
+  entry->ttl_ms = reqcache_ttl_for(cache, name, name_len);
+  entry->users = 1;
+
+  if (cache->num_entries >= cache->max_entries)
+    reqcache_purge(cache, now);
+
+  if (cache->num_entries < cache->max_entries) {
+    uint32_t bucket = hash & (REQCACHE_NUM_BUCKETS - 1);
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    entry->in_table = true;
+    cache->num_entries ++;
+  }
+  return entry;
+}
+
+/*
+ * Forget the cached Replies for Requests with the given name, or for all
+ * Requests if `name` is NULL.
+ *
+ * Requests that are still waiting for their Replies will get them, but they
+ * won't be cached, as they may be out of date already.
+ */
+static void reqcache_invalidate(kbus_reqcache_t *cache,
+                                const char      *name,
+                                uint32_t         name_len)
+{
+  int ii;
+
+  for (ii = 0; ii < REQCACHE_NUM_BUCKETS; ii++) {
+    reqcache_entry_t *entry = cache->buckets[ii];
+    while (entry) {
+      reqcache_entry_t *next = entry->next;
+      if (name == NULL ||
+          (entry->name_len == name_len &&
+           !memcmp(entry->name, name, name_len))) {
+        if (entry->state == REQCACHE_PENDING)
+          entry->ttl_ms = 0;
+        reqcache_unlink(cache, entry);
+      }
+      entry = next;
+    }
+  }
+  cache->stats.invalidations ++;
+}
+
+/*
+ * Deal with a message read from our Ksock. We take over the message.
+ */
+static void reqcache_dispatch(kbus_reqcache_t   *cache,
+                              kbus_message_t    *msg)
+{
+  if (msg->in_reply_to.network_id != 0 || msg->in_reply_to.serial_num != 0) {
+    reqcache_entry_t **prev = &cache->pending;
+    reqcache_entry_t  *entry;
+
+    while ((entry = *prev) != NULL) {
+      if (!kbus_msg_compare_ids(&entry->request_id, &msg->in_reply_to))
+        break;
+      prev = &entry->next_pending;
+    }
+    if (entry == NULL) {
+      kbus_msg_delete(&msg);
+      return;
+    }
+    *prev = entry->next_pending;
+    entry->next_pending = NULL;
+
+    entry->reply = msg;
+    entry->state = REQCACHE_READY;
+    entry->expires_ms = reqcache_now_ms() + entry->ttl_ms;
+
+    // Synthetic Replies (the Replier went away, etc.) are not worth keeping
+    if (entry->ttl_ms == 0 || (msg->flags & KBUS_BIT_SYNTHETIC))
+      reqcache_unlink(cache, entry);
+    else if (!entry->in_table && entry->users == 0)
+      reqcache_free_entry(entry);
+    return;
+  }
+
+  if (cache->invalidate_name &&
+      msg->name_len == strlen(cache->invalidate_name) &&
+      !memcmp(kbus_msg_name_ptr(msg), cache->invalidate_name, msg->name_len)) {
+    // The data may name the Requests to forget, otherwise forget them all
+    const char *name = kbus_msg_data_ptr(msg);
+    uint32_t    name_len = msg->data_len;
+    while (name_len > 0 && name[name_len - 1] == '\0')
+      name_len --;
+    reqcache_invalidate(cache, name_len ? name : NULL, name_len);
+  }
+  kbus_msg_delete(&msg);
+}
+
+/*
+ * Deal with any messages waiting on our Ksock, without waiting for more.
+ * Only to be called when no-one else is reading it.
+ */
+static int reqcache_drain(kbus_reqcache_t *cache)
+{
+  for (;;) {
+    kbus_message_t *msg;
+    int rv = kbus_ksock_read_next_msg(cache->ksock, &msg);
+    if (rv < 0) return rv;
+    if (msg == NULL) return 0;
+    reqcache_dispatch(cache, msg);
+  }
+}
+
+/*
+ * Send the Request for a new entry.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+static int reqcache_send(kbus_reqcache_t   *cache,
+                         reqcache_entry_t  *entry)
+{
+  kbus_message_t *msg;
+  int             rv;
+
+  rv = kbus_msg_create_request(&msg, entry->name, entry->name_len,
+                               entry->data_len ? entry->data : NULL,
+                               entry->data_len, 0);
+  if (rv) return rv;
+
+  rv = kbus_ksock_send_msg(cache->ksock, msg, &entry->request_id);
+  kbus_msg_delete(&msg);
+  if (rv) return rv;
+
+  entry->next_pending = cache->pending;
+  cache->pending = entry;
+  return 0;
+}
+
+/*
+ * Wait for an entry's Reply to arrive.
+ *
+ * Only one thread at a time reads our Ksock - the others wait for it to tell
+ * them something has happened. Whoever is reading passes on any Replies it
+ * reads, whoever they are for.
+ *
+ * Must be called with the cache locked, and returns with it locked.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+static int reqcache_wait(kbus_reqcache_t   *cache,
+                         reqcache_entry_t  *entry)
+{
+  while (entry->state == REQCACHE_PENDING) {
+    kbus_message_t *msg = NULL;
+    int             rv;
+
+    if (cache->reading) {
+      pthread_cond_wait(&cache->changed, &cache->lock);
+      continue;
+    }
+
+    cache->reading = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    rv = kbus_wait_for_message(cache->ksock, KBUS_KSOCK_READABLE);
+    if (rv >= 0)
+      rv = kbus_ksock_read_next_msg(cache->ksock, &msg);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->reading = false;
+    if (msg)
+      reqcache_dispatch(cache, msg);
+    pthread_cond_broadcast(&cache->changed);
+    if (rv < 0)
+      return rv;
+  }
+  return 0;
+}
+
+/*
+ * Make a new Request cache, using an open Ksock, which it takes over (and
+ * closes if anything goes wrong).
+ */
+static int reqcache_new(kbus_reqcache_t       **cache,
+                        kbus_ksock_t            ksock,
+                        uint32_t                max_entries,
+                        uint32_t                default_ttl_ms,
+                        const char             *invalidate_name)
+{
+  kbus_reqcache_t *new;
+  int              rv;
+
+  *cache = NULL;
+
+  if (ksock < 0)
+    return ksock;
+
+  new = malloc(sizeof(*new));
+  if (!new) {
+    kbus_ksock_close(ksock);
+    return -ENOMEM;
+  }
+  memset(new, 0, sizeof(*new));
+
+  new->ksock = ksock;
+  new->max_entries = max_entries ? max_entries : KBUS_REQCACHE_DEF_MAX_ENTRIES;
+  new->default_ttl_ms = default_ttl_ms;
+
+  if (invalidate_name) {
+    new->invalidate_name = strdup(invalidate_name);
+    if (!new->invalidate_name) {
+      kbus_ksock_close(ksock);
+      free(new);
+      return -ENOMEM;
+    }
+
+    rv = kbus_ksock_bind(ksock, invalidate_name, false);
+    if (rv) {
+      kbus_ksock_close(ksock);
+      free(new->invalidate_name);
+      free(new);
+      return rv;
+    }
+  }
+
+  pthread_mutex_init(&new->lock, NULL);
+  pthread_cond_init(&new->changed, NULL);
+
+  *cache = new;
+  return 0;
+}
+
+/*
+ * Create a new Request cache.
+ *
+ * `cache` is the new cache.
+ *
+ * `device_number` is the KBUS device on which it will make its Requests, using
+ * a Ksock of its own.
+ *
+ * `max_entries` is the most Replies it will remember at once, or 0 for
+ * KBUS_REQCACHE_DEF_MAX_ENTRIES. If the cache is full (of Replies that have
+ * not expired), new Requests still work, but their Replies are not kept.
+ *
+ * `default_ttl_ms` is how long a Reply is kept (in milliseconds), unless
+ * ``kbus_reqcache_set_ttl()`` says otherwise for its name. A TTL of 0 means
+ * Replies are not kept at all, but identical Requests made at the same time
+ * (by different threads) still share a single Reply.
+ *
+ * If `invalidate_name` is not NULL, then the cache listens for Announcements
+ * with that name. If such an Announcement has data, it is taken as a message
+ * name, and all the Replies to Requests with that name are forgotten.
+ * Otherwise, all Replies are forgotten.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_new(kbus_reqcache_t  **cache,
+                             uint32_t           device_number,
+                             uint32_t           max_entries,
+                             uint32_t           default_ttl_ms,
+                             const char        *invalidate_name)
+{
+  return reqcache_new(cache, kbus_ksock_open(device_number, O_RDWR),
+                      max_entries, default_ttl_ms, invalidate_name);
+}
+
+/*
+ * Create a new Request cache on a loopback bus.
+ *
+ * This is the same as ``kbus_reqcache_new()``, except that the cache's Ksock
+ * is opened with ``kbus_ksock_open_loopback()``, on loopback bus
+ * `bus_number`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_new_loopback(kbus_reqcache_t  **cache,
+                                      uint32_t           bus_number,
+                                      uint32_t           max_entries,
+                                      uint32_t           default_ttl_ms,
+                                      const char        *invalidate_name)
+{
+  return reqcache_new(cache, kbus_ksock_open_loopback(bus_number, O_RDWR),
+                      max_entries, default_ttl_ms, invalidate_name);
+}
+
+/*
+ * Free a Request cache, and close its Ksock.
+ *
+ * No-one may be using the cache when it is freed.
+ *
+ * Does nothing if `cache` is NULL, or `*cache` is NULL.
+ */
+extern void kbus_reqcache_free(kbus_reqcache_t **cache)
+{
+  kbus_reqcache_t *this;
+  reqcache_ttl_t  *ttl;
+  int              ii;
+
+  if (cache == NULL || *cache == NULL)
+    return;
+  this = *cache;
+
+  // Anything still pending that is not in the table is only on this list
+  while (this->pending) {
+    reqcache_entry_t *next = this->pending->next_pending;
+    if (!this->pending->in_table)
+      reqcache_free_entry(this->pending);
+    this->pending = next;
+  }
+  for (ii = 0; ii < REQCACHE_NUM_BUCKETS; ii++) {
+    reqcache_entry_t *entry = this->buckets[ii];
+    while (entry) {
+      reqcache_entry_t *next = entry->next;
+      reqcache_free_entry(entry);
+      entry = next;
+    }
+  }
+
+  ttl = this->ttls;
+  while (ttl) {
+    reqcache_ttl_t *next = ttl->next;
+    free(ttl->name);
+    free(ttl);
+    ttl = next;
+  }
+
+  kbus_ksock_close(this->ksock);
+  pthread_cond_destroy(&this->changed);
+  pthread_mutex_destroy(&this->lock);
+  free(this->invalidate_name);
+  free(this);
+  *cache = NULL;
+}
+
+/*
+ * Set the TTL (in milliseconds) for Replies to Requests with the given name.
+ *
+ * A TTL of 0 means such Replies are not kept. The new TTL applies to Requests
+ * sent from now on.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_set_ttl(kbus_reqcache_t    *cache,
+                                 const char         *name,
+                                 uint32_t            ttl_ms)
+{
+  reqcache_ttl_t *ttl;
+
+  pthread_mutex_lock(&cache->lock);
+  for (ttl = cache->ttls; ttl; ttl = ttl->next)
+    if (!strcmp(ttl->name, name))
+      break;
+
+  if (ttl == NULL) {
+    ttl = malloc(sizeof(*ttl));
+    if (ttl) ttl->name = strdup(name);
+    if (ttl == NULL || ttl->name == NULL) {
+      free(ttl);
+      pthread_mutex_unlock(&cache->lock);
+      return -ENOMEM;
+    }
+    ttl->next = cache->ttls;
+    cache->ttls = ttl;
+  }
+  ttl->ttl_ms = ttl_ms;
+  pthread_mutex_unlock(&cache->lock);
+  return 0;
+}
+
+/*
+ * Make a Request through the cache.
+ *
+ * If there is a cached Reply to a Request with this `name` and `data`, that
+ * is returned straight away. If an identical Request is already waiting for
+ * its Reply, we wait for (and share) that Reply. Otherwise the Request is
+ * sent, and we wait for its Reply.
+ *
+ * `data` is the Request's data, or NULL if there is none. `data_len` is then
+ * the length of the data, in bytes.
+ *
+ * `reply` is a copy of the Reply, an "entire" message, which the caller should
+ * free with ``kbus_msg_delete()``. Note that it may be a synthetic message
+ * (for instance, if the Replier went away) - these are never cached.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure - for
+ * instance, the error from sending the Request.
+ */
+extern int kbus_reqcache_request(kbus_reqcache_t    *cache,
+                                 const char         *name,
+                                 const void         *data,
+                                 uint32_t            data_len,
+                                 kbus_message_t    **reply)
+{
+  uint32_t          name_len = strlen(name);
+  uint32_t          hash = reqcache_hash(name, name_len, data, data_len);
+  uint64_t          now = reqcache_now_ms();
+  reqcache_entry_t *entry;
+  size_t            length;
+  int               rv = 0;
+
+  *reply = NULL;
+
+  pthread_mutex_lock(&cache->lock);
+
+  // Look for invalidations (if we care), unless someone else will
+  if (cache->invalidate_name && !cache->reading) {
+    rv = reqcache_drain(cache);
+    if (rv) goto done;
+  }
+
+  entry = reqcache_find(cache, hash, name, name_len, data, data_len, now);
+  if (entry && entry->state == REQCACHE_READY) {
+    cache->stats.hits ++;
+    entry->users ++;
+  } else if (entry) {
+    cache->stats.coalesced ++;
+    entry->users ++;
+  } else {
+    cache->stats.misses ++;
+    entry = reqcache_new_entry(cache, hash, name, name_len, data, data_len,
+                               now);
+    if (!entry) {
+      rv = -ENOMEM;
+      goto done;
+    }
+    rv = reqcache_send(cache, entry);
+    if (rv) {
+      // No-one else can be waiting for it yet
+      entry->state = REQCACHE_FAILED;
+      entry->error = rv;
+      entry->users --;
+      reqcache_unlink(cache, entry);
+      goto done;
+    }
+  }
+
+  rv = reqcache_wait(cache, entry);
+  if (rv == 0 && entry->state == REQCACHE_FAILED)
+    rv = entry->error;
+  if (rv == 0) {
+    length = KBUS_ENTIRE_MSG_LEN(entry->reply->name_len,
+                                 entry->reply->data_len);
+    *reply = malloc(length);
+    if (*reply)
+      memcpy(*reply, entry->reply, length);
+    else
+      rv = -ENOMEM;
+  }
+  reqcache_release(entry);
+
+done:
+  pthread_mutex_unlock(&cache->lock);
+  return rv;
+}
+
+/*
+ * Forget the cached Replies to Requests with the given name, or all cached
+ * Replies if `name` is NULL.
+ *
+ * This has the same effect as the cache's invalidation Announcement.
+ */
+extern void kbus_reqcache_invalidate(kbus_reqcache_t    *cache,
+                                     const char         *name)
+{
+  pthread_mutex_lock(&cache->lock);
+  reqcache_invalidate(cache, name, name ? strlen(name) : 0);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Find out what the cache has been doing.
+ */
+extern void kbus_reqcache_get_stats(kbus_reqcache_t         *cache,
+                                    kbus_reqcache_stats_t   *stats)
+{
+  pthread_mutex_lock(&cache->lock);
+  *stats = cache->stats;
+  stats->entries = cache->num_entries;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
@@ -0,0 +1,197 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifndef _REQCACHE_H_INCLUDED_
+#define _REQCACHE_H_INCLUDED_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// NOTE that the middle portion of this file is autogenerated from reqcache.c
+// so that the function header comments and function prototypes may be
+// automatically kept in-step. This allows me to treat the C file as the main
+// specification of the functions it defines, and also to keep C header
+// comments in the C file, which I find easier when keeping the comments
+// correct as the code is edited.
+//
+// The Python script extract_hdrs.py is used to perform this autogeneration.
+// It should transfer any C function marked as 'extern' and with a header
+// comment (of the '/*...*...*/' form).
+
+/*
+ * A cache of the Replies to idempotent Requests.
+ *
+ * Requests made through the cache are sent on its own Ksock. A Reply is
+ * remembered, keyed on the Request's name and data, for the TTL ("time to
+ * live") given for that name, and any identical Request in that time is
+ * answered from the cache, without going near KBUS. Identical Requests made
+ * (by different threads) whilst the first is still waiting for its Reply all
+ * share that Reply, so only one of them is actually sent.
+ *
+ * This is created by a call to kbus_reqcache_new(), and freed by a call to
+ * kbus_reqcache_free(). It may be used by any number of threads at once.
+ */
+struct kbus_reqcache;
+typedef struct kbus_reqcache kbus_reqcache_t;
+
+/*
+ * What the cache has been doing, as returned by kbus_reqcache_get_stats().
+ */
+struct kbus_reqcache_stats {
+  uint64_t      hits;           // Requests answered from the cache
+  uint64_t      misses;         // Requests actually sent
+  uint64_t      coalesced;      // Requests that shared another's Reply
+  uint64_t      invalidations;  // Invalidation announcements (or calls)
+  uint32_t      entries;        // How many Replies are currently cached
+};
+typedef struct kbus_reqcache_stats kbus_reqcache_stats_t;
+
+// The default maximum number of cached Replies
+#define KBUS_REQCACHE_DEF_MAX_ENTRIES   1024
+
+// -------- TEXT AFTER THIS AUTOGENERATED - DO NOT EDIT --------
+// Autogenerated by extract_hdrs.py on 2026-10-18 (Sun 18 Oct 2026) at 13:58
+
+/*
+ * Create a new Request cache.
+ *
+ * `cache` is the new cache.
+ *
+ * `device_number` is the KBUS device on which it will make its Requests, using
+ * a Ksock of its own.
+ *
+ * `max_entries` is the most Replies it will remember at once, or 0 for
+ * KBUS_REQCACHE_DEF_MAX_ENTRIES. If the cache is full (of Replies that have
+ * not expired), new Requests still work, but their Replies are not kept.
+ *
+ * `default_ttl_ms` is how long a Reply is kept (in milliseconds), unless
+ * ``kbus_reqcache_set_ttl()`` says otherwise for its name. A TTL of 0 means
+ * Replies are not kept at all, but identical Requests made at the same time
+ * (by different threads) still share a single Reply.
+ *
+ * If `invalidate_name` is not NULL, then the cache listens for Announcements
+ * with that name. If such an Announcement has data, it is taken as a message
+ * name, and all the Replies to Requests with that name are forgotten.
+ * Otherwise, all Replies are forgotten.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_new(kbus_reqcache_t  **cache,
+                             uint32_t           device_number,
+                             uint32_t           max_entries,
+                             uint32_t           default_ttl_ms,
+                             const char        *invalidate_name);
+
+/*
+ * Create a new Request cache on a loopback bus.
+ *
+ * This is the same as ``kbus_reqcache_new()``, except that the cache's Ksock
+ * is opened with ``kbus_ksock_open_loopback()``, on loopback bus
+ * `bus_number`.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_new_loopback(kbus_reqcache_t  **cache,
+                                      uint32_t           bus_number,
+                                      uint32_t           max_entries,
+                                      uint32_t           default_ttl_ms,
+                                      const char        *invalidate_name);
+
+/*
+ * Free a Request cache, and close its Ksock.
+ *
+ * No-one may be using the cache when it is freed.
+ *
+ * Does nothing if `cache` is NULL, or `*cache` is NULL.
+ */
+extern void kbus_reqcache_free(kbus_reqcache_t **cache);
+
+/*
+ * Set the TTL (in milliseconds) for Replies to Requests with the given name.
+ *
+ * A TTL of 0 means such Replies are not kept. The new TTL applies to Requests
+ * sent from now on.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure.
+ */
+extern int kbus_reqcache_set_ttl(kbus_reqcache_t    *cache,
+                                 const char         *name,
+                                 uint32_t            ttl_ms);
+
+/*
+ * Make a Request through the cache.
+ *
+ * If there is a cached Reply to a Request with this `name` and `data`, that
+ * is returned straight away. If an identical Request is already waiting for
+ * its Reply, we wait for (and share) that Reply. Otherwise the Request is
+ * sent, and we wait for its Reply.
+ *
+ * `data` is the Request's data, or NULL if there is none. `data_len` is then
+ * the length of the data, in bytes.
+ *
+ * `reply` is a copy of the Reply, an "entire" message, which the caller should
+ * free with ``kbus_msg_delete()``. Note that it may be a synthetic message
+ * (for instance, if the Replier went away) - these are never cached.
+ *
+ * Returns 0 for success, or a negative number (``-errno``) for failure - for
+ * instance, the error from sending the Request.
+ */
+extern int kbus_reqcache_request(kbus_reqcache_t    *cache,
+                                 const char         *name,
+                                 const void         *data,
+                                 uint32_t            data_len,
+                                 kbus_message_t    **reply);
+
+/*
+ * Forget the cached Replies to Requests with the given name, or all cached
+ * Replies if `name` is NULL.
+ *
+ * This has the same effect as the cache's invalidation Announcement.
+ */
+extern void kbus_reqcache_invalidate(kbus_reqcache_t    *cache,
+                                     const char         *name);
+
+/*
+ * Find out what the cache has been doing.
+ */
+extern void kbus_reqcache_get_stats(kbus_reqcache_t         *cache,
+                                    kbus_reqcache_stats_t   *stats);
+// -------- TEXT BEFORE THIS AUTOGENERATED - DO NOT EDIT --------
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _REQCACHE_H_INCLUDED_ */
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
@@ -0,0 +1,787 @@
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Tests for libkbus. These only use loopback Ksocks (see
+ * kbus_ksock_open_loopback()), so they do not need the KBUS kernel module.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kbus.h"
+#include "mux.h"
+#include "reqcache.h"
+
+// Each test uses a loopback bus of its own
+#define BUS_ROUTING     1
+#define BUS_SYNTHETIC   2
+#define BUS_WAIT        3
+#define BUS_AUTO_SEND   4
+#define BUS_ONLY_ONCE   5
+#define BUS_REQCACHE    6
+#define BUS_MUX         7
+
+static kbus_ksock_t open_ksock(uint32_t bus_number)
+{
+  kbus_ksock_t ks = kbus_ksock_open_loopback(bus_number, O_RDWR);
+  assert(ks >= 0);
+  return ks;
+}
+
+/*
+ * What poll() says about a Ksock, without waiting.
+ */
+static int ready(kbus_ksock_t ks)
+{
+  struct pollfd fds[1];
+
+  fds[0].fd = ks;
+  fds[0].events = POLLIN | POLLOUT;
+  fds[0].revents = 0;
+  assert(poll(fds, 1, 0) >= 0);
+  return fds[0].revents;
+}
+
+static int send_msg(kbus_ksock_t ks, const char *name, uint32_t flags,
+                    kbus_msg_id_t *msg_id)
+{
+  kbus_message_t *msg;
+  int rv;
+
+  if (flags & KBUS_BIT_WANT_A_REPLY)
+    rv = kbus_msg_create_request(&msg, name, strlen(name), NULL, 0,
+                                 flags & ~KBUS_BIT_WANT_A_REPLY);
+  else
+    rv = kbus_msg_create(&msg, name, strlen(name), NULL, 0, flags);
+  assert(rv == 0);
+  rv = kbus_ksock_send_msg(ks, msg, msg_id);
+  kbus_msg_delete(&msg);
+  return rv;
+}
+
+/*
+ * Read the next message, which must have the given name. The caller should
+ * delete it.
+ */
+static kbus_message_t *expect_msg(kbus_ksock_t ks, const char *name)
+{
+  kbus_message_t *msg = NULL;
+  int rv = kbus_ksock_read_next_msg(ks, &msg);
+
+  assert(rv == 0);
+  assert(msg != NULL);
+  assert(msg->name_len == strlen(name));
+  assert(!memcmp(kbus_msg_name_ptr(msg), name, msg->name_len));
+  return msg;
+}
+
+static void expect_nothing(kbus_ksock_t ks)
+{
+  kbus_message_t *msg = NULL;
+
+  assert(kbus_ksock_read_next_msg(ks, &msg) == 0);
+  assert(msg == NULL);
+  assert(!(ready(ks) & POLLIN));
+}
+
+static void expect_synthetic_reply(kbus_ksock_t ks, const char *name,
+                                   const kbus_msg_id_t *request_id)
+{
+  kbus_message_t *msg = expect_msg(ks, name);
+
+  assert(msg->flags & KBUS_BIT_SYNTHETIC);
+  assert(kbus_msg_compare_ids(&msg->in_reply_to, request_id) == 0);
+  kbus_msg_delete(&msg);
+}
+
+static int testLoopbackRouting(void)
+{
+  kbus_ksock_t sender = open_ksock(BUS_ROUTING);
+  kbus_ksock_t star = open_ksock(BUS_ROUTING);
+  kbus_ksock_t percent = open_ksock(BUS_ROUTING);
+  kbus_ksock_t exact = open_ksock(BUS_ROUTING);
+  kbus_ksock_t listener = open_ksock(BUS_ROUTING);
+  kbus_ksock_t other = open_ksock(BUS_ROUTING);
+  kbus_message_t *msg;
+  uint32_t replier, star_id, percent_id;
+
+  assert(kbus_ksock_id(star, &star_id) == 0);
+  assert(kbus_ksock_id(percent, &percent_id) == 0);
+
+  assert(kbus_ksock_bind(star, "$.Fred.*", 1) == 0);
+  assert(kbus_ksock_bind(percent, "$.Fred.%", 1) == 0);
+  assert(kbus_ksock_bind(exact, "$.Fred.Jim", 1) == 0);
+  assert(kbus_ksock_bind(listener, "$.Fred.*", 0) == 0);
+
+  // Only one Replier for each name
+  assert(kbus_ksock_bind(other, "$.Fred.Jim", 1) == -EADDRINUSE);
+  assert(kbus_ksock_bind(other, "$.Fred.*", 1) == -EADDRINUSE);
+  // But anyone may listen
+  assert(kbus_ksock_bind(other, "$.Fred.Jim", 0) == 0);
+
+  // As with KBUS, this only finds the Replier bound to exactly that name
+  assert(kbus_ksock_find_replier(sender, "$.Fred.%", &replier) == 0);
+  assert(replier == percent_id);
+  assert(kbus_ksock_find_replier(sender, "$.Fred.*", &replier) == 0);
+  assert(replier == star_id);
+  assert(kbus_ksock_find_replier(sender, "$.Fred.Bob", &replier) == 0);
+  assert(replier == 0);
+
+  // But the most specific Replier gets each Request
+  assert(send_msg(sender, "$.Fred.Jim", KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  assert(send_msg(sender, "$.Fred.Bob", KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  assert(send_msg(sender, "$.Fred.Bob.Jim", KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+
+  msg = expect_msg(exact, "$.Fred.Jim");
+  assert(kbus_msg_wants_us_to_reply(msg));
+  kbus_msg_delete(&msg);
+  expect_nothing(exact);
+
+  msg = expect_msg(percent, "$.Fred.Bob");
+  assert(kbus_msg_wants_us_to_reply(msg));
+  kbus_msg_delete(&msg);
+  expect_nothing(percent);
+
+  msg = expect_msg(star, "$.Fred.Bob.Jim");
+  assert(kbus_msg_wants_us_to_reply(msg));
+  kbus_msg_delete(&msg);
+  expect_nothing(star);
+
+  // The Listener hears all of them, but need not reply
+  msg = expect_msg(listener, "$.Fred.Jim");
+  assert(kbus_msg_is_request(msg) && !kbus_msg_wants_us_to_reply(msg));
+  kbus_msg_delete(&msg);
+  msg = expect_msg(listener, "$.Fred.Bob");
+  kbus_msg_delete(&msg);
+  msg = expect_msg(listener, "$.Fred.Bob.Jim");
+  kbus_msg_delete(&msg);
+  expect_nothing(listener);
+
+  msg = expect_msg(other, "$.Fred.Jim");
+  kbus_msg_delete(&msg);
+  expect_nothing(other);
+
+  // A Request with no Replier fails at once
+  assert(send_msg(sender, "$.Jim", KBUS_BIT_WANT_A_REPLY, NULL) ==
+         -EADDRNOTAVAIL);
+
+  assert(kbus_ksock_close(other) == 0);
+  assert(kbus_ksock_close(listener) == 0);
+  assert(kbus_ksock_close(exact) == 0);
+  assert(kbus_ksock_close(percent) == 0);
+  assert(kbus_ksock_close(star) == 0);
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+static int testLoopbackSynthetic(void)
+{
+  kbus_ksock_t sender = open_ksock(BUS_SYNTHETIC);
+  kbus_ksock_t replier = open_ksock(BUS_SYNTHETIC);
+  kbus_msg_id_t id1, id2;
+  kbus_message_t *msg;
+
+  // A Replier that unbinds with Requests still queued
+  assert(kbus_ksock_bind(replier, "$.Question", 1) == 0);
+  assert(send_msg(sender, "$.Question", KBUS_BIT_WANT_A_REPLY, &id1) == 0);
+  assert(kbus_ksock_unbind(replier, "$.Question", 1) == 0);
+  expect_synthetic_reply(sender, KBUS_MSG_NAME_REPLIER_UNBOUND, &id1);
+  expect_nothing(sender);
+  expect_nothing(replier);
+
+  // A Replier that goes away, having read one Request but not the other
+  assert(kbus_ksock_bind(replier, "$.Question", 1) == 0);
+  assert(send_msg(sender, "$.Question", KBUS_BIT_WANT_A_REPLY, &id1) == 0);
+  assert(send_msg(sender, "$.Question", KBUS_BIT_WANT_A_REPLY, &id2) == 0);
+  msg = expect_msg(replier, "$.Question");
+  kbus_msg_delete(&msg);
+  assert(kbus_ksock_close(replier) == 0);
+  expect_synthetic_reply(sender, KBUS_MSG_NAME_REPLIER_GONEAWAY, &id2);
+  expect_synthetic_reply(sender, KBUS_MSG_NAME_REPLIER_IGNORED, &id1);
+  expect_nothing(sender);
+
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+static int testLoopbackAllOrWait(void)
+{
+  kbus_ksock_t sender = open_ksock(BUS_WAIT);
+  kbus_ksock_t listener = open_ksock(BUS_WAIT);
+  uint32_t max_messages = 1;
+  kbus_msg_id_t id1, id2;
+  kbus_message_t *msg;
+
+  assert(kbus_ksock_max_messages(listener, &max_messages) == 0);
+  assert(kbus_ksock_bind(listener, "$.Fred", 0) == 0);
+
+  assert(send_msg(sender, "$.Fred", KBUS_BIT_ALL_OR_WAIT, &id1) == 0);
+  assert(send_msg(sender, "$.Fred", KBUS_BIT_ALL_OR_WAIT, &id2) == -EAGAIN);
+
+  // Whilst the send is blocked, the sender is neither writable, nor readable
+  assert(ready(sender) == 0);
+  assert(ready(listener) == (POLLIN | POLLOUT));
+
+  // Reading the first message makes room for the second, which is then sent
+  msg = expect_msg(listener, "$.Fred");
+  assert(kbus_msg_compare_ids(&msg->id, &id1) == 0);
+  kbus_msg_delete(&msg);
+
+  assert(ready(sender) == POLLOUT);
+  msg = expect_msg(listener, "$.Fred");
+  assert(kbus_msg_compare_ids(&msg->id, &id2) == 0);
+  kbus_msg_delete(&msg);
+  expect_nothing(listener);
+  expect_nothing(sender);
+
+  // Whereas ALL_OR_FAIL does not wait
+  assert(send_msg(sender, "$.Fred", KBUS_BIT_ALL_OR_FAIL, NULL) == 0);
+  assert(send_msg(sender, "$.Fred", KBUS_BIT_ALL_OR_FAIL, NULL) == -EBUSY);
+  assert(ready(sender) == POLLOUT);
+  msg = expect_msg(listener, "$.Fred");
+  kbus_msg_delete(&msg);
+  expect_nothing(listener);
+
+  assert(kbus_ksock_close(listener) == 0);
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+static int testLoopbackAutoSend(void)
+{
+  kbus_ksock_t sender = open_ksock(BUS_AUTO_SEND);
+  kbus_ksock_t listener = open_ksock(BUS_AUTO_SEND);
+  kbus_msg_id_t id1, id2;
+  kbus_message_t *msg;
+
+  assert(kbus_ksock_bind(listener, "$.Fred", 0) == 0);
+
+  assert(kbus_ksock_auto_send(sender, 0xFFFFFFFF) == 0);
+  assert(kbus_ksock_auto_send(sender, 1) == 0);
+  assert(kbus_ksock_auto_send(sender, 0xFFFFFFFF) == 1);
+
+  // Each message is sent exactly once, with or without asking for its id
+  assert(send_msg(sender, "$.Fred", 0, &id1) == 0);
+  assert(send_msg(sender, "$.Fred", 0, NULL) == 0);
+  assert(kbus_ksock_last_msg_id(sender, &id2) == 0);
+  assert(id2.serial_num == id1.serial_num + 1);
+
+  msg = expect_msg(listener, "$.Fred");
+  assert(kbus_msg_compare_ids(&msg->id, &id1) == 0);
+  kbus_msg_delete(&msg);
+  msg = expect_msg(listener, "$.Fred");
+  assert(kbus_msg_compare_ids(&msg->id, &id2) == 0);
+  kbus_msg_delete(&msg);
+  expect_nothing(listener);
+
+  // And sending explicitly works again once auto send is off
+  assert(kbus_ksock_auto_send(sender, 0) == 1);
+  assert(send_msg(sender, "$.Fred", 0, &id1) == 0);
+  assert(id1.serial_num == id2.serial_num + 1);
+  msg = expect_msg(listener, "$.Fred");
+  kbus_msg_delete(&msg);
+  expect_nothing(listener);
+
+  assert(kbus_ksock_close(listener) == 0);
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+static int testLoopbackOnlyOnce(void)
+{
+  kbus_ksock_t sender = open_ksock(BUS_ONLY_ONCE);
+  kbus_ksock_t ks = open_ksock(BUS_ONLY_ONCE);
+  kbus_message_t *msg;
+
+  assert(kbus_ksock_bind(ks, "$.Fred", 0) == 0);
+  assert(kbus_ksock_bind(ks, "$.*", 0) == 0);
+  assert(kbus_ksock_bind(ks, "$.Fred", 1) == 0);
+
+  // By default, one copy for each binding
+  assert(send_msg(sender, "$.Fred", 0, NULL) == 0);
+  msg = expect_msg(ks, "$.Fred");
+  kbus_msg_delete(&msg);
+  msg = expect_msg(ks, "$.Fred");
+  kbus_msg_delete(&msg);
+  expect_nothing(ks);
+
+  assert(kbus_ksock_only_once(ks, 0xFFFFFFFF) == 0);
+  assert(kbus_ksock_only_once(ks, 1) == 0);
+  assert(kbus_ksock_only_once(ks, 0xFFFFFFFF) == 1);
+
+  assert(send_msg(sender, "$.Fred", 0, NULL) == 0);
+  msg = expect_msg(ks, "$.Fred");
+  kbus_msg_delete(&msg);
+  expect_nothing(ks);
+
+  // A Request we should reply to is the copy we get
+  assert(send_msg(sender, "$.Fred", KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  msg = expect_msg(ks, "$.Fred");
+  assert(kbus_msg_wants_us_to_reply(msg));
+  kbus_msg_delete(&msg);
+  expect_nothing(ks);
+
+  assert(kbus_ksock_close(ks) == 0);
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+// ===========================================================================
+// Request cache
+
+/*
+ * A Replier for "$.Cache.%", which answers each Request with how many
+ * Requests it has had so far. It holds on to Requests for "$.Cache.Slow"
+ * until `hold` is cleared.
+ */
+struct cache_replier {
+  kbus_ksock_t          ksock;
+  pthread_t             thread;
+  volatile int          stop;
+  volatile int          hold;
+  volatile uint32_t     count;
+};
+
+static void *cache_replier_main(void *arg)
+{
+  struct cache_replier *replier = arg;
+
+  while (!replier->stop) {
+    struct pollfd   fds[1];
+    kbus_message_t *msg = NULL;
+    kbus_message_t *reply;
+    uint32_t        count;
+
+    fds[0].fd = replier->ksock;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    if (poll(fds, 1, 10) <= 0)
+      continue;
+    assert(kbus_ksock_read_next_msg(replier->ksock, &msg) == 0);
+    if (msg == NULL)
+      continue;
+    assert(kbus_msg_wants_us_to_reply(msg));
+
+    if (msg->name_len == strlen("$.Cache.Slow") &&
+        !memcmp(kbus_msg_name_ptr(msg), "$.Cache.Slow", msg->name_len))
+      while (replier->hold)
+        usleep(1000);
+
+    count = ++ replier->count;
+    assert(kbus_msg_create_reply_to(&reply, msg, &count, sizeof(count), 0) == 0);
+    assert(kbus_ksock_send_msg(replier->ksock, reply, NULL) == 0);
+    kbus_msg_delete(&reply);
+    kbus_msg_delete(&msg);
+  }
+  return NULL;
+}
+
+/*
+ * Make a Request through the cache, and return the count in its Reply (or 0
+ * if the Reply was synthetic).
+ */
+static uint32_t cache_request(kbus_reqcache_t *cache, const char *name)
+{
+  kbus_message_t *reply;
+  uint32_t        count = 0;
+
+  assert(kbus_reqcache_request(cache, name, "key", 3, &reply) == 0);
+  assert(reply != NULL);
+  if (!(reply->flags & KBUS_BIT_SYNTHETIC)) {
+    assert(reply->data_len == sizeof(count));
+    memcpy(&count, kbus_msg_data_ptr(reply), sizeof(count));
+  }
+  kbus_msg_delete(&reply);
+  return count;
+}
+
+struct cache_requester {
+  kbus_reqcache_t      *cache;
+  const char           *name;
+  pthread_t             thread;
+  uint32_t              count;
+};
+
+static void *cache_requester_main(void *arg)
+{
+  struct cache_requester *requester = arg;
+  requester->count = cache_request(requester->cache, requester->name);
+  return NULL;
+}
+
+static void start_requester(struct cache_requester *requester,
+                            kbus_reqcache_t *cache, const char *name)
+{
+  requester->cache = cache;
+  requester->name = name;
+  requester->count = 0;
+  assert(pthread_create(&requester->thread, NULL, cache_requester_main,
+                        requester) == 0);
+}
+
+static void expect_stats(kbus_reqcache_t *cache, uint64_t hits,
+                         uint64_t misses, uint64_t coalesced, uint32_t entries)
+{
+  kbus_reqcache_stats_t stats;
+
+  kbus_reqcache_get_stats(cache, &stats);
+  assert(stats.hits == hits);
+  assert(stats.misses == misses);
+  assert(stats.coalesced == coalesced);
+  assert(stats.entries == entries);
+}
+
+static int testRequestCache(void)
+{
+  kbus_ksock_t announcer = open_ksock(BUS_REQCACHE);
+  struct cache_replier replier;
+  struct cache_requester first, second;
+  kbus_reqcache_stats_t stats;
+  kbus_reqcache_t *cache;
+  kbus_ksock_t gone;
+  uint32_t count;
+
+  memset(&replier, 0, sizeof(replier));
+  replier.ksock = open_ksock(BUS_REQCACHE);
+  assert(kbus_ksock_bind(replier.ksock, "$.Cache.%", 1) == 0);
+  assert(pthread_create(&replier.thread, NULL, cache_replier_main,
+                        &replier) == 0);
+
+  assert(kbus_reqcache_new_loopback(&cache, BUS_REQCACHE, 0, 60000,
+                                    "$.Cache.Invalidate") == 0);
+
+  // A miss, and then a hit with the same Reply
+  count = cache_request(cache, "$.Cache.A");
+  assert(count == 1);
+  assert(cache_request(cache, "$.Cache.A") == count);
+  expect_stats(cache, 1, 1, 0, 1);
+
+  // Different data is a different Request
+  {
+    kbus_message_t *reply;
+    assert(kbus_reqcache_request(cache, "$.Cache.A", "other", 5, &reply) == 0);
+    kbus_msg_delete(&reply);
+    expect_stats(cache, 1, 2, 0, 2);
+  }
+
+  // Identical Requests made whilst the first is waiting share its Reply
+  replier.hold = 1;
+  start_requester(&first, cache, "$.Cache.Slow");
+  do {
+    usleep(1000);
+    kbus_reqcache_get_stats(cache, &stats);
+  } while (stats.misses < 3);
+  start_requester(&second, cache, "$.Cache.Slow");
+  do {
+    usleep(1000);
+    kbus_reqcache_get_stats(cache, &stats);
+  } while (stats.coalesced < 1);
+  replier.hold = 0;
+  assert(pthread_join(first.thread, NULL) == 0);
+  assert(pthread_join(second.thread, NULL) == 0);
+  assert(first.count == replier.count);
+  assert(second.count == first.count);
+  expect_stats(cache, 1, 3, 1, 3);
+
+  // A Reply is only kept for its TTL
+  assert(kbus_reqcache_set_ttl(cache, "$.Cache.Short", 50) == 0);
+  count = cache_request(cache, "$.Cache.Short");
+  assert(cache_request(cache, "$.Cache.Short") == count);
+  usleep(100 * 1000);
+  assert(cache_request(cache, "$.Cache.Short") == replier.count);
+  assert(replier.count == count + 1);
+  kbus_reqcache_get_stats(cache, &stats);
+  assert(stats.hits == 2 && stats.misses == 5);
+
+  // An invalidation Announcement naming a Request forgets just its Replies
+  count = cache_request(cache, "$.Cache.B");
+  assert(cache_request(cache, "$.Cache.A") == 1);
+  {
+    kbus_message_t *msg;
+    assert(kbus_msg_create(&msg, "$.Cache.Invalidate", 18, "$.Cache.A", 9,
+                           0) == 0);
+    assert(kbus_ksock_send_msg(announcer, msg, NULL) == 0);
+    kbus_msg_delete(&msg);
+  }
+  assert(cache_request(cache, "$.Cache.A") == replier.count);
+  assert(cache_request(cache, "$.Cache.B") == count);
+
+  // And so does asking the cache to
+  kbus_reqcache_invalidate(cache, "$.Cache.B");
+  assert(cache_request(cache, "$.Cache.B") == replier.count);
+
+  // Whereas an invalidation without data forgets everything
+  count = replier.count;
+  assert(send_msg(announcer, "$.Cache.Invalidate", 0, NULL) == 0);
+  assert(cache_request(cache, "$.Cache.A") == count + 1);
+  assert(cache_request(cache, "$.Cache.B") == count + 2);
+
+  // Synthetic Replies are passed on, but not kept
+  gone = open_ksock(BUS_REQCACHE);
+  assert(kbus_ksock_bind(gone, "$.Gone", 1) == 0);
+  start_requester(&first, cache, "$.Gone");
+  while (!(ready(gone) & POLLIN))
+    usleep(1000);
+  assert(kbus_ksock_close(gone) == 0);
+  assert(pthread_join(first.thread, NULL) == 0);
+  assert(first.count == 0);
+  kbus_reqcache_get_stats(cache, &stats);
+  count = stats.entries;
+  // With no Replier now, the Request fails, rather than being answered
+  {
+    kbus_message_t *reply;
+    assert(kbus_reqcache_request(cache, "$.Gone", "key", 3, &reply) ==
+           -EADDRNOTAVAIL);
+    assert(reply == NULL);
+  }
+  kbus_reqcache_get_stats(cache, &stats);
+  assert(stats.entries == count);
+
+  kbus_reqcache_free(&cache);
+  assert(cache == NULL);
+
+  replier.stop = 1;
+  assert(pthread_join(replier.thread, NULL) == 0);
+  assert(kbus_ksock_close(replier.ksock) == 0);
+  assert(kbus_ksock_close(announcer) == 0);
+  return 0;
+}
+
+// ===========================================================================
+// Subscription multiplexer
+
+/*
+ * A subscriber, which counts its callbacks, and may unsubscribe itself or
+ * others when called.
+ */
+struct mux_subscriber {
+  kbus_mux_t             *mux;
+  kbus_mux_sub_t         *sub;
+  int                     calls;
+  char                    last_name[32];
+  struct mux_subscriber  *unsubscribe[2];
+};
+
+static void mux_callback(const kbus_message_t *msg, void *arg)
+{
+  struct mux_subscriber *subscriber = arg;
+  int ii;
+
+  subscriber->calls ++;
+  assert(msg->name_len < sizeof(subscriber->last_name));
+  memcpy(subscriber->last_name, kbus_msg_name_ptr(msg), msg->name_len);
+  subscriber->last_name[msg->name_len] = '\0';
+
+  for (ii = 0; ii < 2; ii++) {
+    struct mux_subscriber *other = subscriber->unsubscribe[ii];
+    if (other && other->sub) {
+      assert(kbus_mux_unsubscribe(subscriber->mux, other->sub) == 0);
+      other->sub = NULL;
+    }
+  }
+}
+
+static void mux_subscribe(kbus_mux_t *mux, const char *name,
+                          struct mux_subscriber *subscriber)
+{
+  memset(subscriber, 0, sizeof(*subscriber));
+  subscriber->mux = mux;
+  assert(kbus_mux_subscribe(mux, name, mux_callback, subscriber,
+                            &subscriber->sub) == 0);
+  assert(subscriber->sub != NULL);
+}
+
+static void mux_unsubscribe(struct mux_subscriber *subscriber)
+{
+  assert(kbus_mux_unsubscribe(subscriber->mux, subscriber->sub) == 0);
+  subscriber->sub = NULL;
+}
+
+static uint32_t mux_queued(kbus_mux_t *mux)
+{
+  uint32_t num_messages;
+  assert(kbus_ksock_num_messages(kbus_mux_ksock(mux), &num_messages) == 0);
+  return num_messages;
+}
+
+static int testMux(void)
+{
+  kbus_mux_t *mux;
+  kbus_ksock_t sender = open_ksock(BUS_MUX);
+  kbus_ksock_t replier = open_ksock(BUS_MUX);
+  struct mux_subscriber fred1, fred2, star, percent, other, self, victim;
+  kbus_message_t *msg, *reply;
+  int ii;
+
+  assert(kbus_mux_new_loopback(&mux, BUS_MUX) == 0);
+  assert(mux != NULL);
+
+  mux_subscribe(mux, "$.Mux.Fred", &fred1);
+  mux_subscribe(mux, "$.Mux.Fred", &fred2);
+  mux_subscribe(mux, "$.Mux.*", &star);
+  mux_subscribe(mux, "$.Mux.%", &percent);
+  mux_subscribe(mux, NULL, &other);
+
+  // Nothing to do yet
+  assert(kbus_mux_dispatch(mux) == 0);
+
+  // A message matching several bindings is read once, and given to every
+  // subscriber it matches, but not to the catch-all
+  assert(send_msg(sender, "$.Mux.Fred", 0, NULL) == 0);
+  assert(mux_queued(mux) == 1);
+  assert(kbus_mux_dispatch(mux) == 1);
+  assert(fred1.calls == 1 && fred2.calls == 1);
+  assert(star.calls == 1 && percent.calls == 1);
+  assert(other.calls == 0);
+
+  // '%' only matches one more level, '*' matches any number
+  assert(send_msg(sender, "$.Mux.Jim", 0, NULL) == 0);
+  assert(send_msg(sender, "$.Mux.Jim.Bob", 0, NULL) == 0);
+  assert(send_msg(sender, "$.MuxJim", 0, NULL) == 0);
+  assert(kbus_mux_dispatch(mux) == 2);
+  assert(fred1.calls == 1 && fred2.calls == 1);
+  assert(star.calls == 3 && !strcmp(star.last_name, "$.Mux.Jim.Bob"));
+  assert(percent.calls == 2 && !strcmp(percent.last_name, "$.Mux.Jim"));
+  assert(other.calls == 0);
+
+  // A Reply to our Request matches no name, so goes to the catch-all
+  assert(kbus_ksock_bind(replier, "$.Other", 1) == 0);
+  assert(send_msg(kbus_mux_ksock(mux), "$.Other",
+                  KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  msg = expect_msg(replier, "$.Other");
+  assert(kbus_msg_create_reply_to(&reply, msg, NULL, 0, 0) == 0);
+  assert(kbus_ksock_send_msg(replier, reply, NULL) == 0);
+  kbus_msg_delete(&reply);
+  kbus_msg_delete(&msg);
+  assert(kbus_mux_dispatch(mux) == 1);
+  assert(other.calls == 1 && !strcmp(other.last_name, "$.Other"));
+  assert(star.calls == 3 && percent.calls == 2);
+
+  // We stay bound to a name until its last subscriber leaves
+  mux_unsubscribe(&star);
+  mux_unsubscribe(&percent);
+  mux_unsubscribe(&fred1);
+  assert(send_msg(sender, "$.Mux.Fred", 0, NULL) == 0);
+  assert(mux_queued(mux) == 1);
+  assert(kbus_mux_dispatch(mux) == 1);
+  assert(fred1.calls == 1 && fred2.calls == 2);
+
+  mux_unsubscribe(&fred2);
+  assert(send_msg(sender, "$.Mux.Fred", 0, NULL) == 0);
+  assert(send_msg(sender, "$.Mux.Jim", 0, NULL) == 0);
+  assert(mux_queued(mux) == 0);
+  assert(kbus_mux_dispatch(mux) == 0);
+  assert(fred2.calls == 2 && other.calls == 1);
+
+  // Unsubscribing from a callback: `self` leaves, and takes `victim` (which
+  // would otherwise be called next) with it. That unbinds "$.Mux.Self", so
+  // the second message is dropped from the queue, as KBUS itself would
+  mux_subscribe(mux, "$.Mux.Self", &self);
+  mux_subscribe(mux, "$.Mux.Self", &victim);
+  self.unsubscribe[0] = &self;
+  self.unsubscribe[1] = &victim;
+  assert(send_msg(sender, "$.Mux.Self", 0, NULL) == 0);
+  assert(send_msg(sender, "$.Mux.Self", 0, NULL) == 0);
+  assert(kbus_mux_dispatch(mux) == 1);
+  assert(self.calls == 1 && self.sub == NULL);
+  assert(victim.calls == 0 && victim.sub == NULL);
+  assert(other.calls == 1);
+
+  assert(send_msg(sender, "$.Mux.Self", 0, NULL) == 0);
+  assert(mux_queued(mux) == 0);
+
+  // The catch-all may also leave from its own callback, after which
+  // unmatched messages are read and ignored
+  other.unsubscribe[0] = &other;
+  assert(send_msg(kbus_mux_ksock(mux), "$.Other",
+                  KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  assert(send_msg(kbus_mux_ksock(mux), "$.Other",
+                  KBUS_BIT_WANT_A_REPLY, NULL) == 0);
+  for (ii = 0; ii < 2; ii++) {
+    msg = expect_msg(replier, "$.Other");
+    assert(kbus_msg_create_reply_to(&reply, msg, NULL, 0, 0) == 0);
+    assert(kbus_ksock_send_msg(replier, reply, NULL) == 0);
+    kbus_msg_delete(&reply);
+    kbus_msg_delete(&msg);
+  }
+  assert(kbus_mux_dispatch(mux) == 2);
+  assert(other.calls == 2 && other.sub == NULL);
+
+  kbus_mux_free(&mux);
+  assert(mux == NULL);
+  assert(kbus_ksock_close(replier) == 0);
+  assert(kbus_ksock_close(sender) == 0);
+  return 0;
+}
+
+int main(void)
+{
+  printf("=== Loopback routing tests ===\n");
+  if (testLoopbackRouting())
+    return 1;
+
+  printf("=== Loopback synthetic message tests ===\n");
+  if (testLoopbackSynthetic())
+    return 1;
+
+  printf("=== Loopback ALL_OR_WAIT tests ===\n");
+  if (testLoopbackAllOrWait())
+    return 1;
+
+  printf("=== Loopback auto send tests ===\n");
+  if (testLoopbackAutoSend())
+    return 1;
+
+  printf("=== Loopback only once tests ===\n");
+  if (testLoopbackOnlyOnce())
+    return 1;
+
+  printf("=== Request cache tests ===\n");
+  if (testRequestCache())
+    return 1;
+
+  printf("=== Multiplexer tests ===\n");
+  if (testMux())
+    return 1;
+
+  printf("Green light: all tests passed\n");
+  return 0;
+}
+
+// Local Variables:
+// tab-width: 8
+// indent-tabs-mode: nil
+// c-basic-offset: 2
+// End:
+// vim: set tabstop=8 shiftwidth=2 softtabstop=2 expandtab:
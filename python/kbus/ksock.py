@@ -82,6 +82,26 @@ class BindStruct(ctypes.Structure):
                 ('len',        ctypes.c_uint32),
                 ('name',       ctypes.c_char_p)]
 
+class TopicStruct(ctypes.Structure):
+    """The datastucture we need to describe an :const:`IOC_SUBSCRIBE` argument
+    """
+    _fields_ = [('flags',     ctypes.c_uint32),
+                ('ring_size', ctypes.c_uint32),
+                ('len',       ctypes.c_uint32),
+                ('name',      ctypes.c_char_p)]
+
+class BindFilterStruct(ctypes.Structure):
+    """The datastucture we need to describe an :const:`IOC_BINDFILTER` argument
+    """
+    _fields_ = [('flags',         ctypes.c_uint32),
+                ('len',           ctypes.c_uint32),
+                ('name',          ctypes.c_char_p),
+                ('from_id',       ctypes.c_uint32),
+                ('orig_network',  ctypes.c_uint32),
+                ('orig_local',    ctypes.c_uint32),
+                ('max_rate',      ctypes.c_uint32),
+                ('sample_every',  ctypes.c_uint32)]
+
 class ReplierStruct(ctypes.Structure):
     """The datastucture we need to describe an :const:`IOC_REPLIER` argument
     """
@@ -133,6 +153,22 @@ class Ksock(object):
     IOC_NEWDEVICE   = _IOR(IOC_MAGIC,  16, ctypes.sizeof(ctypes.c_char_p))
     IOC_REPORTREPLIERBINDS = _IOWR(IOC_MAGIC, 17, ctypes.sizeof(ctypes.c_char_p))
     IOC_MAXMSGSIZE  = _IOWR(IOC_MAGIC, 18, ctypes.sizeof(ctypes.c_char_p))
+    IOC_BLOCKING    = _IOWR(IOC_MAGIC, 19, ctypes.sizeof(ctypes.c_char_p))
+    IOC_BUSYPOLL    = _IOWR(IOC_MAGIC, 20, ctypes.sizeof(ctypes.c_char_p))
+    IOC_AUTOSEND    = _IOWR(IOC_MAGIC, 21, ctypes.sizeof(ctypes.c_char_p))
+    IOC_SUBSCRIBE   = _IOW(IOC_MAGIC,  22, ctypes.sizeof(ctypes.c_char_p))
+    IOC_UNSUBSCRIBE = _IOW(IOC_MAGIC,  23, ctypes.sizeof(ctypes.c_char_p))
+    IOC_BINDFILTER  = _IOW(IOC_MAGIC,  24, ctypes.sizeof(ctypes.c_char_p))
+    IOC_UNBINDFILTER = _IOW(IOC_MAGIC, 25, ctypes.sizeof(ctypes.c_char_p))
+
+    # Flags for :meth:`subscribe`
+    TOPIC_BACKPRESSURE = 0x00000001
+
+    # Flags for :meth:`bind_filtered`
+    BIND_FILTER_FROM      = 0x00000001
+    BIND_FILTER_ORIG_FROM = 0x00000002
+    BIND_FILTER_MAX_RATE  = 0x00000004
+    BIND_FILTER_SAMPLE    = 0x00000008
 
     def __init__(self, which=0, mode='rw'):
         if mode not in ('r', 'rw'):
@@ -144,6 +180,7 @@ class Ksock(object):
         else:
             mode = 'r+'
             self.mode = 'read/write'
+        self._auto_send = False
         # Although Unix doesn't mind whether a file is opened with a 'b'
         # for binary, it is possible that some version of Python may
         self.fd = open(self.name, mode+'b')
@@ -189,6 +226,81 @@ class Ksock(object):
         arg = BindStruct(replier, len(name), name)
         fcntl.ioctl(self.fd, Ksock.IOC_UNBIND, arg)
 
+    def subscribe(self, name, backpressure=False, ring_size=0):
+        """Subscribe to the broadcast topic with the given name.
+
+        Announcements with that name are then kept just once, in a ring of
+        recent messages, rather than being copied to every Listener, and we
+        read them (after any messages in our queue) as normal.
+
+        `backpressure` and `ring_size` are only used if we are the topic's
+        first subscriber. If `backpressure` is true, then senders wait for the
+        slowest subscriber - otherwise, a subscriber that falls too far behind
+        reads a '$.KBUS.TopicLapped' message saying how many messages it lost.
+        A `ring_size` of 0 means the default.
+        """
+        flags = Ksock.TOPIC_BACKPRESSURE if backpressure else 0
+        arg = TopicStruct(flags, ring_size, len(name), name)
+        fcntl.ioctl(self.fd, Ksock.IOC_SUBSCRIBE, arg)
+
+    def unsubscribe(self, name):
+        """Unsubscribe from the broadcast topic with the given name.
+        """
+        arg = TopicStruct(0, 0, len(name), name)
+        fcntl.ioctl(self.fd, Ksock.IOC_UNSUBSCRIBE, arg)
+
+    def _bind_filter_arg(self, name, from_id, orig_from, max_rate,
+                         sample_every):
+        """Return the IOC_BINDFILTER argument for a (un)bind_filtered call.
+        """
+        flags = 0
+        if from_id is None:
+            from_id = 0
+        else:
+            flags |= Ksock.BIND_FILTER_FROM
+        if orig_from is None:
+            network_id, local_id = 0, 0
+        else:
+            flags |= Ksock.BIND_FILTER_ORIG_FROM
+            network_id, local_id = orig_from.network_id, orig_from.local_id
+        if max_rate is None:
+            max_rate = 0
+        else:
+            flags |= Ksock.BIND_FILTER_MAX_RATE
+        if sample_every is None:
+            sample_every = 0
+        else:
+            flags |= Ksock.BIND_FILTER_SAMPLE
+        return BindFilterStruct(flags, len(name), name,
+                                from_id, network_id, local_id,
+                                max_rate, sample_every)
+
+    def bind_filtered(self, name, from_id=None, orig_from=None,
+                      max_rate=None, sample_every=None):
+        """Bind the given name to the file descriptor, as a Listener, but
+        only for some of the messages with that name.
+
+        If `from_id` is given, only messages sent by the Ksock with that id
+        are wanted. If `orig_from` is given (as an :class:`OrigFrom`), only
+        messages whose ``orig_from`` matches it are wanted. If `max_rate` is
+        given, at most that many messages a second are wanted, and if
+        `sample_every` is given, only every `sample_every`th message is
+        wanted. Other messages are never queued for this binding.
+        """
+        arg = self._bind_filter_arg(name, from_id, orig_from, max_rate,
+                                    sample_every)
+        fcntl.ioctl(self.fd, Ksock.IOC_BINDFILTER, arg)
+
+    def unbind_filtered(self, name, from_id=None, orig_from=None,
+                        max_rate=None, sample_every=None):
+        """Unbind a binding made with :meth:`bind_filtered`.
+
+        The arguments need to match the binding that we want to unbind.
+        """
+        arg = self._bind_filter_arg(name, from_id, orig_from, max_rate,
+                                    sample_every)
+        fcntl.ioctl(self.fd, Ksock.IOC_UNBINDFILTER, arg)
+
     def ksock_id(self):
         """Return the internal 'Ksock id' for this file descriptor.
         """
@@ -342,6 +454,80 @@ class Ksock(object):
         fcntl.ioctl(self.fd, Ksock.IOC_MSGONLYONCE, id, True)
         return id[0]
 
+    def blocking(self, block=True, just_ask=False):
+        """Determine whether receiving a message waits for one to arrive.
+
+        If this is set, then :meth:`next_msg` will wait until there is a
+        message, rather than returning 0 at once, and :meth:`read_next_msg`
+        will wait likewise. The default is False.
+
+        Note that a Ksock opened with O_NONBLOCK never waits, whatever this
+        is set to.
+
+        * if `block` is true then we want receiving a message to wait.
+        * if `just_ask` is true, then we just want to find out the current state
+          of the flag, and `block` will be ignored.
+
+        Returns the previous value of the flag (i.e., what it used to be set to).
+        Which, if `just_ask` is true, will also be the current state.
+        """
+        if just_ask:
+            val = 0xFFFFFFFF
+        elif block:
+            val = 1
+        else:
+            val = 0
+        id = array.array('I', [val])
+        fcntl.ioctl(self.fd, Ksock.IOC_BLOCKING, id, True)
+        return id[0]
+
+    def busy_poll(self, usecs=0, just_ask=False):
+        """Determine how long a blocking receive spins before sleeping.
+
+        When waiting for a message (see :meth:`blocking`), KBUS will first
+        spin for up to `usecs` microseconds, checking for a message, before
+        going to sleep. The default is 0, i.e., not to spin.
+
+        * if `just_ask` is true, then we just want to find out the current
+          value, and `usecs` will be ignored.
+
+        Returns the previous value (i.e., what it used to be set to).
+        Which, if `just_ask` is true, will also be the current value.
+        """
+        if just_ask:
+            val = 0xFFFFFFFF
+        else:
+            val = usecs
+        id = array.array('I', [val])
+        fcntl.ioctl(self.fd, Ksock.IOC_BUSYPOLL, id, True)
+        return id[0]
+
+    def auto_send(self, send=True, just_ask=False):
+        """Determine whether writing a complete message also sends it.
+
+        If this is set, then the write that completes a message also sends
+        it, as if :meth:`send` had been called, and :meth:`send_msg` takes
+        advantage of this. The default is False.
+
+        * if `send` is true then we want writing a message to send it.
+        * if `just_ask` is true, then we just want to find out the current state
+          of the flag, and `send` will be ignored.
+
+        Returns the previous value of the flag (i.e., what it used to be set to).
+        Which, if `just_ask` is true, will also be the current state.
+        """
+        if just_ask:
+            val = 0xFFFFFFFF
+        elif send:
+            val = 1
+        else:
+            val = 0
+        id = array.array('I', [val])
+        fcntl.ioctl(self.fd, Ksock.IOC_AUTOSEND, id, True)
+        if not just_ask:
+            self._auto_send = bool(send)
+        return id[0]
+
     def kernel_module_verbose(self, verbose=True, just_ask=False):
         """Determine whether the kernel module should output verbose messages.
 
@@ -469,8 +655,13 @@ class Ksock(object):
 	Entirely equivalent to calling :meth:`write_msg` and then :meth:`send`,
 	and returns the :class:`MessageId` of the sent message, as
 	:meth:`send` does.
+
+        If we are in :meth:`auto_send` mode, then writing the message has
+        already sent it, so we just ask for its :class:`MessageId`.
         """
         self.write_msg(message)
+        if self._auto_send:
+            return self.last_msg_id()
         return self.send()
 
     def write_data(self, data):
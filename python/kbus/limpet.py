@@ -79,6 +79,11 @@ class BadMessage(Exception):
 
 _SERIALISED_MESSAGE_HEADER_LEN = 16
 _SerialisedMessageHeaderType = ctypes.c_uint32 * _SERIALISED_MESSAGE_HEADER_LEN
+_SERIALISED_HEADER_BYTES = _SERIALISED_MESSAGE_HEADER_LEN * 4
+_SERIALISED_END_GUARD = struct.pack('!L', Message.END_GUARD)
+
+# How much we try to read from the other Limpet at one go
+_INBOUND_READ_SIZE = 64 * 1024
 
 class LimpetKsock(Ksock):
     """A Limpet proxies KBUS messages to/from another Limpet.
@@ -793,6 +798,11 @@ class LimpetExample(object):
         # the key, and the from/to information as the data
         self.our_requests = {}
 
+        # Data read from the other Limpet that we have not yet turned into
+        # messages, and how far through it we've got
+        self.inbound = ''
+        self.inbound_pos = 0
+
         # So we're set up to talk at both ends - now sort out what we're
         # talking about
 
@@ -857,19 +867,21 @@ class LimpetExample(object):
         return 'Limpet from KBUS Ksock %u via socket %s'%(self.ksock_id,
                                                           self.sock)
 
-    def read_message_from_other_limpet(self):
-        """Read a message from the other Limpet.
+    def _message_from_inbound(self):
+        """Extract the next complete message from our inbound buffer.
 
-        Returns the corresponding Message instance.
+        Returns the corresponding Message instance, or None if the buffer
+        does not (yet) hold an entire message. The buffer position is moved
+        past any message that is returned.
         """
+        buf = self.inbound
+        pos = self.inbound_pos
 
-        # First, read the message header
-        header = self.sock.recv(_SERIALISED_MESSAGE_HEADER_LEN*4,
-                                socket.MSG_WAITALL)
-        if header == '':
-            raise OtherLimpetGoneAway()
+        if len(buf) - pos < _SERIALISED_HEADER_BYTES:
+            return None
 
-        name_len, data_len, array = unserialise_message_header(header)
+        name_len, data_len, array = unserialise_message_header(
+                buf[pos:pos+_SERIALISED_HEADER_BYTES])
 
         if array[0] != Message.START_GUARD:
             raise BadMessage('Message data start guard is %08x,'
@@ -879,34 +891,36 @@ class LimpetExample(object):
             raise BadMessage('Message data end guard is %08x,'
                          ' not %08x'%(array[-1],Message.END_GUARD))
 
-        name = self.sock.recv(calc_padded_name_len(name_len),
-                              socket.MSG_WAITALL)
-        if name == '':
-            raise OtherLimpetGoneAway()
+        padded_name_len = calc_padded_name_len(name_len)
+        padded_data_len = calc_padded_data_len(data_len)
+        total = _SERIALISED_HEADER_BYTES + padded_name_len + padded_data_len + 4
+        if len(buf) - pos < total:
+            return None
 
+        name_start = pos + _SERIALISED_HEADER_BYTES
+        data_start = name_start + padded_name_len
+        end_start = data_start + padded_data_len
+
+        name = buf[name_start:name_start+name_len]
         if data_len:
-            data = self.sock.recv(calc_padded_data_len(data_len),
-                                  socket.MSG_WAITALL)
-            if data == '':
-                raise OtherLimpetGoneAway()
+            data = buf[data_start:data_start+data_len]
         else:
             data = None
 
-        end = self.sock.recv(4, socket.MSG_WAITALL)
-        #value = struct.unpack('!L', end)   # unsigned long, network order
-        #end = ntohl(value[0])
-        end = struct.unpack('!L', end)[0]   # unsigned long, network order
+        end = struct.unpack('!L', buf[end_start:end_start+4])[0]
         if end != Message.END_GUARD:
             raise BadMessage('Final message data end guard is %08x,'
                          ' not %08x'%(end,Message.END_GUARD))
 
+        self.inbound_pos = pos + total
+
         # We know enough to sort out the network order of the integers in
         # the Replier Bind Event's data
-        if name[:name_len] == '$.KBUS.ReplierBindEvent':
+        if name == '$.KBUS.ReplierBindEvent':
             data = convert_ReplierBindEvent_data_from_network(data, data_len)
-        
-        return Message(name[:name_len],
-                       data=data[:data_len] if data else None,
+
+        return Message(name,
+                       data=data,
                        id=MessageId(array[1],array[2]),
                        in_reply_to=MessageId(array[3],array[4]),
                        to=array[5], from_=array[6],
@@ -914,8 +928,55 @@ class LimpetExample(object):
                        final_to=OrigFrom(array[9],array[10]),
                        flags=array[12])
 
-    def write_message_to_other_limpet(self, msg):
-        """Write a Message to the other Limpet.
+    def _fill_inbound(self):
+        """Read whatever the other Limpet has sent us into our inbound buffer.
+
+        Any data already consumed from the buffer is discarded first, so the
+        buffer only grows by as much as is still waiting to be parsed.
+        """
+        data = self.sock.recv(_INBOUND_READ_SIZE)
+        if data == '':
+            raise OtherLimpetGoneAway()
+        if self.inbound_pos:
+            self.inbound = self.inbound[self.inbound_pos:]
+            self.inbound_pos = 0
+        self.inbound += data
+
+    def read_message_from_other_limpet(self):
+        """Read a message from the other Limpet.
+
+        Blocks until an entire message is available.
+
+        Returns the corresponding Message instance.
+        """
+        msg = self._message_from_inbound()
+        while msg is None:
+            self._fill_inbound()
+            msg = self._message_from_inbound()
+        return msg
+
+    def read_messages_from_other_limpet(self):
+        """Read all the messages the other Limpet has sent us so far.
+
+        Does a single read from the socket, which should therefore be
+        readable, and then returns a list of all the complete messages now in
+        our inbound buffer (which may be empty). Any trailing partial message
+        is kept for next time.
+        """
+        self._fill_inbound()
+        messages = []
+        msg = self._message_from_inbound()
+        while msg is not None:
+            messages.append(msg)
+            msg = self._message_from_inbound()
+        return messages
+
+    def _serialise_message(self, msg, parts):
+        """Append the parts of a serialised Message to the list 'parts'.
+
+        The parts are laid out exactly as the C Limpet expects them: the
+        serialised header, the padded name, the padded data (if any) and
+        the final end guard, all with integers in network order.
         """
         # We know enough to sort out the network order of the integers in
         # the Replier Bind Event's data
@@ -923,27 +984,66 @@ class LimpetExample(object):
             data = convert_ReplierBindEvent_data_to_network(msg.data)
             msg = Message.from_message(msg, data=data)
 
-        header = serialise_message_header(msg)
-        self.sock.sendall(header)
+        parts.append(_struct_to_bytes(serialise_message_header(msg)))
 
-        self.sock.sendall(msg.name)
+        parts.append(msg.name)
         padded_name_len = calc_padded_name_len(msg.msg.name_len)
         if len(msg.name) != padded_name_len:
-            self.sock.sendall('\0'*(padded_name_len - len(msg.name)))
+            parts.append('\0'*(padded_name_len - len(msg.name)))
 
         if msg.msg.data_len:
-            self.sock.sendall(msg.data)
+            parts.append(msg.data)
             padded_data_len = calc_padded_data_len(msg.msg.data_len)
             if len(msg.data) != padded_data_len:
-                self.sock.sendall('\0'*(padded_data_len - len(msg.data)))
+                parts.append('\0'*(padded_data_len - len(msg.data)))
 
-        ##end_guard = struct.pack('!L', header[-1])
-        end_guard = struct.pack('!L', Message.END_GUARD)
-        self.sock.sendall(end_guard)       # end guard again
+        parts.append(_SERIALISED_END_GUARD)
+
+    def _send_parts(self, parts):
+        """Send a list of byte strings to the other Limpet, as one write.
+
+        The parts are joined into a single buffer and sent with ``sendall``.
+        (This module is Python 2 only, and Python 2 sockets have no
+        ``sendmsg``, so there is no scatter-gather alternative to use.)
+        """
+        if parts:
+            self.sock.sendall(''.join(parts))
+
+    def write_message_to_other_limpet(self, msg):
+        """Write a Message to the other Limpet.
+        """
+        self.write_messages_to_other_limpet([msg])
+
+    def write_messages_to_other_limpet(self, messages):
+        """Write a list of Messages to the other Limpet, as one write.
+        """
+        parts = []
+        for msg in messages:
+            self._serialise_message(msg, parts)
+        self._send_parts(parts)
+
+    def _read_messages_from_kbus(self):
+        """Read all the messages currently waiting on our Ksock.
+
+        Returns a list of those messages that should be forwarded to the
+        other Limpet (which may be empty).
+        """
+        messages = []
+        length = self.wrapper.next_msg()
+        while length:
+            msg = self.wrapper.read_msg(length)
+            if msg is not None:
+                messages.append(msg)
+            length = self.wrapper.next_msg()
+        return messages
 
     def run_forever(self):
         """Or until we're interrupted, or read the termination message from KBUS.
 
+        Each time we wake up, we forward *all* the messages that are ready,
+        in each direction, rather than just one. Messages for the other Limpet
+        are batched up and sent with a single write.
+
         If an exception is raised, then the Limpet is closed as the method
         is exited.
         """
@@ -956,31 +1056,43 @@ class LimpetExample(object):
                 if self.verbosity > 1:
                     print
 
+                # Messages to go to the other Limpet, in order
+                outgoing = []
+
                 if self.wrapper in r:
-                    print '%u ---------------------- Message from KBUS'% \
-                            self.wrapper.network_id
-                    msg = self.wrapper.read_next_msg()
-                    if msg is not None:
-                        self.write_message_to_other_limpet(msg)
+                    outgoing = self._read_messages_from_kbus()
+                    if self.verbosity > 1:
+                        print '%u ---------------------- %d message%s from KBUS'%(
+                                self.wrapper.network_id, len(outgoing),
+                                '' if len(outgoing) == 1 else 's')
 
                 if self.sock in r:
-                    print '%u ---------------------- Message from other Limpet'% \
-                            self.wrapper.network_id
-                    msg = self.read_message_from_other_limpet()
-                    print '%u %s'%(self.wrapper.network_id,msg)
-                    try:
-                        msg_id = self.wrapper.send_msg(msg)
-                        print '%u msg_id %s'%(self.wrapper.network_id,msg_id)
-                    except NoMessage as exc:
-                        # It turned out to be a message we should ignore - do so
-                        print '%u IGNORED %s'%(self.wrapper.network_id,msg)
-                    except ErrorMessage as exc:
-                        self.write_message_to_other_limpet(exc.error)
-                    except IOError as exc:
-                        error = self.wrapper.could_not_send_to_kbus_msg(msg, exc)
-                        if error is not None:
-                            self.write_message_to_other_limpet(error)
-                            return
+                    incoming = self.read_messages_from_other_limpet()
+                    if self.verbosity > 1:
+                        print '%u ---------------------- %d message%s from other Limpet'%(
+                                self.wrapper.network_id, len(incoming),
+                                '' if len(incoming) == 1 else 's')
+                    for msg in incoming:
+                        if self.verbosity > 1:
+                            print '%u %s'%(self.wrapper.network_id,msg)
+                        try:
+                            msg_id = self.wrapper.send_msg(msg)
+                            if self.verbosity > 1:
+                                print '%u msg_id %s'%(self.wrapper.network_id,msg_id)
+                        except NoMessage as exc:
+                            # It turned out to be a message we should ignore - do so
+                            if self.verbosity > 1:
+                                print '%u IGNORED %s'%(self.wrapper.network_id,msg)
+                        except ErrorMessage as exc:
+                            outgoing.append(exc.error)
+                        except IOError as exc:
+                            error = self.wrapper.could_not_send_to_kbus_msg(msg, exc)
+                            if error is not None:
+                                outgoing.append(error)
+                                self.write_messages_to_other_limpet(outgoing)
+                                return
+
+                self.write_messages_to_other_limpet(outgoing)
         finally:
             self.close()
 
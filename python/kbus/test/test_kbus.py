@@ -59,6 +59,7 @@ import fcntl
 import itertools
 import os
 import select
+import struct
 import subprocess
 import sys
 import time
@@ -3474,4 +3475,435 @@ class TestKernelModule:
                     thing.unbind('$.Fred.*')
                     thing.num_messages() == 0
 
+    def test_blocking_receive(self):
+        """Test that a blocking Ksock waits for a message to arrive
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'rw') as listener:
+                listener.bind('$.Fred')
+
+                assert listener.blocking(just_ask=True) == 0
+                assert listener.blocking(True) == 0
+                assert listener.blocking(just_ask=True) == 1
+
+                # Send our message from another process, a little later
+                msg = Announcement('$.Fred', 'wake')
+                pid = os.fork()
+                if pid == 0:
+                    time.sleep(0.5)
+                    sender.send_msg(msg)
+                    os._exit(0)
+
+                start = time.time()
+                m = listener.read_next_msg()
+                os.waitpid(pid, 0)
+                assert time.time() - start >= 0.4
+                assert m.equivalent(msg)
+
+                # And back to the default, we don't wait
+                assert listener.blocking(False) == 1
+                assert listener.next_msg() == 0
+
+    def test_busy_poll(self):
+        """Test setting how long a blocking receive spins
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'rw') as listener:
+                listener.bind('$.Fred')
+
+                assert listener.busy_poll(just_ask=True) == 0
+                assert listener.busy_poll(500) == 0
+                assert listener.busy_poll(just_ask=True) == 500
+
+                # There is a limit to how long we may spin
+                check_IOError(errno.EINVAL, listener.busy_poll, 1000000)
+                assert listener.busy_poll(just_ask=True) == 500
+
+                # A message that is already there is read at once
+                listener.blocking(True)
+                msg = Announcement('$.Fred', 'dada')
+                sender.send_msg(msg)
+                m = listener.read_next_msg()
+                assert m.equivalent(msg)
+
+                # And one that arrives after the spin still wakes us
+                pid = os.fork()
+                if pid == 0:
+                    time.sleep(0.2)
+                    sender.send_msg(msg)
+                    os._exit(0)
+                m = listener.read_next_msg()
+                os.waitpid(pid, 0)
+                assert m.equivalent(msg)
+
+                assert listener.busy_poll(0) == 500
+
+    def test_blocked_send_retried_when_queue_drains(self):
+        """Test that an ALL_OR_WAIT send is finished once there is room
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'rw') as listener:
+                listener.bind('$.Fred')
+                listener.set_max_messages(1)
+
+                msg1 = Announcement('$.Fred', 'one.')
+                msg2 = Announcement('$.Fred', 'two.', flags=Message.ALL_OR_WAIT)
+                sender.send_msg(msg1)
+                check_IOError(errno.EAGAIN, sender.send_msg, msg2)
+
+                # Whilst the send is still pending, we are not writable
+                (r, w, x) = select.select([], [sender], [], 0)
+                assert w == []
+
+                # Reading the first message makes room, and KBUS then
+                # finishes sending the second for us
+                m = listener.read_next_msg()
+                assert m.equivalent(msg1)
+
+                (r, w, x) = select.select([], [sender], [], 1)
+                assert w == [sender]
+                assert listener.num_messages() == 1
+                m = listener.read_next_msg()
+                assert m.equivalent(msg2)
+
+    def test_message_queue_ring(self):
+        """Test that the message queue keeps its order as it grows
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'rw') as listener:
+                listener.bind('$.Fred')
+                listener.bind('$.Jim')
+
+                # Enough messages that the queue has to grow (more than
+                # once), and an URGENT one that goes to the front
+                listener.set_max_messages(3000)
+                for ii in xrange(2500):
+                    sender.send_msg(Announcement('$.Fred', '%04d'%ii))
+                    if ii % 2:
+                        sender.send_msg(Announcement('$.Jim', '%04d'%ii))
+                urgent = Announcement('$.Fred', 'urgh', flags=Message.URGENT)
+                sender.send_msg(urgent)
+                assert listener.num_messages() == 2500 + 1250 + 1
+
+                m = listener.read_next_msg()
+                assert m.equivalent(urgent)
+
+                # Unbinding '$.Jim' takes its messages out of the middle of
+                # the queue, and leaves the rest in order
+                listener.unbind('$.Jim')
+                assert listener.num_messages() == 2500
+                for ii in xrange(2500):
+                    m = listener.read_next_msg()
+                    assert m.name == '$.Fred'
+                    assert m.data == '%04d'%ii
+                assert listener.next_msg() == 0
+
+    def test_release_with_many_bindings(self):
+        """Test that closing a Ksock forgets all (and only) its bindings
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'rw') as other:
+                other.bind('$.Fred.0')
+
+                with Ksock(0, 'rw') as listener:
+                    listener_id = listener.ksock_id()
+                    for ii in xrange(100):
+                        listener.bind('$.Fred.%d'%ii)
+                        listener.bind('$.Jim.%d'%ii, replier=True)
+                    listener.unbind('$.Fred.50')
+
+                    bindings = read_bindings({listener_id:'listener'})
+                    ours = [b for b in bindings if b[0] == 'listener']
+                    assert len(ours) == 199
+
+                    # A Request it will never answer
+                    req = Request('$.Jim.99', 'dada')
+                    sender.send_msg(req)
+                    req_id = sender.last_msg_id()
+
+                bindings = read_bindings({listener_id:'listener'})
+                assert [b for b in bindings if b[0] == 'listener'] == []
+
+                # The other Ksock's binding is still there
+                sender.send_msg(Announcement('$.Fred.0', 'dada'))
+                assert other.num_messages() == 1
+
+                # And the sender was told its Replier had gone
+                e = sender.read_next_msg()
+                assert e.name == '$.KBUS.Replier.GoneAway'
+                assert e.in_reply_to == req_id
+                assert e.from_ == listener_id
+
+    def test_inline_names_and_data(self):
+        """Test messages whose names and data are either side of the sizes
+        KBUS keeps inside the message itself
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as listener1:
+                with Ksock(0, 'r') as listener2:
+                    listener1.bind('$.*')
+                    listener2.bind('$.*')
+
+                    for name_len in (3, 62, 63, 64, 65, 200):
+                        name = '$.' + 'N'*(name_len - 2)
+                        for data_len in (0, 4, 60, 64, 68, 500):
+                            if data_len:
+                                data = ('%04d'%data_len) * (data_len / 4)
+                            else:
+                                data = None
+                            msg = Announcement(name, data)
+                            sender.send_msg(msg)
+
+                            # Each listener has its own copy
+                            m1 = listener1.read_next_msg()
+                            m2 = listener2.read_next_msg()
+                            assert m1.equivalent(msg)
+                            assert m2.equivalent(msg)
+                            assert m1.name == name
+                            assert m1.data == data
+                            assert m2.data == data
+
+    def test_auto_send(self):
+        """Test that in auto send mode, writing a message sends it
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as listener:
+                listener.bind('$.Fred')
+
+                assert sender.auto_send(just_ask=True) == 0
+                assert sender.auto_send(True) == 0
+                assert sender.auto_send(just_ask=True) == 1
+
+                # Just writing the message is enough
+                msg = Announcement('$.Fred', 'dada')
+                sender.write_msg(msg)
+                assert listener.num_messages() == 1
+                m = listener.read_next_msg()
+                assert m.equivalent(msg)
+                assert m.id == sender.last_msg_id()
+
+                # And send_msg knows not to SEND it again
+                msg_id = sender.send_msg(msg)
+                assert listener.num_messages() == 1
+                m = listener.read_next_msg()
+                assert m.id == msg_id
+
+                # An error from the send comes back from the write
+                req = Request('$.NoOneHere', 'dada')
+                check_IOError(errno.EADDRNOTAVAIL, sender.write_msg, req)
+                sender.discard()
+
+                # And out of auto send mode, writing doesn't send
+                assert sender.auto_send(False) == 1
+                sender.write_msg(msg)
+                assert listener.num_messages() == 0
+                sender.send()
+                assert listener.num_messages() == 1
+
+    def test_subscribe(self):
+        """Test subscribing to broadcast topics
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as sub1:
+                with Ksock(0, 'r') as sub2:
+                    sub1.subscribe('$.Topic')
+                    sub2.subscribe('$.Topic')
+                    check_IOError(errno.EALREADY, sub1.subscribe, '$.Topic')
+
+                    # Both subscribers read the same Announcement
+                    msg = Announcement('$.Topic', 'dada')
+                    msg_id = sender.send_msg(msg)
+                    for sub in (sub1, sub2):
+                        m = sub.read_next_msg()
+                        assert m.equivalent(msg)
+                        assert m.id == msg_id
+                        assert sub.read_next_msg() is None
+
+                    # And once unsubscribed, we don't get any more
+                    sub2.unsubscribe('$.Topic')
+                    check_IOError(errno.EINVAL, sub2.unsubscribe, '$.Topic')
+                    sender.send_msg(msg)
+                    assert sub1.read_next_msg().equivalent(msg)
+                    assert sub2.read_next_msg() is None
+
+                    # Subscribing again only sees what is published from now
+                    sub2.subscribe('$.Topic')
+                    assert sub2.read_next_msg() is None
+                    sender.send_msg(msg)
+                    assert sub1.read_next_msg().equivalent(msg)
+                    assert sub2.read_next_msg().equivalent(msg)
+
+                    check_IOError(errno.EINVAL, sub1.unsubscribe, '$.Other')
+
+    def test_subscribe_lapped(self):
+        """Test a subscriber that falls behind is told what it lost
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as sub:
+                sub.subscribe('$.Topic', ring_size=8)
+
+                for ii in range(12):
+                    sender.send_msg(Announcement('$.Topic', '%04d' % ii))
+
+                # We lost the oldest four...
+                m = sub.read_next_msg()
+                assert m.name == '$.KBUS.TopicLapped'
+                lost, name_len = struct.unpack('II', m.data[:8])
+                assert lost == 4
+                assert m.data[8:8 + name_len] == '$.Topic'
+
+                # ...and then carry on with the oldest the topic still has
+                for ii in range(4, 12):
+                    m = sub.read_next_msg()
+                    assert m.name == '$.Topic'
+                    assert m.data == '%04d' % ii
+                assert sub.read_next_msg() is None
+
+    def test_subscribe_backpressure(self):
+        """Test a topic with backpressure waits for its slowest subscriber
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as sub:
+                sub.subscribe('$.Topic', backpressure=True, ring_size=4)
+
+                msg = Announcement('$.Topic', 'dada')
+                for ii in range(4):
+                    sender.send_msg(msg)
+                check_IOError(errno.EBUSY, sender.send_msg, msg)
+
+                wait = Announcement('$.Topic', 'dada', flags=Message.ALL_OR_WAIT)
+                check_IOError(errno.EAGAIN, sender.send_msg, wait)
+                sender.discard()
+
+                # Once the subscriber has caught up, we can send again
+                sub.read_next_msg()
+                sender.send_msg(msg)
+                for ii in range(4):
+                    assert sub.read_next_msg().equivalent(msg)
+                assert sub.read_next_msg() is None
+
+    def test_bind_filtered(self):
+        """Test binding as a Listener for messages from particular senders
+        """
+        with Ksock(0, 'rw') as sender1:
+            with Ksock(0, 'rw') as sender2:
+                with Ksock(0, 'r') as listener:
+                    id1 = sender1.ksock_id()
+
+                    listener.bind_filtered('$.Fred', from_id=id1)
+                    listener.bind_filtered('$.Jim', orig_from=OrigFrom(7, 42))
+
+                    # Only the first sender's $.Fred gets through
+                    msg = Announcement('$.Fred', 'dada')
+                    sender1.send_msg(msg)
+                    sender2.send_msg(msg)
+                    m = listener.read_next_msg()
+                    assert m.equivalent(msg)
+                    assert m.from_ == id1
+                    assert listener.read_next_msg() is None
+
+                    # And only a $.Jim from the right place gets through
+                    msg1 = Announcement('$.Jim', 'one.')
+                    msg1.orig_from = OrigFrom(7, 42)
+                    msg2 = Announcement('$.Jim', 'two.')
+                    msg2.orig_from = OrigFrom(7, 43)
+                    sender2.send_msg(msg1)
+                    sender2.send_msg(msg2)
+                    m = listener.read_next_msg()
+                    assert m.equivalent(msg1)
+                    assert listener.read_next_msg() is None
+
+                    # Unbinding needs the same filter as binding did
+                    check_IOError(errno.EINVAL, listener.unbind, '$.Fred')
+                    check_IOError(errno.EINVAL, listener.unbind_filtered,
+                                  '$.Fred', from_id=id1 + 1)
+                    listener.unbind_filtered('$.Fred', from_id=id1)
+                    sender1.send_msg(msg)
+                    assert listener.read_next_msg() is None
+
+                    # A filter can't be unbound twice
+                    check_IOError(errno.EINVAL, listener.unbind_filtered,
+                                  '$.Fred', from_id=id1)
+                    listener.unbind_filtered('$.Jim', orig_from=OrigFrom(7, 42))
+                    sender2.send_msg(msg1)
+                    assert listener.read_next_msg() is None
+
+    def test_bind_sampled(self):
+        """Test binding as a Listener for only every Nth message
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as listener:
+                check_IOError(errno.EINVAL, listener.bind_filtered,
+                              '$.Fred', sample_every=0)
+
+                listener.bind_filtered('$.Fred', sample_every=3)
+
+                for ii in range(9):
+                    sender.send_msg(Announcement('$.Fred', '%04d' % ii))
+
+                # We get the first of every three
+                for ii in (0, 3, 6):
+                    m = listener.read_next_msg()
+                    assert m.data == '%04d' % ii
+                assert listener.read_next_msg() is None
+
+    def test_bind_rate_limited(self):
+        """Test binding as a Listener for at most N messages a second
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as listener:
+                check_IOError(errno.EINVAL, listener.bind_filtered,
+                              '$.Fred', max_rate=0)
+
+                listener.bind_filtered('$.Fred', max_rate=5)
+
+                # A quick burst only gets the first five through
+                for ii in range(20):
+                    sender.send_msg(Announcement('$.Fred', '%04d' % ii))
+                assert listener.num_messages() == 5
+                for ii in range(5):
+                    m = listener.read_next_msg()
+                    assert m.data == '%04d' % ii
+
+                # But once the second is up, we can have some more
+                time.sleep(1.1)
+                sender.send_msg(Announcement('$.Fred', 'more'))
+                assert listener.read_next_msg().data == 'more'
+
+    def test_delivery_notice(self):
+        """Test a sender can be told when its message has left the system
+        """
+        with Ksock(0, 'rw') as sender:
+            with Ksock(0, 'r') as listener:
+                listener.bind('$.Fred')
+
+                msg = Announcement('$.Fred', 'dada',
+                                   flags=Message.DELIVERY_NOTICE)
+                msg_id = sender.send_msg(msg)
+
+                # The listener's copy doesn't ask for a notice
+                m = listener.read_next_msg()
+                assert m.id == msg_id
+                assert m.flags & Message.DELIVERY_NOTICE == 0
+
+                # Now it has been read, the sender is told (but the notice
+                # is delivered in the background, so we may need to wait)
+                (r, w, x) = select.select([sender], [], [], 1)
+                assert r == [sender]
+
+                d = sender.read_next_msg()
+                assert d.name == '$.KBUS.Delivered'
+                count, missed = struct.unpack('II', d.data[:8])
+                assert count == 1
+                assert missed == 0
+                network_id, serial_num = struct.unpack('II', d.data[8:16])
+                assert MessageId(network_id, serial_num) == msg_id
+                assert sender.read_next_msg() is None
+
+                # And a message sent without asking gets no notice
+                sender.send_msg(Announcement('$.Fred', 'dada'))
+                listener.read_next_msg()
+                (r, w, x) = select.select([sender], [], [], 0.5)
+                assert r == []
+
 # vim: set tabstop=8 shiftwidth=4 softtabstop=4 expandtab:
@@ -984,6 +984,7 @@ class Message:
 
     ALL_OR_WAIT         = _BIT(8)
     ALL_OR_FAIL         = _BIT(9)
+    DELIVERY_NOTICE     = _BIT(10)
 
     def __init__(self, name, data=None, to=None, from_=None, orig_from=None,
                  final_to=None, in_reply_to=None, flags=None, id=None,
@@ -1235,6 +1236,8 @@ class Message:
             words.append('aFL')
         if flags & Message.ALL_OR_WAIT:
             words.append('aWT')
+        if flags & Message.DELIVERY_NOTICE:
+            words.append('DLV')
 
         if len(words):
             return ','.join(words)
@@ -0,0 +1,466 @@
+/* kcapture.c */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/* A program you can use to record the traffic on a KBUS device to a binary
+ * log, for later inspection or replay. See kcapture.h for the file format.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libkbus/kbus.h"
+#include "kcapture.h"
+
+#define DEFAULT_SEGMENT_MB      64
+#define DEFAULT_QUEUE_LEN       1000
+
+struct capture_writer {
+  const char    *prefix;        // segment files are <prefix>.<NNNNNN>.kcap
+  uint32_t       device;        // the KBUS device being captured
+  uint64_t       segment_size;  // the size to preallocate for each segment
+  uint32_t       keep;          // keep at most this many segments (0 = all)
+
+  uint32_t       segment;       // the current segment number
+  int            fd;            // and its file descriptor
+  char          *map;           // the segment, mapped into memory
+  uint64_t       used;          // how many bytes of it we have used
+  uint32_t       num_records;   // how many records are in it
+
+  struct kbus_capture_index_entry *index;
+  uint32_t       index_len;     // entries used in 'index'
+  uint32_t       index_size;    // entries allocated in 'index'
+
+  uint64_t       total_records; // over all segments
+  uint64_t       total_bytes;
+  uint32_t       too_big;       // messages too big to fit in a segment
+};
+
+static volatile sig_atomic_t stop_capture = 0;
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Syntax: kcapture [-bus <n>] [-size <MB>] [-keep <n>] [-queue <n>]\n"
+          "                 [-count <n>] [-v] <prefix> [<msgname>]\n"
+          "\n"
+          "Record every message matching <msgname> (which defaults to '$.*')\n"
+          "on the given KBUS device (which defaults to 0) to a binary log.\n"
+          "\n"
+          "The log is written as segment files <prefix>.<NNNNNN>.kcap, each\n"
+          "of (at most) <MB> megabytes (default %d). A new segment is started\n"
+          "when the current one is full. If -keep is given, only the most\n"
+          "recent <n> segments are kept.\n"
+          "\n"
+          "-queue <n> sets the length of our KBUS message queue (default %d),\n"
+          "so that we do not hold up senders using ALL_OR_WAIT/ALL_OR_FAIL.\n"
+          "-count <n> stops after <n> messages. Otherwise, stop with ^C.\n"
+          "-h or -help prints this text.\n",
+          DEFAULT_SEGMENT_MB, DEFAULT_QUEUE_LEN);
+}
+
+static void handle_signal(int signum)
+{
+  stop_capture = 1;
+}
+
+static void segment_name(struct capture_writer *w, uint32_t segment,
+                         char *name, size_t name_len)
+{
+  snprintf(name, name_len, "%s.%06u%s", w->prefix, segment,
+           KBUS_CAPTURE_SUFFIX);
+}
+
+static int remember_index_entry(struct capture_writer *w,
+                                uint64_t               timestamp_ns,
+                                uint64_t               offset)
+{
+  if (w->index_len == w->index_size)
+  {
+    uint32_t new_size = w->index_size ? 2 * w->index_size : 1024;
+    struct kbus_capture_index_entry *new_index;
+
+    new_index = realloc(w->index, new_size * sizeof(*new_index));
+    if (new_index == NULL)
+      return -ENOMEM;
+    w->index = new_index;
+    w->index_size = new_size;
+  }
+  w->index[w->index_len].timestamp_ns = timestamp_ns;
+  w->index[w->index_len].offset = offset;
+  w->index_len ++;
+  return 0;
+}
+
+/*
+ * Start a new segment file, preallocate it and map it into memory.
+ */
+static int open_segment(struct capture_writer *w)
+{
+  char name[PATH_MAX];
+  struct kbus_capture_file_header *hdr;
+
+  segment_name(w, w->segment, name, sizeof(name));
+
+  w->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0)
+  {
+    fprintf(stderr, "Cannot open %s - %s [%d] \n", name, strerror(errno), errno);
+    return -errno;
+  }
+
+  if (ftruncate(w->fd, w->segment_size) < 0)
+  {
+    int rv = -errno;
+    fprintf(stderr, "Cannot set size of %s - %s [%d] \n",
+            name, strerror(-rv), -rv);
+    close(w->fd);
+    return rv;
+  }
+
+  w->map = mmap(NULL, w->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                w->fd, 0);
+  if (w->map == MAP_FAILED)
+  {
+    int rv = -errno;
+    fprintf(stderr, "Cannot map %s - %s [%d] \n", name, strerror(-rv), -rv);
+    w->map = NULL;
+    close(w->fd);
+    return rv;
+  }
+
+  hdr = (struct kbus_capture_file_header *)w->map;
+  memcpy(hdr->magic, KBUS_CAPTURE_MAGIC, sizeof(hdr->magic));
+  hdr->version = KBUS_CAPTURE_VERSION;
+  hdr->header_len = sizeof(*hdr);
+  hdr->segment = w->segment;
+  hdr->device = w->device;
+  hdr->start_ns = kbus_capture_now_ns();
+
+  w->used = sizeof(*hdr);
+  w->num_records = 0;
+  w->index_len = 0;
+
+  // Tidy up the oldest segment, if we're only keeping some of them
+  if (w->keep && w->segment >= w->keep)
+  {
+    segment_name(w, w->segment - w->keep, name, sizeof(name));
+    (void) unlink(name);
+  }
+  return 0;
+}
+
+/*
+ * Finish the current segment - trim it to the space actually used, and
+ * append its index.
+ */
+static int close_segment(struct capture_writer *w)
+{
+  struct kbus_capture_index_trailer trailer;
+  size_t index_bytes = w->index_len * sizeof(struct kbus_capture_index_entry);
+  int rv = 0;
+
+  if (w->map == NULL)
+    return 0;
+
+  munmap(w->map, w->segment_size);
+  w->map = NULL;
+
+  memcpy(trailer.magic, KBUS_CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+  trailer.index_offset = w->used;
+  trailer.num_entries = w->index_len;
+  trailer.num_records = w->num_records;
+
+  if (ftruncate(w->fd, w->used) < 0 ||
+      pwrite(w->fd, w->index, index_bytes, w->used) != (ssize_t)index_bytes ||
+      pwrite(w->fd, &trailer, sizeof(trailer), w->used + index_bytes) !=
+          (ssize_t)sizeof(trailer))
+  {
+    fprintf(stderr, "Cannot write index for segment %u - %s [%d] \n",
+            w->segment, strerror(errno), errno);
+    rv = -errno;
+  }
+  close(w->fd);
+  w->fd = -1;
+  return rv;
+}
+
+/*
+ * Read the next message from KBUS straight into the current segment.
+ *
+ * 'msg_len' is the length returned by kbus_ksock_next_msg().
+ */
+static int capture_message(kbus_ksock_t           ksock,
+                           struct capture_writer *w,
+                           uint32_t               msg_len)
+{
+  struct kbus_capture_record *rec;
+  uint64_t  record_len = sizeof(*rec) + msg_len;
+  char     *buf;
+  size_t    so_far = 0;
+  int       rv;
+
+  if (sizeof(struct kbus_capture_file_header) + record_len > w->segment_size)
+  {
+    // It can never fit - just skip it (the next kbus_ksock_next_msg()
+    // will throw it away)
+    w->too_big ++;
+    return 0;
+  }
+
+  if (w->used + record_len > w->segment_size)
+  {
+    rv = close_segment(w);
+    if (rv) return rv;
+    w->segment ++;
+    rv = open_segment(w);
+    if (rv) return rv;
+  }
+
+  rec = (struct kbus_capture_record *)(w->map + w->used);
+  buf = (char *)(rec + 1);
+
+  while (so_far < msg_len)
+  {
+    ssize_t length = read(ksock, buf + so_far, msg_len - so_far);
+    if (length > 0)
+      so_far += length;
+    else if (length == 0)
+      return -EBADMSG;
+    else if (errno != EAGAIN && errno != EINTR)
+      return -errno;
+  }
+
+  rec->msg_len = msg_len;
+  rec->timestamp_ns = kbus_capture_now_ns();
+
+  if (w->num_records % KBUS_CAPTURE_INDEX_INTERVAL == 0)
+  {
+    rv = remember_index_entry(w, rec->timestamp_ns, w->used);
+    if (rv) return rv;
+  }
+
+  // Writing the length last means a reader (or a crash) never sees a
+  // partial record
+  rec->record_len = record_len;
+
+  w->used += record_len;
+  w->num_records ++;
+  w->total_records ++;
+  w->total_bytes += msg_len;
+  return 0;
+}
+
+static int do_capture(kbus_ksock_t           ksock,
+                      struct capture_writer *w,
+                      uint64_t               max_count,
+                      int                    verbose)
+{
+  int rv;
+
+  rv = open_segment(w);
+  if (rv) return rv;
+
+  while (!stop_capture && (max_count == 0 || w->total_records < max_count))
+  {
+    uint32_t msg_len;
+    uint64_t before = w->total_records;
+
+    rv = kbus_wait_for_message(ksock, KBUS_KSOCK_READABLE);
+    if (rv == -EINTR)
+      continue;
+    else if (rv < 0)
+    {
+      fprintf(stderr, "Cannot wait for message - %s [%d] \n",
+              strerror(-rv), -rv);
+      break;
+    }
+
+    // Drain everything that is ready before we wait again
+    while (max_count == 0 || w->total_records < max_count)
+    {
+      rv = kbus_ksock_next_msg(ksock, &msg_len);
+      if (rv < 0)
+      {
+        fprintf(stderr, "Cannot get next message - %s [%d] \n",
+                strerror(-rv), -rv);
+        break;
+      }
+      if (msg_len == 0)
+        break;
+
+      rv = capture_message(ksock, w, msg_len);
+      if (rv < 0)
+      {
+        fprintf(stderr, "Cannot capture message - %s [%d] \n",
+                strerror(-rv), -rv);
+        break;
+      }
+    }
+    if (rv < 0)
+      break;
+
+    if (verbose > 1)
+      printf("> Captured %llu messages\n",
+             (unsigned long long)(w->total_records - before));
+  }
+
+  (void) close_segment(w);
+  return rv < 0 ? rv : 0;
+}
+
+int main(int argn, char *args[])
+{
+  int bus_number = 0;
+  int verbose = 0;
+  uint32_t queue_len = DEFAULT_QUEUE_LEN;
+  uint64_t max_count = 0;
+  const char *msgname = "$.*";
+  struct capture_writer writer;
+  struct sigaction action;
+  char kname[128];
+  kbus_ksock_t ks;
+  int rv;
+
+  memset(&writer, 0, sizeof(writer));
+  writer.segment_size = (uint64_t)DEFAULT_SEGMENT_MB * 1024 * 1024;
+  writer.fd = -1;
+
+  while (argn > 1 && args[1][0] == '-')
+  {
+    if (!strcmp(args[1], "-v") || !strcmp(args[1], "--verbose"))
+    {
+      ++verbose;
+      args += 1; argn -= 1;
+      continue;
+    }
+    if (!strcmp(args[1], "-h") || !strcmp(args[1], "-help") ||
+        !strcmp(args[1], "--help"))
+    {
+      usage();
+      return 0;
+    }
+    if (argn < 3)
+    {
+      fprintf(stderr, "kcapture %s must have an argument.\n", args[1]);
+      usage();
+      return 1;
+    }
+    if (!strcmp(args[1], "-bus") || !strcmp(args[1], "--bus"))
+      bus_number = atoi(args[2]);
+    else if (!strcmp(args[1], "-size") || !strcmp(args[1], "--size"))
+      writer.segment_size = strtoull(args[2], NULL, 0) * 1024 * 1024;
+    else if (!strcmp(args[1], "-keep") || !strcmp(args[1], "--keep"))
+      writer.keep = strtoul(args[2], NULL, 0);
+    else if (!strcmp(args[1], "-queue") || !strcmp(args[1], "--queue"))
+      queue_len = strtoul(args[2], NULL, 0);
+    else if (!strcmp(args[1], "-count") || !strcmp(args[1], "--count"))
+      max_count = strtoull(args[2], NULL, 0);
+    else
+    {
+      fprintf(stderr, "Unrecognised switch '%s'\n", args[1]);
+      usage();
+      return 1;
+    }
+    args += 2; argn -= 2;
+  }
+
+  if (argn < 2 || argn > 3)
+  {
+    usage();
+    return 1;
+  }
+  writer.prefix = args[1];
+  if (argn == 3)
+    msgname = args[2];
+  writer.device = bus_number;
+
+  if (writer.segment_size == 0)
+  {
+    fprintf(stderr, "Segment size must be at least 1 MB\n");
+    return 1;
+  }
+
+  sprintf(kname, "/dev/kbus%d", bus_number);
+  ks = kbus_ksock_open_by_name(kname, O_RDONLY);
+  if (ks < 0)
+  {
+    fprintf(stderr, "Cannot kbus_open() %s - %s [%d] \n",
+            kname, strerror(errno), errno);
+    return 2;
+  }
+
+  if (queue_len)
+  {
+    rv = kbus_ksock_max_messages(ks, &queue_len);
+    if (rv < 0)
+      fprintf(stderr, "Cannot set queue length - %s [%d] -- continuing\n",
+              strerror(-rv), -rv);
+  }
+
+  rv = kbus_ksock_bind(ks, msgname, 0);
+  if (rv < 0)
+  {
+    fprintf(stderr, "Cannot bind() to %s - %s [%d] \n",
+            msgname, strerror(-rv), -rv);
+    return 2;
+  }
+
+  // No SA_RESTART, so that a signal gets us out of poll()
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  if (verbose)
+    printf("> Capturing %s on %s to %s.*%s\n", msgname, kname,
+           writer.prefix, KBUS_CAPTURE_SUFFIX);
+
+  rv = do_capture(ks, &writer, max_count, verbose);
+
+  printf("> Captured %llu messages (%llu bytes) in %u segment%s\n",
+         (unsigned long long)writer.total_records,
+         (unsigned long long)writer.total_bytes,
+         writer.segment + 1, writer.segment ? "s" : "");
+  if (writer.too_big)
+    printf("> Skipped %u messages too big for a segment\n", writer.too_big);
+
+  free(writer.index);
+  kbus_ksock_close(ks);
+  return rv < 0 ? 3 : 0;
+}
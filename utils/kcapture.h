@@ -0,0 +1,105 @@
+/* kcapture.h */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * The KBUS capture file format, as written by kcapture.
+ *
+ * A capture is a sequence of segment files, named <prefix>.<NNNNNN>.kcap,
+ * where NNNNNN counts up from 000000. Each segment is:
+ *
+ * 1. A struct kbus_capture_file_header.
+ * 2. Zero or more records. Each record is a struct kbus_capture_record,
+ *    followed immediately by an "entire" message, exactly as it was read
+ *    from KBUS. Since entire messages are always a multiple of 4 bytes long,
+ *    so is every record.
+ * 3. If the segment was closed cleanly, an index: an array of struct
+ *    kbus_capture_index_entry (one for every KBUS_CAPTURE_INDEX_INTERVAL
+ *    records), followed by a struct kbus_capture_index_trailer, which is
+ *    always the last thing in the file.
+ *
+ * A segment that was not closed cleanly (for instance, because the capture
+ * process was killed) has no index, and may be followed by zero bytes up to
+ * its preallocated size. It can still be read by walking the records from the
+ * start - a record with a 'record_len' of 0 marks the end.
+ *
+ * All integers are in host order, and timestamps are nanoseconds since the
+ * epoch (CLOCK_REALTIME), taken when the message was read from KBUS.
+ */
+
+#ifndef _KCAPTURE_H_INCLUDED_
+#define _KCAPTURE_H_INCLUDED_
+
+#include <stdint.h>
+#include <time.h>
+
+#define KBUS_CAPTURE_MAGIC              "KBUSCAP1"
+#define KBUS_CAPTURE_INDEX_MAGIC        "KBUSIDX1"
+#define KBUS_CAPTURE_VERSION            1
+#define KBUS_CAPTURE_SUFFIX             ".kcap"
+
+// One index entry is written for every this many records
+#define KBUS_CAPTURE_INDEX_INTERVAL     64
+
+struct kbus_capture_file_header {
+  char          magic[8];       // KBUS_CAPTURE_MAGIC, not NUL terminated
+  uint32_t      version;        // KBUS_CAPTURE_VERSION
+  uint32_t      header_len;     // sizeof(struct kbus_capture_file_header)
+  uint32_t      segment;        // which segment this is, from 0
+  uint32_t      device;         // which KBUS device we were capturing
+  uint64_t      start_ns;       // when this segment was started
+};
+
+struct kbus_capture_record {
+  uint32_t      record_len;     // this header plus the message, in bytes
+  uint32_t      msg_len;        // the entire message, in bytes
+  uint64_t      timestamp_ns;   // when the message was read
+};
+
+struct kbus_capture_index_entry {
+  uint64_t      timestamp_ns;   // the timestamp of the record...
+  uint64_t      offset;         // ...which starts at this offset in the file
+};
+
+struct kbus_capture_index_trailer {
+  char          magic[8];       // KBUS_CAPTURE_INDEX_MAGIC
+  uint64_t      index_offset;   // where the index entries start
+  uint32_t      num_entries;    // how many index entries there are
+  uint32_t      num_records;    // how many records the segment holds
+};
+
+/*
+ * Return the current time, in nanoseconds, as used for capture timestamps.
+ */
+static inline uint64_t kbus_capture_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* _KCAPTURE_H_INCLUDED_ */
@@ -0,0 +1,765 @@
+/* kreplay.c */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/* A program you can use to replay traffic captured by kcapture (or by our own
+ * "record" command) onto a KBUS device, either at the recorded rate, at a
+ * scaled rate, or as fast as possible. See kcapture.h for the file format.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libkbus/kbus.h"
+#include "kcapture.h"
+
+#define DEFAULT_MAX_SENDERS     16
+
+/*
+ * Each distinct Ksock that sent messages in the capture is replayed by
+ * its own Ksock, so that 'from' (and anything that refers back to it) stays
+ * consistent. If there are more senders than we're allowed Ksocks, the
+ * extras share the last one (and we say so).
+ */
+struct replay_sender {
+  uint32_t      orig_id;        // the Ksock id in the capture
+  kbus_ksock_t  ksock;          // the Ksock we replay it with
+  uint32_t      new_id;         // and that Ksock's id
+};
+
+struct replay_state {
+  int                   bus_number;
+  bool                  flat_out;       // ignore the recorded timing
+  double                scale;          // play at this multiple of real time
+  bool                  requests;       // keep Requests as Requests
+
+  struct replay_sender *senders;
+  uint32_t              num_senders;
+  uint32_t              max_senders;
+
+  char                 *buf;            // our copy of the current message
+  size_t                buf_size;
+
+  uint64_t              sent;
+  uint64_t              skipped;
+  uint64_t              shared;         // sent by a sender beyond max_senders
+  uint64_t              eagain;         // -EAGAIN: sender blocked (ALL_OR_WAIT)
+  uint64_t              ebusy;          // -EBUSY: receiver full (ALL_OR_FAIL)
+  uint64_t              errors;         // anything else
+  uint64_t              bytes;
+};
+
+struct capture_reader {
+  const char   *prefix;
+  bool          single_file;    // 'prefix' is actually a single segment
+  uint32_t      segment;
+  char         *map;
+  size_t        map_len;
+  uint64_t      pos;
+  uint64_t      end;
+};
+
+static volatile sig_atomic_t stop_now = 0;
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Syntax: kreplay [-bus <n>] [-scale <factor> | -flat] [-senders <n>]\n"
+          "                [-requests] play <capture>\n"
+          "        kreplay [-bus <n>] [-count <n>] record <prefix> [<msgname>]\n"
+          "\n"
+          "'play' sends the messages in <capture> to the given KBUS device\n"
+          "(which defaults to 0). <capture> is either a single .kcap file, or\n"
+          "the <prefix> given to kcapture, in which case all the segments\n"
+          "<prefix>.000000.kcap, <prefix>.000001.kcap, ... are played in order.\n"
+          "\n"
+          "By default, the recorded gaps between messages are preserved.\n"
+          "-scale <factor> plays <factor> times faster (so 2 is twice as fast),\n"
+          "and -flat plays as fast as possible.\n"
+          "\n"
+          "Each Ksock that sent messages in the capture is replayed from its own\n"
+          "Ksock (up to -senders, default %d). By default all messages are sent\n"
+          "as Announcements - with -requests, Requests are sent as Requests\n"
+          "(which needs Repliers on the bus) and recorded Replies are skipped.\n"
+          "\n"
+          "'record' listens for <msgname> (default '$.*') and writes what it\n"
+          "hears to <prefix>.000000.kcap, in the same format as kcapture,\n"
+          "until ^C (or -count messages).\n",
+          DEFAULT_MAX_SENDERS);
+}
+
+static void handle_signal(int signum)
+{
+  stop_now = 1;
+}
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t when)
+{
+  struct timespec ts;
+  ts.tv_sec = when / 1000000000ULL;
+  ts.tv_nsec = when % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR &&
+         !stop_now)
+    ;
+}
+
+// ===========================================================================
+// Reading captures
+
+static void close_segment(struct capture_reader *r)
+{
+  if (r->map)
+    munmap(r->map, r->map_len);
+  r->map = NULL;
+}
+
+/*
+ * Open and map the next segment of the capture.
+ *
+ * Returns 0 if all went well, 1 if there are no more segments, or a negative
+ * number (``-errno``) for failure.
+ */
+static int open_next_segment(struct capture_reader *r)
+{
+  char name[PATH_MAX];
+  struct stat st;
+  struct kbus_capture_file_header *hdr;
+  int fd;
+
+  close_segment(r);
+
+  if (r->single_file)
+  {
+    if (r->segment > 0)
+      return 1;
+    snprintf(name, sizeof(name), "%s", r->prefix);
+  }
+  else
+    snprintf(name, sizeof(name), "%s.%06u%s", r->prefix, r->segment,
+             KBUS_CAPTURE_SUFFIX);
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT && r->segment > 0)
+      return 1;
+    fprintf(stderr, "Cannot open %s - %s [%d] \n", name, strerror(errno), errno);
+    return -errno;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*hdr))
+  {
+    fprintf(stderr, "%s is too short to be a capture\n", name);
+    close(fd);
+    return -EBADMSG;
+  }
+
+  r->map_len = st.st_size;
+  r->map = mmap(NULL, r->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (r->map == MAP_FAILED)
+  {
+    r->map = NULL;
+    fprintf(stderr, "Cannot map %s - %s [%d] \n", name, strerror(errno), errno);
+    return -errno;
+  }
+  madvise(r->map, r->map_len, MADV_SEQUENTIAL);
+
+  hdr = (struct kbus_capture_file_header *)r->map;
+  if (memcmp(hdr->magic, KBUS_CAPTURE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != KBUS_CAPTURE_VERSION)
+  {
+    fprintf(stderr, "%s is not a KBUS capture (version %d)\n", name,
+            KBUS_CAPTURE_VERSION);
+    close_segment(r);
+    return -EBADMSG;
+  }
+
+  r->pos = hdr->header_len;
+  r->end = r->map_len;
+
+  // If the segment was closed cleanly, the records stop where its index starts
+  if (r->map_len >= sizeof(*hdr) + sizeof(struct kbus_capture_index_trailer))
+  {
+    struct kbus_capture_index_trailer *trailer;
+    trailer = (struct kbus_capture_index_trailer *)
+        (r->map + r->map_len - sizeof(*trailer));
+    if (!memcmp(trailer->magic, KBUS_CAPTURE_INDEX_MAGIC, sizeof(trailer->magic)) &&
+        trailer->index_offset <= r->map_len)
+      r->end = trailer->index_offset;
+  }
+
+  r->segment ++;
+  return 0;
+}
+
+/*
+ * Return the next record in the capture, or NULL if there are no more.
+ */
+static struct kbus_capture_record *next_record(struct capture_reader *r)
+{
+  struct kbus_capture_record *rec;
+
+  for (;;)
+  {
+    if (r->map && r->pos + sizeof(*rec) <= r->end)
+    {
+      rec = (struct kbus_capture_record *)(r->map + r->pos);
+      if (rec->record_len >= sizeof(*rec) + sizeof(kbus_message_t) &&
+          r->pos + rec->record_len <= r->end)
+      {
+        r->pos += rec->record_len;
+        return rec;
+      }
+      // A zero length (or a broken record) means the end of this segment
+    }
+    if (open_next_segment(r))
+      return NULL;
+  }
+}
+
+// ===========================================================================
+// Replaying
+
+static uint32_t remap_id(struct replay_state *s, uint32_t orig_id)
+{
+  uint32_t ii;
+  for (ii = 0; ii < s->num_senders; ii++)
+    if (s->senders[ii].orig_id == orig_id)
+      return s->senders[ii].new_id;
+  return orig_id;
+}
+
+/*
+ * Find (or make) the Ksock we're using to replay messages from 'orig_id'.
+ */
+static int sender_for(struct replay_state   *s,
+                      uint32_t               orig_id,
+                      struct replay_sender **sender)
+{
+  struct replay_sender *new;
+  uint32_t ii;
+  int rv;
+
+  for (ii = 0; ii < s->num_senders; ii++)
+  {
+    if (s->senders[ii].orig_id == orig_id)
+    {
+      *sender = &s->senders[ii];
+      return 0;
+    }
+  }
+
+  if (s->num_senders == s->max_senders)
+  {
+    if (s->shared ++ == 0)
+      fprintf(stderr, "More than %u Ksocks sent messages - the rest are"
+              " replayed from the last one (see -senders)\n", s->max_senders);
+    *sender = &s->senders[s->num_senders - 1];
+    return 0;
+  }
+
+  new = &s->senders[s->num_senders];
+  new->orig_id = orig_id;
+  new->ksock = kbus_ksock_open(s->bus_number, O_RDWR);
+  if (new->ksock < 0)
+  {
+    fprintf(stderr, "Cannot open a Ksock on KBUS %d - %s [%d] \n",
+            s->bus_number, strerror(errno), errno);
+    return -errno;
+  }
+  rv = kbus_ksock_id(new->ksock, &new->new_id);
+  if (rv < 0)
+    return rv;
+
+  s->num_senders ++;
+  *sender = new;
+  return 0;
+}
+
+/*
+ * Read (and ignore) any Replies that have arrived for our Requests.
+ */
+static void drain_senders(struct replay_state *s)
+{
+  uint32_t ii, len;
+
+  for (ii = 0; ii < s->num_senders; ii++)
+    while (kbus_ksock_next_msg(s->senders[ii].ksock, &len) > 0 && len)
+      ;
+}
+
+static int replay_message(struct replay_state        *s,
+                          struct kbus_capture_record *rec)
+{
+  kbus_message_t       *orig = (kbus_message_t *)(rec + 1);
+  kbus_message_t       *msg;
+  struct replay_sender *sender;
+  char                 *name = kbus_msg_name_ptr(orig);
+  kbus_msg_id_t         id;
+  int                   rv;
+
+  // KBUS makes its own synthetic messages, and won't let us send them
+  if ((orig->flags & KBUS_BIT_SYNTHETIC) || !strncmp(name, "$.KBUS.", 7))
+  {
+    s->skipped ++;
+    return 0;
+  }
+
+  if (kbus_msg_is_reply(orig) && s->requests)
+  {
+    // The Repliers on the bus we're replaying to will make their own
+    s->skipped ++;
+    return 0;
+  }
+
+  if (rec->msg_len > s->buf_size)
+  {
+    char *new_buf = realloc(s->buf, rec->msg_len);
+    if (new_buf == NULL)
+      return -ENOMEM;
+    s->buf = new_buf;
+    s->buf_size = rec->msg_len;
+  }
+  memcpy(s->buf, orig, rec->msg_len);
+  msg = (kbus_message_t *)s->buf;
+
+  rv = sender_for(s, orig->from, &sender);
+  if (rv < 0)
+    return rv;
+
+  // KBUS gives the message a new id (and 'from') as we send it
+  msg->id.network_id = 0;
+  msg->id.serial_num = 0;
+  msg->from = 0;
+
+  // Any reference to a sender we're replaying must refer to its new Ksock.
+  // A non-zero network id means a Ksock on another network (beyond a
+  // Limpet), which we aren't replaying, so those are left alone
+  if (msg->orig_from.network_id == 0)
+    msg->orig_from.local_id = remap_id(s, msg->orig_from.local_id);
+  if (msg->final_to.network_id == 0)
+    msg->final_to.local_id = remap_id(s, msg->final_to.local_id);
+
+  // We can't reproduce the exact Request/Reply pairing (the Ksocks that
+  // took part are gone), so Requests lose any particular recipient, and
+  // are only kept as Requests if we were asked to
+  msg->to = 0;
+  msg->in_reply_to.network_id = 0;
+  msg->in_reply_to.serial_num = 0;
+  msg->flags &= ~KBUS_BIT_WANT_YOU_TO_REPLY;
+  if (!s->requests)
+    msg->flags &= ~KBUS_BIT_WANT_A_REPLY;
+
+  rv = kbus_ksock_write_msg(sender->ksock, msg);
+  if (rv == 0)
+    rv = kbus_ksock_send(sender->ksock, &id);
+
+  if (rv == -EAGAIN)
+  {
+    // KBUS is holding on to the message until there's room for it
+    s->eagain ++;
+    rv = kbus_wait_for_message(sender->ksock, KBUS_KSOCK_WRITABLE);
+    if (rv >= 0)
+      rv = 0;
+  }
+  else if (rv == -EBUSY)
+  {
+    s->ebusy ++;
+    (void) kbus_ksock_discard(sender->ksock);
+    return 0;
+  }
+
+  if (rv < 0)
+  {
+    s->errors ++;
+    (void) kbus_ksock_discard(sender->ksock);
+    if (s->errors == 1)
+      fprintf(stderr, "Cannot send %.*s - %s [%d] (further errors are only counted)\n",
+              orig->name_len, name, strerror(-rv), -rv);
+    return 0;
+  }
+
+  s->sent ++;
+  s->bytes += rec->msg_len;
+  return 0;
+}
+
+static int do_play(struct replay_state *s, const char *capture)
+{
+  struct capture_reader reader;
+  struct kbus_capture_record *rec;
+  uint64_t first_ns = 0, last_ns = 0;
+  uint64_t start, now, finish, last_due;
+  uint64_t batches = 0;
+  bool in_batch = false;
+  size_t len = strlen(capture);
+  int rv = 0;
+
+  memset(&reader, 0, sizeof(reader));
+  reader.prefix = capture;
+  reader.single_file = (len > strlen(KBUS_CAPTURE_SUFFIX) &&
+                        !strcmp(capture + len - strlen(KBUS_CAPTURE_SUFFIX),
+                                KBUS_CAPTURE_SUFFIX));
+
+  start = now = last_due = monotonic_ns();
+
+  while (!stop_now && (rec = next_record(&reader)) != NULL)
+  {
+    if (first_ns == 0)
+      first_ns = rec->timestamp_ns;
+    if (rec->timestamp_ns > last_ns)
+      last_ns = rec->timestamp_ns;
+
+    if (!s->flat_out)
+    {
+      // Everything that is already due is sent as one batch, without
+      // looking at the clock again - we only check (and maybe sleep)
+      // when we get to a message that wasn't due last time we looked
+      //
+      // Capture timestamps are wall clock time, so may step backwards (or
+      // be out of order) - never let a message be due before the last one
+      uint64_t due = start;
+      if (rec->timestamp_ns > first_ns)
+        due += (uint64_t)((rec->timestamp_ns - first_ns) / s->scale);
+      if (due < last_due)
+        due = last_due;
+      last_due = due;
+      if (due > now)
+      {
+        if (s->requests)
+          drain_senders(s);
+        now = monotonic_ns();
+        if (due > now)
+        {
+          sleep_until_ns(due);
+          now = monotonic_ns();
+        }
+        in_batch = false;
+      }
+    }
+
+    if (!in_batch)
+    {
+      batches ++;
+      in_batch = true;
+    }
+
+    rv = replay_message(s, rec);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot replay message - %s [%d] \n", strerror(-rv), -rv);
+      break;
+    }
+    if (s->flat_out && s->requests && (s->sent % 64) == 0)
+      drain_senders(s);
+  }
+  close_segment(&reader);
+
+  finish = monotonic_ns();
+  {
+    double recorded = (double)(last_ns - first_ns) / 1e9;
+    double target = s->flat_out ? 0 : recorded / s->scale;
+    double elapsed = (double)(finish - start) / 1e9;
+    uint64_t total = s->sent + s->ebusy + s->errors;
+
+    printf("> Sent %llu messages (%llu bytes) in %llu batch%s, skipped %llu\n",
+           (unsigned long long)s->sent, (unsigned long long)s->bytes,
+           (unsigned long long)batches, batches == 1 ? "" : "es",
+           (unsigned long long)s->skipped);
+    if (s->shared)
+      printf("> %llu messages from more than %u senders shared the last"
+             " sender's Ksock\n", (unsigned long long)s->shared,
+             s->max_senders);
+    printf("> Recorded over %g s, target %g s, took %g s\n",
+           recorded, target, elapsed);
+    if (elapsed > 0)
+      printf("> Achieved %g msgs/s", (double)total / elapsed);
+    if (target > 0)
+      printf(", target %g msgs/s", (double)total / target);
+    printf("\n");
+    printf("> Backpressure: %llu -EAGAIN (waited), %llu -EBUSY (dropped),"
+           " %llu other errors\n",
+           (unsigned long long)s->eagain, (unsigned long long)s->ebusy,
+           (unsigned long long)s->errors);
+  }
+  return rv;
+}
+
+// ===========================================================================
+// Recording
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t rv = write(fd, ptr, len);
+    if (rv < 0)
+    {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    ptr += rv;
+    len -= rv;
+  }
+  return 0;
+}
+
+/*
+ * A simple recorder, writing a single segment. kcapture is the tool to use
+ * for long or busy captures.
+ */
+static int do_record(int bus_number, const char *prefix, const char *msgname,
+                     uint64_t max_count)
+{
+  struct kbus_capture_file_header hdr;
+  struct kbus_capture_index_trailer trailer;
+  struct kbus_capture_index_entry *index = NULL;
+  uint32_t index_len = 0, index_size = 0;
+  uint64_t offset, count = 0;
+  char name[PATH_MAX];
+  kbus_ksock_t ks;
+  int fd, rv;
+
+  ks = kbus_ksock_open(bus_number, O_RDONLY);
+  if (ks < 0)
+  {
+    fprintf(stderr, "Cannot open KBUS %d - %s [%d] \n",
+            bus_number, strerror(errno), errno);
+    return -errno;
+  }
+  rv = kbus_ksock_bind(ks, msgname, 0);
+  if (rv < 0)
+  {
+    fprintf(stderr, "Cannot bind() to %s - %s [%d] \n",
+            msgname, strerror(-rv), -rv);
+    return rv;
+  }
+
+  snprintf(name, sizeof(name), "%s.%06u%s", prefix, 0, KBUS_CAPTURE_SUFFIX);
+  fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Cannot open %s - %s [%d] \n", name, strerror(errno), errno);
+    return -errno;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, KBUS_CAPTURE_MAGIC, sizeof(hdr.magic));
+  hdr.version = KBUS_CAPTURE_VERSION;
+  hdr.header_len = sizeof(hdr);
+  hdr.device = bus_number;
+  hdr.start_ns = kbus_capture_now_ns();
+  rv = write_all(fd, &hdr, sizeof(hdr));
+  offset = sizeof(hdr);
+
+  printf("> Recording %s on KBUS %d to %s\n", msgname, bus_number, name);
+
+  while (rv == 0 && !stop_now && (max_count == 0 || count < max_count))
+  {
+    kbus_message_t *msg;
+    struct kbus_capture_record rec;
+
+    rv = kbus_wait_for_message(ks, KBUS_KSOCK_READABLE);
+    if (rv == -EINTR)
+    {
+      rv = 0;
+      continue;
+    }
+    else if (rv < 0)
+      break;
+
+    while (max_count == 0 || count < max_count)
+    {
+      rv = kbus_ksock_read_next_msg(ks, &msg);
+      if (rv < 0 || msg == NULL)
+        break;
+
+      rec.msg_len = kbus_msg_sizeof(msg);
+      rec.record_len = sizeof(rec) + rec.msg_len;
+      rec.timestamp_ns = kbus_capture_now_ns();
+
+      if (count % KBUS_CAPTURE_INDEX_INTERVAL == 0)
+      {
+        if (index_len == index_size)
+        {
+          uint32_t new_size = index_size ? 2 * index_size : 1024;
+          struct kbus_capture_index_entry *new_index;
+          new_index = realloc(index, new_size * sizeof(*index));
+          if (new_index == NULL)
+          {
+            kbus_msg_delete(&msg);
+            rv = -ENOMEM;
+            break;
+          }
+          index = new_index;
+          index_size = new_size;
+        }
+        index[index_len].timestamp_ns = rec.timestamp_ns;
+        index[index_len].offset = offset;
+        index_len ++;
+      }
+
+      rv = write_all(fd, &rec, sizeof(rec));
+      if (rv == 0)
+        rv = write_all(fd, msg, rec.msg_len);
+      kbus_msg_delete(&msg);
+      if (rv < 0)
+        break;
+      offset += rec.record_len;
+      count ++;
+    }
+  }
+
+  memcpy(trailer.magic, KBUS_CAPTURE_INDEX_MAGIC, sizeof(trailer.magic));
+  trailer.index_offset = offset;
+  trailer.num_entries = index_len;
+  trailer.num_records = count;
+  if (index_len)
+    (void) write_all(fd, index, index_len * sizeof(*index));
+  (void) write_all(fd, &trailer, sizeof(trailer));
+  close(fd);
+  free(index);
+  kbus_ksock_close(ks);
+
+  printf("> Recorded %llu messages\n", (unsigned long long)count);
+  if (rv < 0 && rv != -EINTR)
+    fprintf(stderr, "Error recording - %s [%d] \n", strerror(-rv), -rv);
+  return rv < 0 && rv != -EINTR ? rv : 0;
+}
+
+int main(int argn, char *args[])
+{
+  struct replay_state state;
+  struct sigaction action;
+  uint64_t max_count = 0;
+  const char *cmd;
+  int rv;
+
+  memset(&state, 0, sizeof(state));
+  state.scale = 1.0;
+  state.max_senders = DEFAULT_MAX_SENDERS;
+
+  while (argn > 1 && args[1][0] == '-')
+  {
+    if (!strcmp(args[1], "-flat") || !strcmp(args[1], "--flat"))
+    {
+      state.flat_out = true;
+      args += 1; argn -= 1;
+      continue;
+    }
+    if (!strcmp(args[1], "-requests") || !strcmp(args[1], "--requests"))
+    {
+      state.requests = true;
+      args += 1; argn -= 1;
+      continue;
+    }
+    if (argn < 3)
+    {
+      fprintf(stderr, "kreplay %s must have an argument.\n", args[1]);
+      usage();
+      return 1;
+    }
+    if (!strcmp(args[1], "-bus") || !strcmp(args[1], "--bus"))
+      state.bus_number = atoi(args[2]);
+    else if (!strcmp(args[1], "-scale") || !strcmp(args[1], "--scale"))
+      state.scale = atof(args[2]);
+    else if (!strcmp(args[1], "-senders") || !strcmp(args[1], "--senders"))
+      state.max_senders = strtoul(args[2], NULL, 0);
+    else if (!strcmp(args[1], "-count") || !strcmp(args[1], "--count"))
+      max_count = strtoull(args[2], NULL, 0);
+    else
+    {
+      fprintf(stderr, "Unrecognised switch '%s'\n", args[1]);
+      usage();
+      return 1;
+    }
+    args += 2; argn -= 2;
+  }
+
+  if (argn < 3)
+  {
+    usage();
+    return 1;
+  }
+  if (state.scale <= 0 || state.max_senders == 0)
+  {
+    fprintf(stderr, "-scale and -senders must be greater than 0\n");
+    return 1;
+  }
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  cmd = args[1];
+  if (!strcmp(cmd, "play") && argn == 3)
+  {
+    uint32_t ii;
+
+    state.senders = calloc(state.max_senders, sizeof(*state.senders));
+    if (state.senders == NULL)
+      return 2;
+
+    rv = do_play(&state, args[2]);
+
+    for (ii = 0; ii < state.num_senders; ii++)
+      kbus_ksock_close(state.senders[ii].ksock);
+    free(state.senders);
+    free(state.buf);
+  }
+  else if (!strcmp(cmd, "record") && (argn == 3 || argn == 4))
+    rv = do_record(state.bus_number, args[2], argn == 4 ? args[3] : "$.*",
+                   max_count);
+  else
+  {
+    usage();
+    return 1;
+  }
+  return rv < 0 ? 3 : 0;
+}
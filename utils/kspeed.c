@@ -31,11 +31,21 @@
  * messages.
  */
 
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include "libkbus/kbus.h"
 
 #define NUMBER_OF_TIMES  1000
 
+// Latency histogram buckets are powers of two of nanoseconds
+#define HIST_BUCKETS     64
+
 static void usage(void)
 {
   fprintf(stderr,
@@ -49,6 +59,28 @@ static void usage(void)
           "\n"
           "You may run as many listeners as you like, but only one sender per\n"
           "message name.\n"
+          "\n"
+          "Or: kspeed [-bus <n>] bench <msgname> <bytes> [<switches>]\n"
+          "\n"
+          "This runs a whole benchmark at once, with:\n"
+          "\n"
+          "  -senders <n>    <n> senders (default 1), each sending -count messages\n"
+          "  -listeners <n>  <n> listeners (default 1) bound to <msgname>\n"
+          "  -repliers <n>   <n> repliers (default 0). If given, senders send\n"
+          "                  Requests to <msgname>.0 .. <msgname>.<n-1> in turn,\n"
+          "                  and wait for each Reply, and listeners bind to\n"
+          "                  <msgname>.*\n"
+          "  -count <n>      messages per sender (default %d)\n"
+          "  -processes      run each sender/listener/replier as a process,\n"
+          "                  rather than a thread\n"
+          "  -wait           send with ALL_OR_WAIT (wait if a queue is full)\n"
+          "  -fail           send with ALL_OR_FAIL (fail if a queue is full)\n"
+          "  -queue <n>      set each listener's queue length\n"
+          "\n"
+          "Each message carries its send time, and the one-way latency (and\n"
+          "round-trip time, with repliers) is reported as a histogram, along\n"
+          "with throughput and CPU time per message.\n",
+          NUMBER_OF_TIMES
          );
 }
 
@@ -102,9 +134,8 @@ static int do_listen(int ksock_fd, const char *kbus_name, const char *msg_name)
 
     gettimeofday(&tv_now, NULL);
     {
-      double times = NUMBER_OF_TIMES;
-      double ms_between = ((double)(tv_now.tv_usec - tv_then.tv_usec) / times) + 
-        ((double)(tv_now.tv_sec - tv_then.tv_sec) * times);
+      double ms_between = ((double)(tv_now.tv_usec - tv_then.tv_usec) / 1000.0) +
+        ((double)(tv_now.tv_sec - tv_then.tv_sec) * 1000.0);
 
       printf("> Recvd %d messages in %g ms => %g msgs/ms \n",
              which, ms_between, (double)which/ ms_between);
@@ -176,9 +207,8 @@ static int do_send(int ksock_fd, const char *kbus_name, const char *msg_name, in
 
     gettimeofday(&tv_now, NULL);
     {
-      double times = NUMBER_OF_TIMES;
-      double ms_between = ((double)(tv_now.tv_usec - tv_then.tv_usec) / times) + 
-        ((double)(tv_now.tv_sec - tv_then.tv_sec) * times);
+      double ms_between = ((double)(tv_now.tv_usec - tv_then.tv_usec) / 1000.0) +
+        ((double)(tv_now.tv_sec - tv_then.tv_sec) * 1000.0);
 
       printf("> Sent %d messages in %g ms => %g msgs/ms \n",
              which, ms_between, (double)which / ms_between);
@@ -187,6 +217,642 @@ static int do_send(int ksock_fd, const char *kbus_name, const char *msg_name, in
   return 0;
 }
 
+// ===========================================================================
+// The "bench" command - many senders, listeners and repliers at once
+
+enum bench_role { ROLE_SENDER, ROLE_LISTENER, ROLE_REPLIER };
+
+// What each sender puts at the start of its message data
+struct bench_stamp {
+  uint64_t      sent_ns;
+  uint32_t      sender;
+  uint32_t      seq;
+};
+
+struct bench_result {
+  enum bench_role role;
+  uint64_t      msgs;           // sent, received or replied to
+  uint64_t      failed;         // sends that failed (-EBUSY, etc.)
+  uint64_t      eagain;         // sends that had to wait
+  uint64_t      cpu_ns;         // CPU time used by this worker
+  uint64_t      hist[HIST_BUCKETS];     // latency (or round-trip time)
+  uint64_t      lat_count;
+  uint64_t      lat_sum_ns;
+  uint64_t      lat_max_ns;
+};
+
+// This lives in shared memory, so it works for processes as well as threads
+struct bench_shared {
+  volatile int  ready;          // listeners and repliers bound so far
+  volatile int  go;             // senders may start
+  volatile int  senders_done;   // senders that have finished (or given up)
+  volatile int  gone;           // workers that gave up
+  volatile int  stop;           // give up without sending anything
+  uint64_t      start_ns;
+  uint64_t      end_ns;         // when the last sender finished
+  struct bench_result results[];
+};
+
+struct bench_config {
+  int           bus_number;
+  const char   *msg_name;
+  int           nr_bytes;
+  int           senders;
+  int           listeners;
+  int           repliers;
+  int           count;
+  uint32_t      flags;          // ALL_OR_WAIT or ALL_OR_FAIL, if wanted
+  uint32_t      queue_len;
+  bool          processes;
+  struct bench_shared *shared;
+};
+
+struct bench_worker {
+  struct bench_config *config;
+  int           index;          // into shared->results
+  int           number;         // within its role
+  pthread_t     thread;
+  pid_t         pid;
+};
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_cpu_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_record_latency(struct bench_result *result, uint64_t ns)
+{
+  int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+  if (bucket >= HIST_BUCKETS)
+    bucket = HIST_BUCKETS - 1;
+  result->hist[bucket] ++;
+  result->lat_count ++;
+  result->lat_sum_ns += ns;
+  if (ns > result->lat_max_ns)
+    result->lat_max_ns = ns;
+}
+
+static int bench_open(struct bench_config *config, int flags)
+{
+  char kname[128];
+  int ks;
+
+  sprintf(kname, "/dev/kbus%d", config->bus_number);
+  ks = kbus_ksock_open_by_name(kname, flags);
+  if (ks < 0)
+    fprintf(stderr, "Cannot kbus_open() %s - %s [%d] \n",
+            kname, strerror(errno), errno);
+  return ks;
+}
+
+/*
+ * Send one message, coping with the effects of ALL_OR_WAIT/ALL_OR_FAIL.
+ */
+static int bench_send(int ks, kbus_message_t *msg, struct bench_result *result)
+{
+  struct kbus_msg_id id;
+  int rv = kbus_ksock_send_msg(ks, msg, &id);
+
+  if (rv == -EAGAIN)
+  {
+    // KBUS keeps the message, and sends it when there is room
+    result->eagain ++;
+    rv = kbus_wait_for_message(ks, KBUS_KSOCK_WRITABLE);
+    if (rv >= 0)
+      rv = 0;
+  }
+  if (rv < 0)
+  {
+    result->failed ++;
+    (void) kbus_ksock_discard(ks);
+  }
+  return rv;
+}
+
+static int bench_do_sender(struct bench_worker *worker)
+{
+  struct bench_config *config = worker->config;
+  struct bench_result *result = &config->shared->results[worker->index];
+  size_t data_len = config->nr_bytes;
+  struct bench_stamp *stamp;
+  char **names = NULL;
+  char *data;
+  int ks = -1;
+  int ii, ret = 4;
+
+  if (data_len < sizeof(*stamp))
+    data_len = sizeof(*stamp);
+  data = malloc(data_len);
+  if (data == NULL)
+    goto gone;
+  memset(data, 0x55, data_len);
+  stamp = (struct bench_stamp *)data;
+  stamp->sender = worker->number;
+
+  if (config->repliers)
+  {
+    names = calloc(config->repliers, sizeof(*names));
+    if (names == NULL)
+      goto gone;
+    for (ii = 0; ii < config->repliers; ii++)
+    {
+      names[ii] = malloc(strlen(config->msg_name) + 12);
+      if (names[ii] == NULL)
+        goto gone;
+      sprintf(names[ii], "%s.%d", config->msg_name, ii);
+    }
+  }
+
+  ks = bench_open(config, O_RDWR);
+  if (ks < 0)
+  {
+    ret = 2;
+    goto gone;
+  }
+
+  while (!config->shared->go)
+    usleep(1000);
+
+  result->cpu_ns = bench_cpu_ns();
+  for (ii = 0; ii < config->count && !config->shared->stop; ii++)
+  {
+    kbus_message_t *msg;
+    const char *name = config->msg_name;
+    int rv;
+
+    if (config->repliers)
+    {
+      name = names[ii % config->repliers];
+      rv = kbus_msg_create_request(&msg, name, strlen(name),
+                                   data, data_len, config->flags);
+    }
+    else
+      rv = kbus_msg_create(&msg, name, strlen(name),
+                           data, data_len, config->flags);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot create kbus message: %s [%d] \n",
+              strerror(-rv), -rv);
+      goto gone;
+    }
+
+    stamp->seq = ii;
+    stamp->sent_ns = bench_now_ns();
+    rv = bench_send(ks, msg, result);
+    kbus_msg_delete(&msg);
+    if (rv < 0)
+      continue;
+    result->msgs ++;
+
+    if (config->repliers)
+    {
+      // Wait for our Reply (or whatever KBUS says instead)
+      kbus_message_t *reply = NULL;
+      while (reply == NULL)
+      {
+        rv = kbus_wait_for_message(ks, KBUS_KSOCK_READABLE);
+        if (rv < 0)
+          break;
+        rv = kbus_ksock_read_next_msg(ks, &reply);
+        if (rv < 0)
+          break;
+      }
+      if (reply)
+      {
+        bench_record_latency(result, bench_now_ns() - stamp->sent_ns);
+        kbus_msg_delete(&reply);
+      }
+    }
+  }
+  result->cpu_ns = bench_cpu_ns() - result->cpu_ns;
+
+  config->shared->end_ns = bench_now_ns();
+  ret = 0;
+
+gone:
+  if (ret)
+    __sync_fetch_and_add(&config->shared->gone, 1);
+  // The receivers stop when all the senders are done, whether or not we made it
+  __sync_fetch_and_add(&config->shared->senders_done, 1);
+
+  if (ks >= 0)
+    kbus_ksock_close(ks);
+  free(data);
+  if (names)
+  {
+    for (ii = 0; ii < config->repliers; ii++)
+      free(names[ii]);
+    free(names);
+  }
+  return ret;
+}
+
+/*
+ * Listeners and repliers keep going until all the senders have finished,
+ * and they have nothing left to read.
+ */
+static int bench_do_receiver(struct bench_worker *worker, bool is_replier)
+{
+  struct bench_config *config = worker->config;
+  struct bench_result *result = &config->shared->results[worker->index];
+  char name[KBUS_MAX_NAME_LEN + 1];
+  int ks, rv;
+
+  ks = bench_open(config, O_RDWR);
+  if (ks < 0)
+  {
+    __sync_fetch_and_add(&config->shared->gone, 1);
+    return 2;
+  }
+
+  if (is_replier)
+    snprintf(name, sizeof(name), "%s.%d", config->msg_name, worker->number);
+  else if (config->repliers)
+    snprintf(name, sizeof(name), "%s.*", config->msg_name);
+  else
+    snprintf(name, sizeof(name), "%s", config->msg_name);
+
+  if (config->queue_len)
+  {
+    uint32_t queue_len = config->queue_len;
+    (void) kbus_ksock_max_messages(ks, &queue_len);
+  }
+
+  rv = kbus_ksock_bind(ks, name, is_replier);
+  if (rv < 0)
+  {
+    fprintf(stderr, "Cannot bind() to %s - %s [%d] \n",
+            name, strerror(-rv), -rv);
+    kbus_ksock_close(ks);
+    __sync_fetch_and_add(&config->shared->gone, 1);
+    return 2;
+  }
+  __sync_fetch_and_add(&config->shared->ready, 1);
+
+  while (!config->shared->go)
+    usleep(1000);
+
+  result->cpu_ns = bench_cpu_ns();
+  for (;;)
+  {
+    struct pollfd fds[1];
+    int senders_done = config->shared->senders_done;
+
+    fds[0].fd = ks;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    rv = poll(fds, 1, 100);
+    if (rv == 0)
+    {
+      if (senders_done == config->senders || config->shared->stop)
+        break;
+      continue;
+    }
+    else if (rv < 0)
+      break;
+
+    for (;;)
+    {
+      kbus_message_t *msg = NULL;
+      uint64_t now;
+
+      rv = kbus_ksock_read_next_msg(ks, &msg);
+      if (rv < 0 || msg == NULL)
+        break;
+      now = bench_now_ns();
+      // Listeners on <msgname>.* also hear the Replies - don't count them
+      if (!kbus_msg_is_reply(msg))
+        result->msgs ++;
+
+      if (msg->data_len >= sizeof(struct bench_stamp))
+      {
+        struct bench_stamp *stamp = kbus_msg_data_ptr(msg);
+        bench_record_latency(result, now - stamp->sent_ns);
+      }
+
+      if (is_replier && kbus_msg_wants_us_to_reply(msg))
+      {
+        kbus_message_t *reply;
+        rv = kbus_msg_create_reply_to(&reply, msg, NULL, 0, 0);
+        if (rv == 0)
+        {
+          (void) bench_send(ks, reply, result);
+          kbus_msg_delete(&reply);
+        }
+      }
+      kbus_msg_delete_all(&msg);
+    }
+  }
+  result->cpu_ns = bench_cpu_ns() - result->cpu_ns;
+
+  kbus_ksock_close(ks);
+  return 0;
+}
+
+static void *bench_worker_main(void *arg)
+{
+  struct bench_worker *worker = arg;
+  struct bench_result *result = &worker->config->shared->results[worker->index];
+
+  if (result->role == ROLE_SENDER)
+    bench_do_sender(worker);
+  else
+    bench_do_receiver(worker, result->role == ROLE_REPLIER);
+  return NULL;
+}
+
+static int bench_start(struct bench_worker *worker)
+{
+  if (worker->config->processes)
+  {
+    worker->pid = fork();
+    if (worker->pid < 0)
+      return -errno;
+    if (worker->pid == 0)
+    {
+      bench_worker_main(worker);
+      _exit(0);
+    }
+    return 0;
+  }
+  return -pthread_create(&worker->thread, NULL, bench_worker_main, worker);
+}
+
+static void bench_wait(struct bench_worker *worker)
+{
+  if (worker->config->processes)
+    waitpid(worker->pid, NULL, 0);
+  else
+    pthread_join(worker->thread, NULL);
+}
+
+static void bench_print_histogram(const char *what, struct bench_result *sum)
+{
+  uint64_t so_far = 0;
+  double p50 = 0, p90 = 0, p99 = 0;
+  int first = -1, last = -1;
+  int ii;
+
+  if (sum->lat_count == 0)
+    return;
+
+  for (ii = 0; ii < HIST_BUCKETS; ii++)
+  {
+    if (sum->hist[ii])
+    {
+      if (first < 0)
+        first = ii;
+      last = ii;
+    }
+  }
+
+  printf("> %s: %llu samples, mean %.1f us, max %.1f us\n", what,
+         (unsigned long long)sum->lat_count,
+         (double)sum->lat_sum_ns / sum->lat_count / 1000.0,
+         (double)sum->lat_max_ns / 1000.0);
+  for (ii = first; ii <= last; ii++)
+  {
+    // Bucket ii holds latencies in [2^(ii-1), 2^ii) ns
+    double upper_us = (double)(1ULL << ii) / 1000.0;
+    so_far += sum->hist[ii];
+    printf(">   < %10.1f us %10llu %6.2f%%\n", upper_us,
+           (unsigned long long)sum->hist[ii],
+           100.0 * so_far / sum->lat_count);
+    if (p50 == 0 && so_far * 100 >= sum->lat_count * 50) p50 = upper_us;
+    if (p90 == 0 && so_far * 100 >= sum->lat_count * 90) p90 = upper_us;
+    if (p99 == 0 && so_far * 100 >= sum->lat_count * 99) p99 = upper_us;
+  }
+  printf(">   50%% < %.1f us, 90%% < %.1f us, 99%% < %.1f us\n", p50, p90, p99);
+}
+
+static void bench_sum(struct bench_config *config, enum bench_role role,
+                      struct bench_result *sum)
+{
+  int total = config->senders + config->listeners + config->repliers;
+  int ii, jj;
+
+  memset(sum, 0, sizeof(*sum));
+  for (ii = 0; ii < total; ii++)
+  {
+    struct bench_result *r = &config->shared->results[ii];
+    if (r->role != role)
+      continue;
+    sum->msgs += r->msgs;
+    sum->failed += r->failed;
+    sum->eagain += r->eagain;
+    sum->cpu_ns += r->cpu_ns;
+    for (jj = 0; jj < HIST_BUCKETS; jj++)
+      sum->hist[jj] += r->hist[jj];
+    sum->lat_count += r->lat_count;
+    sum->lat_sum_ns += r->lat_sum_ns;
+    if (r->lat_max_ns > sum->lat_max_ns)
+      sum->lat_max_ns = r->lat_max_ns;
+  }
+}
+
+static int do_bench(struct bench_config *config)
+{
+  int total = config->senders + config->listeners + config->repliers;
+  size_t shared_len = sizeof(struct bench_shared) +
+                      total * sizeof(struct bench_result);
+  struct bench_worker *workers;
+  struct bench_result senders, listeners, repliers;
+  double secs;
+  int ii, rv, ret = 0;
+
+  config->shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (config->shared == MAP_FAILED)
+  {
+    fprintf(stderr, "Cannot allocate shared memory - %s [%d] \n",
+            strerror(errno), errno);
+    return 2;
+  }
+  memset(config->shared, 0, shared_len);
+
+  workers = calloc(total, sizeof(*workers));
+  if (workers == NULL)
+  {
+    munmap(config->shared, shared_len);
+    return 2;
+  }
+
+  for (ii = 0; ii < total; ii++)
+  {
+    struct bench_result *result = &config->shared->results[ii];
+    workers[ii].config = config;
+    workers[ii].index = ii;
+    if (ii < config->listeners)
+    {
+      result->role = ROLE_LISTENER;
+      workers[ii].number = ii;
+    }
+    else if (ii < config->listeners + config->repliers)
+    {
+      result->role = ROLE_REPLIER;
+      workers[ii].number = ii - config->listeners;
+    }
+    else
+    {
+      result->role = ROLE_SENDER;
+      workers[ii].number = ii - config->listeners - config->repliers;
+    }
+  }
+
+  printf("> %d sender%s, %d listener%s, %d replier%s (as %s), "
+         "%d messages of %d bytes each to %s\n",
+         config->senders, config->senders == 1 ? "" : "s",
+         config->listeners, config->listeners == 1 ? "" : "s",
+         config->repliers, config->repliers == 1 ? "" : "s",
+         config->processes ? "processes" : "threads",
+         config->count, config->nr_bytes, config->msg_name);
+
+  for (ii = 0; ii < total; ii++)
+  {
+    rv = bench_start(&workers[ii]);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot start worker %d - %s [%d] \n",
+              ii, strerror(-rv), -rv);
+      // Let the ones we did start give up, and tidy up after them
+      config->shared->senders_done = config->senders;
+      config->shared->stop = 1;
+      config->shared->go = 1;
+      while (ii-- > 0)
+        bench_wait(&workers[ii]);
+      ret = 2;
+      goto tidyup;
+    }
+  }
+
+  // Everyone must be bound before anyone sends
+  while (config->shared->ready + config->shared->gone <
+         config->listeners + config->repliers)
+    usleep(1000);
+  if (config->shared->gone)
+    config->shared->stop = 1;
+  config->shared->start_ns = bench_now_ns();
+  config->shared->go = 1;
+
+  for (ii = 0; ii < total; ii++)
+    bench_wait(&workers[ii]);
+
+  if (config->shared->gone)
+  {
+    fprintf(stderr, "> %d worker%s failed\n", config->shared->gone,
+            config->shared->gone == 1 ? "" : "s");
+    ret = 2;
+    goto tidyup;
+  }
+
+  bench_sum(config, ROLE_SENDER, &senders);
+  bench_sum(config, ROLE_LISTENER, &listeners);
+  bench_sum(config, ROLE_REPLIER, &repliers);
+
+  secs = (double)(config->shared->end_ns - config->shared->start_ns) / 1e9;
+  printf("> Sent %llu messages in %g s => %g msgs/s (%llu failed, %llu waited)\n",
+         (unsigned long long)senders.msgs, secs, senders.msgs / secs,
+         (unsigned long long)senders.failed,
+         (unsigned long long)senders.eagain);
+  if (config->listeners)
+    printf("> Listeners received %llu of %llu messages\n",
+           (unsigned long long)listeners.msgs,
+           (unsigned long long)senders.msgs * config->listeners);
+  if (config->repliers)
+    printf("> Repliers received %llu messages\n",
+           (unsigned long long)repliers.msgs);
+
+  if (senders.msgs)
+    printf("> CPU per message sent: senders %.2f us", senders.cpu_ns / 1000.0 / senders.msgs);
+  if (listeners.msgs)
+    printf(", listeners %.2f us", listeners.cpu_ns / 1000.0 / listeners.msgs);
+  if (repliers.msgs)
+    printf(", repliers %.2f us", repliers.cpu_ns / 1000.0 / repliers.msgs);
+  printf("\n");
+
+  bench_print_histogram("One-way latency", &listeners);
+  bench_print_histogram("Request latency (at replier)", &repliers);
+  bench_print_histogram("Round-trip time", &senders);
+
+tidyup:
+  free(workers);
+  munmap(config->shared, shared_len);
+  return ret;
+}
+
+static int bench_main(int bus_number, int argn, char *args[])
+{
+  struct bench_config config;
+
+  if (argn < 4)
+  {
+    usage();
+    return 1;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.bus_number = bus_number;
+  config.msg_name = args[2];
+  config.nr_bytes = atoi(args[3]);
+  config.senders = 1;
+  config.listeners = 1;
+  config.count = NUMBER_OF_TIMES;
+  args += 3; argn -= 3;
+
+  while (argn > 1)
+  {
+    if (!strcmp(args[1], "-processes"))
+      config.processes = true;
+    else if (!strcmp(args[1], "-wait"))
+      config.flags = KBUS_BIT_ALL_OR_WAIT;
+    else if (!strcmp(args[1], "-fail"))
+      config.flags = KBUS_BIT_ALL_OR_FAIL;
+    else if (argn < 3)
+    {
+      fprintf(stderr, "kspeed bench %s must have an argument.\n", args[1]);
+      return 1;
+    }
+    else
+    {
+      if (!strcmp(args[1], "-senders"))
+        config.senders = atoi(args[2]);
+      else if (!strcmp(args[1], "-listeners"))
+        config.listeners = atoi(args[2]);
+      else if (!strcmp(args[1], "-repliers"))
+        config.repliers = atoi(args[2]);
+      else if (!strcmp(args[1], "-count"))
+        config.count = atoi(args[2]);
+      else if (!strcmp(args[1], "-queue"))
+        config.queue_len = atoi(args[2]);
+      else
+      {
+        fprintf(stderr, "Unrecognised bench switch '%s'\n", args[1]);
+        usage();
+        return 1;
+      }
+      args += 1; argn -= 1;
+    }
+    args += 1; argn -= 1;
+  }
+
+  if (config.senders < 1 || config.listeners < 0 || config.repliers < 0 ||
+      config.count < 1 || config.nr_bytes < 0)
+  {
+    fprintf(stderr, "Bench needs at least one sender, and sensible counts\n");
+    return 1;
+  }
+  return do_bench(&config);
+}
+
 int main(int argn, char *args[])
 {
   int bus_number = 0;
@@ -212,6 +878,9 @@ int main(int argn, char *args[])
 
 
 
+  if (!strcmp(args[1], "bench"))
+    return bench_main(bus_number, argn, args);
+
   {
     const char *cmd = args[1];
     const char *msgname = args[2];
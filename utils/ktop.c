@@ -0,0 +1,557 @@
+/* ktop.c */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/* A "top" for KBUS - shows, every so often, the traffic for each message name
+ * and the state of each Ksock on a KBUS device.
+ *
+ * Per-Ksock information comes from /proc/kbus/stats. Per-name information
+ * comes from listening to "$.*" - to keep the cost of that bounded, we only
+ * read the header and name of each message (never its data), and only keep
+ * counts for a fixed number of distinct names.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libkbus/kbus.h"
+
+#define DEFAULT_MAX_NAMES       1024
+#define DEFAULT_TOP             15
+#define MAX_KSOCKS              1024
+#define LISTEN_QUEUE_LEN        10000
+
+struct name_count {
+  char         *name;           // NULL if this slot is unused
+  uint32_t      hash;
+  uint64_t      msgs;           // in this interval
+  uint64_t      bytes;
+};
+
+struct name_table {
+  struct name_count *slots;
+  uint32_t      size;           // always a power of two
+  uint32_t      used;
+  uint32_t      max_names;      // never use more than this many slots
+  uint64_t      other_msgs;     // for names we had no room for
+  uint64_t      other_bytes;
+};
+
+struct ksock_stats {
+  uint32_t      id;
+  unsigned long pid;
+  uint32_t      queued;
+  uint32_t      max_messages;
+  uint32_t      max_queued;
+  uint64_t      num_sent;
+  uint64_t      bytes_sent;
+  uint64_t      num_received;
+  uint32_t      num_blocked;
+  uint32_t      num_refused;
+};
+
+struct ksock_sample {
+  struct ksock_stats ksocks[MAX_KSOCKS];
+  uint32_t      count;
+};
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Syntax: ktop [-bus <n>] [-interval <secs>] [-names <n>] [-top <n>]\n"
+          "             [-nolisten] [-count <n>]\n"
+          "\n"
+          "Show, every <secs> seconds (default 1), the message traffic on the\n"
+          "given KBUS device (default 0):\n"
+          "\n"
+          "* messages/s and bytes/s for each message name (by listening to '$.*')\n"
+          "* for each Ksock, its pid, queue depth, send rate and blocked sends\n"
+          "  (from /proc/kbus/stats)\n"
+          "* the Ksocks with the fullest queues - the slowest consumers.\n"
+          "\n"
+          "-names <n> limits the number of distinct names counted (default %d),\n"
+          "the rest are counted together as '(other)'. -top <n> limits the number\n"
+          "of rows in each table (default %d). -nolisten just uses /proc/kbus/stats.\n"
+          "-count <n> stops after <n> refreshes.\n",
+          DEFAULT_MAX_NAMES, DEFAULT_TOP);
+}
+
+static uint64_t monotonic_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ===========================================================================
+// Per-name counts
+
+static uint32_t hash_name(const char *name, uint32_t len)
+{
+  uint32_t hash = 2166136261u;          // FNV-1a
+  uint32_t ii;
+  for (ii = 0; ii < len; ii++)
+  {
+    hash ^= (uint8_t)name[ii];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int init_name_table(struct name_table *t, uint32_t max_names)
+{
+  t->size = 16;
+  while (t->size < 2 * max_names)
+    t->size *= 2;
+  t->slots = calloc(t->size, sizeof(*t->slots));
+  if (t->slots == NULL)
+    return -ENOMEM;
+  t->used = 0;
+  t->max_names = max_names;
+  return 0;
+}
+
+static void count_name(struct name_table *t, const char *name,
+                       uint32_t name_len, uint32_t msg_len)
+{
+  uint32_t hash = hash_name(name, name_len);
+  uint32_t ii = hash & (t->size - 1);
+
+  // The table is never more than half full, so this always stops
+  while (t->slots[ii].name)
+  {
+    if (t->slots[ii].hash == hash &&
+        !strncmp(t->slots[ii].name, name, name_len) &&
+        t->slots[ii].name[name_len] == '\0')
+    {
+      t->slots[ii].msgs ++;
+      t->slots[ii].bytes += msg_len;
+      return;
+    }
+    ii = (ii + 1) & (t->size - 1);
+  }
+
+  if (t->used < t->max_names)
+  {
+    t->slots[ii].name = strndup(name, name_len);
+    if (t->slots[ii].name)
+    {
+      t->slots[ii].hash = hash;
+      t->slots[ii].msgs = 1;
+      t->slots[ii].bytes = msg_len;
+      t->used ++;
+      return;
+    }
+  }
+  t->other_msgs ++;
+  t->other_bytes += msg_len;
+}
+
+static void reset_name_counts(struct name_table *t)
+{
+  uint32_t ii;
+  for (ii = 0; ii < t->size; ii++)
+    t->slots[ii].msgs = t->slots[ii].bytes = 0;
+  t->other_msgs = t->other_bytes = 0;
+}
+
+/*
+ * Read the header and name of every message waiting for us, and count them.
+ *
+ * We never read the message data - asking for the next message throws away
+ * whatever is left of the current one.
+ */
+static int drain_listener(kbus_ksock_t ksock, struct name_table *t)
+{
+  char buf[sizeof(kbus_message_t) + KBUS_MAX_NAME_LEN + 1];
+  uint32_t msg_len;
+  int rv;
+
+  for (;;)
+  {
+    kbus_message_t *hdr = (kbus_message_t *)buf;
+    size_t want, so_far = 0;
+
+    rv = kbus_ksock_next_msg(ksock, &msg_len);
+    if (rv < 0)
+      return rv;
+    if (msg_len == 0)
+      return 0;
+
+    want = sizeof(*hdr);
+    while (so_far < want)
+    {
+      ssize_t length = read(ksock, buf + so_far, want - so_far);
+      if (length > 0)
+      {
+        so_far += length;
+        if (so_far == sizeof(*hdr))
+        {
+          if (hdr->name_len > KBUS_MAX_NAME_LEN)
+            return -EBADMSG;
+          want += hdr->name_len;
+        }
+      }
+      else if (length == 0)
+        return -EBADMSG;
+      else if (errno != EAGAIN && errno != EINTR)
+        return -errno;
+    }
+    count_name(t, buf + sizeof(*hdr), hdr->name_len, msg_len);
+  }
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  const struct name_count *na = *(const struct name_count **)a;
+  const struct name_count *nb = *(const struct name_count **)b;
+  if (na->msgs != nb->msgs)
+    return na->msgs < nb->msgs ? 1 : -1;
+  if (na->bytes != nb->bytes)
+    return na->bytes < nb->bytes ? 1 : -1;
+  return 0;
+}
+
+static void show_names(struct name_table *t, double secs, uint32_t top,
+                       struct name_count **sorted)
+{
+  uint32_t ii, count = 0;
+
+  for (ii = 0; ii < t->size; ii++)
+    if (t->slots[ii].name && t->slots[ii].msgs)
+      sorted[count++] = &t->slots[ii];
+  qsort(sorted, count, sizeof(*sorted), compare_names);
+
+  printf("%10s %12s  %s\n", "msgs/s", "bytes/s", "message name");
+  for (ii = 0; ii < count && ii < top; ii++)
+    printf("%10.1f %12.1f  %s\n", sorted[ii]->msgs / secs,
+           sorted[ii]->bytes / secs, sorted[ii]->name);
+  if (count > top)
+    printf("%10s %12s  ...and %u more names\n", "", "", count - top);
+  if (t->other_msgs)
+    printf("%10.1f %12.1f  (other - more than %u names)\n",
+           t->other_msgs / secs, t->other_bytes / secs, t->max_names);
+  if (count == 0 && t->other_msgs == 0)
+    printf("%10s %12s  (no messages)\n", "", "");
+}
+
+// ===========================================================================
+// Per-Ksock statistics
+
+/*
+ * Read /proc/kbus/stats for our device.
+ *
+ * Returns 0 if all goes well, or a negative number (``-errno``) if the file
+ * could not be read.
+ */
+static int read_ksock_stats(int bus_number, struct ksock_sample *sample)
+{
+  FILE *file = fopen("/proc/kbus/stats", "r");
+  char line[256];
+  bool ours = false;
+  struct ksock_stats *current = NULL;
+
+  sample->count = 0;
+  if (file == NULL)
+    return -errno;
+
+  while (fgets(line, sizeof(line), file))
+  {
+    unsigned int dev, id, net, serial, queued, max;
+
+    if (sscanf(line, "dev %u:", &dev) == 1)
+    {
+      ours = (dev == (unsigned int)bus_number);
+      current = NULL;
+    }
+    else if (!ours)
+      continue;
+    else if (sscanf(line, " ksock %u last msg %u:%u queue %u of %u",
+                    &id, &net, &serial, &queued, &max) == 5)
+    {
+      if (sample->count == MAX_KSOCKS)
+      {
+        current = NULL;
+        continue;
+      }
+      current = &sample->ksocks[sample->count++];
+      memset(current, 0, sizeof(*current));
+      current->id = id;
+      current->queued = queued;
+      current->max_messages = max;
+    }
+    else if (current)
+    {
+      unsigned long long sent, bytes, received;
+      unsigned int max_queued, blocked, refused;
+      if (sscanf(line, " pid %lu sent %llu msgs %llu bytes, received %llu msgs"
+                 " (max queued %u), blocked %u refused %u",
+                 &current->pid, &sent, &bytes, &received,
+                 &max_queued, &blocked, &refused) == 7)
+      {
+        current->num_sent = sent;
+        current->bytes_sent = bytes;
+        current->num_received = received;
+        current->max_queued = max_queued;
+        current->num_blocked = blocked;
+        current->num_refused = refused;
+      }
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+static struct ksock_stats *find_ksock(struct ksock_sample *sample, uint32_t id)
+{
+  uint32_t ii;
+  for (ii = 0; ii < sample->count; ii++)
+    if (sample->ksocks[ii].id == id)
+      return &sample->ksocks[ii];
+  return NULL;
+}
+
+static int compare_fullness(const void *a, const void *b)
+{
+  const struct ksock_stats *ka = *(const struct ksock_stats **)a;
+  const struct ksock_stats *kb = *(const struct ksock_stats **)b;
+  double fa = ka->max_messages ? (double)ka->queued / ka->max_messages : 0;
+  double fb = kb->max_messages ? (double)kb->queued / kb->max_messages : 0;
+  if (fa != fb)
+    return fa < fb ? 1 : -1;
+  return 0;
+}
+
+static void show_ksocks(struct ksock_sample *now, struct ksock_sample *before,
+                        double secs, uint32_t top, uint32_t our_id)
+{
+  struct ksock_stats *sorted[MAX_KSOCKS];
+  uint32_t ii, count = 0;
+
+  printf("%8s %8s %9s %10s %12s %10s %8s %8s\n", "ksock", "pid", "queue",
+         "sent/s", "bytes/s", "recvd/s", "blocked", "refused");
+  for (ii = 0; ii < now->count && ii < top; ii++)
+  {
+    struct ksock_stats *k = &now->ksocks[ii];
+    struct ksock_stats *old = find_ksock(before, k->id);
+    uint64_t sent = k->num_sent - (old ? old->num_sent : 0);
+    uint64_t bytes = k->bytes_sent - (old ? old->bytes_sent : 0);
+    uint64_t received = k->num_received - (old ? old->num_received : 0);
+    char queue[24];
+
+    snprintf(queue, sizeof(queue), "%u/%u", k->queued, k->max_messages);
+    printf("%8u %8lu %9s %10.1f %12.1f %10.1f %8u %8u%s\n", k->id, k->pid,
+           queue, sent / secs, bytes / secs, received / secs,
+           k->num_blocked - (old ? old->num_blocked : 0),
+           k->num_refused - (old ? old->num_refused : 0),
+           k->id == our_id ? "  (ktop)" : "");
+  }
+  if (now->count > top)
+    printf("...and %u more Ksocks\n", now->count - top);
+
+  for (ii = 0; ii < now->count; ii++)
+    if (now->ksocks[ii].queued && now->ksocks[ii].id != our_id)
+      sorted[count++] = &now->ksocks[ii];
+  qsort(sorted, count, sizeof(*sorted), compare_fullness);
+
+  printf("\nSlowest consumers (fullest queues):\n");
+  for (ii = 0; ii < count && ii < top; ii++)
+    printf("%8u %8lu  %u of %u queued (most ever %u)\n", sorted[ii]->id,
+           sorted[ii]->pid, sorted[ii]->queued, sorted[ii]->max_messages,
+           sorted[ii]->max_queued);
+  if (count == 0)
+    printf("    (all queues empty)\n");
+}
+
+int main(int argn, char *args[])
+{
+  int bus_number = 0;
+  double interval = 1.0;
+  uint32_t max_names = DEFAULT_MAX_NAMES;
+  uint32_t top = DEFAULT_TOP;
+  uint64_t max_count = 0, count = 0;
+  bool listen = true;
+  bool have_stats;
+  struct name_table names;
+  struct name_count **sorted = NULL;
+  struct ksock_sample *samples;
+  struct ksock_sample *now, *before;
+  kbus_ksock_t ks = -1;
+  uint32_t our_id = 0;
+  uint64_t last;
+  int rv;
+
+  while (argn > 1 && args[1][0] == '-')
+  {
+    if (!strcmp(args[1], "-nolisten") || !strcmp(args[1], "--nolisten"))
+    {
+      listen = false;
+      args += 1; argn -= 1;
+      continue;
+    }
+    if (argn < 3)
+    {
+      usage();
+      return 1;
+    }
+    if (!strcmp(args[1], "-bus") || !strcmp(args[1], "--bus"))
+      bus_number = atoi(args[2]);
+    else if (!strcmp(args[1], "-interval") || !strcmp(args[1], "--interval"))
+      interval = atof(args[2]);
+    else if (!strcmp(args[1], "-names") || !strcmp(args[1], "--names"))
+      max_names = strtoul(args[2], NULL, 0);
+    else if (!strcmp(args[1], "-top") || !strcmp(args[1], "--top"))
+      top = strtoul(args[2], NULL, 0);
+    else if (!strcmp(args[1], "-count") || !strcmp(args[1], "--count"))
+      max_count = strtoull(args[2], NULL, 0);
+    else
+    {
+      fprintf(stderr, "Unrecognised switch '%s'\n", args[1]);
+      usage();
+      return 1;
+    }
+    args += 2; argn -= 2;
+  }
+  if (argn != 1 || interval <= 0 || max_names == 0)
+  {
+    usage();
+    return 1;
+  }
+
+  samples = calloc(2, sizeof(*samples));
+  if (samples == NULL)
+    return 2;
+  now = &samples[0];
+  before = &samples[1];
+
+  have_stats = (read_ksock_stats(bus_number, before) == 0);
+  if (!have_stats && !listen)
+  {
+    fprintf(stderr, "Cannot read /proc/kbus/stats, and -nolisten given\n");
+    return 2;
+  }
+
+  if (listen)
+  {
+    uint32_t queue_len = LISTEN_QUEUE_LEN;
+
+    if (init_name_table(&names, max_names) < 0)
+      return 2;
+    sorted = calloc(max_names, sizeof(*sorted));
+    if (sorted == NULL)
+      return 2;
+
+    ks = kbus_ksock_open(bus_number, O_RDONLY);
+    if (ks < 0)
+    {
+      fprintf(stderr, "Cannot open KBUS %d - %s [%d] \n",
+              bus_number, strerror(errno), errno);
+      return 2;
+    }
+    (void) kbus_ksock_max_messages(ks, &queue_len);
+    (void) kbus_ksock_only_once(ks, 1);
+    rv = kbus_ksock_bind(ks, "$.*", 0);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot bind() to $.* - %s [%d] \n",
+              strerror(-rv), -rv);
+      return 2;
+    }
+    (void) kbus_ksock_id(ks, &our_id);
+  }
+
+  last = monotonic_ms();
+  while (max_count == 0 || count < max_count)
+  {
+    uint64_t due = last + (uint64_t)(interval * 1000);
+    uint64_t current = monotonic_ms();
+    double secs;
+
+    if (current < due)
+    {
+      if (listen)
+      {
+        struct pollfd fds[1];
+        fds[0].fd = ks;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        rv = poll(fds, 1, due - current);
+        if (rv > 0)
+        {
+          rv = drain_listener(ks, &names);
+          if (rv < 0)
+          {
+            fprintf(stderr, "Cannot read messages - %s [%d] \n",
+                    strerror(-rv), -rv);
+            return 3;
+          }
+        }
+      }
+      else
+        usleep((due - current) * 1000);
+      continue;
+    }
+
+    secs = (current - last) / 1000.0;
+    last = current;
+    count ++;
+
+    printf("\033[H\033[2J");
+    printf("KBUS %d - every %g s\n\n", bus_number, interval);
+
+    if (listen)
+    {
+      show_names(&names, secs, top, sorted);
+      reset_name_counts(&names);
+      printf("\n");
+    }
+
+    if (have_stats && read_ksock_stats(bus_number, now) == 0)
+    {
+      struct ksock_sample *tmp;
+      show_ksocks(now, before, secs, top, our_id);
+      tmp = before;
+      before = now;
+      now = tmp;
+    }
+    else
+      printf("(no /proc/kbus/stats - per-Ksock information unavailable)\n");
+    fflush(stdout);
+  }
+
+  if (ks >= 0)
+    kbus_ksock_close(ks);
+  return 0;
+}
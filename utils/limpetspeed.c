@@ -0,0 +1,1198 @@
+/* limpetspeed.c */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MPL 1.1
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the KBUS Lightweight Linux-kernel mediated
+ * message system
+ *
+ * The Initial Developer of the Original Code is Kynesim, Cambridge UK.
+ * Portions created by the Initial Developer are Copyright (C) 2010
+ * the Initial Developer. All Rights Reserved.
+ *
+ * Contributor(s):
+ *   Kynesim, Cambridge UK
+ *
+ * ***** END LICENSE BLOCK *****
+ */
+
+/* A program you can use to check how fast a pair of Limpets is.
+ *
+ * It runs two Limpets on this machine, joining two KBUS devices by a Unix
+ * domain socket (or TCP to localhost), and then sends messages through them
+ * in each direction, so that Limpet changes can be measured without a second
+ * host.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#include "libkbus/kbus.h"
+
+#define DEFAULT_COUNT      10000
+#define DEFAULT_LISTENERS  4
+#define DEFAULT_BYTES      64
+#define DEFAULT_WINDOW     32
+
+// The Limpets proxy everything under this name, and nothing else
+#define SPEED_MSG_PREFIX   "$.LimpetSpeed."
+
+// How long to wait for something to happen before giving up on it
+#define STALL_SECONDS      5
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Syntax: limpetspeed [<switches>] [fanout] [rpc] [large]\n"
+          "\n"
+          "This program starts a server Limpet on one KBUS device and a client\n"
+          "Limpet on another, linked by a Unix domain socket or by TCP to\n"
+          "localhost, and then measures messages going through them. For each\n"
+          "direction (from the server's KBUS, A, to the client's, B, and back)\n"
+          "it runs the chosen workloads (by default, all of them):\n"
+          "\n"
+          "  fanout   Announcements, each heard by -listeners listeners on the\n"
+          "           far side\n"
+          "  rpc      Requests to a Replier on the far side, one at a time, each\n"
+          "           answered by a Reply with the same data\n"
+          "  large    Announcements of -large bytes to one listener\n"
+          "\n"
+          "and reports throughput, latency percentiles (one-way for\n"
+          "Announcements, round-trip for Requests), and the system calls and\n"
+          "CPU time each Limpet used per message.\n"
+          "\n"
+          "  -kbus <a> <b>    the KBUS devices to join (default 0 and 1)\n"
+          "  -unix <path>     link the Limpets by this Unix domain socket\n"
+          "                   (default /tmp/limpetspeed.<pid>)\n"
+          "  -tcp <port>      link the Limpets by TCP to localhost:<port> instead\n"
+          "  -limpet <cmd>    the Limpet to run, which must take the same switches\n"
+          "                   as runlimpet (default runlimpet, from the same\n"
+          "                   directory as limpetspeed). For instance,\n"
+          "                   -limpet 'python runlimpet.py'\n"
+          "  -count <n>       messages (or Requests) per workload and direction\n"
+          "                   (default %d)\n"
+          "  -listeners <n>   listeners for fanout (default %d)\n"
+          "  -bytes <n>       data in each fanout message and Request (default %d)\n"
+          "  -large <n>       data in each large message (default as much as\n"
+          "                   both KBUS devices allow)\n"
+          "  -window <n>      at most <n> Announcements sent but not yet heard\n"
+          "                   by every listener (default %d)\n"
+          "  -a-b, -b-a       only measure messages going that way\n"
+          "  -verbose         show what the Limpets themselves output\n"
+          "  -- <args>        give all the remaining arguments to both Limpets,\n"
+          "                   for instance '-- -frame 4096'\n"
+          "\n"
+          "System calls are counted with the raw_syscalls:sys_enter tracepoint\n"
+          "if that is available, and otherwise only read and write calls are\n"
+          "counted (from /proc/<pid>/io). The count includes any messages the\n"
+          "Limpets send to each other to keep their routes or bindings current.\n",
+          DEFAULT_COUNT, DEFAULT_LISTENERS, DEFAULT_BYTES, DEFAULT_WINDOW);
+}
+
+// ===========================================================================
+// The Limpets themselves
+
+struct speed_limpet {
+  bool          is_server;
+  uint32_t      bus_number;
+  pid_t         pid;
+  clockid_t     cpu_clock;
+  int           perf_fd;        // counting system calls, or -1
+};
+
+// What a Limpet has used so far
+struct limpet_usage {
+  uint64_t      cpu_ns;
+  uint64_t      syscalls;
+};
+
+struct speed_config {
+  uint32_t      bus[2];         // A (the server's) and B (the client's)
+  char         *limpet_cmd;
+  char          address[128];   // a socket path, or localhost:<port>
+  bool          is_tcp;
+  bool          made_path;      // so we should remove it at the end
+  int           count;
+  int           listeners;
+  int           nr_bytes;
+  int           large_bytes;
+  int           window;
+  bool          a_to_b;
+  bool          b_to_a;
+  bool          verbose;
+  char        **limpet_args;    // after "--"
+  int           nr_limpet_args;
+  bool          full_syscalls;  // else only read and write calls
+  struct speed_limpet limpets[2];
+};
+
+static uint64_t speed_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Count the system calls made by process `pid`, using the tracepoint that
+ * every system call passes through.
+ *
+ * Returns a perf event file descriptor, or -1 if that is not possible.
+ */
+static int open_syscall_counter(pid_t pid)
+{
+  static const char *id_paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+  };
+  struct perf_event_attr attr;
+  unsigned long long id = 0;
+  unsigned ii;
+
+  for (ii = 0; ii < sizeof(id_paths) / sizeof(id_paths[0]); ii++)
+  {
+    FILE *file = fopen(id_paths[ii], "r");
+    if (file == NULL)
+      continue;
+    if (fscanf(file, "%llu", &id) != 1)
+      id = 0;
+    fclose(file);
+    if (id)
+      break;
+  }
+  if (id == 0)
+    return -1;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_TRACEPOINT;
+  attr.size = sizeof(attr);
+  attr.config = id;
+  return syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+}
+
+static uint64_t read_syscall_count(struct speed_limpet *limpet)
+{
+  if (limpet->perf_fd >= 0)
+  {
+    uint64_t count = 0;
+    if (read(limpet->perf_fd, &count, sizeof(count)) != sizeof(count))
+      return 0;
+    return count;
+  }
+  else
+  {
+    // Only the read and write family of calls, but better than nothing
+    char path[64];
+    char line[128];
+    unsigned long long value, total = 0;
+    FILE *file;
+
+    sprintf(path, "/proc/%d/io", (int)limpet->pid);
+    file = fopen(path, "r");
+    if (file == NULL)
+      return 0;
+    while (fgets(line, sizeof(line), file))
+    {
+      if (sscanf(line, "syscr: %llu", &value) == 1 ||
+          sscanf(line, "syscw: %llu", &value) == 1)
+        total += value;
+    }
+    fclose(file);
+    return total;
+  }
+}
+
+static void read_limpet_usage(struct speed_config *config,
+                              struct limpet_usage usage[2])
+{
+  int ii;
+
+  for (ii = 0; ii < 2; ii++)
+  {
+    struct speed_limpet *limpet = &config->limpets[ii];
+    struct timespec ts;
+
+    if (clock_gettime(limpet->cpu_clock, &ts) == 0)
+      usage[ii].cpu_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    else
+      usage[ii].cpu_ns = 0;
+    usage[ii].syscalls = read_syscall_count(limpet);
+  }
+}
+
+/*
+ * Start a Limpet, as a separate process, with the given command line.
+ */
+static int start_limpet(struct speed_config *config,
+                        struct speed_limpet *limpet)
+{
+  char *cmd = strdup(config->limpet_cmd);
+  char **argv = NULL;
+  char bus_str[16];
+  int argc = 0;
+  int ii;
+  char *word;
+
+  if (cmd)
+    argv = calloc(strlen(cmd) / 2 + 16 + config->nr_limpet_args,
+                  sizeof(*argv));
+  if (argv == NULL)
+  {
+    free(cmd);
+    return -ENOMEM;
+  }
+
+  // The Limpet command may be several words, e.g., 'python runlimpet.py'
+  for (word = strtok(cmd, " \t"); word; word = strtok(NULL, " \t"))
+    argv[argc++] = word;
+  if (argc == 0)
+  {
+    free(argv);
+    free(cmd);
+    return -EINVAL;
+  }
+
+  sprintf(bus_str, "%u", limpet->bus_number);
+  argv[argc++] = limpet->is_server ? "-s" : "-c";
+  argv[argc++] = "-k";
+  argv[argc++] = bus_str;
+  argv[argc++] = "-m";
+  argv[argc++] = SPEED_MSG_PREFIX "*";
+  argv[argc++] = "-v";
+  argv[argc++] = config->verbose ? "1" : "0";
+  argv[argc++] = config->address;
+  for (ii = 0; ii < config->nr_limpet_args; ii++)
+    argv[argc++] = config->limpet_args[ii];
+  argv[argc] = NULL;
+
+  fflush(stdout);
+  limpet->pid = fork();
+  if (limpet->pid < 0)
+    return -errno;
+  if (limpet->pid == 0)
+  {
+    if (!config->verbose)
+    {
+      int null_fd = open("/dev/null", O_WRONLY);
+      if (null_fd >= 0)
+        dup2(null_fd, STDOUT_FILENO);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "Cannot run Limpet %s - %s [%d] \n",
+            argv[0], strerror(errno), errno);
+    _exit(127);
+  }
+
+  free(argv);
+  free(cmd);
+
+  if (clock_getcpuclockid(limpet->pid, &limpet->cpu_clock))
+    limpet->cpu_clock = -1;
+  limpet->perf_fd = open_syscall_counter(limpet->pid);
+  return 0;
+}
+
+static bool limpet_has_died(struct speed_limpet *limpet)
+{
+  int status;
+  if (limpet->pid <= 0)
+    return true;
+  if (waitpid(limpet->pid, &status, WNOHANG) == limpet->pid)
+  {
+    limpet->pid = 0;
+    return true;
+  }
+  return false;
+}
+
+static void stop_limpets(struct speed_config *config)
+{
+  int ii;
+
+  for (ii = 0; ii < 2; ii++)
+  {
+    struct speed_limpet *limpet = &config->limpets[ii];
+    if (limpet->perf_fd >= 0)
+      close(limpet->perf_fd);
+    limpet->perf_fd = -1;
+    if (limpet->pid > 0)
+    {
+      kill(limpet->pid, SIGTERM);
+      waitpid(limpet->pid, NULL, 0);
+      limpet->pid = 0;
+    }
+  }
+  if (config->made_path)
+    (void) unlink(config->address);
+}
+
+static int start_limpets(struct speed_config *config)
+{
+  struct speed_limpet *server = &config->limpets[0];
+  struct speed_limpet *client = &config->limpets[1];
+  struct stat st;
+  int rv, ii;
+
+  if (!config->is_tcp && stat(config->address, &st) == 0)
+  {
+    fprintf(stderr, "Socket %s already exists - not using it\n",
+            config->address);
+    return -EEXIST;
+  }
+
+  server->is_server = true;
+  server->bus_number = config->bus[0];
+  client->is_server = false;
+  client->bus_number = config->bus[1];
+
+  rv = start_limpet(config, server);
+  if (rv < 0)
+    return rv;
+  config->made_path = !config->is_tcp;
+
+  // The client gives up if the server is not there to connect to, so wait
+  // for the server's socket to exist (there is no harmless way to probe a
+  // TCP port, so just give the server a moment)
+  if (config->is_tcp)
+    usleep(500000);
+  else
+  {
+    for (ii = 0; ii < STALL_SECONDS * 100; ii++)
+    {
+      if (stat(config->address, &st) == 0 || limpet_has_died(server))
+        break;
+      usleep(10000);
+    }
+  }
+  if (limpet_has_died(server))
+  {
+    fprintf(stderr, "The server Limpet has stopped\n");
+    return -ECHILD;
+  }
+  return start_limpet(config, client);
+}
+
+// ===========================================================================
+// The workloads
+
+enum workload_kind { WORK_FANOUT, WORK_RPC, WORK_LARGE };
+
+// What the sender puts at the start of each message's data
+struct speed_stamp {
+  uint64_t      sent_ns;
+  uint32_t      seq;
+  uint32_t      unused;
+};
+
+struct speed_workload;
+
+struct speed_receiver {
+  struct speed_workload *work;
+  pthread_t     thread;
+  uint64_t      received;       // protected by work->lock
+  uint64_t      last_ns;        // when the last message arrived
+  uint64_t     *latency_ns;     // one per message received
+};
+
+struct speed_workload {
+  struct speed_config *config;
+  enum workload_kind kind;
+  const char   *label;
+  int           from;           // index into config->bus
+  int           to;
+  char          name[KBUS_MAX_NAME_LEN + 1];
+  int           nr_receivers;
+  struct speed_receiver *receivers;
+  uint32_t      data_len;
+  int           count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int           ready;          // receivers bound to the name
+  int           gone;           // receivers that could not bind
+  volatile int  stop;
+
+  uint64_t      sent;
+  uint64_t      retries;        // sends that found a queue full
+  uint64_t      start_ns;
+  uint64_t      end_ns;
+  uint64_t     *rtt_ns;         // one per Reply
+  uint64_t      nr_rtts;
+  bool          stalled;
+};
+
+static void *receiver_main(void *arg)
+{
+  struct speed_receiver *receiver = arg;
+  struct speed_workload *work = receiver->work;
+  struct speed_config *config = work->config;
+  bool is_replier = (work->kind == WORK_RPC);
+  uint32_t queue_len = 2 * config->window;
+  int ks, rv;
+
+  ks = kbus_ksock_open(config->bus[work->to], O_RDWR);
+  if (ks < 0)
+  {
+    fprintf(stderr, "Cannot open KBUS %u - %s [%d] \n",
+            config->bus[work->to], strerror(errno), errno);
+    goto gone;
+  }
+  if (queue_len > 100)
+    (void) kbus_ksock_max_messages(ks, &queue_len);
+  rv = kbus_ksock_bind(ks, work->name, is_replier);
+  if (rv < 0)
+  {
+    fprintf(stderr, "Cannot bind() to %s - %s [%d] \n",
+            work->name, strerror(-rv), -rv);
+    kbus_ksock_close(ks);
+    goto gone;
+  }
+
+  pthread_mutex_lock(&work->lock);
+  work->ready ++;
+  pthread_cond_broadcast(&work->cond);
+  pthread_mutex_unlock(&work->lock);
+
+  while (!work->stop && (is_replier || receiver->received < work->count))
+  {
+    struct pollfd fds[1];
+
+    fds[0].fd = ks;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    rv = poll(fds, 1, 100);
+    if (rv <= 0)
+      continue;
+
+    for (;;)
+    {
+      kbus_message_t *msg = NULL;
+      uint64_t now;
+
+      rv = kbus_ksock_read_next_msg(ks, &msg);
+      if (rv < 0 || msg == NULL)
+        break;
+      now = speed_now_ns();
+
+      if (is_replier)
+      {
+        if (kbus_msg_wants_us_to_reply(msg))
+        {
+          kbus_message_t *reply;
+          kbus_msg_id_t id;
+          rv = kbus_msg_create_reply_to(&reply, msg, kbus_msg_data_ptr(msg),
+                                        msg->data_len, 0);
+          if (rv == 0)
+          {
+            (void) kbus_ksock_send_msg(ks, reply, &id);
+            kbus_msg_delete(&reply);
+          }
+        }
+      }
+      else if (msg->data_len >= sizeof(struct speed_stamp) &&
+               receiver->received < work->count)
+      {
+        struct speed_stamp *stamp = kbus_msg_data_ptr(msg);
+        receiver->latency_ns[receiver->received] = now - stamp->sent_ns;
+      }
+      kbus_msg_delete_all(&msg);
+
+      pthread_mutex_lock(&work->lock);
+      receiver->received ++;
+      receiver->last_ns = now;
+      pthread_cond_broadcast(&work->cond);
+      pthread_mutex_unlock(&work->lock);
+    }
+  }
+  kbus_ksock_close(ks);
+  return NULL;
+
+gone:
+  pthread_mutex_lock(&work->lock);
+  work->gone ++;
+  pthread_cond_broadcast(&work->cond);
+  pthread_mutex_unlock(&work->lock);
+  return NULL;
+}
+
+/*
+ * Wait on the workload's condition, for at most STALL_SECONDS.
+ *
+ * Call with work->lock held. Returns false if we waited all that time.
+ */
+static bool wait_for_progress(struct speed_workload *work)
+{
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += STALL_SECONDS;
+  return pthread_cond_timedwait(&work->cond, &work->lock, &until) != ETIMEDOUT;
+}
+
+static uint64_t least_received(struct speed_workload *work)
+{
+  uint64_t least = UINT64_MAX;
+  int ii;
+
+  for (ii = 0; ii < work->nr_receivers; ii++)
+    if (work->receivers[ii].received < least)
+      least = work->receivers[ii].received;
+  return least;
+}
+
+/*
+ * Send a message, waiting a little while if the Limpet's queue is full.
+ */
+static int speed_send(struct speed_workload *work, int ks, kbus_message_t *msg)
+{
+  kbus_msg_id_t id;
+  uint64_t give_up = speed_now_ns() + STALL_SECONDS * 1000000000ULL;
+  int rv;
+
+  for (;;)
+  {
+    rv = kbus_ksock_send_msg(ks, msg, &id);
+    if (rv != -EBUSY || speed_now_ns() > give_up)
+      break;
+    work->retries ++;
+    usleep(100);
+  }
+  if (rv < 0)
+    (void) kbus_ksock_discard(ks);
+  return rv;
+}
+
+static int send_announcements(struct speed_workload *work, int ks, char *data)
+{
+  struct speed_stamp *stamp = (struct speed_stamp *)data;
+  int ii, rv;
+
+  work->start_ns = speed_now_ns();
+  for (ii = 0; ii < work->count; ii++)
+  {
+    kbus_message_t *msg;
+
+    // Don't get so far ahead that someone's queue fills up
+    pthread_mutex_lock(&work->lock);
+    while (ii - least_received(work) >= work->config->window && !work->stalled)
+      work->stalled = !wait_for_progress(work);
+    pthread_mutex_unlock(&work->lock);
+    if (work->stalled)
+      break;
+
+    rv = kbus_msg_create(&msg, work->name, strlen(work->name),
+                         data, work->data_len, 0);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot create kbus message: %s [%d] \n",
+              strerror(-rv), -rv);
+      return rv;
+    }
+    stamp->seq = ii;
+    stamp->sent_ns = speed_now_ns();
+    rv = speed_send(work, ks, msg);
+    kbus_msg_delete(&msg);
+    if (rv < 0)
+    {
+      fprintf(stderr, "Cannot send to %s: %s [%d] \n",
+              work->name, strerror(-rv), -rv);
+      return rv;
+    }
+    work->sent ++;
+  }
+
+  // And wait for everything to arrive
+  pthread_mutex_lock(&work->lock);
+  while (least_received(work) < work->sent && !work->stalled)
+    work->stalled = !wait_for_progress(work);
+  for (ii = 0; ii < work->nr_receivers; ii++)
+    if (work->receivers[ii].last_ns > work->end_ns)
+      work->end_ns = work->receivers[ii].last_ns;
+  pthread_mutex_unlock(&work->lock);
+  return 0;
+}
+
+/*
+ * Send one Request, and wait for its Reply.
+ *
+ * Returns 0 if we got the Reply, 1 if there was (as yet) no Replier to
+ * send it to, and a negative number if something went wrong.
+ */
+static int request_and_reply(struct speed_workload *work, int ks, char *data)
+{
+  struct speed_stamp *stamp = (struct speed_stamp *)data;
+  kbus_message_t *msg;
+  kbus_message_t *reply = NULL;
+  uint64_t sent_ns;
+  int rv;
+
+  rv = kbus_msg_create_request(&msg, work->name, strlen(work->name),
+                               data, work->data_len, 0);
+  if (rv < 0)
+    return rv;
+  stamp->seq = work->sent;
+  stamp->sent_ns = sent_ns = speed_now_ns();
+  rv = speed_send(work, ks, msg);
+  kbus_msg_delete(&msg);
+  if (rv == -EADDRNOTAVAIL)
+    return 1;
+  else if (rv < 0)
+    return rv;
+  work->sent ++;
+
+  while (reply == NULL)
+  {
+    struct pollfd fds[1];
+
+    fds[0].fd = ks;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    rv = poll(fds, 1, STALL_SECONDS * 1000);
+    if (rv == 0)
+    {
+      work->stalled = true;
+      return -ETIMEDOUT;
+    }
+    else if (rv < 0)
+      return -errno;
+    rv = kbus_ksock_read_next_msg(ks, &reply);
+    if (rv < 0)
+      return rv;
+  }
+  if (work->nr_rtts < work->count)
+    work->rtt_ns[work->nr_rtts++] = speed_now_ns() - sent_ns;
+  kbus_msg_delete_all(&reply);
+  return 0;
+}
+
+static int send_requests(struct speed_workload *work, int ks, char *data)
+{
+  int ii, rv;
+
+  work->start_ns = speed_now_ns();
+  for (ii = 0; ii < work->count; ii++)
+  {
+    rv = request_and_reply(work, ks, data);
+    if (rv == 1)
+      rv = -EADDRNOTAVAIL;      // the Replier has gone away
+    if (rv == -ETIMEDOUT)
+      break;
+    else if (rv < 0)
+    {
+      fprintf(stderr, "Cannot send Request to %s: %s [%d] \n",
+              work->name, strerror(-rv), -rv);
+      return rv;
+    }
+  }
+  work->end_ns = speed_now_ns();
+  return 0;
+}
+
+/*
+ * The far Limpet tells the near Limpet about the Replier binding, and only
+ * then can the near Limpet bind as a proxy for it. So keep trying until a
+ * Request gets through. This also tells us that the Limpets are talking to
+ * each other.
+ */
+static int wait_for_replier(struct speed_workload *work, int ks, char *data)
+{
+  int ii, rv = 1;
+
+  for (ii = 0; ii < STALL_SECONDS * 100 && rv == 1; ii++)
+  {
+    rv = request_and_reply(work, ks, data);
+    if (rv == 1)
+      usleep(10000);
+  }
+  work->sent = 0;
+  work->nr_rtts = 0;
+  if (rv == 1)
+    rv = -ETIMEDOUT;
+  if (rv < 0)
+    fprintf(stderr, "No Limpet proxying %s on KBUS %u: %s [%d] \n",
+            work->name, work->config->bus[work->from], strerror(-rv), -rv);
+  return rv;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t aa = *(const uint64_t *)a;
+  uint64_t bb = *(const uint64_t *)b;
+  return (aa > bb) - (aa < bb);
+}
+
+static void print_latency(const char *what, uint64_t *samples, uint64_t count)
+{
+  uint64_t sum = 0;
+  uint64_t ii;
+
+  if (count == 0)
+    return;
+  qsort(samples, count, sizeof(*samples), compare_u64);
+  for (ii = 0; ii < count; ii++)
+    sum += samples[ii];
+  printf(">   %s: mean %.1f us, 50%% %.1f us, 90%% %.1f us, "
+         "99%% %.1f us, max %.1f us\n", what,
+         (double)sum / count / 1000.0,
+         samples[count * 50 / 100] / 1000.0,
+         samples[count * 90 / 100] / 1000.0,
+         samples[count * 99 / 100] / 1000.0,
+         samples[count - 1] / 1000.0);
+}
+
+static void print_workload(struct speed_workload *work,
+                           struct limpet_usage before[2],
+                           struct limpet_usage after[2])
+{
+  struct speed_config *config = work->config;
+  double secs = (double)(work->end_ns - work->start_ns) / 1e9;
+  uint64_t delivered = 0;
+  uint64_t ii;
+
+  for (ii = 0; ii < work->nr_receivers; ii++)
+    delivered += work->receivers[ii].received;
+
+  printf("> %s %s: ", work->label, work->from == 0 ? "A->B" : "B->A");
+  if (work->kind == WORK_RPC)
+    printf("%llu Requests of %u bytes, %llu Replies\n",
+           (unsigned long long)work->sent, work->data_len,
+           (unsigned long long)work->nr_rtts);
+  else
+    printf("%llu messages of %u bytes to %d listener%s, "
+           "%llu of %llu delivered\n",
+           (unsigned long long)work->sent, work->data_len,
+           work->nr_receivers, work->nr_receivers == 1 ? "" : "s",
+           (unsigned long long)delivered,
+           (unsigned long long)work->sent * work->nr_receivers);
+  if (work->stalled)
+    printf(">   (gave up after nothing happened for %d s)\n", STALL_SECONDS);
+  if (work->sent == 0 || secs <= 0)
+    return;
+
+  printf(">   %.0f msgs/s, %.2f MB/s, in %.3f s",
+         work->sent / secs, work->sent * (double)work->data_len / secs / 1e6,
+         secs);
+  if (work->retries)
+    printf(" (%llu sends found the Limpet's queue full)",
+           (unsigned long long)work->retries);
+  printf("\n");
+
+  if (work->kind == WORK_RPC)
+    print_latency("round-trip", work->rtt_ns, work->nr_rtts);
+  else
+  {
+    uint64_t *samples = malloc(delivered * sizeof(*samples));
+    uint64_t nr_samples = 0;
+    if (samples)
+    {
+      for (ii = 0; ii < work->nr_receivers; ii++)
+      {
+        struct speed_receiver *receiver = &work->receivers[ii];
+        uint64_t got = receiver->received;
+        if (got > work->count)
+          got = work->count;
+        memcpy(samples + nr_samples, receiver->latency_ns,
+               got * sizeof(*samples));
+        nr_samples += got;
+      }
+      print_latency("one-way", samples, nr_samples);
+      free(samples);
+    }
+  }
+
+  for (ii = 0; ii < 2; ii++)
+  {
+    struct speed_limpet *limpet = &config->limpets[ii];
+    printf(">   %s Limpet (KBUS %u): %.2f %s/msg, %.2f us CPU/msg\n",
+           limpet->is_server ? "server" : "client", limpet->bus_number,
+           (double)(after[ii].syscalls - before[ii].syscalls) / work->sent,
+           config->full_syscalls ? "syscalls" : "read/write calls",
+           (double)(after[ii].cpu_ns - before[ii].cpu_ns) / 1000.0 / work->sent);
+  }
+}
+
+/*
+ * Run one workload in one direction. A `count` of 0 just checks that the
+ * Limpets are passing Requests that way.
+ */
+static int run_workload(struct speed_config *config,
+                        enum workload_kind kind,
+                        int from,
+                        int count,
+                        uint32_t data_len)
+{
+  static const char *labels[] = { "fanout", "rpc", "large" };
+  static const char *names[] = { "FanOut", "Request", "Large" };
+  struct speed_workload work;
+  struct limpet_usage before[2], after[2];
+  char *data = NULL;
+  int ks = -1;
+  int ii, rv = 0;
+
+  memset(&work, 0, sizeof(work));
+  work.config = config;
+  work.kind = kind;
+  work.label = labels[kind];
+  work.from = from;
+  work.to = 1 - from;
+  work.count = count;
+  work.data_len = data_len;
+  work.nr_receivers = kind == WORK_FANOUT ? config->listeners : 1;
+  snprintf(work.name, sizeof(work.name), SPEED_MSG_PREFIX "%s.%s",
+           names[kind], from == 0 ? "AB" : "BA");
+  pthread_mutex_init(&work.lock, NULL);
+  pthread_cond_init(&work.cond, NULL);
+
+  if (work.data_len < sizeof(struct speed_stamp))
+    work.data_len = sizeof(struct speed_stamp);
+  data = calloc(1, work.data_len);
+  work.receivers = calloc(work.nr_receivers, sizeof(*work.receivers));
+  work.rtt_ns = calloc(count + 1, sizeof(*work.rtt_ns));
+  if (data == NULL || work.receivers == NULL || work.rtt_ns == NULL)
+    return -ENOMEM;
+  memset(data, 0x55, work.data_len);
+
+  ks = kbus_ksock_open(config->bus[from], O_RDWR);
+  if (ks < 0)
+  {
+    rv = -errno;
+    fprintf(stderr, "Cannot open KBUS %u - %s [%d] \n",
+            config->bus[from], strerror(errno), errno);
+    goto tidyup;
+  }
+
+  for (ii = 0; ii < work.nr_receivers; ii++)
+  {
+    struct speed_receiver *receiver = &work.receivers[ii];
+    receiver->work = &work;
+    if (kind != WORK_RPC)
+    {
+      receiver->latency_ns = calloc(count + 1, sizeof(uint64_t));
+      if (receiver->latency_ns == NULL)
+      {
+        rv = -ENOMEM;
+        goto tidyup;
+      }
+    }
+    rv = -pthread_create(&receiver->thread, NULL, receiver_main, receiver);
+    if (rv < 0)
+    {
+      work.nr_receivers = ii;
+      goto tidyup;
+    }
+  }
+
+  // Everyone must be bound before anyone sends
+  pthread_mutex_lock(&work.lock);
+  while (work.ready + work.gone < work.nr_receivers)
+    pthread_cond_wait(&work.cond, &work.lock);
+  pthread_mutex_unlock(&work.lock);
+  if (work.gone)
+  {
+    rv = -EIO;
+    goto tidyup;
+  }
+
+  if (kind == WORK_RPC)
+  {
+    rv = wait_for_replier(&work, ks, data);
+    if (rv < 0 || count == 0)
+      goto tidyup;
+  }
+
+  read_limpet_usage(config, before);
+  if (kind == WORK_RPC)
+    rv = send_requests(&work, ks, data);
+  else
+    rv = send_announcements(&work, ks, data);
+  read_limpet_usage(config, after);
+  if (rv == 0)
+    print_workload(&work, before, after);
+
+tidyup:
+  work.stop = 1;
+  for (ii = 0; ii < work.nr_receivers; ii++)
+    pthread_join(work.receivers[ii].thread, NULL);
+  for (ii = 0; ii < work.nr_receivers; ii++)
+    free(work.receivers[ii].latency_ns);
+  if (ks >= 0)
+    kbus_ksock_close(ks);
+  free(work.receivers);
+  free(work.rtt_ns);
+  free(data);
+  pthread_mutex_destroy(&work.lock);
+  pthread_cond_destroy(&work.cond);
+  return rv;
+}
+
+/*
+ * Let both KBUS devices take messages of `data_len` bytes for the large
+ * workload, remembering what they took before. If `data_len` is 0, choose
+ * the largest that both allow.
+ */
+static int raise_max_message_size(struct speed_config *config,
+                                  uint32_t *data_len,
+                                  uint32_t was[2])
+{
+  size_t name_len = strlen(SPEED_MSG_PREFIX "Large.AB");
+  uint32_t most = UINT32_MAX;
+  uint32_t needed;
+  int ks[2];
+  int ii, rv = 0;
+
+  for (ii = 0; ii < 2; ii++)
+  {
+    uint32_t abs_max = 1;
+    ks[ii] = kbus_ksock_open(config->bus[ii], O_RDWR);
+    if (ks[ii] < 0)
+    {
+      rv = -errno;
+      if (ii == 1)
+        kbus_ksock_close(ks[0]);
+      return rv;
+    }
+    was[ii] = 0;
+    (void) kbus_ksock_max_message_size(ks[ii], &was[ii]);
+    (void) kbus_ksock_max_message_size(ks[ii], &abs_max);
+    if (abs_max > KBUS_ENTIRE_MSG_LEN(name_len, 0) &&
+        abs_max - KBUS_ENTIRE_MSG_LEN(name_len, 0) < most)
+      most = (abs_max - KBUS_ENTIRE_MSG_LEN(name_len, 0)) & ~3;
+  }
+  if (*data_len == 0)
+    *data_len = most;
+
+  needed = KBUS_ENTIRE_MSG_LEN(name_len, *data_len);
+  for (ii = 0; ii < 2 && rv == 0; ii++)
+  {
+    uint32_t size = needed;
+    if (was[ii] >= needed)
+      continue;
+    rv = kbus_ksock_max_message_size(ks[ii], &size);
+    if (rv < 0)
+      fprintf(stderr, "KBUS %u cannot take messages of %u bytes: %s [%d] \n",
+              config->bus[ii], needed, strerror(-rv), -rv);
+  }
+  kbus_ksock_close(ks[0]);
+  kbus_ksock_close(ks[1]);
+  return rv;
+}
+
+static void restore_max_message_size(struct speed_config *config,
+                                     uint32_t was[2])
+{
+  int ii;
+
+  for (ii = 0; ii < 2; ii++)
+  {
+    int ks = kbus_ksock_open(config->bus[ii], O_RDWR);
+    if (ks < 0)
+      continue;
+    (void) kbus_ksock_max_message_size(ks, &was[ii]);
+    kbus_ksock_close(ks);
+  }
+}
+
+static int do_speed(struct speed_config *config, bool run[3])
+{
+  int from, rv;
+
+  printf("> Limpets joining KBUS %u (A) and KBUS %u (B) via %s, running '%s'\n",
+         config->bus[0], config->bus[1], config->address, config->limpet_cmd);
+
+  rv = start_limpets(config);
+  if (rv < 0)
+  {
+    stop_limpets(config);
+    return 2;
+  }
+  config->full_syscalls = config->limpets[0].perf_fd >= 0 &&
+                          config->limpets[1].perf_fd >= 0;
+
+  // Make sure the Limpets are talking, in both directions, first
+  for (from = 0; from < 2 && rv == 0; from++)
+    rv = run_workload(config, WORK_RPC, from, 0, 0);
+
+  for (from = 0; from < 2 && rv == 0; from++)
+  {
+    if ((from == 0 && !config->a_to_b) || (from == 1 && !config->b_to_a))
+      continue;
+    if (run[WORK_FANOUT] && rv == 0)
+      rv = run_workload(config, WORK_FANOUT, from, config->count,
+                        config->nr_bytes);
+    if (run[WORK_RPC] && rv == 0)
+      rv = run_workload(config, WORK_RPC, from, config->count,
+                        config->nr_bytes);
+    if (run[WORK_LARGE] && rv == 0)
+    {
+      uint32_t data_len = config->large_bytes;
+      uint32_t was[2];
+      rv = raise_max_message_size(config, &data_len, was);
+      if (rv == 0)
+        rv = run_workload(config, WORK_LARGE, from, config->count, data_len);
+      restore_max_message_size(config, was);
+    }
+  }
+
+  if (limpet_has_died(&config->limpets[0]) ||
+      limpet_has_died(&config->limpets[1]))
+    fprintf(stderr, "A Limpet stopped during the run\n");
+  stop_limpets(config);
+  return rv == 0 ? 0 : 2;
+}
+
+int main(int argn, char *args[])
+{
+  struct speed_config config;
+  bool run[3] = { false, false, false };
+  bool any = false;
+  char *runlimpet = NULL;
+  char *slash;
+
+  memset(&config, 0, sizeof(config));
+  config.bus[0] = 0;
+  config.bus[1] = 1;
+  config.count = DEFAULT_COUNT;
+  config.listeners = DEFAULT_LISTENERS;
+  config.nr_bytes = DEFAULT_BYTES;
+  config.window = DEFAULT_WINDOW;
+  config.a_to_b = config.b_to_a = true;
+  config.limpets[0].perf_fd = config.limpets[1].perf_fd = -1;
+  snprintf(config.address, sizeof(config.address),
+           "/tmp/limpetspeed.%d", (int)getpid());
+
+  // By default, use the runlimpet that was built alongside us
+  slash = strrchr(args[0], '/');
+  if (slash)
+  {
+    runlimpet = malloc(slash - args[0] + sizeof("/runlimpet"));
+    if (runlimpet == NULL)
+      return 2;
+    sprintf(runlimpet, "%.*s/runlimpet", (int)(slash - args[0]), args[0]);
+    config.limpet_cmd = runlimpet;
+  }
+  else
+    config.limpet_cmd = "runlimpet";
+
+  while (argn > 1)
+  {
+    if (!strcmp(args[1], "fanout"))
+      run[WORK_FANOUT] = any = true;
+    else if (!strcmp(args[1], "rpc"))
+      run[WORK_RPC] = any = true;
+    else if (!strcmp(args[1], "large"))
+      run[WORK_LARGE] = any = true;
+    else if (!strcmp(args[1], "-a-b"))
+    {
+      config.a_to_b = true;
+      config.b_to_a = false;
+    }
+    else if (!strcmp(args[1], "-b-a"))
+    {
+      config.a_to_b = false;
+      config.b_to_a = true;
+    }
+    else if (!strcmp(args[1], "-verbose"))
+      config.verbose = true;
+    else if (!strcmp(args[1], "--"))
+    {
+      config.limpet_args = args + 2;
+      config.nr_limpet_args = argn - 2;
+      break;
+    }
+    else if (!strcmp(args[1], "-h") || !strcmp(args[1], "-help"))
+    {
+      usage();
+      return 0;
+    }
+    else if (argn < 3 || (!strcmp(args[1], "-kbus") && argn < 4))
+    {
+      fprintf(stderr, "limpetspeed %s must have an argument.\n", args[1]);
+      return 1;
+    }
+    else
+    {
+      if (!strcmp(args[1], "-kbus"))
+      {
+        config.bus[0] = atoi(args[2]);
+        config.bus[1] = atoi(args[3]);
+        args += 1; argn -= 1;
+      }
+      else if (!strcmp(args[1], "-unix"))
+      {
+        snprintf(config.address, sizeof(config.address), "%s", args[2]);
+        config.is_tcp = false;
+      }
+      else if (!strcmp(args[1], "-tcp"))
+      {
+        snprintf(config.address, sizeof(config.address),
+                 "localhost:%d", atoi(args[2]));
+        config.is_tcp = true;
+      }
+      else if (!strcmp(args[1], "-limpet"))
+        config.limpet_cmd = args[2];
+      else if (!strcmp(args[1], "-count"))
+        config.count = atoi(args[2]);
+      else if (!strcmp(args[1], "-listeners"))
+        config.listeners = atoi(args[2]);
+      else if (!strcmp(args[1], "-bytes"))
+        config.nr_bytes = atoi(args[2]);
+      else if (!strcmp(args[1], "-large"))
+        config.large_bytes = atoi(args[2]);
+      else if (!strcmp(args[1], "-window"))
+        config.window = atoi(args[2]);
+      else
+      {
+        fprintf(stderr, "Unrecognised switch '%s'\n", args[1]);
+        usage();
+        return 1;
+      }
+      args += 1; argn -= 1;
+    }
+    args += 1; argn -= 1;
+  }
+
+  if (!any)
+    run[WORK_FANOUT] = run[WORK_RPC] = run[WORK_LARGE] = true;
+
+  if (config.count < 1 || config.listeners < 1 || config.nr_bytes < 0 ||
+      config.large_bytes < 0 || config.window < 1 ||
+      config.bus[0] == config.bus[1])
+  {
+    fprintf(stderr, "limpetspeed needs two different KBUS devices, "
+            "and sensible counts\n");
+    return 1;
+  }
+
+  // A Limpet stopping under us should not stop us
+  signal(SIGPIPE, SIG_IGN);
+
+  {
+    int rv = do_speed(&config, run);
+    free(runlimpet);
+    return rv;
+  }
+}
@@ -47,12 +47,67 @@
 #include <sys/socket.h>
 #include <sys/un.h>     // for sockaddr_un
 #include <netinet/in.h> // for sockaddr_in
+#include <arpa/inet.h>  // for inet_aton
 #include <netdb.h>
 #include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "libkbus/kbus.h"
 #include "libkbus/limpet.h"
 
+/*
+ * Announcements (messages that are neither Requests nor Replies) may be sent
+ * by UDP multicast, instead of over the socket to the other Limpet, so that
+ * sending an Announcement to many hosts costs the same as sending it to one.
+ * Each datagram holds a single message, preceded by::
+ *
+ *    "KBMC"
+ *    the sending Limpet's network id
+ *    the sending Limpet's "epoch", which changes each time it starts
+ *    the datagram's sequence number, counting from 0 for each epoch
+ *
+ * (the numbers in network order), after which the message is laid out just
+ * as it is when sent to the other Limpet.
+ *
+ * UDP may lose datagrams, or deliver them more than once, or out of order. We
+ * use the sequence numbers to ignore datagrams we've already seen (or have
+ * given up on), and to report any that went missing.
+ *
+ * Only Announcements that started on our own KBUS are multicast - any others
+ * were put there by a Limpet, and so the group has had them already. Every
+ * Limpet in the group hears each datagram, so several Limpets on one KBUS
+ * may hear the same Announcement. Each datagram goes through the same checks
+ * as a message from the other Limpet, so that (when routes are advertised)
+ * only the Limpet with the best way back to its sender passes it on. We also
+ * remember the ids of the recent Announcements that Limpets have put on our
+ * KBUS, and ignore datagrams for any of them.
+ */
+#define MCAST_MAGIC             "KBMC"
+#define MCAST_PREFIX_LEN        16
+#define MCAST_MAX_DATAGRAM      65507
+#define MCAST_INJECTED_SIZE     1024    // a power of two
+
+// What we know about each Limpet sending to our multicast group
+typedef struct mcast_sender {
+    uint32_t             network_id;
+    uint32_t             epoch;
+    uint32_t             next_seq;      // the sequence number we expect next
+    uint32_t             num_lost;      // datagrams that never arrived
+    struct mcast_sender *next;
+} mcast_sender_t;
+
+typedef struct multicast {
+    int                  socket;
+    struct sockaddr_in   group;
+    uint32_t             epoch;         // our own
+    uint32_t             next_seq;      // for the next datagram we send
+    mcast_sender_t      *senders;
+    // The ids of recent Announcements put on our KBUS by Limpets, by hash
+    kbus_msg_id_t        injected[MCAST_INJECTED_SIZE];
+    uint8_t              buffer[MCAST_MAX_DATAGRAM];
+} multicast_t;
+
 /*
  * Read the other limpet's network id.
  */
@@ -309,6 +364,807 @@ error_return:
     return -1;
 }
 
+/*
+ * How many bytes does a message take when serialised for the network?
+ */
+static size_t serialised_length(kbus_message_t *msg)
+{
+    size_t       length;
+
+    length = KBUS_SERIALISED_HDR_LEN * sizeof(uint32_t) +
+        KBUS_PADDED_NAME_LEN(msg->name_len) + sizeof(uint32_t);
+    if (msg->data_len != 0 && kbus_msg_data_ptr(msg) != NULL)
+        length += KBUS_PADDED_DATA_LEN(msg->data_len);
+    return length;
+}
+
+/*
+ * Serialise a message into `buf`, laid out just as
+ * send_message_to_other_limpet() sends it.
+ *
+ * `buf` must have room for serialised_length(msg) bytes.
+ */
+static void serialise_message(kbus_message_t    *msg,
+                              uint8_t           *buf)
+{
+    uint32_t     array[KBUS_SERIALISED_HDR_LEN];
+    char        *name = kbus_msg_name_ptr(msg);
+    void        *data = kbus_msg_data_ptr(msg);
+    uint32_t     padded_name_len = KBUS_PADDED_NAME_LEN(msg->name_len);
+    uint32_t     padded_data_len;
+
+    kbus_serialise_message_header(msg, array);
+    memcpy(buf, array, sizeof(array));
+    buf += sizeof(array);
+
+    memset(buf, 0, padded_name_len);
+    memcpy(buf, name, msg->name_len);
+    buf += padded_name_len;
+
+    if (msg->data_len != 0 && data != NULL) {
+        // We know the structure of Replier Bind Event data, and can mangle
+        // it appropriately for the network
+        if (!strncmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len)) {
+            kbus_limpet_ReplierBindEvent_hton(msg);
+        }
+
+        padded_data_len = KBUS_PADDED_DATA_LEN(msg->data_len);
+        memset(buf, 0, padded_data_len);
+        memcpy(buf, data, msg->data_len);
+        buf += padded_data_len;
+    }
+
+    // And a final end guard for safety
+    memcpy(buf, &array[KBUS_SERIALISED_HDR_LEN-1], sizeof(uint32_t));
+}
+
+/*
+ * Unserialise a message from the `length` bytes at `buf`.
+ *
+ * `msg` is set up as a "pointy" message, with its name and data pointing
+ * into `buf`, which must therefore outlast it.
+ *
+ * Returns 0 if all went well, or -1 if `buf` does not hold exactly one
+ * well formed message.
+ */
+static int unserialise_message(uint8_t          *buf,
+                               size_t            length,
+                               kbus_message_t   *msg)
+{
+    uint32_t     array[KBUS_SERIALISED_HDR_LEN];
+    uint32_t     end_guard;
+    size_t       wanted;
+    size_t       padded_name_len;
+    size_t       padded_data_len;
+
+    if (length < sizeof(array) + sizeof(uint32_t))
+        return -1;
+
+    memcpy(array, buf, sizeof(array));
+    buf += sizeof(array);
+    kbus_unserialise_message_header(array, msg);
+
+    if (msg->start_guard != KBUS_MSG_START_GUARD ||
+        msg->end_guard != KBUS_MSG_END_GUARD ||
+        msg->name_len == 0 || msg->name_len > KBUS_MAX_NAME_LEN ||
+        msg->data_len > length)
+        return -1;
+
+    padded_name_len = KBUS_PADDED_NAME_LEN(msg->name_len);
+    padded_data_len = msg->data_len ? KBUS_PADDED_DATA_LEN(msg->data_len) : 0;
+    wanted = sizeof(array) + padded_name_len + padded_data_len + sizeof(uint32_t);
+    if (length != wanted)
+        return -1;
+
+    msg->name = (char *)buf;
+    msg->name[msg->name_len] = 0;       // there is always room for this
+    buf += padded_name_len;
+    if (msg->data_len) {
+        msg->data = buf;
+        buf += padded_data_len;
+    } else {
+        msg->data = NULL;
+    }
+
+    memcpy(&end_guard, buf, sizeof(uint32_t));
+    if (ntohl(end_guard) != KBUS_MSG_END_GUARD)
+        return -1;
+
+    // We know the structure of Replier Bind Event data, and can mangle
+    // it appropriately for having come from the network
+    if (msg->data_len &&
+        !strncmp(msg->name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len)) {
+        kbus_limpet_ReplierBindEvent_ntoh(msg);
+    }
+    return 0;
+}
+
+/*
+ * Is this a message we would send by multicast?
+ */
+static bool is_announcement(kbus_message_t *msg)
+{
+    char *name = kbus_msg_name_ptr(msg);
+
+    // Replier Bind Events are meant for the other Limpet in particular
+    if (!strncmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len))
+        return false;
+    return !kbus_msg_is_request(msg) && !kbus_msg_is_reply(msg);
+}
+
+static kbus_msg_id_t *injected_slot(multicast_t         *mcast,
+                                    const kbus_msg_id_t *id)
+{
+    uint32_t hash = (id->network_id * 2654435761U) ^ id->serial_num;
+    return &mcast->injected[hash & (MCAST_INJECTED_SIZE - 1)];
+}
+
+/*
+ * Remember that an Announcement (from another network) is on our KBUS.
+ */
+static void note_injected(multicast_t *mcast, const kbus_msg_id_t *id)
+{
+    *injected_slot(mcast, id) = *id;
+}
+
+/*
+ * Is this Announcement one we remember being on our KBUS already?
+ */
+static bool was_injected(multicast_t *mcast, const kbus_msg_id_t *id)
+{
+    kbus_msg_id_t *slot = injected_slot(mcast, id);
+    return id->network_id != 0 && kbus_msg_compare_ids(slot, id) == 0;
+}
+
+/*
+ * Send a message to our multicast group.
+ *
+ * Returns 0 if it was sent, 1 if it is too big for a datagram (and should be
+ * sent to the other Limpet instead), or -1 if something went wrong.
+ */
+static int send_message_to_multicast(multicast_t    *mcast,
+                                     uint32_t        network_id,
+                                     kbus_message_t *msg,
+                                     int             verbosity)
+{
+    uint32_t     prefix[MCAST_PREFIX_LEN / 4];
+    size_t       length;
+    ssize_t      written;
+
+    length = MCAST_PREFIX_LEN + serialised_length(msg);
+    if (length > MCAST_MAX_DATAGRAM)
+        return 1;
+
+    memcpy(&prefix[0], MCAST_MAGIC, 4);
+    prefix[1] = htonl(network_id);
+    prefix[2] = htonl(mcast->epoch);
+    prefix[3] = htonl(mcast->next_seq);
+    memcpy(mcast->buffer, prefix, MCAST_PREFIX_LEN);
+    serialise_message(msg, mcast->buffer + MCAST_PREFIX_LEN);
+
+    written = sendto(mcast->socket, mcast->buffer, length, 0,
+                     (struct sockaddr *)&mcast->group, sizeof(mcast->group));
+    if (written < 0) {
+        printf("### Error sending message to multicast group: %s\n",
+               strerror(errno));
+        return -1;
+    }
+    if (verbosity > 1)
+        printf("%u ----------------- Sent as datagram %u\n", network_id,
+               mcast->next_seq);
+    mcast->next_seq ++;
+    return 0;
+}
+
+/*
+ * Check a datagram's sequence number against what we expected from its
+ * sender, reporting any that went missing.
+ *
+ * Returns 0 if we should accept the datagram, 1 if we should ignore it, or -1
+ * if something went wrong.
+ */
+static int check_multicast_sequence(multicast_t *mcast,
+                                    uint32_t     network_id,
+                                    uint32_t     sender_id,
+                                    uint32_t     epoch,
+                                    uint32_t     seq,
+                                    int          verbosity)
+{
+    mcast_sender_t  *sender;
+    int32_t          diff;
+
+    for (sender = mcast->senders; sender; sender = sender->next)
+        if (sender->network_id == sender_id)
+            break;
+
+    if (sender == NULL) {
+        sender = malloc(sizeof(*sender));
+        if (sender == NULL) {
+            printf("### Unable to allocate multicast sender\n");
+            return -1;
+        }
+        sender->network_id = sender_id;
+        sender->num_lost = 0;
+        sender->next = mcast->senders;
+        mcast->senders = sender;
+    } else if (sender->epoch == epoch) {
+        diff = (int32_t)(seq - sender->next_seq);
+        if (diff < 0) {
+            if (verbosity > 1)
+                printf("%u ----------------- Ignoring old datagram %u from %u\n",
+                       network_id, seq, sender_id);
+            return 1;
+        } else if (diff > 0) {
+            sender->num_lost += diff;
+            if (verbosity)
+                printf("!!! Limpet %u: Lost %d multicast datagram%s from %u"
+                       " (%u-%u, %u lost in total)\n", network_id,
+                       diff, diff==1?"":"s", sender_id, sender->next_seq, seq-1,
+                       sender->num_lost);
+        }
+        sender->next_seq = seq + 1;
+        return 0;
+    } else if (verbosity) {
+        printf("Limpet %u: Multicast sender %u has restarted\n",
+               network_id, sender_id);
+    }
+
+    // A new sender, or a new epoch: start counting from here
+    sender->epoch = epoch;
+    sender->next_seq = seq + 1;
+    return 0;
+}
+
+/*
+ * Read a message from our multicast group.
+ *
+ * `msg` is set to point into our datagram buffer, so must not be freed, and
+ * is only valid until the next datagram is read.
+ *
+ * Returns 0 if we have a message, 1 if the datagram should be ignored (it is
+ * our own, or one we've already seen, or malformed), or -1 if something went
+ * wrong.
+ */
+static int read_message_from_multicast(multicast_t     *mcast,
+                                       uint32_t         network_id,
+                                       kbus_message_t  *msg,
+                                       int              verbosity)
+{
+    uint32_t     prefix[MCAST_PREFIX_LEN / 4];
+    uint8_t     *buf = mcast->buffer;
+    ssize_t      length;
+    uint32_t     sender_id;
+    int          rv;
+
+    length = recv(mcast->socket, mcast->buffer, sizeof(mcast->buffer), 0);
+    if (length < 0) {
+        printf("### Error reading from multicast group: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (length < MCAST_PREFIX_LEN || memcmp(buf, MCAST_MAGIC, 4)) {
+        if (verbosity)
+            printf("!!! Limpet %u: Ignoring unrecognised multicast datagram\n",
+                   network_id);
+        return 1;
+    }
+    memcpy(prefix, buf, MCAST_PREFIX_LEN);
+    buf += MCAST_PREFIX_LEN;
+
+    // We hear our own datagrams as well
+    sender_id = ntohl(prefix[1]);
+    if (sender_id == network_id)
+        return 1;
+
+    if (unserialise_message(buf, length - MCAST_PREFIX_LEN, msg)) {
+        if (verbosity)
+            printf("!!! Limpet %u: Ignoring malformed multicast datagram from %u\n",
+                   network_id, sender_id);
+        return 1;
+    }
+
+    rv = check_multicast_sequence(mcast, network_id, sender_id,
+                                  ntohl(prefix[2]), ntohl(prefix[3]),
+                                  verbosity);
+    if (rv) return rv;
+
+    // Only Announcements should be sent by multicast
+    if (!is_announcement(msg)) {
+        if (verbosity)
+            printf("!!! Limpet %u: Ignoring multicast message that is not an"
+                   " Announcement\n", network_id);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Messages to the other Limpet may instead be sent as a series of "frames",
+ * each carrying at most a fixed number of bytes of a serialised message, so
+ * that a large message does not hold up the messages queued after it. Each
+ * frame is::
+ *
+ *    the id of the message it is part of
+ *    the number of message bytes in this frame, with the top bit set if
+ *      this is the last frame of that message
+ *    those bytes
+ *
+ * (the numbers in network order). The frames of a message are sent in order,
+ * but the frames of different messages may be interleaved. The other Limpet
+ * reassembles each message before passing it on to KBUS.
+ *
+ * There are two queues of messages to send. Urgent messages, and Replier Bind
+ * Events (which later messages may depend upon), go before anything else.
+ * Within a queue, we send one frame of the first message, and then, if that
+ * is not the end of it, move the message to the back of the queue. So a
+ * message that fits in one frame never waits behind more than one frame of
+ * any larger message, and such small messages stay in order.
+ *
+ * We only read from or write to the socket when poll() says we can, and never
+ * wait for a read or write to finish, so that neither Limpet can end up
+ * waiting for the other. A partly read frame is kept until the rest of it
+ * arrives.
+ *
+ * So that the queues don't grow without limit when the other Limpet is slow,
+ * we stop reading from KBUS whilst they hold more than MAX_QUEUED_BYTES.
+ */
+#define FRAME_HDR_LEN           8
+#define FRAME_LAST              0x80000000
+#define MIN_FRAME_SIZE          256
+#define MAX_FRAME_SIZE          (1 << 24)
+#define MAX_QUEUED_BYTES        (4 * 1024 * 1024)
+
+// A message we are sending to the other Limpet
+typedef struct outgoing {
+    uint32_t             id;
+    uint8_t             *bytes;         // the serialised message
+    size_t               length;
+    size_t               offset;        // how much has gone into frames
+    struct outgoing     *next;
+} outgoing_t;
+
+// A message we are reading from the other Limpet
+typedef struct incoming {
+    uint32_t             id;
+    uint8_t             *bytes;         // as much as has arrived so far
+    size_t               length;
+    size_t               size;          // of the `bytes` array
+    struct incoming     *next;
+} incoming_t;
+
+typedef struct framer {
+    size_t               frame_size;    // the most message bytes in a frame
+    uint32_t             next_id;
+    outgoing_t          *head[2];       // [0] is urgent, [1] is the rest
+    outgoing_t          *tail[2];
+    size_t               queued_bytes;  // not yet put into a frame
+    uint8_t             *frame;         // the frame we are writing
+    size_t               frame_length;  // 0 if there isn't one
+    size_t               frame_offset;  // how much of it has been written
+    incoming_t          *incoming;
+    uint32_t             in_hdr[2];     // the header of the frame we are
+    size_t               in_hdr_length; //   reading, and how much we have
+    incoming_t          *in_frame;      // NULL until we have its header
+    size_t               in_left;       // how much of its body is to come
+    bool                 in_last;       // is it the last of its message?
+    uint8_t             *delivered;     // the last message we returned
+} framer_t;
+
+static int new_framer(size_t         frame_size,
+                      framer_t     **framer)
+{
+    framer_t    *new;
+
+    *framer = NULL;
+
+    new = malloc(sizeof(*new));
+    if (new == NULL) {
+        printf("### Unable to allocate framer\n");
+        return -1;
+    }
+    memset(new, 0, sizeof(*new));
+    new->frame_size = frame_size;
+
+    new->frame = malloc(FRAME_HDR_LEN + frame_size);
+    if (new->frame == NULL) {
+        printf("### Unable to allocate frame buffer\n");
+        free(new);
+        return -1;
+    }
+
+    *framer = new;
+    return 0;
+}
+
+static void free_framer(framer_t **framer)
+{
+    framer_t    *this = *framer;
+    int          which;
+
+    if (this == NULL)
+        return;
+
+    for (which = 0; which < 2; which++) {
+        while (this->head[which]) {
+            outgoing_t *next = this->head[which]->next;
+            free(this->head[which]->bytes);
+            free(this->head[which]);
+            this->head[which] = next;
+        }
+    }
+    while (this->incoming) {
+        incoming_t *next = this->incoming->next;
+        free(this->incoming->bytes);
+        free(this->incoming);
+        this->incoming = next;
+    }
+    free(this->delivered);
+    free(this->frame);
+    free(this);
+    *framer = NULL;
+}
+
+/*
+ * Do we have anything waiting to be written to the other Limpet?
+ */
+static bool framer_has_output(framer_t *framer)
+{
+    return framer->frame_length != 0 ||
+        framer->head[0] != NULL || framer->head[1] != NULL;
+}
+
+/*
+ * Have we queued up so much for the other Limpet that we should stop reading
+ * more messages from KBUS for the moment?
+ */
+static bool framer_is_full(framer_t *framer)
+{
+    return framer->queued_bytes > MAX_QUEUED_BYTES;
+}
+
+/*
+ * Queue a message to be sent to the other Limpet.
+ *
+ * The message is copied, so the caller may free it afterwards.
+ */
+static int queue_message_for_other_limpet(framer_t         *framer,
+                                          kbus_message_t   *msg)
+{
+    outgoing_t  *out;
+    int          which;
+    char        *name = kbus_msg_name_ptr(msg);
+
+    out = malloc(sizeof(*out));
+    if (out == NULL) {
+        printf("### Unable to allocate outgoing message\n");
+        return -1;
+    }
+    out->length = serialised_length(msg);
+    out->bytes = malloc(out->length);
+    if (out->bytes == NULL) {
+        printf("### Unable to allocate %zu bytes for outgoing message\n",
+               out->length);
+        free(out);
+        return -1;
+    }
+    serialise_message(msg, out->bytes);
+    out->id = framer->next_id ++;
+    out->offset = 0;
+    out->next = NULL;
+    framer->queued_bytes += out->length;
+
+    if ((msg->flags & KBUS_BIT_URGENT) ||
+        !strncmp(name, KBUS_MSG_NAME_REPLIER_BIND_EVENT, msg->name_len))
+        which = 0;
+    else
+        which = 1;
+
+    if (framer->tail[which])
+        framer->tail[which]->next = out;
+    else
+        framer->head[which] = out;
+    framer->tail[which] = out;
+    return 0;
+}
+
+/*
+ * Take the next frame from the head of the queues (as described above),
+ * into framer->frame.
+ *
+ * Returns true if there was a frame to take, false if there was nothing
+ * queued.
+ */
+static bool take_next_frame(framer_t *framer)
+{
+    int          which = framer->head[0] ? 0 : 1;
+    outgoing_t  *out = framer->head[which];
+    uint32_t     hdr[2];
+    size_t       count;
+
+    if (out == NULL)
+        return false;
+
+    count = out->length - out->offset;
+    if (count > framer->frame_size)
+        count = framer->frame_size;
+
+    hdr[0] = htonl(out->id);
+    hdr[1] = htonl(count | (out->offset + count == out->length ? FRAME_LAST : 0));
+    memcpy(framer->frame, hdr, FRAME_HDR_LEN);
+    memcpy(framer->frame + FRAME_HDR_LEN, out->bytes + out->offset, count);
+    framer->frame_length = FRAME_HDR_LEN + count;
+    framer->frame_offset = 0;
+    framer->queued_bytes -= count;
+    out->offset += count;
+
+    framer->head[which] = out->next;
+    if (framer->head[which] == NULL)
+        framer->tail[which] = NULL;
+
+    if (out->offset == out->length) {
+        free(out->bytes);
+        free(out);
+    } else {
+        out->next = NULL;
+        if (framer->tail[which])
+            framer->tail[which]->next = out;
+        else
+            framer->head[which] = out;
+        framer->tail[which] = out;
+    }
+    return true;
+}
+
+/*
+ * Write as many frames as we can to the other Limpet, until there are none
+ * left or the socket will take no more.
+ *
+ * Each frame is taken from the head of the queues only when the one before
+ * it has been written, so urgent messages queued meanwhile still go first.
+ *
+ * Returns 0 if all went well (even if we could not write anything), or -1 if
+ * something went wrong.
+ */
+static int send_frame_to_other_limpet(framer_t *framer,
+                                      int       limpet_socket)
+{
+    ssize_t      written;
+
+    for (;;) {
+        if (framer->frame_length == 0 && !take_next_frame(framer))
+            return 0;
+
+        written = send(limpet_socket, framer->frame + framer->frame_offset,
+                       framer->frame_length - framer->frame_offset,
+                       MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            printf("### Error sending frame to other limpet: %s\n",
+                   strerror(errno));
+            return -1;
+        }
+
+        framer->frame_offset += written;
+        if (framer->frame_offset == framer->frame_length)
+            framer->frame_length = 0;
+    }
+}
+
+/*
+ * Read as much as we can (without waiting) of a frame from the other Limpet.
+ *
+ * Returns 0 if we read all that was asked for, 1 if we have to wait for the
+ * rest, or -1 if something went wrong.
+ */
+static int read_frame_part(int          limpet_socket,
+                           void        *buf,
+                           size_t      *got,
+                           size_t       wanted)
+{
+    ssize_t      length;
+
+    length = recv(limpet_socket, (uint8_t *)buf + *got, wanted - *got,
+                  MSG_DONTWAIT);
+    if (length == 0) {
+        printf("### Trying to read frame: other Limpet has gone away\n");
+        return -1;
+    } else if (length < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 1;
+        printf("### Unable to read frame from other Limpet: %s\n",
+               strerror(errno));
+        return -1;
+    }
+    *got += length;
+    return *got == wanted ? 0 : 1;
+}
+
+/*
+ * Make a note of the header of the frame we are reading, and find (or start)
+ * the message it is part of, with room for its bytes.
+ *
+ * Returns 0 if all went well, or -1 if something went wrong.
+ */
+static int start_incoming_frame(framer_t *framer)
+{
+    uint32_t     id = ntohl(framer->in_hdr[0]);
+    size_t       count = ntohl(framer->in_hdr[1]) & ~FRAME_LAST;
+    incoming_t  *in;
+
+    if (count > MAX_FRAME_SIZE) {
+        printf("### Frame from other Limpet claims to hold %zu bytes\n", count);
+        return -1;
+    }
+
+    for (in = framer->incoming; in; in = in->next)
+        if (in->id == id)
+            break;
+
+    if (in == NULL) {
+        in = malloc(sizeof(*in));
+        if (in == NULL) {
+            printf("### Unable to allocate incoming message\n");
+            return -1;
+        }
+        memset(in, 0, sizeof(*in));
+        in->id = id;
+        in->next = framer->incoming;
+        framer->incoming = in;
+    }
+
+    if (in->length + count > in->size) {
+        size_t   size = in->size * 2;
+        uint8_t *bytes;
+        if (size < in->length + count)
+            size = in->length + count;
+        bytes = realloc(in->bytes, size);
+        if (bytes == NULL) {
+            printf("### Unable to allocate %zu bytes for incoming message\n",
+                   size);
+            return -1;
+        }
+        in->bytes = bytes;
+        in->size = size;
+    }
+
+    framer->in_frame = in;
+    framer->in_left = count;
+    framer->in_last = (ntohl(framer->in_hdr[1]) & FRAME_LAST) != 0;
+    return 0;
+}
+
+/*
+ * Read what we can of the frames from the other Limpet, without waiting.
+ *
+ * If that completes a message, `msg` is set to it, and the caller should
+ * free it with kbus_msg_delete() -- its name and data belong to the framer,
+ * and remain valid until the next call of this function.
+ *
+ * Returns 0 if we have a message, 1 if we do not have one yet, or -1 if
+ * something went wrong.
+ */
+static int read_frame_from_other_limpet(framer_t         *framer,
+                                        int               limpet_socket,
+                                        kbus_message_t  **msg)
+{
+    incoming_t  *in;
+    incoming_t **prev;
+    size_t       length;
+    int          rv;
+
+    kbus_message_t      *new_msg = NULL;
+
+    *msg = NULL;
+
+    // Our caller has finished with the last message we gave it
+    free(framer->delivered);
+    framer->delivered = NULL;
+
+    for (;;) {
+        if (framer->in_frame == NULL) {
+            rv = read_frame_part(limpet_socket, framer->in_hdr,
+                                 &framer->in_hdr_length, FRAME_HDR_LEN);
+            if (rv) return rv;
+            if (start_incoming_frame(framer))
+                return -1;
+        }
+
+        in = framer->in_frame;
+        if (framer->in_left) {
+            size_t   got = in->length;
+            rv = read_frame_part(limpet_socket, in->bytes, &got,
+                                 in->length + framer->in_left);
+            framer->in_left -= got - in->length;
+            in->length = got;
+            if (rv) return rv;
+        }
+
+        // We have the whole frame, so the next thing is a frame header
+        framer->in_frame = NULL;
+        framer->in_hdr_length = 0;
+        if (framer->in_last)
+            break;
+    }
+
+    for (prev = &framer->incoming; *prev != in; prev = &(*prev)->next)
+        ;
+    *prev = in->next;
+    framer->delivered = in->bytes;
+    length = in->length;
+    free(in);
+
+    new_msg = malloc(sizeof(*new_msg));
+    if (new_msg == NULL) {
+        printf("### Unable to allocate message header\n");
+        return -1;
+    }
+    if (unserialise_message(framer->delivered, length, new_msg)) {
+        printf("### Malformed message (%zu bytes) from other limpet\n", length);
+        free(new_msg);
+        return -1;
+    }
+
+    *msg = new_msg;
+    return 0;
+}
+
+/*
+ * Send a message to the other Limpet, or queue it to be sent in frames.
+ */
+static int send_to_other_limpet(int                limpet_socket,
+                                framer_t          *framer,
+                                kbus_message_t    *msg)
+{
+    if (framer)
+        return queue_message_for_other_limpet(framer, msg);
+    else
+        return send_message_to_other_limpet(limpet_socket, msg);
+}
+
+/*
+ * Advertise our routes, to KBUS (for any other Limpets there) and to the other
+ * Limpet.
+ */
+static int advertise_routes(kbus_ksock_t             ksock,
+                            int                      limpet_socket,
+                            framer_t                *framer,
+                            kbus_limpet_context_t   *context,
+                            uint32_t                 network_id,
+                            int                      verbosity)
+{
+    int              rv;
+    kbus_message_t  *msg = NULL;
+    kbus_msg_id_t    msg_id;
+
+    rv = kbus_limpet_new_routes_msg(context, &msg);
+    if (rv) {
+        printf("### Unable to create routes message: %s\n", strerror(-rv));
+        return -1;
+    }
+
+    if (verbosity > 1)
+        printf("%u ----------------- Advertising routes\n", network_id);
+
+    rv = kbus_ksock_send_msg(ksock, msg, &msg_id);
+    if (rv && verbosity)
+        printf("Limpet %u: Error sending routes to KBUS: %s -- continuing\n",
+               network_id, strerror(-rv));
+
+    rv = send_to_other_limpet(limpet_socket, framer, msg);
+    kbus_msg_delete(&msg);
+    return rv;
+}
+
+static time_t now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
 /*
  * Run a KBUS Limpet.
  *
@@ -338,6 +1194,21 @@ error_return:
  * produce messages giving details of exactly how messages are being received,
  * sent and manipulated.
  *
+ * If `mcast` is non-NULL, then Announcements are sent to (and received from)
+ * that multicast group, instead of the other Limpet. Requests and Replies
+ * (and Replier Bind Events) still go to the other Limpet.
+ *
+ * If `frame_size` is non-zero, then messages to and from the other Limpet
+ * are sent in frames of (at most) that many bytes, interleaved so that small
+ * messages do not wait for large ones. The other Limpet must be using the
+ * same mechanism (although not necessarily the same frame size).
+ *
+ * If `route_interval` is non-zero, then this Limpet advertises the routes it
+ * knows (to the other Limpet, and to any other Limpets on our KBUS) at least
+ * every `route_interval` seconds, and as soon as they change. The Limpets can
+ * then pass messages on by the shortest way, and avoid sending them round in
+ * loops, so that Limpets need not link every pair of KBUS devices directly.
+ *
  * This function is not normally expected to return, but given that, it returns
  * 0 if `termination_message` was given, and the Limpet received such a
  * message, or -1 if it went wrong.
@@ -347,14 +1218,20 @@ static int kbus_limpet(kbus_ksock_t     ksock,
                        uint32_t         network_id,
                        char            *message_name,
                        char            *termination_message,
-                       int              verbosity)
+                       int              verbosity,
+                       multicast_t     *mcast,
+                       size_t           frame_size,
+                       int              route_interval)
 {
     int             rv = 0;
     uint32_t        other_network_id;
     uint32_t        ksock_id;
-    struct pollfd   fds[2];
+    struct pollfd   fds[3];
+    int             nfds = mcast ? 3 : 2;
+    time_t          next_advert = 0;
 
     kbus_limpet_context_t    *context;
+    framer_t                 *framer = NULL;
 
     kbus_message_t  *msg = NULL;
     kbus_message_t  *error = NULL;
@@ -395,17 +1272,60 @@ static int kbus_limpet(kbus_ksock_t     ksock,
                                  &context);
     if (rv) goto tidyup;
 
+    // So we can recognise the messages we sent to KBUS ourselves
+    rv = kbus_ksock_id(ksock, &ksock_id);
+    if (rv) goto tidyup;
+
+    if (frame_size) {
+        rv = new_framer(frame_size, &framer);
+        if (rv) goto tidyup;
+    }
+
+    if (route_interval) {
+        rv = advertise_routes(ksock, limpet_socket, framer, context,
+                              network_id, verbosity);
+        if (rv) goto tidyup;
+        next_advert = now_seconds() + route_interval;
+    }
+
     fds[0].fd = ksock;
     fds[0].events = POLLIN; // We want to read a KBUS message
     fds[1].fd = limpet_socket;
     fds[1].events = POLLIN; // We want to read a message from our pair
+    if (mcast) {
+        fds[2].fd = mcast->socket;
+        fds[2].events = POLLIN; // We want to read a multicast message
+    }
     for (;;) {
         int   results;
+        int   timeout = -1;         // No timeout, we're patient
         char *name;
 
         fds[0].revents = 0;
         fds[1].revents = 0;
-        results = poll(fds, 2, -1);     // No timeout, we're patient
+        // Leave messages in KBUS whilst the other Limpet catches up
+        if (framer && framer_is_full(framer))
+            fds[0].events = 0;
+        else
+            fds[0].events = POLLIN;
+        if (framer && framer_has_output(framer))
+            fds[1].events = POLLIN | POLLOUT;
+        else
+            fds[1].events = POLLIN;
+        fds[2].revents = 0;
+        if (route_interval) {
+            time_t now = now_seconds();
+            if (now >= next_advert) {
+                // Forget the Limpets on our KBUS that have stopped talking
+                kbus_limpet_expire_routes(context, 3 * route_interval);
+                rv = advertise_routes(ksock, limpet_socket, framer, context,
+                                      network_id, verbosity);
+                if (rv) goto tidyup;
+                next_advert = now + route_interval;
+            }
+            timeout = (next_advert - now) * 1000;
+        }
+        results = poll(fds, nfds, timeout);
         if (results < 0) {
             printf("### Waiting for messages abandoned: %s\n",strerror(errno));
             goto tidyup;
@@ -439,59 +1359,142 @@ static int kbus_limpet(kbus_ksock_t     ksock,
                 }
             }
 
-            rv = kbus_limpet_amend_msg_from_kbus(context, msg);
-            if (rv == 0) {
-               rv = send_message_to_other_limpet(limpet_socket, msg);
-               if (rv) goto tidyup;
+            if (mcast && is_announcement(msg) && msg->id.network_id != 0) {
+                // A Limpet (maybe us) put this on our KBUS, so if it also
+                // arrives by multicast, we don't want to put it there again
+                note_injected(mcast, &msg->id);
             }
-            else if (rv < 0) {
-                goto tidyup;
+
+            if (mcast && is_announcement(msg) && msg->from == ksock_id) {
+                // Don't send back what we read from the group (or the other
+                // Limpet) in the first place
+                if (verbosity > 1)
+                    printf("%u .. Ignoring Announcement we sent\n", network_id);
+            } else if (mcast && is_announcement(msg) && msg->id.network_id == 0) {
+                // Only Announcements that started on our KBUS are multicast
+                rv = kbus_limpet_amend_msg_from_kbus(context, msg);
+                if (rv == 0) {
+                    rv = send_message_to_multicast(mcast, network_id, msg,
+                                                   verbosity);
+                    // If it was too big, it goes the other way
+                    if (rv == 1)
+                        rv = send_to_other_limpet(limpet_socket, framer, msg);
+                    if (rv) goto tidyup;
+                }
+                else if (rv < 0) {
+                    goto tidyup;
+                }
+            } else {
+                // Including Announcements another Limpet put on our KBUS,
+                // which go on over our link unless that would be a loop
+                rv = kbus_limpet_amend_msg_from_kbus(context, msg);
+                if (rv == 0) {
+                   rv = send_to_other_limpet(limpet_socket, framer, msg);
+                   if (rv) goto tidyup;
+                }
+                else if (rv < 0) {
+                    goto tidyup;
+                }
             }
         }
         kbus_msg_delete(&msg);
 
-        if (fds[1].revents & POLLIN) {
+        if (mcast && (fds[2].revents & POLLIN)) {
+            kbus_message_t   mcast_msg;
             if (verbosity > 1)
-                printf("%u ----------------- Message from other Limpet\n", network_id);
+                printf("%u ----------------- Message from multicast group\n", network_id);
 
-            rv = read_message_from_other_limpet(limpet_socket, &msg);
+            rv = read_message_from_multicast(mcast, network_id, &mcast_msg,
+                                             verbosity);
             if (rv < 0) goto tidyup;
 
-            rv = kbus_limpet_amend_msg_to_kbus(context, msg, &error);
+            if (rv == 0 && was_injected(mcast, &mcast_msg.id)) {
+                if (verbosity > 1)
+                    printf("%u .. Ignoring datagram for %u:%u, already on our KBUS\n",
+                           network_id, mcast_msg.id.network_id,
+                           mcast_msg.id.serial_num);
+                rv = 1;
+            }
+            if (rv == 0) {
+                // The same loop and route checks as from the other Limpet
+                // (any error message is for the sender, which we can't reach)
+                rv = kbus_limpet_amend_msg_to_kbus(context, &mcast_msg, &error);
+                if (rv < 0) goto tidyup;
+            }
             if (rv == 0) {
                 kbus_msg_id_t    msg_id;
                 if (verbosity > 1) {
                     printf("%u ----------------- ", network_id);
-                    kbus_msg_print(stdout, msg);
+                    kbus_msg_print(stdout, &mcast_msg);
                     printf("\n");
                 }
-                rv = kbus_ksock_send_msg(ksock, msg, &msg_id);
-                if (rv) {
-                    rv = kbus_limpet_could_not_send_to_kbus_msg(context, msg,
-                                                                rv, &error);
-                    if (rv == 0) {
-                        rv = send_message_to_other_limpet(limpet_socket, error);
-                        if (rv) goto tidyup;
-                    } else if (rv < 0) {
-                        goto tidyup;
+                note_injected(mcast, &mcast_msg.id);
+                // Announcements can't fail in a way the sender cares about
+                rv = kbus_ksock_send_msg(ksock, &mcast_msg, &msg_id);
+                if (rv && verbosity)
+                    printf("Limpet %u: send message error %d -- continuing\n",
+                           network_id, -rv);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            if (verbosity > 1)
+                printf("%u ----------------- Message from other Limpet\n", network_id);
+
+            if (framer)
+                rv = read_frame_from_other_limpet(framer, limpet_socket, &msg);
+            else
+                rv = read_message_from_other_limpet(limpet_socket, &msg);
+            if (rv < 0) goto tidyup;
+
+            if (rv == 0) {
+                rv = kbus_limpet_amend_msg_to_kbus(context, msg, &error);
+                if (rv == 0) {
+                    kbus_msg_id_t    msg_id;
+                    if (verbosity > 1) {
+                        printf("%u ----------------- ", network_id);
+                        kbus_msg_print(stdout, msg);
+                        printf("\n");
                     }
+                    rv = kbus_ksock_send_msg(ksock, msg, &msg_id);
+                    if (rv) {
+                        rv = kbus_limpet_could_not_send_to_kbus_msg(context, msg,
+                                                                    rv, &error);
+                        if (rv == 0) {
+                            rv = send_to_other_limpet(limpet_socket, framer, error);
+                            if (rv) goto tidyup;
+                        } else if (rv < 0) {
+                            goto tidyup;
+                        }
+                    }
+                } else if (rv == 2) {
+                    if (verbosity > 1) {
+                        printf("%u ----------------- ", network_id);
+                        kbus_msg_print(stdout, msg);
+                        printf("\n");
+                        printf("%u >>>>>>>>>>>>>>>>> ", network_id);
+                        kbus_msg_print(stdout, error);
+                        printf("\n");
+                    }
+                    // an error occurred, tell the other limpet
+                    rv = send_to_other_limpet(limpet_socket, framer, error);
+                    if (rv) goto tidyup;
+                } else if (rv < 0) {
+                    goto tidyup;
                 }
-            } else if (rv == 2) {
-                if (verbosity > 1) {
-                    printf("%u ----------------- ", network_id);
-                    kbus_msg_print(stdout, msg);
-                    printf("\n");
-                    printf("%u >>>>>>>>>>>>>>>>> ", network_id);
-                    kbus_msg_print(stdout, error);
-                    printf("\n");
-                }
-                // an error occurred, tell the other limpet
-                rv = send_message_to_other_limpet(limpet_socket, error);
-                if (rv) goto tidyup;
-            } else if (rv < 0) {
-                goto tidyup;
             }
         }
+
+        if (route_interval && kbus_limpet_routes_changed(context) == 1) {
+            rv = advertise_routes(ksock, limpet_socket, framer, context,
+                                  network_id, verbosity);
+            if (rv) goto tidyup;
+        }
+
+        if (framer && (fds[1].revents & POLLOUT)) {
+            rv = send_frame_to_other_limpet(framer, limpet_socket);
+            if (rv) goto tidyup;
+        }
         kbus_msg_delete(&msg);
         kbus_msg_delete(&error);
     }
@@ -499,6 +1502,7 @@ static int kbus_limpet(kbus_ksock_t     ksock,
 tidyup:
     kbus_msg_delete(&msg);
     kbus_msg_delete(&error);
+    free_framer(&framer);
     kbus_limpet_free_context(&context);
     return rv;
 }
@@ -684,6 +1688,113 @@ static int open_server_socket(char     *address,
   return 0;
 }
 
+static int open_multicast_socket(char          *address,
+                                 int            port,
+                                 uint32_t       network_id,
+                                 multicast_t  **mcast)
+{
+  int            err;
+  int            opt[1];
+  unsigned char  ttl = 1;
+  struct ip_mreq mreq;
+  struct sockaddr_in  ipaddr;
+  multicast_t   *new;
+
+  *mcast = NULL;
+
+  new = malloc(sizeof(*new));
+  if (new == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate multicast datastructure\n");
+    return -1;
+  }
+  memset(new, 0, sizeof(*new) - sizeof(new->buffer));
+
+  if (!inet_aton(address, &new->group.sin_addr) ||
+      !IN_MULTICAST(ntohl(new->group.sin_addr.s_addr)))
+  {
+    fprintf(stderr,"### %s is not a multicast group address\n",address);
+    free(new);
+    return -1;
+  }
+  new->group.sin_family = AF_INET;
+  new->group.sin_port = htons(port);
+
+  new->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (new->socket == -1)
+  {
+    fprintf(stderr,"### Unable to create multicast socket: %s\n",strerror(errno));
+    free(new);
+    return -1;
+  }
+
+  // Several Limpets on the same host (for instance, when testing) may all
+  // want this port
+  opt[0] = 1;
+  (void) setsockopt(new->socket, SOL_SOCKET, SO_REUSEADDR, opt, sizeof(int));
+
+  memset(&ipaddr, 0, sizeof(ipaddr));
+#if !defined(__linux__)
+  // On BSD, the length is defined in the datastructure
+  ipaddr.sin_len = sizeof(struct sockaddr_in);
+#endif
+  ipaddr.sin_family = AF_INET;
+  ipaddr.sin_port = htons(port);
+  ipaddr.sin_addr = new->group.sin_addr;        // only our group's datagrams
+
+  err = bind(new->socket, (struct sockaddr*)&ipaddr, sizeof(ipaddr));
+  if (err == -1)
+  {
+    fprintf(stderr,"### Unable to bind to multicast port %d: %s\n",
+            port,strerror(errno));
+    goto error_return;
+  }
+
+  mreq.imr_multiaddr = new->group.sin_addr;
+  mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+  err = setsockopt(new->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  if (err == -1)
+  {
+    fprintf(stderr,"### Unable to join multicast group %s: %s\n",
+            address,strerror(errno));
+    goto error_return;
+  }
+
+  // Stay on the local network, but do let other Limpets on this host hear us
+  (void) setsockopt(new->socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+  opt[0] = 1;
+  (void) setsockopt(new->socket, IPPROTO_IP, IP_MULTICAST_LOOP, opt, sizeof(int));
+
+  // So that the other Limpets can tell when we've restarted
+  new->epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ network_id;
+
+  printf("Joined multicast group %s port %d on socket %d\n",address,port,
+         new->socket);
+  *mcast = new;
+  return 0;
+
+error_return:
+  close(new->socket);
+  free(new);
+  return -1;
+}
+
+static void close_multicast_socket(multicast_t  **mcast)
+{
+  if (*mcast == NULL)
+    return;
+
+  close((*mcast)->socket);
+  while ((*mcast)->senders)
+  {
+    mcast_sender_t *next = (*mcast)->senders->next;
+    free((*mcast)->senders);
+    (*mcast)->senders = next;
+  }
+  free(*mcast);
+  *mcast = NULL;
+}
+
 static int run_limpet(uint32_t  kbus_device,
                       char     *message_name,
                       bool      is_server,
@@ -691,12 +1802,17 @@ static int run_limpet(uint32_t  kbus_device,
                       int       port,
                       uint32_t  network_id,
                       char     *termination_message,
-                      int       verbosity)
+                      int       verbosity,
+                      char     *mcast_address,
+                      int       mcast_port,
+                      size_t    frame_size,
+                      int       route_interval)
 {
     int             rv = 0;
     int             limpet_socket = -1;
     int             listen_socket = -1;
     kbus_ksock_t    ksock = -1;
+    multicast_t    *mcast = NULL;
     uint32_t        other_network_id;
     uint32_t        ksock_id;
     struct pollfd   fds[2];
@@ -721,8 +1837,15 @@ static int run_limpet(uint32_t  kbus_device,
         if (rv) goto tidyup;
     }
 
+    if (mcast_address) {
+        rv = open_multicast_socket(mcast_address, mcast_port, network_id,
+                                   &mcast);
+        if (rv) goto tidyup;
+    }
+
     rv = kbus_limpet(ksock, limpet_socket, network_id, message_name,
-                     termination_message, verbosity);
+                     termination_message, verbosity, mcast, frame_size,
+                     route_interval);
 
     if (rv) goto tidyup;
 
@@ -743,6 +1866,7 @@ tidyup:
                 (void) unlink(address);
         }
     }
+    close_multicast_socket(&mcast);
     if (ksock != -1)
         (void) kbus_ksock_close(ksock);
 
@@ -886,8 +2010,37 @@ static void print_usage(void)
         "    -t <name>       When the Limpet reads a message named <name> from\n"
         "                    KBUS, it should terminate.\n"
         "\n"
-        "This is an example application, not intended to production use.\n"
-        );
+        "    -mcast <group>:<port>\n"
+        "                    Send Announcements (messages that are not Requests or\n"
+        "                    Replies) to the given UDP multicast group, instead of\n"
+        "                    to the other Limpet, and send Announcements from that\n"
+        "                    group to KBUS. Requests and Replies still go to the\n"
+        "                    other Limpet. Datagrams that go missing are reported,\n"
+        "                    but not resent. For instance, '-mcast 239.255.0.1:5555'.\n"
+        "\n"
+        "        All the Limpets joined to a multicast group must have different\n"
+        "        network ids, and each KBUS device should have at most one Limpet\n"
+        "        joined to a given group. Hosts that share a multicast group should\n"
+        "        not also exchange Announcements through other Limpets.\n"
+        "\n"
+        "    -frame <bytes>  Send messages to the other Limpet in frames of at most\n"
+        "                    <bytes> bytes, so that small messages (and urgent\n"
+        "                    messages) are not held up behind large ones. <bytes>\n"
+        "                    must be between %d and %d. The other Limpet must also\n"
+        "                    be using -frame, and this is not supported by the\n"
+        "                    Python Limpet. The default is not to use frames.\n"
+        "\n"
+        "    -routes <seconds>\n"
+        "                    Advertise the routes this Limpet knows to other\n"
+        "                    Limpets, every <seconds> seconds and whenever they\n"
+        "                    change, and use the routes they advertise. Messages\n"
+        "                    then take the shortest way between KBUS devices, and\n"
+        "                    do not go round in loops, so Limpets need not link\n"
+        "                    every pair of KBUS devices. All the Limpets in the\n"
+        "                    network should use this.\n"
+        "\n"
+        "This is an example application, not intended to production use.\n",
+        MIN_FRAME_SIZE, MAX_FRAME_SIZE);
 }
 
 int main(int argc, char **argv)
@@ -905,6 +2058,10 @@ int main(int argc, char **argv)
     int          ii = 1;
 
     char        *termination_message = NULL;
+    char        *mcast_address = NULL;
+    int          mcast_port = 0;
+    size_t       frame_size = 0;         // meaning "don't use frames"
+    int          route_interval = 0;     // meaning "don't advertise routes"
 
     if (argc < 2)
     {
@@ -968,6 +2125,59 @@ int main(int argc, char **argv)
                 termination_message = argv[ii+1];
                 ii++;
             }
+            else if (!strcmp("-mcast",argv[ii]))
+            {
+                if (ii+1 == argc)
+                {
+                    fprintf(stderr,"### %s requires an argument (<group>:<port>)\n",argv[ii]);
+                    return 1;
+                }
+                if (parse_address(argv[ii+1],&mcast_address,&mcast_port))
+                    return 1;
+                if (mcast_port == 0)
+                {
+                    fprintf(stderr,"### %s requires a port number (<group>:<port>)\n",argv[ii]);
+                    return 1;
+                }
+                ii++;
+            }
+            else if (!strcmp("-frame",argv[ii]))
+            {
+                long  val;
+                if (ii+1 == argc)
+                {
+                    fprintf(stderr,"### %s requires an integer argument (frame size)\n",argv[ii]);
+                    return 1;
+                }
+                if (int_value(argv[ii], argv[ii+1], true, 10, &val))
+                    return 1;
+                if (val < MIN_FRAME_SIZE || val > MAX_FRAME_SIZE)
+                {
+                    fprintf(stderr,"### Frame size %ld should be between %d and %d\n",
+                            val,MIN_FRAME_SIZE,MAX_FRAME_SIZE);
+                    return 1;
+                }
+                frame_size = val;
+                ii++;
+            }
+            else if (!strcmp("-routes",argv[ii]))
+            {
+                long  val;
+                if (ii+1 == argc)
+                {
+                    fprintf(stderr,"### %s requires an integer argument (seconds)\n",argv[ii]);
+                    return 1;
+                }
+                if (int_value(argv[ii], argv[ii+1], true, 10, &val))
+                    return 1;
+                if (val < 1)
+                {
+                    fprintf(stderr,"### %s requires at least 1 second\n",argv[ii]);
+                    return 1;
+                }
+                route_interval = val;
+                ii++;
+            }
             else if (!strcmp("-m",argv[ii]) || !strcmp("-message",argv[ii]))
             {
                 if (ii+1 == argc)
@@ -1028,9 +2238,18 @@ int main(int argc, char **argv)
         printf(" port %d",port);
     printf(" for KBUS %d, using network id %d, listening for '%s'\n",
            kbus_device, network_id, message_name);
+    if (mcast_address)
+        printf("Announcements via multicast group %s port %d\n",
+               mcast_address, mcast_port);
+    if (frame_size)
+        printf("Sending messages to the other Limpet in frames of %zu bytes\n",
+               frame_size);
+    if (route_interval)
+        printf("Advertising routes every %d seconds\n", route_interval);
 
     err = run_limpet(kbus_device, message_name, is_server, address, port,
-                     network_id, termination_message, verbosity);
+                     network_id, termination_message, verbosity,
+                     mcast_address, mcast_port, frame_size, route_interval);
     if (err) return 1;
 
     return 0;